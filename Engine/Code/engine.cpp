@@ -17,11 +17,15 @@
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#include <cfloat>
+#include <chrono>
 
 
 #define BINDING(b) b
 
-#define CreateConstantBuffer(size) CreateBuffer(size, GL_UNIFORM_BUFFER, GL_STREAM_DRAW)
+#define CreateConstantBuffer(size) CreateRingBuffer(size, GL_UNIFORM_BUFFER, MAX_BUFFER_REGIONS)
 #define CreateStaticVertexBuffer(size) CreateBuffer(size, GL_ARRAY_BUFFER, GL_STATIC_DRAW)
 #define CreateStaticIndexBuffer(size) CreateBuffer(size, GL_ELEMENT_ARRAY_BUFFER, GL_STATIC_DRAW)
 
@@ -116,6 +120,59 @@ GLuint CreateProgramFromSource(String programSource, const char* shaderName)
     return programHandle;
 }
 
+GLuint CreateComputeProgramFromSource(String programSource, const char* shaderName)
+{
+    GLchar  infoLogBuffer[1024] = {};
+    GLsizei infoLogBufferSize = sizeof(infoLogBuffer);
+    GLsizei infoLogSize;
+    GLint   success;
+
+    char versionString[] = "#version 430\n";
+    char shaderNameDefine[128];
+    sprintf(shaderNameDefine, "#define %s\n", shaderName);
+    char computeShaderDefine[] = "#define COMPUTE\n";
+
+    const GLchar* computeShaderSource[] = {
+        versionString,
+        shaderNameDefine,
+        computeShaderDefine,
+        programSource.str
+    };
+    const GLint computeShaderLengths[] = {
+        (GLint) strlen(versionString),
+        (GLint) strlen(shaderNameDefine),
+        (GLint) strlen(computeShaderDefine),
+        (GLint) programSource.len
+    };
+
+    GLuint cshader = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(cshader, ARRAY_COUNT(computeShaderSource), computeShaderSource, computeShaderLengths);
+    glCompileShader(cshader);
+    glGetShaderiv(cshader, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(cshader, infoLogBufferSize, &infoLogSize, infoLogBuffer);
+        ELOG("glCompileShader() failed with compute shader %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+    }
+
+    GLuint programHandle = glCreateProgram();
+    glAttachShader(programHandle, cshader);
+    glLinkProgram(programHandle);
+    glGetProgramiv(programHandle, GL_LINK_STATUS, &success);
+    if (!success)
+    {
+        glGetProgramInfoLog(programHandle, infoLogBufferSize, &infoLogSize, infoLogBuffer);
+        ELOG("glLinkProgram() failed with program %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+    }
+
+    glUseProgram(0);
+
+    glDetachShader(programHandle, cshader);
+    glDeleteShader(cshader);
+
+    return programHandle;
+}
+
 u32 LoadProgram(App* app, const char* filepath, const char* programName)
 {
     String programSource = ReadTextFile(filepath);
@@ -150,16 +207,200 @@ u32 LoadProgram(App* app, const char* filepath, const char* programName)
         program.vertexShaderLayout.attributes.push_back(attribute);
     }
 
+    ReflectProgramUniforms(program);
+
+    app->programs.push_back(program);
+
+    return app->programs.size() - 1;
+}
+
+// Compute programs have no vertex inputs, only uniforms and buffer bindings
+u32 LoadComputeProgram(App* app, const char* filepath, const char* programName)
+{
+    String programSource = ReadTextFile(filepath);
+
+    Program program = {};
+    program.handle = CreateComputeProgramFromSource(programSource, programName);
+    program.filepath = filepath;
+    program.programName = programName;
+    program.lastWriteTimestamp = GetFileLastWriteTimestamp(filepath);
+    program.isCompute = true;
+
+    ReflectProgramUniforms(program);
 
     app->programs.push_back(program);
 
     return app->programs.size() - 1;
 }
 
+void ReflectProgramUniforms(Program& program)
+{
+    GLint size;
+    GLenum type;
+    const GLsizei bufSize = 64;
+    GLchar name[bufSize];
+    GLsizei length;
+
+    // Uniforms (the ones living inside uniform blocks have no location and are skipped)
+    GLint count = 0;
+    glGetProgramiv(program.handle, GL_ACTIVE_UNIFORMS, &count);
+
+    u32 tableSize = 8;
+    while (tableSize < (u32)count * 2)
+        tableSize *= 2;
+
+    program.uniforms.clear();
+    program.uniforms.resize(tableSize, UniformSlot{});
+
+    for (GLint i = 0; i < count; i++)
+    {
+        glGetActiveUniform(program.handle, (GLuint)i, bufSize, &length, &size, &type, name);
+
+        GLint location = glGetUniformLocation(program.handle, name);
+        if (location == -1)
+            continue;
+
+        // Arrays are reported as "name[0]", register them by their base name
+        for (GLsizei c = 0; c < length; ++c)
+            if (name[c] == '[') { name[c] = '\0'; break; }
+
+        u32 nameHash = HashString(name);
+        u32 slotIdx = nameHash & (tableSize - 1);
+        while (program.uniforms[slotIdx].used && program.uniforms[slotIdx].nameHash != nameHash)
+            slotIdx = (slotIdx + 1) & (tableSize - 1);
+
+        // Lookups only have the hash, two names sharing it would silently get the same location
+        if (program.uniforms[slotIdx].used)
+        {
+            ELOG("Program %s: uniform %s has the same hash as another uniform, it can't be set", program.programName.c_str(), name);
+            continue;
+        }
+
+        UniformSlot& slot = program.uniforms[slotIdx];
+        slot.used = true;
+        slot.nameHash = nameHash;
+        slot.location = location;
+        slot.type = type;
+        slot.arraySize = size;
+    }
+
+    // Uniform blocks
+    count = 0;
+    glGetProgramiv(program.handle, GL_ACTIVE_UNIFORM_BLOCKS, &count);
+
+    program.uniformBlocks.clear();
+    for (GLint i = 0; i < count; i++)
+    {
+        glGetActiveUniformBlockName(program.handle, (GLuint)i, bufSize, &length, name);
+
+        UniformBlockSlot block = {};
+        block.nameHash = HashString(name);
+        if (FindUniformBlock(program, block.nameHash))
+            ELOG("Program %s: uniform block %s has the same hash as another block", program.programName.c_str(), name);
+        block.index = (GLuint)i;
+        glGetActiveUniformBlockiv(program.handle, (GLuint)i, GL_UNIFORM_BLOCK_BINDING, &block.binding);
+        glGetActiveUniformBlockiv(program.handle, (GLuint)i, GL_UNIFORM_BLOCK_DATA_SIZE, &block.dataSize);
+        program.uniformBlocks.push_back(block);
+    }
+}
+
+UniformSlot* FindUniform(Program& program, u32 nameHash)
+{
+    const u32 tableSize = (u32)program.uniforms.size();
+    if (tableSize == 0)
+        return NULL;
+
+    u32 slotIdx = nameHash & (tableSize - 1);
+    while (program.uniforms[slotIdx].used)
+    {
+        if (program.uniforms[slotIdx].nameHash == nameHash)
+            return &program.uniforms[slotIdx];
+        slotIdx = (slotIdx + 1) & (tableSize - 1);
+    }
+
+    return NULL; // not active in this program (e.g. optimized out by the compiler)
+}
+
+const UniformBlockSlot* FindUniformBlock(const Program& program, u32 nameHash)
+{
+    for (const UniformBlockSlot& block : program.uniformBlocks)
+        if (block.nameHash == nameHash)
+            return &block;
+    return NULL;
+}
+
+// Returns false if the value is already the one uploaded to the program
+static bool UpdateUniformCache(UniformSlot& slot, const void* value, u32 size)
+{
+    if (slot.cached && memcmp(slot.value, value, size) == 0)
+        return false;
+
+    memcpy(slot.value, value, size);
+    slot.cached = true;
+    return true;
+}
+
+void SetUniform1i(Program& program, u32 nameHash, i32 value)
+{
+    UniformSlot* slot = FindUniform(program, nameHash);
+    if (slot && UpdateUniformCache(*slot, &value, sizeof(value)))
+        glUniform1i(slot->location, value);
+}
+
+void SetUniform1f(Program& program, u32 nameHash, f32 value)
+{
+    UniformSlot* slot = FindUniform(program, nameHash);
+    if (slot && UpdateUniformCache(*slot, &value, sizeof(value)))
+        glUniform1f(slot->location, value);
+}
+
+void SetUniform2f(Program& program, u32 nameHash, const vec2& value)
+{
+    UniformSlot* slot = FindUniform(program, nameHash);
+    if (slot && UpdateUniformCache(*slot, value_ptr(value), sizeof(value)))
+        glUniform2f(slot->location, value.x, value.y);
+}
+
+void SetUniform2i(Program& program, u32 nameHash, const ivec2& value)
+{
+    UniformSlot* slot = FindUniform(program, nameHash);
+    if (slot && UpdateUniformCache(*slot, value_ptr(value), sizeof(value)))
+        glUniform2i(slot->location, value.x, value.y);
+}
+
+void SetUniform3i(Program& program, u32 nameHash, const ivec3& value)
+{
+    UniformSlot* slot = FindUniform(program, nameHash);
+    if (slot && UpdateUniformCache(*slot, value_ptr(value), sizeof(value)))
+        glUniform3i(slot->location, value.x, value.y, value.z);
+}
+
+void SetUniform4f(Program& program, u32 nameHash, const vec4& value)
+{
+    UniformSlot* slot = FindUniform(program, nameHash);
+    if (slot && UpdateUniformCache(*slot, value_ptr(value), sizeof(value)))
+        glUniform4f(slot->location, value.x, value.y, value.z, value.w);
+}
+
+void SetUniformMat4(Program& program, u32 nameHash, const mat4& value)
+{
+    UniformSlot* slot = FindUniform(program, nameHash);
+    if (slot && UpdateUniformCache(*slot, value_ptr(value), sizeof(value)))
+        glUniformMatrix4fv(slot->location, 1, GL_FALSE, value_ptr(value));
+}
+
+void SetUniform3fv(Program& program, u32 nameHash, u32 count, const f32* values)
+{
+    UniformSlot* slot = FindUniform(program, nameHash);
+    if (slot)
+        glUniform3fv(slot->location, min((GLint)count, slot->arraySize), values);
+}
+
 Image LoadImage(const char* filename)
 {
     Image img = {};
-    stbi_set_flip_vertically_on_load(true);
+    // Per thread flag: images are also decoded on the worker pool
+    stbi_set_flip_vertically_on_load_thread(1);
     img.pixels = stbi_load(filename, &img.size.x, &img.size.y, &img.nchannels, 0);
     if (img.pixels)
     {
@@ -207,8 +448,10 @@ GLuint CreateTexture2DFromImage(Image image)
 
 u32 LoadTexture2D(App* app, const char* filepath)
 {
+    PROFILE_FUNCTION();
+
     for (u32 texIdx = 0; texIdx < app->textures.size(); ++texIdx)
-        if (app->textures[texIdx].filepath == filepath)
+        if (app->textures[texIdx].filepath == filepath && app->textures[texIdx].usage == TextureUsage_Color)
             return texIdx;
 
     Image image = LoadImage(filepath);
@@ -219,6 +462,11 @@ u32 LoadTexture2D(App* app, const char* filepath)
         tex.handle = CreateTexture2DFromImage(image);
         tex.filepath = filepath;
 
+        // Full mip chain is about a third on top of the base level
+        const u64 size = (u64)image.size.x * image.size.y * image.nchannels * 4 / 3;
+        app->textureMemory += size;
+        app->textureMemoryUncompressed += size;
+
         u32 texIdx = app->textures.size();
         app->textures.push_back(tex);
 
@@ -231,145 +479,855 @@ u32 LoadTexture2D(App* app, const char* filepath)
     }
 }
 
-void CreateFBTexture(App* app, GLuint& handle)
+// ----------------------------------------------
+// ---------- TEXTURE COOKER --------------------
+// ----------------------------------------------
+
+// Textures are cooked into a block compressed mip chain stored next to the source
+// (e.g. Box/normal.jpg.tex), so neither decoding nor glGenerateMipmap happens at load:
+//
+//   CookedTextureHeader | mip 0 | mip 1 | ... | mip N
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT  0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
+#define COOKED_TEXTURE_MAGIC   0x58455442 // "BTEX"
+#define COOKED_TEXTURE_VERSION 1
+
+struct CookedTextureHeader
 {
-    glGenTextures(1, &handle);
-    glBindTexture(GL_TEXTURE_2D, handle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    u32 magic;
+    u32 version;
+    u32 usage;
+    u32 format;
+    u32 width;
+    u32 height;
+    u32 sourceChannels;
+    u32 mipCount;
+    u32 mipOffsets[MAX_TEXTURE_MIPS];
+    u32 mipSizes[MAX_TEXTURE_MIPS];
+};
+
+static u16 PackRGB565(i32 r, i32 g, i32 b)
+{
+    return (u16)(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
 }
 
-void Init(App* app)
+static void UnpackRGB565(u16 color, i32* rgb)
 {
-    glEnable(GL_DEBUG_OUTPUT);
+    const i32 r = (color >> 11) & 31;
+    const i32 g = (color >> 5) & 63;
+    const i32 b = color & 31;
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
 
-    glDebugMessageCallback(OnGlError, app);
+// BC1 from 16 RGBA8 texels: inset bounding box endpoints, indices by projecting on the endpoint axis
+static void EncodeBC1Block(const u8* texels, u8* dst)
+{
+    const __m128i row0 = _mm_loadu_si128((const __m128i*)(texels + 0));
+    const __m128i row1 = _mm_loadu_si128((const __m128i*)(texels + 16));
+    const __m128i row2 = _mm_loadu_si128((const __m128i*)(texels + 32));
+    const __m128i row3 = _mm_loadu_si128((const __m128i*)(texels + 48));
+
+    // Per channel min and max of the 16 texels, 4 at a time
+    __m128i lo = _mm_min_epu8(_mm_min_epu8(row0, row1), _mm_min_epu8(row2, row3));
+    __m128i hi = _mm_max_epu8(_mm_max_epu8(row0, row1), _mm_max_epu8(row2, row3));
+    lo = _mm_min_epu8(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+    lo = _mm_min_epu8(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(1, 0, 3, 2)));
+    hi = _mm_max_epu8(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 3, 0, 1)));
+    hi = _mm_max_epu8(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(1, 0, 3, 2)));
+
+    const u32 loColor = (u32)_mm_cvtsi128_si32(lo);
+    const u32 hiColor = (u32)_mm_cvtsi128_si32(hi);
+
+    i32 minC[3], maxC[3];
+    for (u32 c = 0; c < 3; ++c)
+    {
+        minC[c] = (loColor >> (c * 8)) & 0xFF;
+        maxC[c] = (hiColor >> (c * 8)) & 0xFF;
+    }
 
-    glEnable(GL_DEPTH_TEST);
+    // The box diagonal goes the wrong way for red/blue when they vary against green
+    i32 mean[3] = {};
+    for (u32 i = 0; i < 16; ++i)
+        for (u32 c = 0; c < 3; ++c)
+            mean[c] += texels[i * 4 + c];
 
-    GLenum err;
-    while ((err = glGetError()) != GL_NO_ERROR) {
-        ELOG("OpenGL error: %s", glGetString(err));
+    i32 covRG = 0, covBG = 0;
+    for (u32 i = 0; i < 16; ++i)
+    {
+        const i32 g = texels[i * 4 + 1] * 16 - mean[1];
+        covRG += (texels[i * 4 + 0] * 16 - mean[0]) * g;
+        covBG += (texels[i * 4 + 2] * 16 - mean[2]) * g;
     }
+    if (covRG < 0) std::swap(minC[0], maxC[0]);
+    if (covBG < 0) std::swap(minC[2], maxC[2]);
 
-    // Retrieve OpenGL information
-    app->Info.OpenGLversion = (const char*)glGetString(GL_VERSION);
-    app->Info.GPU = (const char*)glGetString(GL_RENDERER);
-    app->Info.Vendor = (const char*)glGetString(GL_VENDOR);
-    app->Info.GLSLverison = (const char*)glGetString(GL_SHADING_LANGUAGE_VERSION);
-
-    app->mode = Mode::Mode_FinalColor;
-    app->renderMode = RenderMode::Mode_Forward;
+    // Inset by 1/16 of the range, the extremes are rarely worth an endpoint
+    for (u32 c = 0; c < 3; ++c)
+    {
+        const i32 inset = (maxC[c] - minC[c]) / 16;
+        minC[c] += inset;
+        maxC[c] -= inset;
+    }
 
-    // FrameBuffer
-    //color
-    CreateFBTexture(app, app->colorAttachmentHandle);
+    u16 color0 = PackRGB565(maxC[0], maxC[1], maxC[2]);
+    u16 color1 = PackRGB565(minC[0], minC[1], minC[2]);
+    if (color0 < color1)
+        std::swap(color0, color1);
 
-    //albedo
-    CreateFBTexture(app, app->albedoAttachmentHandle);
+    u32 indices = 0;
+    if (color0 != color1)
+    {
+        i32 e0[3], e1[3];
+        UnpackRGB565(color0, e0);
+        UnpackRGB565(color1, e1);
 
-    //normals
-    CreateFBTexture(app, app->normalAttachmentHandle);
+        const i32 axis[3] = { e0[0] - e1[0], e0[1] - e1[1], e0[2] - e1[2] };
+        const i32 length2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
 
-    //position
-    glGenTextures(1, &app->positionAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->positionAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glBindTexture(GL_TEXTURE_2D, 0);
+        // Palette order is e0, e1, 2/3 e0 + 1/3 e1, 1/3 e0 + 2/3 e1
+        static const u32 paletteIdx[4] = { 1, 3, 2, 0 };
 
-    //depth texture
-    CreateFBTexture(app, app->depthTextureHandle);
+        for (u32 i = 0; i < 16; ++i)
+        {
+            const u8* texel = texels + i * 4;
+            const i32 t = (texel[0] - e1[0]) * axis[0] + (texel[1] - e1[1]) * axis[1] + (texel[2] - e1[2]) * axis[2];
+            const i32 level = glm::clamp((t * 3 + length2 / 2) / length2, 0, 3);
+            indices |= paletteIdx[level] << (i * 2);
+        }
+    }
 
-    //ssao
-    glGenTextures(1, &app->ssaoColorBuffer);
-    glBindTexture(GL_TEXTURE_2D, app->ssaoColorBuffer);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    memcpy(dst + 0, &color0, 2);
+    memcpy(dst + 2, &color1, 2);
+    memcpy(dst + 4, &indices, 4);
+}
 
-    // Depth
-    glGenTextures(1, &app->depthAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, app->displaySize.x, app->displaySize.y, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glBindTexture(GL_TEXTURE_2D, 0);
+// BC4 from one channel of 16 texels, 8 value mode
+static void EncodeBC4Block(const u8* texels, u32 channel, u8* dst)
+{
+    u8 values[16];
+    for (u32 i = 0; i < 16; ++i)
+        values[i] = texels[i * 4 + channel];
+
+    // Fold the 16 values down to the first byte
+    __m128i lo = _mm_loadu_si128((const __m128i*)values);
+    __m128i hi = lo;
+    lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 8)); hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 8));
+    lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 4)); hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 4));
+    lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 2)); hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 2));
+    lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 1)); hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 1));
+
+    const i32 minV = _mm_cvtsi128_si32(lo) & 0xFF;
+    const i32 maxV = _mm_cvtsi128_si32(hi) & 0xFF;
+    const i32 range = maxV - minV;
+
+    dst[0] = (u8)maxV;
+    dst[1] = (u8)minV;
+
+    u64 indices = 0;
+    if (range > 0)
+    {
+        for (u32 i = 0; i < 16; ++i)
+        {
+            // level 7 is the max endpoint (index 0), level 0 the min one (index 1)
+            const i32 level = ((values[i] - minV) * 7 + range / 2) / range;
+            const u64 idx = level == 7 ? 0 : level == 0 ? 1 : 8 - level;
+            indices |= idx << (i * 3);
+        }
+    }
 
-    // Binding frame buffer
-    glGenFramebuffers(1, &app->framebufferHandle);
-    glBindFramebuffer(GL_FRAMEBUFFER, app->framebufferHandle);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, app->colorAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, app->albedoAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, app->normalAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, app->positionAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT4, app->depthTextureHandle, 0);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT5, GL_TEXTURE_2D, app->ssaoColorBuffer, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, app->depthAttachmentHandle, 0);
+    for (u32 i = 0; i < 6; ++i)
+        dst[2 + i] = (u8)(indices >> (i * 8));
+}
 
-    // Sample kernel
-    std::uniform_real_distribution<float> randomFloats(0.0, 1.0); // random floats between [0.0, 1.0]
-    std::default_random_engine generator;
+static bool HasAlpha(const u8* pixels, u32 texelCount)
+{
+    for (u32 i = 0; i < texelCount; ++i)
+        if (pixels[i * 4 + 3] != 255)
+            return true;
+    return false;
+}
 
-    for (unsigned int i = 0; i < 64; ++i)
+// Copies the 4x4 block at (bx, by), clamping at the borders of images smaller than a block
+static void FetchBlock(const u8* pixels, i32 width, i32 height, i32 bx, i32 by, u8* texels)
+{
+    for (i32 y = 0; y < 4; ++y)
     {
-        glm::vec3 sample(randomFloats(generator) * 2.0 - 1.0,
-                         randomFloats(generator) * 2.0 - 1.0,
-                         randomFloats(generator));
+        const i32 py = min(by * 4 + y, height - 1);
+        for (i32 x = 0; x < 4; ++x)
+        {
+            const i32 px = min(bx * 4 + x, width - 1);
+            memcpy(texels + (y * 4 + x) * 4, pixels + (py * width + px) * 4, 4);
+        }
+    }
+}
 
-        sample = glm::normalize(sample);
-        sample *= randomFloats(generator);
+// 2x2 box filter. Normals are renormalized so lower mips do not get shorter.
+static void DownsampleRGBA(const u8* src, i32 width, i32 height, u8* dst, bool normalMap)
+{
+    const i32 dstWidth = max(1, width / 2);
+    const i32 dstHeight = max(1, height / 2);
 
-        float scale = float(i) / 64.0;
+    for (i32 y = 0; y < dstHeight; ++y)
+    {
+        const i32 y0 = min(y * 2, height - 1);
+        const i32 y1 = min(y * 2 + 1, height - 1);
+        for (i32 x = 0; x < dstWidth; ++x)
+        {
+            const i32 x0 = min(x * 2, width - 1);
+            const i32 x1 = min(x * 2 + 1, width - 1);
+            u8* out = dst + (y * dstWidth + x) * 4;
 
-        // scale samples s.t. they're more aligned to center of kernel
-        scale = lerp(0.1f, 1.0f, scale * scale);
-        sample *= scale;
+            for (u32 c = 0; c < 4; ++c)
+            {
+                const u32 sum = src[(y0 * width + x0) * 4 + c] + src[(y0 * width + x1) * 4 + c] +
+                                src[(y1 * width + x0) * 4 + c] + src[(y1 * width + x1) * 4 + c];
+                out[c] = (u8)((sum + 2) / 4);
+            }
 
-        app->ssaoKernel.push_back(sample);
+            if (normalMap)
+            {
+                vec3 n = vec3(out[0], out[1], out[2]) / 127.5f - 1.0f;
+                n = length(n) > 0.0f ? normalize(n) : vec3(0.0f, 0.0f, 1.0f);
+                for (u32 c = 0; c < 3; ++c)
+                    out[c] = (u8)glm::clamp((n[c] + 1.0f) * 127.5f + 0.5f, 0.0f, 255.0f);
+            }
+        }
     }
+}
 
-    // Random rotation vectors with screen tiling
-    for (unsigned int i = 0; i < 16; i++)
+bool CookTexture(const char* sourcePath, const char* cookedPath, TextureUsage usage, CompressedImage& image, u64& encodedPixels, f64& encodeTime)
+{
+    i32 width, height, channels;
+    stbi_set_flip_vertically_on_load_thread(1);
+    u8* pixels = stbi_load(sourcePath, &width, &height, &channels, 4);
+    if (!pixels)
     {
-        glm::vec3 noise(randomFloats(generator) * 2.0 - 1.0,
-                        randomFloats(generator) * 2.0 - 1.0,
-                        0.0f);
+        ELOG("Could not open file %s", sourcePath);
+        return false;
+    }
 
-        app->ssaoNoise.push_back(noise);
+    switch (usage)
+    {
+        case TextureUsage_Normal: image.format = GL_COMPRESSED_RG_RGTC2; break;
+        case TextureUsage_Height: image.format = GL_COMPRESSED_RED_RGTC1; break;
+        default: image.format = channels == 4 && HasAlpha(pixels, width * height) ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT; break;
     }
-   
-    glGenTextures(1, &app->noiseTexture);
-    glBindTexture(GL_TEXTURE_2D, app->noiseTexture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 4, 4, 0, GL_RGB, GL_FLOAT, &app->ssaoNoise[0]);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 
-    GLenum frameBufferStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (frameBufferStatus != GL_FRAMEBUFFER_COMPLETE)
+    const u32 blockSize = (image.format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || image.format == GL_COMPRESSED_RED_RGTC1) ? 8 : 16;
+
+    image.size = ivec2(width, height);
+    image.sourceChannels = channels;
+    image.mipCount = 0;
+
+    u32 dataSize = 0;
+    for (i32 w = width, h = height; image.mipCount < MAX_TEXTURE_MIPS; w = max(1, w / 2), h = max(1, h / 2))
     {
-        switch (frameBufferStatus)
-        {
-        case GL_FRAMEBUFFER_UNDEFINED:                      ELOG("GL_FRAMEBUFFER_UNDEFINED");                       break;
-        case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT:          ELOG("GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT");           break;
+        image.mipOffsets[image.mipCount] = sizeof(CookedTextureHeader) + dataSize;
+        image.mipSizes[image.mipCount] = ((w + 3) / 4) * ((h + 3) / 4) * blockSize;
+        dataSize += image.mipSizes[image.mipCount];
+        image.mipCount++;
+
+        if (w == 1 && h == 1)
+            break;
+    }
+
+    // The blob is the whole file, header included, so it can be written as is
+    image.blob.assign(sizeof(CookedTextureHeader) + dataSize, 0);
+
+    auto encodeStart = std::chrono::high_resolution_clock::now();
+
+    std::vector<u8> level(pixels, pixels + width * height * 4);
+    std::vector<u8> nextLevel;
+    stbi_image_free(pixels);
+
+    i32 w = width, h = height;
+    for (u32 mip = 0; mip < image.mipCount; ++mip)
+    {
+        u8* dst = image.blob.data() + image.mipOffsets[mip];
+        const i32 blocksX = (w + 3) / 4;
+        const i32 blocksY = (h + 3) / 4;
+
+        u8 texels[64];
+        for (i32 by = 0; by < blocksY; ++by)
+        {
+            for (i32 bx = 0; bx < blocksX; ++bx)
+            {
+                FetchBlock(level.data(), w, h, bx, by, texels);
+
+                switch (image.format)
+                {
+                    case GL_COMPRESSED_RGB_S3TC_DXT1_EXT: EncodeBC1Block(texels, dst); break;
+                    case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT: EncodeBC4Block(texels, 3, dst); EncodeBC1Block(texels, dst + 8); break;
+                    case GL_COMPRESSED_RED_RGTC1: EncodeBC4Block(texels, 0, dst); break;
+                    case GL_COMPRESSED_RG_RGTC2: EncodeBC4Block(texels, 0, dst); EncodeBC4Block(texels, 1, dst + 8); break;
+                }
+                dst += blockSize;
+            }
+        }
+
+        encodedPixels += w * h;
+
+        if (mip + 1 < image.mipCount)
+        {
+            nextLevel.resize(max(1, w / 2) * max(1, h / 2) * 4);
+            DownsampleRGBA(level.data(), w, h, nextLevel.data(), usage == TextureUsage_Normal);
+            level.swap(nextLevel);
+            w = max(1, w / 2);
+            h = max(1, h / 2);
+        }
+    }
+
+    auto encodeEnd = std::chrono::high_resolution_clock::now();
+    encodeTime += std::chrono::duration<f64, std::micro>(encodeEnd - encodeStart).count();
+
+    CookedTextureHeader header = {};
+    header.magic = COOKED_TEXTURE_MAGIC;
+    header.version = COOKED_TEXTURE_VERSION;
+    header.usage = usage;
+    header.format = image.format;
+    header.width = width;
+    header.height = height;
+    header.sourceChannels = channels;
+    header.mipCount = image.mipCount;
+    memcpy(header.mipOffsets, image.mipOffsets, sizeof(header.mipOffsets));
+    memcpy(header.mipSizes, image.mipSizes, sizeof(header.mipSizes));
+    memcpy(image.blob.data(), &header, sizeof(header));
+
+    FILE* file = fopen(cookedPath, "wb");
+    if (file)
+    {
+        fwrite(image.blob.data(), 1, image.blob.size(), file);
+        fclose(file);
+    }
+    else
+    {
+        ELOG("Could not write cooked texture %s", cookedPath);
+    }
+
+    return true;
+}
+
+// Maps a cooked texture. Returns false if it is missing, older than the source or stale.
+bool LoadCompressedTexture(const char* cookedPath, const char* sourcePath, TextureUsage usage, CompressedImage& image)
+{
+    const u64 cookedTimestamp = GetFileLastWriteTimestamp(cookedPath);
+    if (cookedTimestamp == 0 || cookedTimestamp < GetFileLastWriteTimestamp(sourcePath))
+        return false;
+
+    MappedFile file = MapFile(cookedPath);
+    if (!file.data)
+        return false;
+
+    const CookedTextureHeader* header = (const CookedTextureHeader*)file.data;
+    if (file.size < sizeof(CookedTextureHeader) ||
+        header->magic != COOKED_TEXTURE_MAGIC ||
+        header->version != COOKED_TEXTURE_VERSION ||
+        header->usage != (u32)usage ||
+        header->mipCount == 0 || header->mipCount > MAX_TEXTURE_MIPS ||
+        file.size < (u64)header->mipOffsets[header->mipCount - 1] + header->mipSizes[header->mipCount - 1])
+    {
+        UnmapFile(file);
+        return false;
+    }
+
+    image.format = header->format;
+    image.size = ivec2(header->width, header->height);
+    image.sourceChannels = header->sourceChannels;
+    image.mipCount = header->mipCount;
+    memcpy(image.mipOffsets, header->mipOffsets, sizeof(image.mipOffsets));
+    memcpy(image.mipSizes, header->mipSizes, sizeof(image.mipSizes));
+    image.file = file;
+
+    return true;
+}
+
+GLuint CreateCompressedTexture2D(const CompressedImage& image)
+{
+    const u8* data = image.file.data ? image.file.data : image.blob.data();
+
+    GLuint texHandle;
+    glGenTextures(1, &texHandle);
+    glBindTexture(GL_TEXTURE_2D, texHandle);
+
+    for (u32 mip = 0; mip < image.mipCount; ++mip)
+    {
+        const i32 w = max(1, image.size.x >> mip);
+        const i32 h = max(1, image.size.y >> mip);
+        glCompressedTexImage2D(GL_TEXTURE_2D, mip, image.format, w, h, 0, image.mipSizes[mip], data + image.mipOffsets[mip]);
+    }
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, image.mipCount - 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    return texHandle;
+}
+
+void FreeCompressedImage(CompressedImage& image)
+{
+    if (image.file.data)
+        UnmapFile(image.file);
+    image.blob.clear();
+    image.blob.shrink_to_fit();
+}
+
+// ----------------------------------------------
+// ---------- ASYNC ASSET LOADING ---------------
+// ----------------------------------------------
+
+// Same flags for every Assimp import, prefetched or not
+static const u32 ModelImportFlags =
+    aiProcess_Triangulate |
+    aiProcess_GenSmoothNormals |
+    aiProcess_CalcTangentSpace |
+    aiProcess_JoinIdenticalVertices |
+    aiProcess_PreTransformVertices |
+    aiProcess_ImproveCacheLocality |
+    aiProcess_OptimizeMeshes |
+    aiProcess_SortByPType;
+
+static const std::chrono::high_resolution_clock::time_point LoaderEpoch = std::chrono::high_resolution_clock::now();
+
+static f64 GetLoaderTime()
+{
+    return std::chrono::duration<f64, std::micro>(std::chrono::high_resolution_clock::now() - LoaderEpoch).count();
+}
+
+static void TraceAssetEvent(AssetLoader& loader, const std::string& name, u32 threadIdx, f64 begin, f64 end)
+{
+    std::lock_guard<std::mutex> lock(loader.mutex);
+    if (!loader.traceWritten)
+        loader.trace.push_back(AssetTraceEvent{ name, threadIdx, begin, end });
+}
+
+static bool IsCookedMeshUpToDate(const char* filepath)
+{
+    char cookedPath[256];
+    snprintf(cookedPath, sizeof(cookedPath), "%s.mesh", filepath);
+    const u64 cookedTimestamp = GetFileLastWriteTimestamp(cookedPath);
+    return cookedTimestamp != 0 && cookedTimestamp >= GetFileLastWriteTimestamp(filepath);
+}
+
+static void AssetWorker(AssetLoader* loader, u32 threadIdx)
+{
+    char threadName[32];
+    snprintf(threadName, sizeof(threadName), "Asset worker %u", threadIdx);
+    RegisterCPUProfilerThread(threadName);
+
+    for (;;)
+    {
+        AssetJob job;
+        {
+            std::unique_lock<std::mutex> lock(loader->mutex);
+            loader->jobAvailable.wait(lock, [loader] { return loader->quit || !loader->jobs.empty(); });
+            if (loader->quit)
+                return;
+
+            job = std::move(loader->jobs.front());
+            loader->jobs.pop_front();
+        }
+
+        PROFILE_SCOPE("Asset job");
+        const f64 begin = GetLoaderTime();
+
+        u64 encodedPixels = 0;
+        f64 encodeTime = 0.0;
+
+        if (job.type == AssetJob_Texture)
+        {
+            // Cook on first use, afterwards the .tex file is mapped as is
+            // One cooked file per usage, or loading a file for two usages would recook it every time
+            static const char* usageSuffixes[] = { "", ".normal", ".height" };
+            char cookedPath[256];
+            snprintf(cookedPath, sizeof(cookedPath), "%s%s.tex", job.filepath.c_str(), usageSuffixes[job.usage]);
+            if (!LoadCompressedTexture(cookedPath, job.filepath.c_str(), job.usage, job.compressed))
+                CookTexture(job.filepath.c_str(), cookedPath, job.usage, job.compressed, encodedPixels, encodeTime);
+        }
+        else
+        {
+            // Nothing to import when LoadModel is going to read the cooked file
+            if (!IsCookedMeshUpToDate(job.filepath.c_str()))
+            {
+                job.scene = aiImportFile(job.filepath.c_str(), ModelImportFlags);
+                if (!job.scene)
+                    ELOG("Error loading mesh %s: %s", job.filepath.c_str(), aiGetErrorString());
+            }
+        }
+
+        const f64 end = GetLoaderTime();
+
+        std::lock_guard<std::mutex> lock(loader->mutex);
+        if (!loader->traceWritten)
+            loader->trace.push_back(AssetTraceEvent{ job.filepath, threadIdx, begin, end });
+        loader->cookedPixels += encodedPixels;
+        loader->cookTime += encodeTime;
+
+        if (job.type == AssetJob_Texture)
+        {
+            loader->uploads.push_back(std::move(job));
+        }
+        else
+        {
+            for (ModelPrefetch& prefetch : loader->prefetches)
+            {
+                if (prefetch.filepath == job.filepath)
+                {
+                    prefetch.scene = job.scene;
+                    prefetch.done = true;
+                }
+            }
+            loader->pendingJobs--;
+            loader->prefetchDone.notify_all();
+        }
+    }
+}
+
+void InitAssetLoader(App* app, u32 workerCount)
+{
+    AssetLoader& loader = app->loader;
+    loader.quit = false;
+
+    for (u32 i = 0; i < workerCount; ++i)
+        loader.workers.emplace_back(AssetWorker, &loader, i + 1);
+
+    ILOG("Asset loader: %u worker threads", workerCount);
+}
+
+void ShutdownAssetLoader(App* app)
+{
+    AssetLoader& loader = app->loader;
+    {
+        std::lock_guard<std::mutex> lock(loader.mutex);
+        loader.quit = true;
+    }
+    loader.jobAvailable.notify_all();
+
+    for (std::thread& worker : loader.workers)
+        worker.join();
+    loader.workers.clear();
+
+    for (AssetJob& job : loader.uploads)
+        FreeCompressedImage(job.compressed);
+    loader.uploads.clear();
+
+    for (ModelPrefetch& prefetch : loader.prefetches)
+        if (prefetch.scene)
+            aiReleaseImport(prefetch.scene);
+    loader.prefetches.clear();
+}
+
+// Returns the texture index right away. Until the worker has decoded the file and
+// ProcessAssetUploads has created it, the texture shares the placeholder's handle.
+u32 LoadTexture2DAsync(App* app, const char* filepath, u32 placeholderIdx, TextureUsage usage)
+{
+    for (u32 texIdx = 0; texIdx < app->textures.size(); ++texIdx)
+        if (app->textures[texIdx].filepath == filepath && app->textures[texIdx].usage == usage)
+            return texIdx;
+
+    Texture tex = {};
+    tex.handle = app->textures[placeholderIdx].handle;
+    tex.filepath = filepath;
+    tex.usage = usage;
+
+    u32 texIdx = app->textures.size();
+    app->textures.push_back(tex);
+
+    AssetJob job = {};
+    job.type = AssetJob_Texture;
+    job.textureIdx = texIdx;
+    job.usage = usage;
+    job.filepath = filepath;
+
+    {
+        std::lock_guard<std::mutex> lock(app->loader.mutex);
+        app->loader.jobs.push_back(std::move(job));
+        app->loader.pendingJobs++;
+    }
+    app->loader.jobAvailable.notify_one();
+
+    return texIdx;
+}
+
+// Starts the Assimp import of a model on a worker, LoadModel picks up the result
+void PrefetchModel(App* app, const char* filepath)
+{
+    AssetLoader& loader = app->loader;
+    {
+        std::lock_guard<std::mutex> lock(loader.mutex);
+        for (const ModelPrefetch& prefetch : loader.prefetches)
+            if (prefetch.filepath == filepath)
+                return;
+
+        loader.prefetches.push_back(ModelPrefetch{ filepath, nullptr, false });
+
+        AssetJob job = {};
+        job.type = AssetJob_Model;
+        job.filepath = filepath;
+        loader.jobs.push_back(std::move(job));
+        loader.pendingJobs++;
+    }
+    loader.jobAvailable.notify_one();
+}
+
+// Waits for a prefetched import and hands over the scene, nullptr if the model was
+// not prefetched or the worker found an up to date cooked mesh
+const aiScene* TakePrefetchedModel(App* app, const char* filepath)
+{
+    AssetLoader& loader = app->loader;
+    std::unique_lock<std::mutex> lock(loader.mutex);
+
+    for (u32 i = 0; i < loader.prefetches.size(); ++i)
+    {
+        if (loader.prefetches[i].filepath == filepath)
+        {
+            loader.prefetchDone.wait(lock, [&loader, i] { return loader.prefetches[i].done; });
+
+            const aiScene* scene = loader.prefetches[i].scene;
+            loader.prefetches.erase(loader.prefetches.begin() + i);
+            return scene;
+        }
+    }
+
+    return nullptr;
+}
+
+static void WriteStartupTrace(AssetLoader& loader, const char* filepath)
+{
+    FILE* file = fopen(filepath, "w");
+    if (!file)
+    {
+        ELOG("Could not write %s", filepath);
+        return;
+    }
+
+    fprintf(file, "{\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"GL thread\"}},\n");
+    for (u32 i = 0; i < loader.workers.size(); ++i)
+        fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"Asset worker %u\"}},\n", i + 1, i + 1);
+    for (u32 i = 0; i < loader.trace.size(); ++i)
+    {
+        const AssetTraceEvent& event = loader.trace[i];
+        fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.1f,\"dur\":%.1f}%s\n",
+            event.name.c_str(), event.threadIdx, event.begin, event.end - event.begin, i + 1 < loader.trace.size() ? "," : "");
+    }
+    fprintf(file, "]}\n");
+    fclose(file);
+}
+
+// Creates the GL textures of decoded images until the frame budget runs out
+void ProcessAssetUploads(App* app, f32 budgetMs)
+{
+    AssetLoader& loader = app->loader;
+    const f64 start = GetLoaderTime();
+
+    while (GetLoaderTime() - start < budgetMs * 1000.0)
+    {
+        AssetJob job;
+        {
+            std::lock_guard<std::mutex> lock(loader.mutex);
+            if (loader.uploads.empty())
+                break;
+
+            job = std::move(loader.uploads.front());
+            loader.uploads.pop_front();
+        }
+
+        const f64 begin = GetLoaderTime();
+
+        // On failure the texture just keeps its placeholder
+        const CompressedImage& image = job.compressed;
+        if (image.mipCount > 0)
+        {
+            app->textures[job.textureIdx].handle = CreateCompressedTexture2D(image);
+
+            for (u32 mip = 0; mip < image.mipCount; ++mip)
+            {
+                app->textureMemory += image.mipSizes[mip];
+                app->textureMemoryUncompressed += max(1, image.size.x >> mip) * max(1, image.size.y >> mip) * image.sourceChannels;
+            }
+        }
+        FreeCompressedImage(job.compressed);
+
+        TraceAssetEvent(loader, "Upload " + job.filepath, 0, begin, GetLoaderTime());
+
+        std::lock_guard<std::mutex> lock(loader.mutex);
+        loader.pendingJobs--;
+    }
+
+    // Once everything requested during startup is in, dump how the loads overlapped
+    std::lock_guard<std::mutex> lock(loader.mutex);
+    if (loader.pendingJobs == 0 && !loader.traceWritten && !loader.trace.empty())
+    {
+        loader.traceWritten = true;
+        WriteStartupTrace(loader, "startup_trace.json");
+        ILOG("Startup assets loaded after %f ms, trace written to startup_trace.json", GetLoaderTime() / 1000.0);
+    }
+}
+
+void CreateFBTexture(App* app, GLuint& handle)
+{
+    glGenTextures(1, &handle);
+    glBindTexture(GL_TEXTURE_2D, handle);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void Init(App* app)
+{
+    InitCPUProfiler();
+    PROFILE_FUNCTION();
+
+    auto initStart = std::chrono::high_resolution_clock::now();
+
+    glEnable(GL_DEBUG_OUTPUT);
+
+    glDebugMessageCallback(OnGlError, app);
+
+    glEnable(GL_DEPTH_TEST);
+
+    GLenum err;
+    while ((err = glGetError()) != GL_NO_ERROR) {
+        ELOG("OpenGL error: %s", glGetString(err));
+    }
+
+    // Retrieve OpenGL information
+    app->Info.OpenGLversion = (const char*)glGetString(GL_VERSION);
+    app->Info.GPU = (const char*)glGetString(GL_RENDERER);
+    app->Info.Vendor = (const char*)glGetString(GL_VENDOR);
+    app->Info.GLSLverison = (const char*)glGetString(GL_SHADING_LANGUAGE_VERSION);
+
+    app->mode = Mode::Mode_FinalColor;
+    app->renderMode = RenderMode::Mode_Forward;
+
+    // FrameBuffer
+    //color
+    CreateFBTexture(app, app->colorAttachmentHandle);
+
+    //albedo
+    CreateFBTexture(app, app->albedoAttachmentHandle);
+
+    //normals, octahedral encoded
+    glGenTextures(1, &app->normalAttachmentHandle);
+    glBindTexture(GL_TEXTURE_2D, app->normalAttachmentHandle);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16, app->displaySize.x, app->displaySize.y, 0, GL_RG, GL_UNSIGNED_SHORT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    //ssao, a single channel read back as grey
+    const GLint ssaoSwizzle[] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+    glGenTextures(1, &app->ssaoColorBuffer);
+    glBindTexture(GL_TEXTURE_2D, app->ssaoColorBuffer);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, app->displaySize.x, app->displaySize.y, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, ssaoSwizzle);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // Depth and stencil, the stencil masks the light volumes
+    glGenTextures(1, &app->depthAttachmentHandle);
+    glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, app->displaySize.x, app->displaySize.y, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // Binding frame buffer
+    glGenFramebuffers(1, &app->framebufferHandle);
+    glBindFramebuffer(GL_FRAMEBUFFER, app->framebufferHandle);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, app->colorAttachmentHandle, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, app->albedoAttachmentHandle, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, app->normalAttachmentHandle, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_2D, app->ssaoColorBuffer, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, app->depthAttachmentHandle, 0);
+
+    // Positions come from the depth attachment, so the geometry pass writes albedo (RGBA8),
+    // normal (RG16) and depth stencil (4 bytes). It used to write 6 RGBA8 targets plus depth.
+    app->gbufferBytesPerPixel = 4 + 4 + 4;
+    ILOG("G-buffer: %u bytes written per pixel (previously %u)", app->gbufferBytesPerPixel, 6 * 4 + 4);
+
+    // Sample kernel
+    std::uniform_real_distribution<float> randomFloats(0.0, 1.0); // random floats between [0.0, 1.0]
+    std::default_random_engine generator;
+
+    for (unsigned int i = 0; i < SSAO_KERNEL_SIZE; ++i)
+    {
+        glm::vec3 sample(randomFloats(generator) * 2.0 - 1.0,
+                         randomFloats(generator) * 2.0 - 1.0,
+                         randomFloats(generator));
+
+        sample = glm::normalize(sample);
+        sample *= randomFloats(generator);
+
+        float scale = float(i) / SSAO_KERNEL_SIZE;
+
+        // scale samples s.t. they're more aligned to center of kernel
+        scale = lerp(0.1f, 1.0f, scale * scale);
+        sample *= scale;
+
+        app->ssaoKernel.push_back(sample);
+    }
+
+    // The kernel never changes, it lives in a uniform block shared by the fragment and compute paths.
+    // std140 pads every vec3 of an array to a vec4
+    std::vector<vec4> kernelBlock;
+    for (const vec3& sample : app->ssaoKernel)
+        kernelBlock.push_back(vec4(sample, 0.0f));
+    glGenBuffers(1, &app->ssaoKernelBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, app->ssaoKernelBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, kernelBlock.size() * sizeof(vec4), kernelBlock.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+    // Random rotation vectors with screen tiling
+    for (unsigned int i = 0; i < 16; i++)
+    {
+        glm::vec3 noise(randomFloats(generator) * 2.0 - 1.0,
+                        randomFloats(generator) * 2.0 - 1.0,
+                        0.0f);
+
+        app->ssaoNoise.push_back(noise);
+    }
+   
+    glGenTextures(1, &app->noiseTexture);
+    glBindTexture(GL_TEXTURE_2D, app->noiseTexture);
+    // Signed components, a normalized format would clamp the negative half to 0
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, 4, 4, 0, GL_RGB, GL_FLOAT, &app->ssaoNoise[0]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+    GLenum frameBufferStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (frameBufferStatus != GL_FRAMEBUFFER_COMPLETE)
+    {
+        switch (frameBufferStatus)
+        {
+        case GL_FRAMEBUFFER_UNDEFINED:                      ELOG("GL_FRAMEBUFFER_UNDEFINED");                       break;
+        case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT:          ELOG("GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT");           break;
         case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT:  ELOG("GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT");   break;
         case GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER:         ELOG("GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER");          break;
         case GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER:         ELOG("GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER");          break;
@@ -380,739 +1338,4687 @@ void Init(App* app)
         }
     }
 
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    CreateSSAOTargets(app);
+
+    // --- Geometry ---
+
+    const VertexV3V2 vertices[] =
+    {
+        { glm::vec3(-1.0f, -1.0f, 0.0f), glm::vec2(0.0f, 0.0f)}, // bottom-left vertex
+        { glm::vec3(1.0f, -1.0f, 0.0f), glm::vec2(1.0f, 0.0f)}, // bottom-right vertex
+        { glm::vec3(1.0f, 1.0f, 0.0f), glm::vec2(1.0f, 1.0f)}, // top-right vertex
+        { glm::vec3(-1.0f, 1.0f, 0.0f), glm::vec2(0.0f, 1.0f)}, // top-left vertex
+    };
+
+    const u16 indices[] =
+    {
+        0, 1, 2,
+        0, 2, 3
+    };
+
+    glGenBuffers(1, &app->embeddedVertices);
+    glBindBuffer(GL_ARRAY_BUFFER, app->embeddedVertices);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glGenBuffers(1, &app->embeddedElements);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, app->embeddedElements);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    // Attribute state
+    glGenVertexArrays(1, &app->vao);
+    glBindVertexArray(app->vao);
+    glBindBuffer(GL_ARRAY_BUFFER, app->embeddedVertices);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(VertexV3V2), (void*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(VertexV3V2), (void*)12);
+    glEnableVertexAttribArray(1);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, app->embeddedElements);
+    glBindVertexArray(0);
+
+    //Creating uniform buffers
+    glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &app->maxUniformBufferSize);
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &app->uniformBlockAlignment);
+
+    app->cbuffer = CreateConstantBuffer(app->maxUniformBufferSize);
+    app->instanceBuffer = CreateRingBuffer(MB(1), GL_SHADER_STORAGE_BUFFER, MAX_BUFFER_REGIONS);
+    app->lightBuffer = CreateRingBuffer(KB(64), GL_SHADER_STORAGE_BUFFER, MAX_BUFFER_REGIONS);
+    glGenBuffers(1, &app->tileOverflowBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, app->tileOverflowBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, TILE_OVERFLOW_LATENCY * sizeof(u32), NULL, GL_DYNAMIC_READ);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    app->clusterBuffer = CreateRingBuffer(KB(256), GL_SHADER_STORAGE_BUFFER, MAX_BUFFER_REGIONS);
+    app->indirectBuffer = CreateRingBuffer(KB(64), GL_DRAW_INDIRECT_BUFFER, MAX_BUFFER_REGIONS);
+    app->drawInstanceBuffer = CreateRingBuffer(KB(64), GL_ARRAY_BUFFER, MAX_BUFFER_REGIONS);
+    app->materialBuffer = CreateRingBuffer(KB(4), GL_SHADER_STORAGE_BUFFER, MAX_BUFFER_REGIONS);
+
+    //Load programs
+    app->ForwardProgramIdx = LoadProgram(app, "shaders.glsl", "FORWARD_RENDERING");
+    app->texturedGeometryProgramIdx = LoadProgram(app, "shaders.glsl", "TEXTURED_GEOMETRY");
+
+    app->GeometryPassProgramIdx = LoadProgram(app, "shaders.glsl", "GEOMETRY_PASS");
+    app->GeometryPassIndirectProgramIdx = LoadProgram(app, "shaders.glsl", "GEOMETRY_PASS_INDIRECT");
+    app->SSAOPassProgramIdx = LoadProgram(app, "shaders.glsl", "SSAO_PASS");
+    app->SSAOComputeProgramIdx = LoadComputeProgram(app, "shaders.glsl", "SSAO_COMPUTE");
+    app->SSAOBlurProgramIdx = LoadComputeProgram(app, "shaders.glsl", "SSAO_BLUR");
+    app->SSAODownsampleProgramIdx = LoadProgram(app, "shaders.glsl", "SSAO_DOWNSAMPLE");
+    app->SSAOUpsampleProgramIdx = LoadProgram(app, "shaders.glsl", "SSAO_UPSAMPLE");
+    app->ShadingPassProgramIdx = LoadProgram(app, "shaders.glsl", "SHADING_PASS");
+    app->TiledShadingProgramIdx = LoadComputeProgram(app, "shaders.glsl", "TILED_SHADING");
+    app->LightVolumeProgramIdx = LoadProgram(app, "shaders.glsl", "LIGHT_VOLUME");
+    app->LightVolumeStencilProgramIdx = LoadProgram(app, "shaders.glsl", "LIGHT_VOLUME_STENCIL");
+    app->GBufferViewProgramIdx = LoadProgram(app, "shaders.glsl", "GBUFFER_VIEW");
+    CreateLightVolume(app);
+    app->lightingQueries.resize(1);
+    glGenQueries(1, app->lightingQueries.data());
+    glGenQueries(ARRAY_COUNT(app->ssaoTimestamps), app->ssaoTimestamps);
+    InitGPUProfiler(app->gpuProfiler);
+
+    //Texture initialization
+    app->diceTexIdx = LoadTexture2D(app, "dice.png");
+    app->whiteTexIdx = LoadTexture2D(app, "color_white.png");
+    app->blackTexIdx = LoadTexture2D(app, "color_black.png");
+    app->normalTexIdx = LoadTexture2D(app, "color_normal.png");
+    app->magentaTexIdx = LoadTexture2D(app, "color_magenta.png");
+
+    Material Default = {};
+    Default.albedoTextureIdx = app->diceTexIdx;
+    app->materials.push_back(Default);
+
+    //Asset loading: the imports below run on the workers while the main thread keeps going
+    const u32 workerCount = glm::clamp(std::thread::hardware_concurrency(), 2u, 9u) - 1u;
+    InitAssetLoader(app, workerCount);
+    InitJobPool(app->jobPool, workerCount);
+    InitOcclusionCuller(app->occlusionCuller);
+    PrefetchModel(app, "Box/JapanFloor.fbx");
+    PrefetchModel(app, "Box/Cube.fbx");
+    PrefetchModel(app, "Patrick/Patrick.obj");
+
+    //Camera initialization
+    app->camera.CameraInit(vec3(0.f, 0.f, 5.f), vec3(0.f, 0.f, 1.f), vec3(0.f, 1.f, 0.f), (float)(app->displaySize.x / app->displaySize.y));
+    app->camera.position = vec3(0.f, 3.5f, 15.f);
+
+    //  -------------- ENTITIES -------------------------
+
+    //Lights
+    Light FirstLight = {};
+    FirstLight.position = vec3(5.f, 2.f, 5.f);
+    FirstLight.type = LightType::Point;
+    FirstLight.color = vec3(1.f, 1.f, 1.f);
+    FirstLight.range = 30.f;
+    app->lights.push_back(FirstLight);
+
+    Light SecondLight = {};
+    SecondLight.position = vec3(-20.f, 2.f, 5.f);
+    SecondLight.type = LightType::Point;
+    SecondLight.color = vec3(1.f, 0.f, 0.f);
+    SecondLight.range = 30.f;
+    app->lights.push_back(SecondLight);
+
+    Light ThirdLight = {};
+    ThirdLight.position = vec3(0.0f, 20.f, -15.f);
+    ThirdLight.type = LightType::Point;
+    ThirdLight.color = vec3(1.f, 1.f, 1.f);
+    ThirdLight.range = 30.f;
+    app->lights.push_back(ThirdLight);
+    app->sceneLightCount = (u32)app->lights.size();
+
+    //Entity plane = CreatePlane(app, 20.f);
+
+    u32 JapanFloor = LoadModel(app, "Box/JapanFloor.fbx");
+
+    Entity Floor = { mat4(1.0f), JapanFloor };
+    Floor.TransformPosition(vec3(-10.f, 0.f, -10.f));
+    Floor.TransformScale(vec3(0.2f, 0.2f, 0.2f));
+    Floor.isOccluder = true;
+    app->entities.push_back(Floor);
+
+    //------------------------------------------
+
+    u32 cube_model = LoadModel(app, "Box/Cube.fbx");
+
+    Entity Cube = { mat4(1.0f), cube_model };
+    Cube.TransformPosition(vec3(10.f, 11.f, -10.f));
+    Cube.TransformScale(vec3(0.05f, 0.05f, 0.05f));
+
+    Model& model1 = app->models[Cube.modelIndex];
+
+    u32 submeshMaterialIdx1 = model1.materialIdx[0];
+    Material& submeshMaterial1 = app->materials[submeshMaterialIdx1]; 
+    submeshMaterial1.albedoTextureIdx = LoadTexture2DAsync(app, "Box/tile1.jpg", app->magentaTexIdx);
+    submeshMaterial1.normalsTextureIdx = LoadTexture2DAsync(app, "Box/toy_box_normal.png", app->normalTexIdx, TextureUsage_Normal);
+    submeshMaterial1.bumpTextureIdx = LoadTexture2DAsync(app, "Box/toy_box_disp.png", app->whiteTexIdx, TextureUsage_Height);
+
+    Cube.isOccluder = true;
+    app->entities.push_back(Cube);
+
+    //---------------------------------
+
+    u32 cube_model2 = LoadModel(app, "Box/Cube.fbx");
+
+    Entity Cube2 = { mat4(1.0f), cube_model2 };
+    Cube2.TransformPosition(vec3(-10.f, 11.f, -10.f));
+    Cube2.TransformScale(vec3(0.05f, 0.05f, 0.05f));
+
+    Model& model2 = app->models[Cube2.modelIndex];
+
+    u32 submeshMaterialIdx2 = model2.materialIdx[0];
+    Material& submeshMaterial2 = app->materials[submeshMaterialIdx2];
+    submeshMaterial2.albedoTextureIdx = LoadTexture2DAsync(app, "Box/basecolor.jpg", app->magentaTexIdx);
+    submeshMaterial2.normalsTextureIdx = LoadTexture2DAsync(app, "Box/normal.jpg", app->normalTexIdx, TextureUsage_Normal);
+    submeshMaterial2.bumpTextureIdx = LoadTexture2DAsync(app, "Box/height.jpg", app->whiteTexIdx, TextureUsage_Height);
+
+    Cube2.isOccluder = true;
+    app->entities.push_back(Cube2);
+
+    //--------------------------------------
+
+    u32 cube_model3 = LoadModel(app, "Box/Cube.fbx");
+
+    Entity Cube3 = { mat4(1.0f), cube_model3 };
+    Cube3.TransformPosition(vec3(0.f, 11.f, -10.f));
+    Cube3.TransformScale(vec3(0.05f, 0.05f, 0.05f));
+
+    Model& model3 = app->models[Cube3.modelIndex];
+
+    u32 submeshMaterialIdx3 = model3.materialIdx[0];
+    Material& submeshMaterial3 = app->materials[submeshMaterialIdx3];
+    submeshMaterial3.albedoTextureIdx = LoadTexture2DAsync(app, "Box/basecolor1.jpg", app->magentaTexIdx);
+    submeshMaterial3.normalsTextureIdx = LoadTexture2DAsync(app, "Box/normal1.jpg", app->normalTexIdx, TextureUsage_Normal);
+    submeshMaterial3.bumpTextureIdx = LoadTexture2DAsync(app, "Box/height1.jpg", app->whiteTexIdx, TextureUsage_Height);
+
+    Cube3.isOccluder = true;
+    app->entities.push_back(Cube3);
+
+    //u32 modelIdx2 = LoadModel(app, "Sphere/sphere.fbx");
+    //app->models[modelIdx2].materialIdx[0] = 4;
+
+    //Entity entity3 = { mat4(1.0f), modelIdx2 };
+    //entity3.TransformPosition(vec3(5.f, 2.f, 5.f));
+    //entity3.TransformScale(vec3(0.01f, 0.01f, 0.01f));
+    //app->entities.push_back(entity3);
+
+    //Entity entity4 = { mat4(1.0f), modelIdx2 };
+    //entity4.TransformPosition(vec3(-5.f, 2.f, 5.f));
+    //entity4.TransformScale(vec3(0.01f, 0.01f, 0.01f));
+    //app->entities.push_back(entity4);
+
+    //Entity entity5 = { mat4(1.0f), modelIdx2 };
+    //entity5.TransformPosition(vec3(0.f, 2.f, -10.f));
+    //entity5.TransformScale(vec3(0.01f, 0.01f, 0.01f));
+    //app->entities.push_back(entity5);
+
+    ///*Entity sphere = CreateSphere(app);
+    //sphere.worldMatrix = translate(sphere.worldMatrix, vec3(10.0f, 20.f, 0.0f));*/
+
+    u32 modelIdx = LoadModel(app, "Patrick/Patrick.obj");
+
+    Entity entity = { mat4(1.0f), modelIdx };
+    entity.TransformPosition(vec3(0.0f, 19.5f, -10.0f));
+    app->entities.push_back(entity);
+
+    //Entity entity1 = { mat4(1.0f), modelIdx };
+    //entity1.TransformPosition(vec3(5.0f, 3.5f, -4.0f));
+    //app->entities.push_back(entity1);
+
+    //Entity entity2 = { mat4(1.0f), modelIdx };
+    //entity2.TransformPosition(vec3(-5.0f, 3.5f, -4.0f));
+    //app->entities.push_back(entity2);
+
+    BuildEntityBVH(app);
+
+    auto initEnd = std::chrono::high_resolution_clock::now();
+    app->startupTime = std::chrono::duration<f32, std::milli>(initEnd - initStart).count();
+    ILOG("Init: %f ms", app->startupTime);
+}
+
+void Shutdown(App* app)
+{
+    ShutdownJobPool(app->jobPool);
+    ShutdownAssetLoader(app);
+}
+
+void Gui(App* app)
+{
+    PROFILE_FUNCTION();
+
+    ImGui::Begin("Info");
+    ImGui::Text("FPS: %f", 1.0f / app->deltaTime);
+    ImGui::Text("Constant buffer fence waits: %u", app->cbuffer.fenceWaitCount);
+    ImGui::Text("Transform stage: %.3f ms (%u entities)", app->transformStageTime, (u32)app->entities.size());
+    ImGui::Text("Draw items: %u  draw calls: %u", (u32)app->renderQueue.items.size(), app->renderQueue.batchCount);
+    ImGui::Checkbox("Multi draw indirect", &app->multiDrawIndirect);
+    ImGui::SameLine(); ImGui::Text("%u multi draws", app->multiDrawIndirect ? app->renderQueue.multiDrawCount : 0);
+    for (const VertexPool& pool : app->geometry.vertexPools)
+        ImGui::Text("Vertex pool (%u B stride): %u / %u vertices  %u free ranges", (u32)pool.layout.stride, pool.vertices.used,
+            pool.vertices.capacity, (u32)pool.vertices.freeRanges.size());
+    ImGui::Text("Index pool: %u / %u indices  %u free ranges", app->geometry.indices.used, app->geometry.indices.capacity,
+        (u32)app->geometry.indices.freeRanges.size());
+    if (ImGui::Button("Benchmark geometry pools")) BenchmarkGeometryPools(app);
+    ImGui::SameLine(); ImGui::Text("%u uploads: %.3f ms  grown after first round: %u  leaked: %u vertices %u indices", app->geometryBenchmark.uploads,
+        app->geometryBenchmark.time, app->geometryBenchmark.grownVertices, app->geometryBenchmark.leakedVertices, app->geometryBenchmark.leakedIndices);
+    ImGui::Checkbox("Frustum culling", &app->renderQueue.frustumCulling);
+    ImGui::Text("Visible: %u  culled: %u  cull: %.3f ms", (u32)app->renderQueue.items.size(), app->renderQueue.culledCount, app->renderQueue.cullTime);
+    ImGui::Text("Binds issued: %u  skipped: %u", app->stateCache.bindsIssued, app->stateCache.bindsSkipped);
+    ImGui::Text("Startup: %.1f ms", app->startupTime);
+    {
+        std::lock_guard<std::mutex> lock(app->loader.mutex);
+        ImGui::Text("Pending asset jobs: %u", app->loader.pendingJobs);
+        if (app->loader.cookTime > 0.0)
+            ImGui::Text("Texture encode: %.1f MPix/s per worker", app->loader.cookedPixels / app->loader.cookTime);
+    }
+    ImGui::Text("Texture VRAM: %.1f MB (uncompressed %.1f MB)", app->textureMemory / (1024.0f * 1024.0f), app->textureMemoryUncompressed / (1024.0f * 1024.0f));
+    ImGui::Text("Model cache hits: %u  bytes saved: %llu", app->modelCacheHits, app->modelCacheBytesSaved);
+    if (ImGui::Button("Benchmark transform stage")) BenchmarkTransformStage(app);
+    ImGui::Text("1k: %.3f ms  10k: %.3f ms  100k: %.3f ms  1M: %.3f ms",
+        app->transformBenchmarkTimes[0], app->transformBenchmarkTimes[1], app->transformBenchmarkTimes[2], app->transformBenchmarkTimes[3]);
+    SceneGeneratorParams& sceneParams = app->sceneGenerator.params;
+    i32 sceneSeed = (i32)sceneParams.seed;
+    if (ImGui::InputInt("Scene seed", &sceneSeed))
+        sceneParams.seed = (u32)sceneSeed;
+    const u32 sceneEntityCounts[] = { 10, 1000, 10000, 100000, 1000000 };
+    const char* sceneEntityNames[] = { "10", "1k", "10k", "100k", "1M" };
+    i32 sceneEntityChoice = 0;
+    for (u32 i = 0; i < ARRAY_COUNT(sceneEntityCounts); ++i)
+        if (sceneParams.entityCount == sceneEntityCounts[i])
+            sceneEntityChoice = (i32)i;
+    if (ImGui::Combo("Scene entities", &sceneEntityChoice, sceneEntityNames, ARRAY_COUNT(sceneEntityNames)))
+        sceneParams.entityCount = sceneEntityCounts[sceneEntityChoice];
+    ImGui::SliderInt("Scene lights", (i32*)&sceneParams.lightCount, 0, 4096);
+    ImGui::SliderInt("Scene materials", (i32*)&sceneParams.materialCount, 1, SCENE_GENERATOR_MAX_MATERIALS);
+    ImGui::SliderInt("Scene meshes", (i32*)&sceneParams.meshCount, 1, SCENE_GENERATOR_MESHES);
+    const char* distributionNames[] = { "Grid", "Random", "Clusters" };
+    ImGui::Combo("Scene distribution", (i32*)&sceneParams.distribution, distributionNames, ARRAY_COUNT(distributionNames));
+    ImGui::SliderFloat("Scene spacing", &sceneParams.spacing, 1.0f, 10.0f);
+    if (ImGui::Button("Generate scene")) GenerateScene(app, sceneParams);
+    ImGui::SameLine(); ImGui::Text("%.1f ms", app->sceneGenerator.generateTime);
+    ImGui::Text("Update: %.3f ms  Render: %.3f ms (CPU)", app->updateTime, app->renderTime);
+    ImGui::Checkbox("Occlusion culling", &app->occlusionCuller.enabled);
+    ImGui::Text("Occluded entities: %u  raster: %.3f ms  test: %.3f ms", app->occlusionCuller.occludedCount, app->occlusionCuller.rasterTime, app->occlusionCuller.testTime);
+    if (ImGui::Button("Benchmark occlusion")) BenchmarkOcclusion(app);
+    ImGui::Text("Raster: %.3f ms (1 thread)  %.3f ms (%u threads)  tests: %.1f M/s", app->occlusionCuller.benchmarkRasterTime[0],
+        app->occlusionCuller.benchmarkRasterTime[1], (u32)app->jobPool.workers.size() + 1, app->occlusionCuller.benchmarkTestsPerSecond / 1e6f);
+    if (ImGui::Button("Benchmark BVH")) BenchmarkBVH(app);
+    const char* bvhCounts[] = { "10k", "100k", "1M" };
+    for (u32 i = 0; i < ARRAY_COUNT(bvhCounts); ++i)
+    {
+        const BVHBenchmark& result = app->bvhBenchmark[i];
+        ImGui::Text("%s: build %.1f ms  refit %.1f M/s  frustum %.3f ms (brute force %.3f ms)  %.0fk spheres/s  %.0fk rays/s", bvhCounts[i],
+            result.buildTime, result.refitsPerSecond / 1e6f, result.frustumTime, result.bruteForceTime, result.spheresPerSecond / 1e3f, result.raysPerSecond / 1e3f);
+    }
+    ImGui::Text("Light clusters: %ux%ux%u  assign: %.3f ms  indices: %u", app->lightClusters.countX, app->lightClusters.countY,
+        app->lightClusters.countZ, app->lightClusters.assignTime, (u32)app->lightClusters.indices.size());
+    if (ImGui::Button("Benchmark light clusters")) BenchmarkLightClusters(app);
+    const char* clusterLightCounts[] = { "256", "1k", "4k", "16k" };
+    for (u32 i = 0; i < ARRAY_COUNT(clusterLightCounts); ++i)
+        ImGui::Text("%s lights: %.3f ms (16x9x24)  %.3f ms (32x18x48)", clusterLightCounts[i],
+            app->lightClusters.benchmarkTimes[i][0], app->lightClusters.benchmarkTimes[i][1]);
+    CPUProfiler& cpuProfiler = GlobalCPUProfiler;
+    bool cpuRecording = cpuProfiler.enabled;
+    if (ImGui::Checkbox("CPU profiler", &cpuRecording))
+        cpuProfiler.enabled = cpuRecording;
+    ImGui::SameLine(); if (ImGui::Button("Capture 120 frames")) StartCPUCapture(120);
+    ImGui::SameLine(); if (ImGui::Button("Write CPU trace")) WriteCPUTrace("cpu_trace.json");
+    if (cpuProfiler.captureFramesLeft > 0)
+    {
+        ImGui::SameLine(); ImGui::Text("capturing, %u frames left", cpuProfiler.captureFramesLeft);
+    }
+    if (ImGui::Button("Benchmark CPU profiler")) BenchmarkCPUProfiler();
+    ImGui::SameLine(); ImGui::Text("%.1f ns per scope recording  %.1f ns off", cpuProfiler.benchmarkOverhead[1], cpuProfiler.benchmarkOverhead[0]);
+    ImGui::Separator();
+    
+    //APP INFO
+    ImGui::Text("OpenGL version: %s", app->Info.OpenGLversion.c_str());
+    ImGui::Text("OpenGL renderer: %s", app->Info.GPU.c_str());
+    ImGui::Text("OpenGL vendor: %s", app->Info.Vendor.c_str());
+    ImGui::Text("OpenGL GLSL verison: %s", app->Info.GLSLverison.c_str());
+    ImGui::Separator();
+
+    //Camera Movement UI
+    //ImGui::Text("Camera");
+    //ImGui::NewLine();
+    //ImGui::SameLine; ImGui::Text("Posiion X Y Z");
+    //
+    //ImGui::PushItemWidth(50); ImGui::DragFloat("##X1", &app->camera.position.x, 0.1f, -INFINITY, INFINITY);
+    //ImGui::SameLine(); ImGui::PushItemWidth(50); ImGui::DragFloat("##Y1", &app->camera.position.y, 0.1f, -INFINITY, INFINITY);
+    //ImGui::SameLine(); ImGui::PushItemWidth(50); ImGui::DragFloat("##Z1", &app->camera.position.z, 0.1f, -INFINITY, INFINITY);
+    //ImGui::SameLine; ImGui::Text("Pitch/Yaw/Roll");
+    //
+    //ImGui::PushItemWidth(50); ImGui::DragFloat("##X2", &app->camera.pitch, 0.1f, -INFINITY, INFINITY);
+    //ImGui::SameLine(); ImGui::PushItemWidth(50); ImGui::DragFloat("##Y2", &app->camera.yaw, 0.1f, -INFINITY, INFINITY);
+    //ImGui::SameLine(); ImGui::PushItemWidth(50); ImGui::DragFloat("##Z2", &app->camera.roll, 0.1f, -INFINITY, INFINITY);
+    //
+    //ImGui::Separator();
+    //ImGui::NewLine();
+    ImGui::Text("Select Render Mode");
+
+    const char* render[] = { "Forward Rendering", "Deferred Rendering" };
+    // Follows app->renderMode, so a mode set elsewhere (--render-mode) is not overwritten
+    const char* curr = render[app->renderMode == RenderMode::Mode_Deferred ? 1 : 0];
+
+    ImGui::PushItemWidth(150);
+    if (ImGui::BeginCombo("##Render Mode", curr)) // The second parameter is the label previewed before opening the combo.
+    {
+        for (int n = 0; n < IM_ARRAYSIZE(render); n++)
+        {
+            bool is_selected = (curr == render[n]); // You can store your selection however you want, outside or inside your objects
+            if (ImGui::Selectable(render[n], is_selected))
+                curr = render[n];
+            if (is_selected)
+                ImGui::SetItemDefaultFocus();   // You may set the initial focus when opening the combo (scrolling + for keyboard navigation support)
+        }
+        ImGui::EndCombo();
+    }
+
+    if (curr == render[0])
+        app->renderMode = RenderMode::Mode_Forward;
+    else if (curr == render[1])
+        app->renderMode = RenderMode::Mode_Deferred;
+
+    ImGui::NewLine();
+    ImGui::Text("Select texture to visualize");
+
+    const char* items[] = { "Final Color", "Albedo", "Normals", "Position", "Depth", "SSAO" };
+    static const char* current_item = items[0];
+
+    ImGui::PushItemWidth(150);
+    if (ImGui::BeginCombo("##Texture visualization", current_item)) // The second parameter is the label previewed before opening the combo.
+    {
+        for (int n = 0; n < IM_ARRAYSIZE(items); n++)
+        {
+            bool is_selected = (current_item == items[n]); // You can store your selection however you want, outside or inside your objects
+            if (ImGui::Selectable(items[n], is_selected))
+                current_item = items[n];
+                if (is_selected)
+                    ImGui::SetItemDefaultFocus();   // You may set the initial focus when opening the combo (scrolling + for keyboard navigation support)
+        }
+        ImGui::EndCombo();
+    }
+
+    if (current_item == items[0])
+        app->mode = Mode::Mode_FinalColor;
+    else if (current_item == items[1])
+        app->mode = Mode::Mode_TexturedAlbedo;
+    else if (current_item == items[2])
+        app->mode = Mode::Mode_TexturedNormals;
+    else if (current_item == items[3])
+        app->mode = Mode::Mode_TexturedPositions;
+    else if (current_item == items[4])
+        app->mode = Mode::Mode_TexturedDepth;
+    else if (current_item == items[5])
+        app->mode = Mode::Mode_SSAOValue;
+
+    ImGui::NewLine();
+
+   
+    ImGui::Checkbox("Relief Mapping", &app->ReliefMapping);
+    ImGui::SameLine; ImGui::Text("Bumpiness"); ImGui::SameLine();  ImGui::PushItemWidth(50); ImGui::DragFloat("##BUMP", &app->bumpiness, 0.001f, 0.0, 0.5);
+    ImGui::NewLine();
+    ImGui::Checkbox("SSAO", &app->SSAO);
+    ImGui::SameLine; ImGui::Text("Radius"); ImGui::SameLine();  ImGui::PushItemWidth(50); ImGui::DragFloat("##RAD", &app->radius, 0.001f, 0.0, 0.5); 
+    ImGui::SameLine(); if(ImGui::Button("Reset Radius")) app->radius = 0.5f;
+    ImGui::SameLine; ImGui::Text("Bias"); ImGui::SameLine();  ImGui::PushItemWidth(75); ImGui::DragFloat("##BIAS", &app->bias, 0.00001f, 0.0, 0.01, "%.5f"); 
+    ImGui::SameLine(); if(ImGui::Button("Reset Bias")) app->bias = 0.0025f;
+    const char* ssaoScales[] = { "Full", "Half", "Quarter" };
+    i32 ssaoScaleItem = app->ssaoScale == 4 ? 2 : app->ssaoScale - 1;
+    ImGui::PushItemWidth(100);
+    if (ImGui::Combo("SSAO resolution", &ssaoScaleItem, ssaoScales, IM_ARRAYSIZE(ssaoScales)))
+        app->ssaoScale = 1 << ssaoScaleItem;
+    ImGui::PopItemWidth();
+    ImGui::SameLine(); ImGui::Checkbox("Compute SSAO", &app->ssaoCompute);
+    for (u32 path = 0; path < 2; ++path)
+    {
+        const f32* stages = app->ssaoStageTimes[path];
+        ImGui::Text("%s GPU: %.3f ms (full)  %.3f ms (half)  %.3f ms (quarter)", path == 0 ? "Fragment" : "Compute ",
+            app->ssaoGpuTime[path][0], app->ssaoGpuTime[path][1], app->ssaoGpuTime[path][2]);
+        ImGui::Text("    downsample %.3f  occlusion %.3f  blur %.3f + %.3f  upsample %.3f (ms, last measured)",
+            stages[SSAOStage_Downsample], stages[SSAOStage_Occlusion], stages[SSAOStage_BlurX],
+            stages[SSAOStage_BlurY], stages[SSAOStage_Upsample]);
+    }
+    ImGui::Checkbox("Temporal SSAO (fragment)", &app->ssaoTemporal);
+    ImGui::SameLine(); ImGui::Text("Samples per frame");
+    ImGui::SameLine(); ImGui::RadioButton("8", &app->ssaoTemporalSamples, 8);
+    ImGui::SameLine(); ImGui::RadioButton("16", &app->ssaoTemporalSamples, 16);
+    ImGui::NewLine();
+    const char* lightingModes[] = { "Tiled compute", "Full screen quad", "Light volumes" };
+    ImGui::PushItemWidth(150);
+    ImGui::Combo("Deferred lighting", (int*)&app->lightingMode, lightingModes, IM_ARRAYSIZE(lightingModes));
+    ImGui::PopItemWidth();
+    ImGui::SameLine(); ImGui::Text("Lights: %u", (u32)app->lights.size());
+    if (app->lightingMode == LightingMode::Mode_Tiled && app->overflowTiles > 0)
+    {
+        ImGui::SameLine();
+        ImGui::TextColored(ImVec4(1.0f, 0.4f, 0.4f, 1.0f), "%u tiles over %u lights, the rest are dropped", app->overflowTiles, MAX_LIGHTS_PER_TILE);
+    }
+    ImGui::Text("G-buffer: %u bytes per pixel", app->gbufferBytesPerPixel);
+    ImGui::Text("Shaded pixels: %llu (full screen quad)  %llu (light volumes)",
+        app->shadedPixels[(u32)LightingMode::Mode_FullScreenQuad], app->shadedPixels[(u32)LightingMode::Mode_LightVolumes]);
+    ImGui::SameLine(); ImGui::PushItemWidth(150);
+    i32 extraLightCount = app->extraLightCount;
+    if (ImGui::SliderInt("Extra point lights", &extraLightCount, 0, 8192))
+        SetExtraLightCount(app, (u32)extraLightCount);
+    ImGui::PopItemWidth();
+
+    ImGui::End();
+
+    // Rolling statistics over the last GPU_PROFILER_HISTORY resolved frames
+    const GPUProfiler& profiler = app->gpuProfiler;
+    ImGui::Begin("GPU profiler");
+    ImGui::Text("Frames: %u  dropped: %u  latency: %u frames", profiler.historyCount, profiler.droppedFrames, GPU_PROFILER_LATENCY);
+    ImGui::Columns(7, "##GPU profiler");
+    const char* headers[] = { "Scope", "Last", "Avg", "p50", "p95", "p99", "Max" };
+    for (u32 i = 0; i < ARRAY_COUNT(headers); ++i)
+    {
+        ImGui::Text("%s", headers[i]);
+        ImGui::NextColumn();
+    }
+    ImGui::Separator();
+    for (u32 scope = 0; scope < profiler.scopeCount; ++scope)
+    {
+        const GPUProfilerStats stats = GetGPUProfilerStats(profiler, scope);
+        if (stats.samples == 0)
+            continue;
+        const f32 values[] = { stats.last, stats.average, stats.p50, stats.p95, stats.p99, stats.max };
+        ImGui::Text("%s", profiler.scopeNames[scope]);
+        ImGui::NextColumn();
+        for (u32 i = 0; i < ARRAY_COUNT(values); ++i)
+        {
+            ImGui::Text("%.3f", values[i]);
+            ImGui::NextColumn();
+        }
+    }
+    ImGui::Columns(1);
+    if (ImGui::Button("Export CSV"))
+        ExportGPUProfilerCSV(profiler, "gpu_profile.csv");
+    ImGui::End();
+
+    GLTrace& trace = GlobalGLTrace;
+    ImGui::Begin("GL calls");
+    bool traceEnabled = trace.enabled;
+    if (ImGui::Checkbox("Intercept GL calls", &traceEnabled))
+        SetGLTraceEnabled(traceEnabled);
+    ImGui::SameLine(); if (ImGui::Button("Capture 120 frames##GL")) StartGLTraceCapture(120);
+    if (trace.captureFramesLeft > 0)
+    {
+        ImGui::SameLine(); ImGui::Text("capturing, %u frames left", trace.captureFramesLeft);
+    }
+    if (trace.enabled)
+    {
+        const GLTraceFrame& frame = trace.lastFrame;
+        ImGui::Text("Calls: %u  draws: %u  dispatches: %u", frame.totalCalls, frame.drawCalls, frame.dispatches);
+        ImGui::Text("State changes: %u  redundant binds: %u", frame.stateChanges, frame.redundantBinds);
+        ImGui::Text("Uploaded: %.1f KB  mapped: %.1f KB", frame.uploadBytes / 1024.0f, frame.mappedBytes / 1024.0f);
+        ImGui::Separator();
+
+        // Busiest entry points first
+        const char* entryNames[] = {
+#define GL_TRACE_NAME(name) #name,
+            GL_TRACE_ENTRY_POINTS(GL_TRACE_NAME)
+#undef GL_TRACE_NAME
+        };
+        u32 order[GLTrace_Count];
+        for (u32 i = 0; i < GLTrace_Count; ++i)
+            order[i] = i;
+        std::sort(order, order + GLTrace_Count, [&frame](u32 a, u32 b) { return frame.calls[a] > frame.calls[b]; });
+
+        ImGui::Columns(2, "##GL calls");
+        for (u32 i = 0; i < GLTrace_Count && frame.calls[order[i]] > 0; ++i)
+        {
+            ImGui::Text("%s", entryNames[order[i]]);
+            ImGui::NextColumn();
+            ImGui::Text("%u", frame.calls[order[i]]);
+            ImGui::NextColumn();
+        }
+        ImGui::Columns(1);
+    }
+    ImGui::End();
+}
+
+void Update(App* app)
+{
+    PROFILE_FUNCTION();
+
+    auto updateStart = std::chrono::high_resolution_clock::now();
+
+    // You can handle app->input keyboard/mouse here
+
+    app->camera.UpdateCameraVectors();
+
+    ProcessAssetUploads(app, app->uploadBudget);
+
+    // Shader hot reload
+    for (u64 i = 0; i < app->programs.size(); i++)
+    {
+        Program& program = app->programs[i];
+        u64 currentTimestamp = GetFileLastWriteTimestamp(program.filepath.c_str());
+        if (currentTimestamp > program.lastWriteTimestamp)
+        {
+            glDeleteProgram(program.handle);
+            String programSource = ReadTextFile(program.filepath.c_str());
+            const char* programName = program.programName.c_str();
+            program.handle = program.isCompute ? CreateComputeProgramFromSource(programSource, programName)
+                                               : CreateProgramFromSource(programSource, programName);
+            program.lastWriteTimestamp = currentTimestamp;
+            ReflectProgramUniforms(program);
+        }
+    }
+
+    //-------------------------------------- WASD position movement and QE yaw rotation -------------------------------------
+    static float speed = 20.0f * app->deltaTime;
+
+    if (app->input.keys[K_W] == BUTTON_PRESSED) app->camera.position += app->camera.front * speed;
+    if (app->input.keys[K_S] == BUTTON_PRESSED) app->camera.position -= app->camera.front * speed;
+    if (app->input.keys[K_D] == BUTTON_PRESSED) app->camera.position += app->camera.right * speed;
+    if (app->input.keys[K_A] == BUTTON_PRESSED) app->camera.position -= app->camera.right * speed;
+
+    if (app->input.keys[K_E] == BUTTON_PRESSED) app->camera.position += app->camera.up * speed;
+    if (app->input.keys[K_Q] == BUTTON_PRESSED) app->camera.position -= app->camera.up * speed;
+
+
+    if (app->input.mouseButtons[LEFT] == BUTTON_PRESSED) app->camera.yaw += app->input.mouseDelta.x / 10;
+    if (app->input.mouseButtons[LEFT] == BUTTON_PRESSED) app->camera.pitch -= app->input.mouseDelta.y / 10;
+
+    //--------------------------------------------------------------------------------------------------------------------------
+   
+    MapBufferRegion(app->cbuffer);
+
+    //Global params
+    app->globalParamOffset = app->cbuffer.head;
+    PushVec3(app->cbuffer, app->camera.position);
+    // GlobalParams only fits the first lights, the tiled pass reads all of them from the light buffer
+    const u32 globalLightCount = min((u32)app->lights.size(), (u32)MAX_GLOBAL_LIGHTS);
+    PushUInt(app->cbuffer, globalLightCount);
+
+    for (u32 i = 0; i < globalLightCount; ++i)
+    {
+        const Light& light = app->lights[i];
+        AlignHead(app->cbuffer, sizeof(vec4));
+
+        PushUInt(app->cbuffer, light.type);
+        PushAlignedData(app->cbuffer, &light.range, sizeof(light.range), 4);
+        PushVec3(app->cbuffer, light.color);
+        PushVec3(app->cbuffer, light.direction);
+        PushVec3(app->cbuffer, light.position);
+    }
+    app->globalParamSize = app->cbuffer.head - app->globalParamOffset;
+
+    UnmapBufferRegion(app->cbuffer);
+
+    UploadLights(app);
+
+    // The forward path only shades the lights of each fragment's cluster
+    if (app->renderMode == RenderMode::Mode_Forward)
+    {
+        AssignLightsToClusters(app->lightClusters, app->camera.GetViewMatrix(), app->camera.GetProjectionMatrix(),
+                               app->camera.near_plane, app->camera.far_plane, app->lights.data(), (u32)app->lights.size(), &app->jobPool);
+        UploadLightClusters(app);
+    }
+
+    //Render queue and per-instance params
+    auto transformStart = std::chrono::high_resolution_clock::now();
+
+    app->camera.ViewProjectionMatrix = app->camera.GetProjectionMatrix() * app->camera.GetViewMatrix();
+
+    // Gribb/Hartmann: each plane is a sum or difference of the last row with another one
+    const mat4 vp = transpose(app->camera.ViewProjectionMatrix);
+    for (u32 i = 0; i < 3; ++i)
+    {
+        app->camera.FrustumPlanes[i * 2 + 0] = vp[3] + vp[i];
+        app->camera.FrustumPlanes[i * 2 + 1] = vp[3] - vp[i];
+    }
+    for (vec4& plane : app->camera.FrustumPlanes)
+        plane /= length(vec3(plane));
+
+    UpdateEntityBVH(app);
+
+    if (app->renderMode == RenderMode::Mode_Forward)
+        BuildRenderQueue(app, app->renderQueue, RenderPass_Forward, app->ForwardProgramIdx);
+    else
+        BuildRenderQueue(app, app->renderQueue, RenderPass_Geometry, app->GeometryPassProgramIdx);
+    CullRenderQueue(app, app->renderQueue);
+    OcclusionCullRenderQueue(app, app->renderQueue);
+    SortRenderQueue(app->renderQueue);
+
+    const u32 instanceCount = (u32)app->renderQueue.items.size();
+    ReserveRingBuffer(app->instanceBuffer, instanceCount * sizeof(InstanceParams));
+
+    MapBufferRegion(app->instanceBuffer);
+    TransformEntities(app->camera.ViewProjectionMatrix, app->entities.data(), app->renderQueue.items.data(), instanceCount,
+                      (u8*)app->instanceBuffer.data, sizeof(InstanceParams));
+    app->instanceBuffer.head += instanceCount * sizeof(InstanceParams);
+    UnmapBufferRegion(app->instanceBuffer);
+
+    auto transformEnd = std::chrono::high_resolution_clock::now();
+    app->transformStageTime = std::chrono::duration<f32, std::milli>(transformEnd - transformStart).count();
+    app->updateTime = std::chrono::duration<f32, std::milli>(transformEnd - updateStart).count();
+}
+
+void Render(App* app)
+{
+    PROFILE_FUNCTION();
+
+    auto renderStart = std::chrono::high_resolution_clock::now();
+
+    app->stateCache.bindsIssued = 0;
+    app->stateCache.bindsSkipped = 0;
+
+    GPUProfiler& profiler = app->gpuProfiler;
+    GPUProfilerBeginFrame(profiler);
+    GPUProfilerBegin(profiler, "Frame");
+
+    if (app->renderMode == RenderMode::Mode_Forward)
+    {
+        GPUProfilerBegin(profiler, "Forward");
+
+        // - clear the framebuffer
+        glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        // - set the viewport
+        glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+        // - the program is bound by the render queue submission
+        Program& texturedMeshProgram = app->programs[app->ForwardProgramIdx];
+
+        //Binding buffer ranges to uniform blocks (GLOBAL PARAMETERS)
+        u32 blockOffset = app->globalParamOffset;
+        u32 blockSize = app->globalParamSize;
+        glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), app->cbuffer.handle, blockOffset, blockSize);
+
+        // Lights and their cluster lists
+        const LightClusters& clusters = app->lightClusters;
+        glUseProgram(texturedMeshProgram.handle);
+        SetUniform3i(texturedMeshProgram, UNIFORM("uClusterCount"), ivec3(clusters.countX, clusters.countY, clusters.countZ));
+        SetUniform2f(texturedMeshProgram, UNIFORM("uViewportSize"), vec2(app->displaySize));
+        SetUniform1f(texturedMeshProgram, UNIFORM("uClusterNear"), clusters.near);
+        SetUniform1f(texturedMeshProgram, UNIFORM("uClusterFar"), clusters.far);
+
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, app->lightBuffer.handle, app->lightBuffer.regionOffset,
+                          app->lightBuffer.head - app->lightBuffer.regionOffset);
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 2, app->clusterBuffer.handle, app->clusterBuffer.regionOffset,
+                          app->clusterBuffer.head - app->clusterBuffer.regionOffset);
+
+        SubmitRenderQueue(app, app->renderQueue, texturedMeshProgram);
+
+        //Clear vertex array and program
+        glBindVertexArray(0);
+        glUseProgram(0);
+
+        GPUProfilerEnd(profiler);
+    }
+
+    else if (app->renderMode == RenderMode::Mode_Deferred)
+    {
+        GPUProfilerBegin(profiler, "Geometry");
+
+        // --- Screen ---
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        // Render on this framebuffer render targets
+        glBindFramebuffer(GL_FRAMEBUFFER, app->framebufferHandle);
+
+        // Select on which render targets to draw
+        GLuint drawBuffers[] = {
+            GL_COLOR_ATTACHMENT0,
+            GL_COLOR_ATTACHMENT1,
+            GL_COLOR_ATTACHMENT2
+        };
+
+        glDrawBuffers(ARRAY_COUNT(drawBuffers), drawBuffers);
+
+        // - clear the framebuffer, the light volumes leave the stencil back at 0
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+
+        // The geometry pass only writes albedo and normal, the lighting output is written later
+        drawBuffers[0] = GL_NONE;
+        glDrawBuffers(ARRAY_COUNT(drawBuffers), drawBuffers);
+
+
+        // - set the viewport
+        glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+
+        // ------- GEOMETRY PASS -------------
+
+        Program& ProgramGeometryPass = app->programs[app->GeometryPassProgramIdx];
+
+        //Binding buffer ranges to uniform blocks (GLOBAL PARAMETERS)
+        u32 blockOffset = app->globalParamOffset;
+        u32 blockSize = app->globalParamSize;
+        glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), app->cbuffer.handle, blockOffset, blockSize);
+
+        if (app->multiDrawIndirect)
+            SubmitRenderQueueIndirect(app, app->renderQueue, app->programs[app->GeometryPassIndirectProgramIdx]);
+        else
+            SubmitRenderQueue(app, app->renderQueue, ProgramGeometryPass);
+        GPUProfilerEnd(profiler);
+
+        ////// -------- SSAO PASS ---------------
+        GPUProfilerBegin(profiler, "SSAO");
+        SSAOPass(app);
+        GPUProfilerEnd(profiler);
+
+        // -------- SHADING PASS ---------------
+        GPUProfilerBegin(profiler, "Shading");
+
+        if (app->lightingMode == LightingMode::Mode_Tiled)
+        {
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            TiledShadingPass(app);
+        }
+        else
+        {
+            // Results come back a few frames late, only one frame of queries is in flight at a time
+            if (app->lightingQueryPending)
+            {
+                GLuint available = 1;
+                for (u32 i = 0; i < app->lightingQueryCount && available; ++i)
+                    glGetQueryObjectuiv(app->lightingQueries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+                if (available)
+                {
+                    GLuint64 samples = 0;
+                    for (u32 i = 0; i < app->lightingQueryCount; ++i)
+                    {
+                        GLuint64 querySamples = 0;
+                        glGetQueryObjectui64v(app->lightingQueries[i], GL_QUERY_RESULT, &querySamples);
+                        samples += querySamples;
+                    }
+                    app->shadedPixels[(u32)app->lightingQueryMode] = samples * app->lightingQueryLights + app->lightingQueryExtra;
+                    app->lightingQueryPending = false;
+                }
+            }
+            const bool measure = !app->lightingQueryPending;
+            const bool lightVolumes = app->lightingMode == LightingMode::Mode_LightVolumes;
+
+            // The quad shades every light of GlobalParams, or only the directional ones when the volumes do the rest
+            u32 quadLights = min((u32)app->lights.size(), (u32)MAX_GLOBAL_LIGHTS);
+            if (lightVolumes)
+            {
+                quadLights = 0;
+                for (u32 i = 0; i < min((u32)app->lights.size(), (u32)MAX_GLOBAL_LIGHTS); ++i)
+                    quadLights += app->lights[i].type == LightType::Directional;
+            }
+
+            Program& shadingPass = app->programs[app->ShadingPassProgramIdx];
+            glUseProgram(shadingPass.handle);
+
+            SetUniform1i(shadingPass, UNIFORM("oAlbedo"), 0);
+            SetUniform1i(shadingPass, UNIFORM("oNormal"), 1);
+            SetUniform1i(shadingPass, UNIFORM("oDepth"), 2);
+            SetUniform1i(shadingPass, UNIFORM("oOcclusion"), 3);
+            SetUniformMat4(shadingPass, UNIFORM("uInverseViewProjection"), inverse(app->camera.ViewProjectionMatrix));
+            SetUniform1i(shadingPass, UNIFORM("uDirectionalOnly"), lightVolumes ? 1 : 0);
+
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, app->albedoAttachmentHandle);
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, app->normalAttachmentHandle);
+            glActiveTexture(GL_TEXTURE2);
+            glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
+            glActiveTexture(GL_TEXTURE3);
+            glBindTexture(GL_TEXTURE_2D, app->ssaoColorBuffer);
+
+            // We only need to draw 1 buffer so it would be unnecessary to use an array of buffers
+            glDrawBuffer(GL_COLOR_ATTACHMENT0);
+
+            glDepthMask(false);
+
+            //Binding buffer ranges to uniform blocks (GLOBAL PARAMETERS)
+            glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), app->cbuffer.handle, blockOffset, blockSize);
+            if (measure && !lightVolumes)
+            {
+                glBeginQuery(GL_SAMPLES_PASSED, app->lightingQueries[0]);
+                app->lightingQueryCount = 1;
+            }
+            renderQuad();
+            if (measure && !lightVolumes)
+                glEndQuery(GL_SAMPLES_PASSED);
+            glDepthMask(true);
+
+            if (lightVolumes)
+                LightVolumePass(app, measure);
+
+            if (measure)
+            {
+                const u64 screenPixels = (u64)app->displaySize.x * app->displaySize.y;
+                app->lightingQueryPending = true;
+                app->lightingQueryMode = app->lightingMode;
+                app->lightingQueryLights = lightVolumes ? 1 : quadLights;
+                app->lightingQueryExtra = lightVolumes ? screenPixels * quadLights : 0;
+            }
+
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        }
+        GPUProfilerEnd(profiler);
+
+        // The G-buffer views are decoded into the color attachment, over the lighting result
+        if (app->mode != Mode::Mode_FinalColor)
+        {
+            GPUProfilerBegin(profiler, "G-buffer view");
+            Program& gbufferView = app->programs[app->GBufferViewProgramIdx];
+            glUseProgram(gbufferView.handle);
+
+            SetUniform1i(gbufferView, UNIFORM("uMode"), (i32)app->mode);
+            SetUniformMat4(gbufferView, UNIFORM("uInverseViewProjection"), inverse(app->camera.ViewProjectionMatrix));
+            SetUniform1f(gbufferView, UNIFORM("uNear"), app->camera.near_plane);
+            SetUniform1f(gbufferView, UNIFORM("uFar"), app->camera.far_plane);
+            SetUniform1i(gbufferView, UNIFORM("oAlbedo"), 0);
+            SetUniform1i(gbufferView, UNIFORM("oNormal"), 1);
+            SetUniform1i(gbufferView, UNIFORM("oDepth"), 2);
+            SetUniform1i(gbufferView, UNIFORM("oOcclusion"), 3);
+
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, app->albedoAttachmentHandle);
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, app->normalAttachmentHandle);
+            glActiveTexture(GL_TEXTURE2);
+            glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
+            glActiveTexture(GL_TEXTURE3);
+            glBindTexture(GL_TEXTURE_2D, app->ssaoColorBuffer);
+
+            glBindFramebuffer(GL_FRAMEBUFFER, app->framebufferHandle);
+            glDrawBuffer(GL_COLOR_ATTACHMENT0);
+            glDisable(GL_DEPTH_TEST);
+            renderQuad();
+            glEnable(GL_DEPTH_TEST);
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            GPUProfilerEnd(profiler);
+        }
+
+        app->DisplayedTexture = app->colorAttachmentHandle;
+
+        // --- Draw framebuffer texture -------------------------------------------------
+        GPUProfilerBegin(profiler, "Display");
+        Program& programTexturedGeometry = app->programs[app->texturedGeometryProgramIdx];
+        glUseProgram(programTexturedGeometry.handle);
+        glBindVertexArray(app->vao);
+
+        //glEnable(GL_BLEND);
+        //glBlendFunc(GL_ONE, GL_ONE);
+
+        SetUniform1i(programTexturedGeometry, UNIFORM("uTexture"), 0);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, app->DisplayedTexture);
+
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+
+        //Clear vertex array and program
+        glBindVertexArray(0);
+        glUseProgram(0);
+        GPUProfilerEnd(profiler);
+    }
+
+    GPUProfilerEnd(profiler);
+
+    // The GPU releases this frame's buffer regions once it reaches this point
+    FenceBufferRegion(app->cbuffer);
+    FenceBufferRegion(app->instanceBuffer);
+    FenceBufferRegion(app->lightBuffer);
+    if (app->renderMode == RenderMode::Mode_Forward)
+        FenceBufferRegion(app->clusterBuffer);
+    if (app->renderMode == RenderMode::Mode_Deferred && app->multiDrawIndirect)
+    {
+        FenceBufferRegion(app->indirectBuffer);
+        FenceBufferRegion(app->drawInstanceBuffer);
+        FenceBufferRegion(app->materialBuffer);
+    }
+
+    auto renderEnd = std::chrono::high_resolution_clock::now();
+    app->renderTime = std::chrono::duration<f32, std::milli>(renderEnd - renderStart).count();
+}
+
+// ----------------------------------------------
+// ---------- RENDER QUEUE ----------------------
+// ----------------------------------------------
+
+void BuildRenderQueue(App* app, RenderQueue& queue, RenderPass pass, u32 programIdx)
+{
+    queue.pass = pass;
+    queue.programIdx = programIdx;
+    queue.items.clear();
+
+    const Camera& camera = app->camera;
+    const f32 depthScale = (f32)((1u << DRAW_KEY_DEPTH_BITS) - 1) / camera.far_plane;
+
+    // Only entities whose bounds touch the frustum, submeshes are culled afterwards
+    queue.entities.clear();
+    if (queue.frustumCulling && app->bvh.root >= 0)
+    {
+        QueryBVHFrustum(app->bvh, app->camera.FrustumPlanes, queue.entities);
+    }
+    else
+    {
+        for (u32 entityIdx = 0; entityIdx < app->entities.size(); ++entityIdx)
+            queue.entities.push_back(entityIdx);
+    }
+
+    for (u32 entityIdx : queue.entities)
+    {
+        const Entity& entity = app->entities[entityIdx];
+        const Model& model = app->models[entity.modelIndex];
+        const Mesh& mesh = app->meshes[model.meshIdx];
+
+        // View depth of the entity origin, quantized so closer entities sort first
+        const vec3 position = vec3(entity.worldMatrix[3]);
+        const f32 viewDepth = clamp(dot(position - camera.position, camera.front), 0.0f, camera.far_plane);
+        const u64 depth = (u64)(viewDepth * depthScale);
+
+        for (u32 submeshIdx = 0; submeshIdx < mesh.submeshes.size(); ++submeshIdx)
+        {
+            DrawItem item = {};
+            item.entityIdx = entityIdx;
+            item.submeshIdx = submeshIdx;
+            item.meshIdx = model.meshIdx;
+            item.materialIdx = model.materialIdx[submeshIdx];
+            item.key = ((u64)pass << DRAW_KEY_PASS_SHIFT) |
+                       ((u64)(programIdx & 0x3f) << DRAW_KEY_PROGRAM_SHIFT) |
+                       ((u64)(item.materialIdx & 0x3fff) << DRAW_KEY_MATERIAL_SHIFT) |
+                       ((u64)(item.meshIdx & 0xfff) << DRAW_KEY_MESH_SHIFT) |
+                       ((u64)(submeshIdx & 0xf) << DRAW_KEY_SUBMESH_SHIFT) |
+                       depth;
+            queue.items.push_back(item);
+        }
+    }
+}
+
+// Transforms the local bounds of every item to a world space AABB and keeps the items
+// that intersect the view frustum, preserving their order
+void CullRenderQueue(App* app, RenderQueue& queue)
+{
+    auto cullStart = std::chrono::high_resolution_clock::now();
+
+    const u32 count = (u32)queue.items.size();
+    if (!queue.frustumCulling || count == 0)
+    {
+        queue.culledCount = 0;
+        queue.cullTime = 0.0f;
+        return;
+    }
+
+    const u32 paddedCount = (count + 7) & ~7u;
+    queue.cullBounds.resize(paddedCount * 6);
+    f32* centerX = queue.cullBounds.data();
+    f32* centerY = centerX + paddedCount;
+    f32* centerZ = centerY + paddedCount;
+    f32* extentX = centerZ + paddedCount;
+    f32* extentY = extentX + paddedCount;
+    f32* extentZ = extentY + paddedCount;
+
+    // Arvo: world center is the transformed local center, world extent the local
+    // extent through the absolute value of the rotation/scale part
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    for (u32 i = 0; i < count; ++i)
+    {
+        const DrawItem& item = queue.items[i];
+        const AABB& bounds = app->meshes[item.meshIdx].submeshes[item.submeshIdx].bounds;
+        const mat4& m = app->entities[item.entityIdx].worldMatrix;
+
+        const vec3 center = (bounds.max + bounds.min) * 0.5f;
+        const vec3 extent = (bounds.max - bounds.min) * 0.5f;
+
+        const __m128 col0 = _mm_loadu_ps(&m[0][0]);
+        const __m128 col1 = _mm_loadu_ps(&m[1][0]);
+        const __m128 col2 = _mm_loadu_ps(&m[2][0]);
+        const __m128 col3 = _mm_loadu_ps(&m[3][0]);
+
+        __m128 c = _mm_add_ps(_mm_add_ps(_mm_mul_ps(col0, _mm_set1_ps(center.x)), _mm_mul_ps(col1, _mm_set1_ps(center.y))),
+                              _mm_add_ps(_mm_mul_ps(col2, _mm_set1_ps(center.z)), col3));
+        __m128 e = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(signMask, col0), _mm_set1_ps(extent.x)),
+                                         _mm_mul_ps(_mm_andnot_ps(signMask, col1), _mm_set1_ps(extent.y))),
+                              _mm_mul_ps(_mm_andnot_ps(signMask, col2), _mm_set1_ps(extent.z)));
+
+        alignas(16) f32 cv[4], ev[4];
+        _mm_store_ps(cv, c);
+        _mm_store_ps(ev, e);
+        centerX[i] = cv[0]; centerY[i] = cv[1]; centerZ[i] = cv[2];
+        extentX[i] = ev[0]; extentY[i] = ev[1]; extentZ[i] = ev[2];
+    }
+
+    // Padding boxes are never visible: infinitely far behind every plane
+    for (u32 i = count; i < paddedCount; ++i)
+    {
+        centerX[i] = centerY[i] = centerZ[i] = 0.0f;
+        extentX[i] = extentY[i] = extentZ[i] = -FLT_MAX;
+    }
+
+    // A box is outside if, for some plane, even its corner furthest along the plane
+    // normal is behind it: dot(n, c) + d + dot(|n|, e) < 0. 8 boxes per iteration.
+    const vec4* planes = app->camera.FrustumPlanes;
+    u32 visibleCount = 0;
+    for (u32 i = 0; i < paddedCount; i += 8)
+    {
+        __m128 insideLo = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        __m128 insideHi = insideLo;
+
+        for (u32 p = 0; p < 6; ++p)
+        {
+            const __m128 nx = _mm_set1_ps(planes[p].x), ax = _mm_set1_ps(fabsf(planes[p].x));
+            const __m128 ny = _mm_set1_ps(planes[p].y), ay = _mm_set1_ps(fabsf(planes[p].y));
+            const __m128 nz = _mm_set1_ps(planes[p].z), az = _mm_set1_ps(fabsf(planes[p].z));
+            const __m128 d = _mm_set1_ps(planes[p].w);
+
+            for (u32 half = 0; half < 2; ++half)
+            {
+                const u32 j = i + half * 4;
+                const __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, _mm_loadu_ps(centerX + j)), _mm_mul_ps(ny, _mm_loadu_ps(centerY + j))),
+                                               _mm_add_ps(_mm_mul_ps(nz, _mm_loadu_ps(centerZ + j)), d));
+                const __m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, _mm_loadu_ps(extentX + j)), _mm_mul_ps(ay, _mm_loadu_ps(extentY + j))),
+                                                 _mm_mul_ps(az, _mm_loadu_ps(extentZ + j)));
+                const __m128 inside = _mm_cmpge_ps(_mm_add_ps(dist, radius), _mm_setzero_ps());
+                if (half == 0) insideLo = _mm_and_ps(insideLo, inside);
+                else           insideHi = _mm_and_ps(insideHi, inside);
+            }
+        }
+
+        const u32 mask = (u32)_mm_movemask_ps(insideLo) | ((u32)_mm_movemask_ps(insideHi) << 4);
+
+        // Compact in place, visibleCount never overtakes i
+        for (u32 bit = 0; bit < 8; ++bit)
+            if (mask & (1u << bit))
+                queue.items[visibleCount++] = queue.items[i + bit];
+    }
+
+    queue.culledCount = count - visibleCount;
+    queue.items.resize(visibleCount);
+
+    auto cullEnd = std::chrono::high_resolution_clock::now();
+    queue.cullTime = std::chrono::duration<f32, std::milli>(cullEnd - cullStart).count();
+}
+
+// LSD radix sort, one byte of the key per pass. Passes where every key has the
+// same byte are skipped, which is the common case for the pass/program bits.
+void SortRenderQueue(RenderQueue& queue)
+{
+    const u32 count = (u32)queue.items.size();
+    if (count < 2)
+        return;
+
+    queue.scratch.resize(count);
+    DrawItem* src = queue.items.data();
+    DrawItem* dst = queue.scratch.data();
+
+    for (u32 shift = 0; shift < 64; shift += 8)
+    {
+        u32 offsets[256] = {};
+        for (u32 i = 0; i < count; ++i)
+            offsets[(src[i].key >> shift) & 0xff]++;
+
+        if (offsets[(src[0].key >> shift) & 0xff] == count)
+            continue;
+
+        u32 total = 0;
+        for (u32 b = 0; b < 256; ++b)
+        {
+            u32 bucketCount = offsets[b];
+            offsets[b] = total;
+            total += bucketCount;
+        }
+
+        for (u32 i = 0; i < count; ++i)
+            dst[offsets[(src[i].key >> shift) & 0xff]++] = src[i];
+
+        DrawItem* tmp = src; src = dst; dst = tmp;
+    }
+
+    if (src != queue.items.data())
+        queue.items.swap(queue.scratch);
+}
+
+void SubmitRenderQueue(App* app, RenderQueue& queue, Program& program)
+{
+    GLStateCache& cache = app->stateCache;
+    InvalidateStateCache(cache);
+
+    CacheUseProgram(cache, program.handle);
+
+    const GLuint Relief = app->ReliefMapping == true ? 1 : 0;
+    SetUniform1f(program, UNIFORM("Relief"), (float)Relief);
+    SetUniform1f(program, UNIFORM("Bumpiness"), app->bumpiness);
+    SetUniform1i(program, UNIFORM("uTexture"), 0);
+    SetUniform1i(program, UNIFORM("uNormalMap"), 1);
+    SetUniform1i(program, UNIFORM("uBumpTex"), 2);
+
+    // Instance i of the queue reads its transforms from slot i of this range
+    const u32 instanceCount = (u32)queue.items.size();
+    if (instanceCount > 0)
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, BINDING(0), app->instanceBuffer.handle,
+                          app->instanceBuffer.regionOffset, instanceCount * sizeof(InstanceParams));
+
+    queue.batchCount = 0;
+
+    for (u32 first = 0; first < instanceCount; )
+    {
+        const DrawItem& item = queue.items[first];
+
+        // Collapse the run of items sharing mesh, submesh and material into one draw
+        u32 last = first + 1;
+        while (last < instanceCount &&
+               queue.items[last].meshIdx == item.meshIdx &&
+               queue.items[last].submeshIdx == item.submeshIdx &&
+               queue.items[last].materialIdx == item.materialIdx)
+            last++;
+
+        const Submesh& submesh = app->meshes[item.meshIdx].submeshes[item.submeshIdx];
+        const Material& submeshMaterial = app->materials[item.materialIdx];
+
+        GLuint vao = FindVAO(app, app->geometry.vertexPools[submesh.vertexPool], program);
+        CacheBindVertexArray(cache, vao);
+
+        SetUniform1f(program, UNIFORM("hasNormalMap"), (float)submeshMaterial.normalsTextureIdx);
+        SetUniform1f(program, UNIFORM("hasReliefMap"), (float)submeshMaterial.bumpTextureIdx);
+        SetUniform1i(program, UNIFORM("uBaseInstance"), first);
+
+        CacheBindTexture(cache, 0, app->textures[submeshMaterial.albedoTextureIdx].handle);
+        CacheBindTexture(cache, 1, app->textures[submeshMaterial.normalsTextureIdx].handle);
+        CacheBindTexture(cache, 2, app->textures[submeshMaterial.bumpTextureIdx].handle);
+
+        glDrawElementsInstancedBaseVertex(GL_TRIANGLES, submesh.indexCount, GL_UNSIGNED_INT, (void*)((u64)submesh.firstIndex * sizeof(u32)),
+                                          last - first, submesh.baseVertex);
+        queue.batchCount++;
+
+        first = last;
+    }
+
+    // Code outside the queue binds state directly, so the shadow copy is no longer trustworthy
+    InvalidateStateCache(cache);
+}
+
+static bool SameTextures(const Material& a, const Material& b)
+{
+    return a.albedoTextureIdx == b.albedoTextureIdx && a.normalsTextureIdx == b.normalsTextureIdx && a.bumpTextureIdx == b.bumpTextureIdx;
+}
+
+// Same pass as SubmitRenderQueue with the geometry in the pools. Runs of items sharing a submesh
+// become indirect commands, and runs of commands sharing vertex pool and textures a single
+// glMultiDrawElementsIndirect. GLSL 4.30 has no gl_DrawID or gl_BaseInstance, so each command's
+// base instance is the queue index of its first item, and an instanced attribute read from there
+// gives every instance its transforms slot and material.
+void SubmitRenderQueueIndirect(App* app, RenderQueue& queue, Program& program)
+{
+    GLStateCache& cache = app->stateCache;
+    InvalidateStateCache(cache);
+
+    CacheUseProgram(cache, program.handle);
+
+    const GLuint Relief = app->ReliefMapping == true ? 1 : 0;
+    SetUniform1f(program, UNIFORM("Relief"), (float)Relief);
+    SetUniform1f(program, UNIFORM("Bumpiness"), app->bumpiness);
+    SetUniform1i(program, UNIFORM("uTexture"), 0);
+    SetUniform1i(program, UNIFORM("uNormalMap"), 1);
+    SetUniform1i(program, UNIFORM("uBumpTex"), 2);
+
+    const u32 instanceCount = (u32)queue.items.size();
+    const u32 materialCount = (u32)app->materials.size();
+
+    // Material flags, bit 0 normal mapped, bit 1 relief mapped
+    ReserveRingBuffer(app->materialBuffer, max(materialCount, 1u) * sizeof(u32));
+    MapBufferRegion(app->materialBuffer);
+    u32* materialFlags = (u32*)app->materialBuffer.data;
+    for (u32 i = 0; i < materialCount; ++i)
+        materialFlags[i] = (app->materials[i].normalsTextureIdx ? 1u : 0u) | (app->materials[i].bumpTextureIdx ? 2u : 0u);
+    app->materialBuffer.head += max(materialCount, 1u) * sizeof(u32);
+    UnmapBufferRegion(app->materialBuffer);
+
+    ReserveRingBuffer(app->drawInstanceBuffer, max(instanceCount, 1u) * sizeof(uvec2));
+    MapBufferRegion(app->drawInstanceBuffer);
+    uvec2* drawInstances = (uvec2*)app->drawInstanceBuffer.data;
+    for (u32 i = 0; i < instanceCount; ++i)
+        drawInstances[i] = uvec2(i, queue.items[i].materialIdx);
+    app->drawInstanceBuffer.head += max(instanceCount, 1u) * sizeof(uvec2);
+    UnmapBufferRegion(app->drawInstanceBuffer);
+
+    // At most one command per item
+    ReserveRingBuffer(app->indirectBuffer, max(instanceCount, 1u) * sizeof(DrawElementsIndirectCommand));
+    MapBufferRegion(app->indirectBuffer);
+    DrawElementsIndirectCommand* commands = (DrawElementsIndirectCommand*)app->indirectBuffer.data;
+
+    queue.multiDraws.clear();
+    u32 commandCount = 0;
+    for (u32 first = 0; first < instanceCount; )
+    {
+        const DrawItem& item = queue.items[first];
+        const Material& material = app->materials[item.materialIdx];
+
+        // Materials only differ in flags within a command, those are read per instance
+        u32 last = first + 1;
+        while (last < instanceCount &&
+               queue.items[last].meshIdx == item.meshIdx &&
+               queue.items[last].submeshIdx == item.submeshIdx &&
+               SameTextures(app->materials[queue.items[last].materialIdx], material))
+            last++;
+
+        const Submesh& submesh = app->meshes[item.meshIdx].submeshes[item.submeshIdx];
+
+        DrawElementsIndirectCommand& command = commands[commandCount];
+        command.count = submesh.indexCount;
+        command.instanceCount = last - first;
+        command.firstIndex = submesh.firstIndex;
+        command.baseVertex = (i32)submesh.baseVertex;
+        command.baseInstance = first;
+
+        if (queue.multiDraws.empty() || queue.multiDraws.back().vertexPool != submesh.vertexPool ||
+            !SameTextures(app->materials[queue.multiDraws.back().materialIdx], material))
+            queue.multiDraws.push_back(MultiDraw{ commandCount, 0, submesh.vertexPool, item.materialIdx });
+        queue.multiDraws.back().commandCount++;
+
+        commandCount++;
+        first = last;
+    }
+    app->indirectBuffer.head += max(instanceCount, 1u) * sizeof(DrawElementsIndirectCommand);
+    UnmapBufferRegion(app->indirectBuffer);
+
+    queue.batchCount = commandCount;
+    queue.multiDrawCount = 0;
+
+    if (instanceCount > 0)
+    {
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, BINDING(0), app->instanceBuffer.handle,
+                          app->instanceBuffer.regionOffset, instanceCount * sizeof(InstanceParams));
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, BINDING(3), app->materialBuffer.handle,
+                          app->materialBuffer.regionOffset, materialCount * sizeof(u32));
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, app->indirectBuffer.handle);
+    }
+
+    GLuint boundVao = 0;
+    for (const MultiDraw& multiDraw : queue.multiDraws)
+    {
+        const Material& material = app->materials[multiDraw.materialIdx];
+
+        GLuint vao = FindVAO(app, app->geometry.vertexPools[multiDraw.vertexPool], program);
+        CacheBindVertexArray(cache, vao);
+        if (vao != boundVao)
+        {
+            glBindVertexBuffer(DRAW_INSTANCE_LOCATION, app->drawInstanceBuffer.handle, app->drawInstanceBuffer.regionOffset, sizeof(uvec2));
+            boundVao = vao;
+        }
+
+        CacheBindTexture(cache, 0, app->textures[material.albedoTextureIdx].handle);
+        CacheBindTexture(cache, 1, app->textures[material.normalsTextureIdx].handle);
+        CacheBindTexture(cache, 2, app->textures[material.bumpTextureIdx].handle);
+
+        const u64 commandOffset = app->indirectBuffer.regionOffset + multiDraw.firstCommand * sizeof(DrawElementsIndirectCommand);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)commandOffset, multiDraw.commandCount, 0);
+        queue.multiDrawCount++;
+    }
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+    // Code outside the queue binds state directly, so the shadow copy is no longer trustworthy
+    InvalidateStateCache(cache);
+}
+
+// ----------------------------------------------
+// ---------- GL STATE CACHE --------------------
+// ----------------------------------------------
+
+void InvalidateStateCache(GLStateCache& cache)
+{
+    cache.program = UINT32_MAX;
+    cache.vao = UINT32_MAX;
+    cache.activeTextureUnit = UINT32_MAX;
+    for (u32 i = 0; i < MAX_TEXTURE_UNITS; ++i)
+        cache.textures[i] = UINT32_MAX;
+}
+
+void CacheUseProgram(GLStateCache& cache, GLuint program)
+{
+    if (cache.program == program) { cache.bindsSkipped++; return; }
+    glUseProgram(program);
+    cache.program = program;
+    cache.bindsIssued++;
+}
+
+void CacheBindVertexArray(GLStateCache& cache, GLuint vao)
+{
+    if (cache.vao == vao) { cache.bindsSkipped++; return; }
+    glBindVertexArray(vao);
+    cache.vao = vao;
+    cache.bindsIssued++;
+}
+
+void CacheBindTexture(GLStateCache& cache, u32 unit, GLuint texture)
+{
+    ASSERT(unit < MAX_TEXTURE_UNITS, "Texture unit out of range");
+    if (cache.textures[unit] == texture) { cache.bindsSkipped++; return; }
+    if (cache.activeTextureUnit != unit)
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        cache.activeTextureUnit = unit;
+    }
+    glBindTexture(GL_TEXTURE_2D, texture);
+    cache.textures[unit] = texture;
+    cache.bindsIssued++;
+}
+
+unsigned int quadVAO = 0;
+unsigned int quadVBO;
+void renderQuad()
+{
+    if (quadVAO == 0)
+    {
+        float quadVertices[] = {
+            // positions        // texture Coords
+            -1.0f,  1.0f, 0.0f, 0.0f, 1.0f,
+            -1.0f, -1.0f, 0.0f, 0.0f, 0.0f,
+             1.0f,  1.0f, 0.0f, 1.0f, 1.0f,
+             1.0f, -1.0f, 0.0f, 1.0f, 0.0f,
+        };
+        // setup plane VAO
+        glGenVertexArrays(1, &quadVAO);
+        glGenBuffers(1, &quadVBO);
+        glBindVertexArray(quadVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(quadVertices), &quadVertices, GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
+    }
+    glBindVertexArray(quadVAO);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glBindVertexArray(0);
+}
+
+// ---------------------------------------------------
+// ---------- GEOMETRY POOLS -------------------------
+// ---------------------------------------------------
+
+static bool SameVertexLayout(const VertexBufferLayout& a, const VertexBufferLayout& b)
+{
+    if (a.stride != b.stride || a.attributes.size() != b.attributes.size())
+        return false;
+
+    for (u32 i = 0; i < a.attributes.size(); ++i)
+        if (a.attributes[i].location != b.attributes[i].location ||
+            a.attributes[i].componentCount != b.attributes[i].componentCount ||
+            a.attributes[i].offset != b.attributes[i].offset)
+            return false;
+    return true;
+}
+
+static void CreateGeometryBuffer(GeometryBuffer& buffer, u32 elementSize, u32 capacity)
+{
+    buffer.elementSize = elementSize;
+    buffer.capacity = capacity;
+    buffer.used = 0;
+    buffer.freeRanges.assign(1, GeometryRange{ 0, capacity });
+
+    glGenBuffers(1, &buffer.handle);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer.handle);
+    glBufferData(GL_COPY_WRITE_BUFFER, (u64)capacity * elementSize, NULL, GL_STATIC_DRAW);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+// Doubles the buffer until count more elements fit at its end, the old contents are copied on the GPU
+static void GrowGeometryBuffer(GeometryBuffer& buffer, u32 count)
+{
+    const u32 oldCapacity = buffer.capacity;
+    u32 newCapacity = oldCapacity;
+    while (newCapacity - oldCapacity < count)
+        newCapacity *= 2;
+
+    GLuint handle = 0;
+    glGenBuffers(1, &handle);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, handle);
+    glBufferData(GL_COPY_WRITE_BUFFER, (u64)newCapacity * buffer.elementSize, NULL, GL_STATIC_DRAW);
+    glBindBuffer(GL_COPY_READ_BUFFER, buffer.handle);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, (u64)oldCapacity * buffer.elementSize);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glDeleteBuffers(1, &buffer.handle);
+
+    buffer.handle = handle;
+    buffer.capacity = newCapacity;
+
+    // The new space extends the last free range if that one reached the old end
+    if (!buffer.freeRanges.empty() && buffer.freeRanges.back().offset + buffer.freeRanges.back().count == oldCapacity)
+        buffer.freeRanges.back().count += newCapacity - oldCapacity;
+    else
+        buffer.freeRanges.push_back(GeometryRange{ oldCapacity, newCapacity - oldCapacity });
+
+    ILOG("Geometry buffer grown to %u elements (%.1f MB)", newCapacity, (u64)newCapacity * buffer.elementSize / (1024.0f * 1024.0f));
+}
+
+// Returns the offset of count contiguous elements, or UINT32_MAX if the buffer has to grow first
+static u32 AllocateGeometryRange(GeometryBuffer& buffer, u32 count)
+{
+    for (u32 i = 0; i < buffer.freeRanges.size(); ++i)
+    {
+        GeometryRange& range = buffer.freeRanges[i];
+        if (range.count < count)
+            continue;
+
+        const u32 offset = range.offset;
+        range.offset += count;
+        range.count -= count;
+        if (range.count == 0)
+            buffer.freeRanges.erase(buffer.freeRanges.begin() + i);
+
+        buffer.used += count;
+        return offset;
+    }
+    return UINT32_MAX;
+}
+
+static void FreeGeometryRange(GeometryBuffer& buffer, u32 offset, u32 count)
+{
+    if (count == 0)
+        return;
+
+    // Insert in offset order, then merge with the neighbours it touches
+    auto next = std::lower_bound(buffer.freeRanges.begin(), buffer.freeRanges.end(), offset,
+        [](const GeometryRange& range, u32 value) { return range.offset < value; });
+    u32 i = (u32)(buffer.freeRanges.insert(next, GeometryRange{ offset, count }) - buffer.freeRanges.begin());
+
+    if (i + 1 < buffer.freeRanges.size() && offset + count == buffer.freeRanges[i + 1].offset)
+    {
+        buffer.freeRanges[i].count += buffer.freeRanges[i + 1].count;
+        buffer.freeRanges.erase(buffer.freeRanges.begin() + i + 1);
+    }
+    if (i > 0 && buffer.freeRanges[i - 1].offset + buffer.freeRanges[i - 1].count == offset)
+    {
+        buffer.freeRanges[i - 1].count += buffer.freeRanges[i].count;
+        buffer.freeRanges.erase(buffer.freeRanges.begin() + i);
+    }
+
+    buffer.used -= count;
+}
+
+static void DeleteVAOs(VertexPool& pool)
+{
+    for (const Vao& vao : pool.vaos)
+        glDeleteVertexArrays(1, &vao.handle);
+    pool.vaos.clear();
+}
+
+static u32 FindVertexPool(App* app, const VertexBufferLayout& layout)
+{
+    GeometryPools& geometry = app->geometry;
+    for (u32 i = 0; i < geometry.vertexPools.size(); ++i)
+        if (SameVertexLayout(geometry.vertexPools[i].layout, layout))
+            return i;
+
+    geometry.vertexPools.push_back(VertexPool{});
+    VertexPool& pool = geometry.vertexPools.back();
+    pool.layout = layout;
+    CreateGeometryBuffer(pool.vertices, layout.stride, GEOMETRY_POOL_VERTICES);
+    return (u32)geometry.vertexPools.size() - 1u;
+}
+
+// Copies the vertices and submesh.indexCount indices of the submesh into the pools
+void UploadSubmeshGeometry(App* app, Submesh& submesh, const void* vertices, u32 vertexSize, const void* indices)
+{
+    GeometryPools& geometry = app->geometry;
+    if (!geometry.indices.handle)
+        CreateGeometryBuffer(geometry.indices, sizeof(u32), GEOMETRY_POOL_INDICES);
+
+    submesh.vertexPool = FindVertexPool(app, submesh.vertexBufferLayout);
+    submesh.vertexCount = vertexSize / submesh.vertexBufferLayout.stride;
+
+    // Growing replaces the buffer, so the VAOs pointing at it go too
+    VertexPool& pool = geometry.vertexPools[submesh.vertexPool];
+    submesh.baseVertex = AllocateGeometryRange(pool.vertices, submesh.vertexCount);
+    if (submesh.baseVertex == UINT32_MAX)
+    {
+        GrowGeometryBuffer(pool.vertices, submesh.vertexCount);
+        DeleteVAOs(pool);
+        submesh.baseVertex = AllocateGeometryRange(pool.vertices, submesh.vertexCount);
+    }
+
+    submesh.firstIndex = AllocateGeometryRange(geometry.indices, submesh.indexCount);
+    if (submesh.firstIndex == UINT32_MAX)
+    {
+        GrowGeometryBuffer(geometry.indices, submesh.indexCount);
+        for (VertexPool& other : geometry.vertexPools)
+            DeleteVAOs(other);
+        submesh.firstIndex = AllocateGeometryRange(geometry.indices, submesh.indexCount);
+    }
+
+    // The copy target leaves the element array binding of whatever VAO is bound alone
+    glBindBuffer(GL_COPY_WRITE_BUFFER, pool.vertices.handle);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, (u64)submesh.baseVertex * pool.vertices.elementSize, vertexSize, vertices);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, geometry.indices.handle);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, (u64)submesh.firstIndex * sizeof(u32), submesh.indexCount * sizeof(u32), indices);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+// Gives the geometry of the mesh back to the pools. The mesh stays in place with no submeshes,
+// so the models and entities using it keep valid indices and simply draw nothing
+void UnloadMesh(App* app, u32 meshIdx)
+{
+    GeometryPools& geometry = app->geometry;
+    Mesh& mesh = app->meshes[meshIdx];
+
+    for (const Submesh& submesh : mesh.submeshes)
+    {
+        FreeGeometryRange(geometry.vertexPools[submesh.vertexPool].vertices, submesh.baseVertex, submesh.vertexCount);
+        FreeGeometryRange(geometry.indices, submesh.firstIndex, submesh.indexCount);
+    }
+    mesh.submeshes.clear();
+    mesh.occluder.clear();
+
+    // LoadModel must not hand out the unloaded geometry again
+    for (u32 i = 0; i < app->modelCache.size(); )
+    {
+        if (app->modelCache[i].meshIdx == meshIdx)
+            app->modelCache.erase(app->modelCache.begin() + i);
+        else
+            ++i;
+    }
+}
+
+GLuint FindVAO(App* app, VertexPool& pool, const Program& program)
+{
+    // Try finding a vao for this pool/program
+    for (u32 i = 0; i < (u32)pool.vaos.size(); ++i)
+        if (pool.vaos[i].programHandle == program.handle)
+            return pool.vaos[i].handle;
+
+    //Create a new vao for this pool/program
+    GLuint vaoHandle = 0;
+    glGenVertexArrays(1, &vaoHandle);
+    glBindVertexArray(vaoHandle);
+
+    glBindBuffer(GL_ARRAY_BUFFER, pool.vertices.handle);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, app->geometry.indices.handle);
+
+    for (u32 i = 0; i < program.vertexShaderLayout.attributes.size(); ++i)
+    {
+        bool attributeWasLinked = false;
+
+        // Per instance, its buffer range is bound every frame by SubmitRenderQueueIndirect
+        if (program.vertexShaderLayout.attributes[i].location == DRAW_INSTANCE_LOCATION)
+        {
+            glVertexAttribIFormat(DRAW_INSTANCE_LOCATION, 2, GL_UNSIGNED_INT, 0);
+            glVertexAttribBinding(DRAW_INSTANCE_LOCATION, DRAW_INSTANCE_LOCATION);
+            glVertexBindingDivisor(DRAW_INSTANCE_LOCATION, 1);
+            glEnableVertexAttribArray(DRAW_INSTANCE_LOCATION);
+            continue;
+        }
+
+        for (u32 j = 0; j < pool.layout.attributes.size(); ++j)
+        {
+            if (program.vertexShaderLayout.attributes[i].location == pool.layout.attributes[j].location)
+            {
+                const u32 index = pool.layout.attributes[j].location;
+                const u32 ncomp = pool.layout.attributes[j].componentCount;
+                const u32 offset = pool.layout.attributes[j].offset;
+                const u32 stride = pool.layout.stride;
+                glVertexAttribPointer(index, ncomp, GL_FLOAT, GL_FALSE, stride, (void*)(u64)offset);
+                glEnableVertexAttribArray(index);
+
+                attributeWasLinked = true;
+                break;
+            }
+        }
+        assert(attributeWasLinked); //The pool should provide an attribute for each vertex inputs
+    }
+
+    glBindVertexArray(0);
+
+    //Store it in the list of vaos of this pool
+    Vao vao = { vaoHandle, program.handle };
+    pool.vaos.push_back(vao);
+    return vaoHandle;
+}
+
+// ---------------------------------------------------
+// ---------- TRANSFORM STAGE ------------------------
+// ---------------------------------------------------
+
+// Writes the world and world-view-projection matrices of each entity into dst,
+// one InstanceParams block every stride bytes. If items is not null, entities are
+// gathered in draw item order (entity items[i].entityIdx goes to slot i). Matrices are column major, so each
+// column of VP * W is the linear combination of the VP columns weighted by the
+// matching column of W: 4 broadcasts and 4 multiply-adds per column.
+void TransformEntities(const mat4& viewProjection, const Entity* entities, const DrawItem* items, u32 count, u8* dst, u32 stride)
+{
+    const float* vp = value_ptr(viewProjection);
+    const __m128 vp0 = _mm_loadu_ps(vp + 0);
+    const __m128 vp1 = _mm_loadu_ps(vp + 4);
+    const __m128 vp2 = _mm_loadu_ps(vp + 8);
+    const __m128 vp3 = _mm_loadu_ps(vp + 12);
+
+    for (u32 i = 0; i < count; ++i)
+    {
+        const u32 entityIdx = items ? items[i].entityIdx : i;
+        const float* world = value_ptr(entities[entityIdx].worldMatrix);
+        float* outWorld = (float*)(dst + (u64)i * stride);
+        float* outWVP = outWorld + 16;
+
+        for (u32 c = 0; c < 4; ++c)
+        {
+            const __m128 col = _mm_loadu_ps(world + c * 4);
+            _mm_storeu_ps(outWorld + c * 4, col);
+
+            __m128 r = _mm_mul_ps(vp0, _mm_shuffle_ps(col, col, _MM_SHUFFLE(0, 0, 0, 0)));
+            r = _mm_add_ps(r, _mm_mul_ps(vp1, _mm_shuffle_ps(col, col, _MM_SHUFFLE(1, 1, 1, 1))));
+            r = _mm_add_ps(r, _mm_mul_ps(vp2, _mm_shuffle_ps(col, col, _MM_SHUFFLE(2, 2, 2, 2))));
+            r = _mm_add_ps(r, _mm_mul_ps(vp3, _mm_shuffle_ps(col, col, _MM_SHUFFLE(3, 3, 3, 3))));
+            _mm_storeu_ps(outWVP + c * 4, r);
+        }
+    }
+}
+
+// Runs the transform kernel over synthetic entity sets to see how it scales
+void BenchmarkTransformStage(App* app)
+{
+    const u32 entityCounts[] = { 1000, 10000, 100000, 1000000 };
+    const u32 stride = sizeof(InstanceParams);
+
+    std::default_random_engine generator;
+    std::uniform_real_distribution<float> randomPosition(-100.0f, 100.0f);
+
+    for (u32 i = 0; i < ARRAY_COUNT(entityCounts); ++i)
+    {
+        const u32 count = entityCounts[i];
+
+        std::vector<Entity> entities(count);
+        for (Entity& entity : entities)
+            entity.worldMatrix = translate(vec3(randomPosition(generator), randomPosition(generator), randomPosition(generator)));
+
+        std::vector<u8> output((u64)count * stride);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        TransformEntities(app->camera.ViewProjectionMatrix, entities.data(), NULL, count, output.data(), stride);
+        auto end = std::chrono::high_resolution_clock::now();
+
+        app->transformBenchmarkTimes[i] = std::chrono::duration<f32, std::milli>(end - start).count();
+        ILOG("Transform stage: %u entities in %f ms", count, app->transformBenchmarkTimes[i]);
+    }
+}
+
+// ---------------------------------------------------
+// ---------- ENTITY BVH -----------------------------
+// ---------------------------------------------------
+
+// Dynamic AABB tree with one leaf per entity. Full builds are top-down binned SAH and
+// lay the nodes out depth first (left child right after its parent). Moved entities
+// only refit their ancestors, and the tree is rebuilt in the background once enough
+// refits have piled up. New entities are inserted with the SAH cost of Catto's b2DynamicTree.
+
+#define BVH_BINS 16
+#define BVH_STACK_SIZE 256
+#define BVH_MARGIN 0.1f //leaves are fattened by this fraction of their size
+
+// Traversal stack, spilling to the heap past BVH_STACK_SIZE: insertions can leave the
+// tree deeper than a balanced one until the next rebuild
+struct BVHStack
+{
+    i32              local[BVH_STACK_SIZE];
+    std::vector<i32> overflow;
+    u32              size = 0;
+
+    void Push(i32 nodeIdx)
+    {
+        if (size < BVH_STACK_SIZE)
+            local[size] = nodeIdx;
+        else
+            overflow.push_back(nodeIdx);
+        size++;
+    }
+
+    i32 Pop()
+    {
+        size--;
+        if (size < BVH_STACK_SIZE)
+            return local[size];
+        const i32 nodeIdx = overflow.back();
+        overflow.pop_back();
+        return nodeIdx;
+    }
+};
+
+static bool IsBVHLeaf(const BVHNode& node)
+{
+    return node.left < 0;
+}
+
+static u32 GetBVHLeafEntity(const BVHNode& node)
+{
+    return (u32)(-1 - node.left);
+}
+
+static f32 SurfaceArea(const vec3& min, const vec3& max)
+{
+    const vec3 d = max - min;
+    return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+static AABB Union(const AABB& a, const AABB& b)
+{
+    return AABB{ min(a.min, b.min), max(a.max, b.max) };
+}
+
+static AABB FattenBounds(const AABB& bounds)
+{
+    const vec3 margin = (bounds.max - bounds.min) * BVH_MARGIN + vec3(0.01f);
+    return AABB{ bounds.min - margin, bounds.max + margin };
+}
+
+static bool Contains(const BVHNode& node, const AABB& bounds)
+{
+    return all(lessThanEqual(node.min, bounds.min)) && all(greaterThanEqual(node.max, bounds.max));
+}
+
+static i32 AllocateBVHNode(BVH& bvh)
+{
+    if (bvh.freeNode >= 0)
+    {
+        const i32 nodeIdx = bvh.freeNode;
+        bvh.freeNode = bvh.nodes[nodeIdx].right;
+        return nodeIdx;
+    }
+
+    bvh.nodes.push_back(BVHNode{});
+    bvh.parents.push_back(-1);
+    return (i32)bvh.nodes.size() - 1;
+}
+
+static void FreeBVHNode(BVH& bvh, i32 nodeIdx)
+{
+    bvh.nodes[nodeIdx].left = 0;
+    bvh.nodes[nodeIdx].right = bvh.freeNode;
+    bvh.parents[nodeIdx] = -1;
+    bvh.freeNode = nodeIdx;
+}
+
+static void RefitBVHAncestors(BVH& bvh, i32 nodeIdx)
+{
+    for (; nodeIdx >= 0; nodeIdx = bvh.parents[nodeIdx])
+    {
+        BVHNode& node = bvh.nodes[nodeIdx];
+        const BVHNode& left = bvh.nodes[node.left];
+        const BVHNode& right = bvh.nodes[node.right];
+        node.min = min(left.min, right.min);
+        node.max = max(left.max, right.max);
+    }
+}
+
+struct BVHBuildRef
+{
+    vec3 min;
+    u32  entityIdx;
+    vec3 max;
+    vec3 centroid;
+};
+
+// Iterative so clustered scenes, where SAH keeps peeling a few entities off, can't overflow
+// the builder thread's stack. Left children are popped first, so the depth first layout holds.
+struct BVHBuildTask
+{
+    BVHBuildRef* refs;
+    u32          count;
+    i32          parent;
+    bool         isLeft;
+};
+
+static i32 BuildBVHNodes(BVH& bvh, BVHBuildRef* rootRefs, u32 rootCount)
+{
+    const i32 root = (i32)bvh.nodes.size();
+
+    std::vector<BVHBuildTask> tasks;
+    tasks.push_back(BVHBuildTask{ rootRefs, rootCount, -1, true });
+
+    while (!tasks.empty())
+    {
+        const BVHBuildTask task = tasks.back();
+        tasks.pop_back();
+
+        BVHBuildRef* refs = task.refs;
+        const u32 count = task.count;
+
+        const i32 nodeIdx = (i32)bvh.nodes.size();
+        bvh.nodes.push_back(BVHNode{});
+        bvh.parents.push_back(task.parent);
+        if (task.parent >= 0)
+        {
+            if (task.isLeft)
+                bvh.nodes[task.parent].left = nodeIdx;
+            else
+                bvh.nodes[task.parent].right = nodeIdx;
+        }
+
+        vec3 boundsMin = refs[0].min, boundsMax = refs[0].max;
+        vec3 centroidMin = refs[0].centroid, centroidMax = refs[0].centroid;
+        for (u32 i = 1; i < count; ++i)
+        {
+            boundsMin = min(boundsMin, refs[i].min);
+            boundsMax = max(boundsMax, refs[i].max);
+            centroidMin = min(centroidMin, refs[i].centroid);
+            centroidMax = max(centroidMax, refs[i].centroid);
+        }
+        bvh.nodes[nodeIdx].min = boundsMin;
+        bvh.nodes[nodeIdx].max = boundsMax;
+
+        if (count == 1)
+        {
+            bvh.nodes[nodeIdx].left = -1 - (i32)refs[0].entityIdx;
+            bvh.nodes[nodeIdx].right = -1;
+            bvh.leafOfEntity[refs[0].entityIdx] = nodeIdx;
+            continue;
+        }
+
+        // Bin the centroids along the widest axis and take the cheapest split
+        const vec3 centroidExtent = centroidMax - centroidMin;
+        const u32 axis = centroidExtent.x > centroidExtent.y ? (centroidExtent.x > centroidExtent.z ? 0 : 2) : (centroidExtent.y > centroidExtent.z ? 1 : 2);
+
+        u32 split = count / 2;
+        if (centroidExtent[axis] > 0.0f)
+        {
+            u32  binCount[BVH_BINS] = {};
+            vec3 binMin[BVH_BINS], binMax[BVH_BINS];
+            for (u32 b = 0; b < BVH_BINS; ++b)
+            {
+                binMin[b] = vec3(FLT_MAX);
+                binMax[b] = vec3(-FLT_MAX);
+            }
+
+            const f32 binScale = BVH_BINS * 0.999f / centroidExtent[axis];
+            for (u32 i = 0; i < count; ++i)
+            {
+                const u32 b = (u32)((refs[i].centroid[axis] - centroidMin[axis]) * binScale);
+                binCount[b]++;
+                binMin[b] = min(binMin[b], refs[i].min);
+                binMax[b] = max(binMax[b], refs[i].max);
+            }
+
+            // Sweep from the right to get the cost of everything after each split plane
+            f32 rightCost[BVH_BINS];
+            vec3 sweepMin = vec3(FLT_MAX), sweepMax = vec3(-FLT_MAX);
+            u32 sweepCount = 0;
+            for (u32 b = BVH_BINS - 1; b > 0; --b)
+            {
+                sweepMin = min(sweepMin, binMin[b]);
+                sweepMax = max(sweepMax, binMax[b]);
+                sweepCount += binCount[b];
+                rightCost[b] = sweepCount ? SurfaceArea(sweepMin, sweepMax) * sweepCount : 0.0f;
+            }
+
+            f32 bestCost = FLT_MAX;
+            u32 bestBin = 0;
+            sweepMin = vec3(FLT_MAX), sweepMax = vec3(-FLT_MAX);
+            sweepCount = 0;
+            for (u32 b = 0; b + 1 < BVH_BINS; ++b)
+            {
+                sweepMin = min(sweepMin, binMin[b]);
+                sweepMax = max(sweepMax, binMax[b]);
+                sweepCount += binCount[b];
+                if (sweepCount == 0 || sweepCount == count)
+                    continue;
+
+                const f32 cost = SurfaceArea(sweepMin, sweepMax) * sweepCount + rightCost[b + 1];
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestBin = b;
+                }
+            }
+
+            if (bestCost < FLT_MAX)
+            {
+                BVHBuildRef* middle = std::partition(refs, refs + count, [&](const BVHBuildRef& ref)
+                {
+                    return (u32)((ref.centroid[axis] - centroidMin[axis]) * binScale) <= bestBin;
+                });
+                split = (u32)(middle - refs);
+            }
+        }
+
+        tasks.push_back(BVHBuildTask{ refs + split, count - split, nodeIdx, false });
+        tasks.push_back(BVHBuildTask{ refs, split, nodeIdx, true });
+    }
+
+    return root;
+}
+
+void BuildBVH(BVH& bvh, const AABB* bounds, u32 count)
+{
+    bvh.nodes.clear();
+    bvh.parents.clear();
+    bvh.nodes.reserve(count * 2);
+    bvh.parents.reserve(count * 2);
+    bvh.leafOfEntity.assign(count, -1);
+    bvh.root = -1;
+    bvh.freeNode = -1;
+    bvh.refitCount = 0;
+
+    if (count == 0)
+        return;
+
+    std::vector<BVHBuildRef> refs(count);
+    for (u32 i = 0; i < count; ++i)
+    {
+        const AABB fat = FattenBounds(bounds[i]);
+        refs[i].min = fat.min;
+        refs[i].max = fat.max;
+        refs[i].entityIdx = i;
+        refs[i].centroid = (fat.min + fat.max) * 0.5f;
+    }
+
+    bvh.root = BuildBVHNodes(bvh, refs.data(), count);
+}
+
+void InsertBVHLeaf(BVH& bvh, u32 entityIdx, const AABB& bounds)
+{
+    const AABB fat = FattenBounds(bounds);
+
+    const i32 leaf = AllocateBVHNode(bvh);
+    bvh.nodes[leaf].min = fat.min;
+    bvh.nodes[leaf].max = fat.max;
+    bvh.nodes[leaf].left = -1 - (i32)entityIdx;
+    bvh.nodes[leaf].right = -1;
+    bvh.parents[leaf] = -1;
+
+    if (entityIdx >= bvh.leafOfEntity.size())
+        bvh.leafOfEntity.resize(entityIdx + 1, -1);
+    bvh.leafOfEntity[entityIdx] = leaf;
+
+    if (bvh.root < 0)
+    {
+        bvh.root = leaf;
+        return;
+    }
+
+    // Walk down towards the sibling that adds the least surface area
+    i32 nodeIdx = bvh.root;
+    while (!IsBVHLeaf(bvh.nodes[nodeIdx]))
+    {
+        const BVHNode& node = bvh.nodes[nodeIdx];
+        const f32 area = SurfaceArea(node.min, node.max);
+        const f32 combinedArea = SurfaceArea(min(node.min, fat.min), max(node.max, fat.max));
+
+        // Cost of making a new parent for this node and the leaf, and the cost
+        // pushed down to the children if we keep descending
+        const f32 cost = 2.0f * combinedArea;
+        const f32 inheritanceCost = 2.0f * (combinedArea - area);
+
+        f32 childCost[2];
+        const i32 children[2] = { node.left, node.right };
+        for (u32 c = 0; c < 2; ++c)
+        {
+            const BVHNode& child = bvh.nodes[children[c]];
+            const f32 unionArea = SurfaceArea(min(child.min, fat.min), max(child.max, fat.max));
+            childCost[c] = (IsBVHLeaf(child) ? unionArea : unionArea - SurfaceArea(child.min, child.max)) + inheritanceCost;
+        }
+
+        if (cost < childCost[0] && cost < childCost[1])
+            break;
+
+        nodeIdx = childCost[0] < childCost[1] ? children[0] : children[1];
+    }
+
+    const i32 sibling = nodeIdx;
+    const i32 oldParent = bvh.parents[sibling];
+    const i32 newParent = AllocateBVHNode(bvh);
+    bvh.parents[newParent] = oldParent;
+    bvh.nodes[newParent].left = sibling;
+    bvh.nodes[newParent].right = leaf;
+    bvh.parents[sibling] = newParent;
+    bvh.parents[leaf] = newParent;
+
+    if (oldParent < 0)
+        bvh.root = newParent;
+    else if (bvh.nodes[oldParent].left == sibling)
+        bvh.nodes[oldParent].left = newParent;
+    else
+        bvh.nodes[oldParent].right = newParent;
+
+    RefitBVHAncestors(bvh, newParent);
+}
+
+void RemoveBVHLeaf(BVH& bvh, u32 entityIdx)
+{
+    const i32 leaf = bvh.leafOfEntity[entityIdx];
+    if (leaf < 0)
+        return;
+    bvh.leafOfEntity[entityIdx] = -1;
+
+    const i32 parent = bvh.parents[leaf];
+    if (parent < 0)
+    {
+        bvh.root = -1;
+        FreeBVHNode(bvh, leaf);
+        return;
+    }
+
+    const i32 grandParent = bvh.parents[parent];
+    const i32 sibling = bvh.nodes[parent].left == leaf ? bvh.nodes[parent].right : bvh.nodes[parent].left;
+
+    if (grandParent < 0)
+    {
+        bvh.root = sibling;
+        bvh.parents[sibling] = -1;
+    }
+    else
+    {
+        if (bvh.nodes[grandParent].left == parent)
+            bvh.nodes[grandParent].left = sibling;
+        else
+            bvh.nodes[grandParent].right = sibling;
+        bvh.parents[sibling] = grandParent;
+        RefitBVHAncestors(bvh, grandParent);
+    }
+
+    FreeBVHNode(bvh, parent);
+    FreeBVHNode(bvh, leaf);
+}
+
+// Returns true if the tree had to be refit, false if the leaf still encloses the new bounds
+bool UpdateBVHLeaf(BVH& bvh, u32 entityIdx, const AABB& bounds)
+{
+    const i32 leaf = bvh.leafOfEntity[entityIdx];
+    if (Contains(bvh.nodes[leaf], bounds))
+        return false;
+
+    const AABB fat = FattenBounds(bounds);
+    bvh.nodes[leaf].min = fat.min;
+    bvh.nodes[leaf].max = fat.max;
+    RefitBVHAncestors(bvh, bvh.parents[leaf]);
+    bvh.refitCount++;
+    return true;
+}
+
+static void CollectBVHLeaves(const BVH& bvh, i32 nodeIdx, std::vector<u32>& out)
+{
+    BVHStack stack;
+    stack.Push(nodeIdx);
+
+    while (stack.size > 0)
+    {
+        const BVHNode& node = bvh.nodes[stack.Pop()];
+        if (IsBVHLeaf(node))
+        {
+            out.push_back(GetBVHLeafEntity(node));
+        }
+        else
+        {
+            stack.Push(node.right);
+            stack.Push(node.left);
+        }
+    }
+}
+
+void QueryBVHFrustum(const BVH& bvh, const vec4* planes, std::vector<u32>& out)
+{
+    if (bvh.root < 0)
+        return;
+
+    BVHStack stack;
+    stack.Push(bvh.root);
+
+    while (stack.size > 0)
+    {
+        const i32 nodeIdx = stack.Pop();
+        const BVHNode& node = bvh.nodes[nodeIdx];
+
+        const vec3 center = (node.max + node.min) * 0.5f;
+        const vec3 extent = (node.max - node.min) * 0.5f;
+
+        bool outside = false;
+        bool inside = true;
+        for (u32 p = 0; p < 6; ++p)
+        {
+            const f32 dist = dot(vec3(planes[p]), center) + planes[p].w;
+            const f32 radius = dot(abs(vec3(planes[p])), extent);
+            if (dist + radius < 0.0f) { outside = true; break; }
+            if (dist - radius < 0.0f) inside = false;
+        }
+
+        if (outside)
+            continue;
+
+        // Whole subtree is in, no need to test any further
+        if (inside || IsBVHLeaf(node))
+        {
+            CollectBVHLeaves(bvh, nodeIdx, out);
+        }
+        else
+        {
+            stack.Push(node.right);
+            stack.Push(node.left);
+        }
+    }
+}
+
+void QueryBVHSphere(const BVH& bvh, const vec3& center, f32 radius, std::vector<u32>& out)
+{
+    if (bvh.root < 0)
+        return;
+
+    const f32 radius2 = radius * radius;
+
+    BVHStack stack;
+    stack.Push(bvh.root);
+
+    while (stack.size > 0)
+    {
+        const BVHNode& node = bvh.nodes[stack.Pop()];
+
+        const vec3 closest = clamp(center, node.min, node.max);
+        const vec3 delta = closest - center;
+        if (dot(delta, delta) > radius2)
+            continue;
+
+        if (IsBVHLeaf(node))
+        {
+            out.push_back(GetBVHLeafEntity(node));
+        }
+        else
+        {
+            stack.Push(node.right);
+            stack.Push(node.left);
+        }
+    }
+}
+
+static f32 RayIntersectsNode(const BVHNode& node, const vec3& origin, const vec3& invDir, f32 maxDistance)
+{
+    const vec3 t0 = (node.min - origin) * invDir;
+    const vec3 t1 = (node.max - origin) * invDir;
+    const vec3 tNear = min(t0, t1);
+    const vec3 tFar = max(t0, t1);
+    const f32 enter = max(max(tNear.x, tNear.y), max(tNear.z, 0.0f));
+    const f32 exit = min(min(tFar.x, tFar.y), min(tFar.z, maxDistance));
+    return enter <= exit ? enter : FLT_MAX;
+}
+
+// Closest entity whose (fattened) bounds the ray hits
+bool RaycastBVH(const BVH& bvh, const vec3& origin, const vec3& direction, f32 maxDistance, u32& entityIdx, f32& distance)
+{
+    if (bvh.root < 0)
+        return false;
+
+    const vec3 invDir = 1.0f / direction;
+    distance = maxDistance;
+    bool hit = false;
+
+    BVHStack stack;
+    stack.Push(bvh.root);
+
+    while (stack.size > 0)
+    {
+        const BVHNode& node = bvh.nodes[stack.Pop()];
+        const f32 t = RayIntersectsNode(node, origin, invDir, distance);
+        if (t == FLT_MAX)
+            continue;
+
+        if (IsBVHLeaf(node))
+        {
+            distance = t;
+            entityIdx = GetBVHLeafEntity(node);
+            hit = true;
+            continue;
+        }
+
+        // Push the far child first so the near one is visited, and shrinks distance, first
+        const f32 tLeft = RayIntersectsNode(bvh.nodes[node.left], origin, invDir, distance);
+        const f32 tRight = RayIntersectsNode(bvh.nodes[node.right], origin, invDir, distance);
+        if (tLeft < tRight)
+        {
+            if (tRight != FLT_MAX) stack.Push(node.right);
+            stack.Push(node.left);
+        }
+        else
+        {
+            if (tLeft != FLT_MAX) stack.Push(node.left);
+            if (tRight != FLT_MAX) stack.Push(node.right);
+        }
+    }
+
+    return hit;
+}
+
+// World bounds of an entity from the local bounds of its submeshes
+AABB ComputeEntityBounds(App* app, const Entity& entity)
+{
+    const Mesh& mesh = app->meshes[app->models[entity.modelIndex].meshIdx];
+
+    AABB local = { vec3(FLT_MAX), vec3(-FLT_MAX) };
+    for (const Submesh& submesh : mesh.submeshes)
+        local = Union(local, submesh.bounds);
+
+    const mat4& m = entity.worldMatrix;
+    const vec3 center = vec3(m * vec4((local.max + local.min) * 0.5f, 1.0f));
+    const vec3 localExtent = (local.max - local.min) * 0.5f;
+    const vec3 extent = abs(vec3(m[0])) * localExtent.x + abs(vec3(m[1])) * localExtent.y + abs(vec3(m[2])) * localExtent.z;
+    return AABB{ center - extent, center + extent };
+}
+
+void BuildEntityBVH(App* app)
+{
+    std::vector<AABB> bounds(app->entities.size());
+    for (u32 i = 0; i < app->entities.size(); ++i)
+        bounds[i] = ComputeEntityBounds(app, app->entities[i]);
+
+    BuildBVH(app->bvh, bounds.data(), (u32)bounds.size());
+    app->bvhMoved.clear();
+}
+
+// Entities placed once the tree is built have to move through here, or culling keeps
+// using their old bounds. Their leaves are refit in UpdateEntityBVH.
+void SetEntityWorldMatrix(App* app, u32 entityIdx, const mat4& worldMatrix)
+{
+    app->entities[entityIdx].worldMatrix = worldMatrix;
+    app->bvhMoved.push_back(entityIdx);
+}
+
+void UpdateEntityBVH(App* app)
+{
+    BVH& bvh = app->bvh;
+
+    // A background rebuild is done: swap it in and replay what moved in the meantime
+    if (app->bvhRebuild.valid() && app->bvhRebuild.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+    {
+        bvh = app->bvhRebuild.get();
+        for (u32 entityIdx : app->bvhMovedDuringRebuild)
+            if (entityIdx < bvh.leafOfEntity.size())
+                UpdateBVHLeaf(bvh, entityIdx, ComputeEntityBounds(app, app->entities[entityIdx]));
+        app->bvhMovedDuringRebuild.clear();
+        app->bvhRebuildCount++;
+    }
+
+    for (u32 entityIdx = (u32)bvh.leafOfEntity.size(); entityIdx < app->entities.size(); ++entityIdx)
+        InsertBVHLeaf(bvh, entityIdx, ComputeEntityBounds(app, app->entities[entityIdx]));
+
+    for (u32 entityIdx : app->bvhMoved)
+    {
+        UpdateBVHLeaf(bvh, entityIdx, ComputeEntityBounds(app, app->entities[entityIdx]));
+        if (app->bvhRebuild.valid())
+            app->bvhMovedDuringRebuild.push_back(entityIdx);
+    }
+    app->bvhMoved.clear();
+
+    // Refits only ever grow nodes, rebuild once a good part of the tree has been touched
+    if (!app->bvhRebuild.valid() && bvh.refitCount > max(64u, (u32)app->entities.size() / 4))
+    {
+        std::vector<AABB> bounds(app->entities.size());
+        for (u32 i = 0; i < app->entities.size(); ++i)
+            bounds[i] = ComputeEntityBounds(app, app->entities[i]);
+
+        bvh.refitCount = 0;
+        app->bvhRebuild = std::async(std::launch::async, [](std::vector<AABB> bounds)
+        {
+            BVH rebuilt = {};
+            BuildBVH(rebuilt, bounds.data(), (u32)bounds.size());
+            return rebuilt;
+        }, std::move(bounds));
+    }
+}
+
+void BenchmarkBVH(App* app)
+{
+    const u32 entityCounts[] = { 10000, 100000, 1000000 };
+
+    std::default_random_engine generator;
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    for (u32 i = 0; i < ARRAY_COUNT(entityCounts); ++i)
+    {
+        const u32 count = entityCounts[i];
+        BVHBenchmark& result = app->bvhBenchmark[i];
+
+        // Same density whatever the count: roughly 1 box per 64 cubic units
+        const f32 side = 4.0f * cbrtf((f32)count);
+        std::vector<AABB> bounds(count);
+        for (AABB& box : bounds)
+        {
+            const vec3 center = vec3(unit(generator), unit(generator), unit(generator)) * side;
+            const vec3 extent = vec3(0.25f + unit(generator) * 0.75f);
+            box = AABB{ center - extent, center + extent };
+        }
+
+        BVH bvh = {};
+        auto start = std::chrono::high_resolution_clock::now();
+        BuildBVH(bvh, bounds.data(), count);
+        auto end = std::chrono::high_resolution_clock::now();
+        result.buildTime = std::chrono::duration<f32, std::milli>(end - start).count();
+
+        // Move everything a bit, far enough that most leaves need a refit
+        for (AABB& box : bounds)
+        {
+            const vec3 offset = (vec3(unit(generator), unit(generator), unit(generator)) - 0.5f) * 2.0f;
+            box.min += offset;
+            box.max += offset;
+        }
+        start = std::chrono::high_resolution_clock::now();
+        for (u32 e = 0; e < count; ++e)
+            UpdateBVHLeaf(bvh, e, bounds[e]);
+        end = std::chrono::high_resolution_clock::now();
+        result.refitsPerSecond = count / std::chrono::duration<f32>(end - start).count();
+
+        // A 60 degree frustum from a corner of the scene, looking at its center
+        const mat4 viewProjection = perspective(radians(60.0f), 16.0f / 9.0f, 0.1f, side) *
+                                    lookAt(vec3(-0.1f * side), vec3(0.5f * side), vec3(0.0f, 1.0f, 0.0f));
+        const mat4 vp = transpose(viewProjection);
+        vec4 planes[6];
+        for (u32 p = 0; p < 3; ++p)
+        {
+            planes[p * 2 + 0] = vp[3] + vp[p];
+            planes[p * 2 + 1] = vp[3] - vp[p];
+        }
+        for (vec4& plane : planes)
+            plane /= length(vec3(plane));
+
+        std::vector<u32> visible;
+        visible.reserve(count);
+        start = std::chrono::high_resolution_clock::now();
+        QueryBVHFrustum(bvh, planes, visible);
+        end = std::chrono::high_resolution_clock::now();
+        result.frustumTime = std::chrono::duration<f32, std::milli>(end - start).count();
+
+        // Reference: test every box
+        start = std::chrono::high_resolution_clock::now();
+        u32 bruteForceVisible = 0;
+        for (const AABB& box : bounds)
+        {
+            const vec3 center = (box.max + box.min) * 0.5f;
+            const vec3 extent = (box.max - box.min) * 0.5f;
+            bool inside = true;
+            for (u32 p = 0; p < 6 && inside; ++p)
+                inside = dot(vec3(planes[p]), center) + planes[p].w + dot(abs(vec3(planes[p])), extent) >= 0.0f;
+            bruteForceVisible += inside;
+        }
+        end = std::chrono::high_resolution_clock::now();
+        result.bruteForceTime = std::chrono::duration<f32, std::milli>(end - start).count();
+
+        const u32 queryCount = 10000;
+        std::vector<u32> hits;
+        start = std::chrono::high_resolution_clock::now();
+        for (u32 q = 0; q < queryCount; ++q)
+        {
+            hits.clear();
+            QueryBVHSphere(bvh, vec3(unit(generator), unit(generator), unit(generator)) * side, 4.0f, hits);
+        }
+        end = std::chrono::high_resolution_clock::now();
+        result.spheresPerSecond = queryCount / std::chrono::duration<f32>(end - start).count();
+
+        start = std::chrono::high_resolution_clock::now();
+        for (u32 q = 0; q < queryCount; ++q)
+        {
+            const vec3 origin = vec3(unit(generator), unit(generator), unit(generator)) * side;
+            const vec3 direction = normalize(vec3(unit(generator), unit(generator), unit(generator)) - 0.5f);
+            u32 entityIdx; f32 distance;
+            RaycastBVH(bvh, origin, direction, side, entityIdx, distance);
+        }
+        end = std::chrono::high_resolution_clock::now();
+        result.raysPerSecond = queryCount / std::chrono::duration<f32>(end - start).count();
+
+        ILOG("BVH %u entities: build %.2f ms, %.2f M refits/s, frustum %.3f ms (%u visible, brute force %.3f ms, %u visible), %.0f spheres/s, %.0f rays/s",
+            count, result.buildTime, result.refitsPerSecond / 1e6f, result.frustumTime, (u32)visible.size(), result.bruteForceTime, bruteForceVisible,
+            result.spheresPerSecond, result.raysPerSecond);
+    }
+}
+
+// ---------------------------------------------------
+// ---------- JOB POOL -------------------------------
+// ---------------------------------------------------
+
+static void JobPoolWorker(JobPool* pool)
+{
+    RegisterCPUProfilerThread("Job worker");
+
+    u32 generation = 0;
+    for (;;)
+    {
+        ParallelJob job;
+        void* data;
+        const char* jobName;
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->workAvailable.wait(lock, [pool, generation] { return pool->quit || pool->generation != generation; });
+            if (pool->quit)
+                return;
+            generation = pool->generation;
+            job = pool->job;
+            data = pool->data;
+            jobName = pool->jobName;
+        }
+
+        {
+            PROFILE_SCOPE(jobName);
+            job(data);
+        }
+
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        if (--pool->busyWorkers == 0)
+            pool->workDone.notify_one();
+    }
+}
+
+void InitJobPool(JobPool& pool, u32 workerCount)
+{
+    pool.quit = false;
+
+    for (u32 i = 0; i < workerCount; ++i)
+        pool.workers.emplace_back(JobPoolWorker, &pool);
+}
+
+void ShutdownJobPool(JobPool& pool)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.quit = true;
+    }
+    pool.workAvailable.notify_all();
+
+    for (std::thread& worker : pool.workers)
+        worker.join();
+    pool.workers.clear();
+}
+
+// Runs job on every worker and the calling thread, and returns once all of them are done.
+// Without a pool, or one with no workers, the calling thread runs it alone.
+void RunParallel(JobPool* pool, ParallelJob job, void* data, const char* jobName)
+{
+    if (!pool || pool->workers.empty())
+    {
+        job(data);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->job = job;
+        pool->data = data;
+        pool->jobName = jobName;
+        pool->busyWorkers = (u32)pool->workers.size();
+        pool->generation++;
+    }
+    pool->workAvailable.notify_all();
+
+    job(data);
+
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->workDone.wait(lock, [pool] { return pool->busyWorkers == 0; });
+}
+
+// ---------------------------------------------------
+// ---------- SOFTWARE OCCLUSION ---------------------
+// ---------------------------------------------------
+
+// Occluder triangles are rasterized on the CPU into a small depth buffer split in tiles,
+// each tile rasterized by whichever thread grabs it, 4 pixels at a time with SSE. Every
+// 8x8 block then keeps its farthest depth, and a box is occluded when its nearest depth
+// is behind that of every block its screen rectangle covers.
+
+#define OCCLUSION_NEAR_W 0.01f
+
+// Keeps the biggest triangles of the mesh, a subset of the real surface so it can
+// never occlude more than the mesh itself would
+void BuildOccluder(Mesh& mesh, const u8* vertexData, const u8* indexData)
+{
+    struct Triangle { vec3 v[3]; f32 area; };
+    std::vector<Triangle> triangles;
+
+    for (const Submesh& submesh : mesh.submeshes)
+    {
+        const u32 floatStride = submesh.vertexBufferLayout.stride / sizeof(float);
+        const f32* vertices = vertexData ? (const f32*)(vertexData + submesh.vertexOffset) : submesh.vertices.data();
+        const u32* indices = indexData ? (const u32*)(indexData + submesh.indexOffset) : submesh.indices.data();
+
+        for (u32 i = 0; i + 2 < submesh.indexCount; i += 3)
+        {
+            Triangle triangle;
+            for (u32 k = 0; k < 3; ++k)
+            {
+                const f32* position = vertices + indices[i + k] * floatStride;
+                triangle.v[k] = vec3(position[0], position[1], position[2]);
+            }
+            triangle.area = length(cross(triangle.v[1] - triangle.v[0], triangle.v[2] - triangle.v[0]));
+            triangles.push_back(triangle);
+        }
+    }
+
+    const u32 keep = min((u32)triangles.size(), (u32)MAX_OCCLUDER_TRIANGLES);
+    std::partial_sort(triangles.begin(), triangles.begin() + keep, triangles.end(),
+        [](const Triangle& a, const Triangle& b) { return a.area > b.area; });
+
+    mesh.occluder.clear();
+    for (u32 i = 0; i < keep; ++i)
+        mesh.occluder.insert(mesh.occluder.end(), triangles[i].v, triangles[i].v + 3);
+}
+
+static void RasterizeOcclusionTile(OcclusionCuller& culler, u32 tileIdx)
+{
+    const u32 tileX = (tileIdx % OCCLUSION_TILES_X) * OCCLUSION_TILE_SIZE;
+    const u32 tileY = (tileIdx / OCCLUSION_TILES_X) * OCCLUSION_TILE_SIZE;
+
+    for (u32 y = tileY; y < tileY + OCCLUSION_TILE_SIZE; ++y)
+        std::fill_n(&culler.depth[y * OCCLUSION_WIDTH + tileX], OCCLUSION_TILE_SIZE, 1.0f);
+
+    const __m128 pixelOffsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+    const __m128 zero = _mm_setzero_ps();
+
+    for (u32 triangleIdx : culler.bins[tileIdx])
+    {
+        const OcclusionTriangle& tri = culler.triangles[triangleIdx];
+
+        const i32 minX = max((i32)tileX, tri.minX) & ~3;
+        const i32 maxX = min((i32)(tileX + OCCLUSION_TILE_SIZE) - 1, tri.maxX);
+        const i32 minY = max((i32)tileY, tri.minY);
+        const i32 maxY = min((i32)(tileY + OCCLUSION_TILE_SIZE) - 1, tri.maxY);
+
+        const __m128 a0 = _mm_set1_ps(tri.edgeA[0]), b0 = _mm_set1_ps(tri.edgeB[0]), c0 = _mm_set1_ps(tri.edgeC[0]);
+        const __m128 a1 = _mm_set1_ps(tri.edgeA[1]), b1 = _mm_set1_ps(tri.edgeB[1]), c1 = _mm_set1_ps(tri.edgeC[1]);
+        const __m128 a2 = _mm_set1_ps(tri.edgeA[2]), b2 = _mm_set1_ps(tri.edgeB[2]), c2 = _mm_set1_ps(tri.edgeC[2]);
+        const __m128 za = _mm_set1_ps(tri.depthA), zb = _mm_set1_ps(tri.depthB), zc = _mm_set1_ps(tri.depthC);
+
+        for (i32 y = minY; y <= maxY; ++y)
+        {
+            const __m128 py = _mm_set1_ps(y + 0.5f);
+            const __m128 rowE0 = _mm_add_ps(_mm_mul_ps(b0, py), c0);
+            const __m128 rowE1 = _mm_add_ps(_mm_mul_ps(b1, py), c1);
+            const __m128 rowE2 = _mm_add_ps(_mm_mul_ps(b2, py), c2);
+            const __m128 rowZ = _mm_add_ps(_mm_mul_ps(zb, py), zc);
+            f32* row = &culler.depth[y * OCCLUSION_WIDTH];
+
+            for (i32 x = minX; x <= maxX; x += 4)
+            {
+                const __m128 px = _mm_add_ps(_mm_set1_ps((f32)x), pixelOffsets);
+                const __m128 e0 = _mm_add_ps(_mm_mul_ps(a0, px), rowE0);
+                const __m128 e1 = _mm_add_ps(_mm_mul_ps(a1, px), rowE1);
+                const __m128 e2 = _mm_add_ps(_mm_mul_ps(a2, px), rowE2);
+                const __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+                if (_mm_movemask_ps(inside) == 0)
+                    continue;
+
+                const __m128 z = _mm_add_ps(_mm_mul_ps(za, px), rowZ);
+                const __m128 old = _mm_loadu_ps(row + x);
+                const __m128 nearest = _mm_min_ps(old, z);
+                _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, old)));
+            }
+        }
+    }
+
+    // Farthest depth of each 8x8 block of the tile
+    for (u32 by = tileY / OCCLUSION_BLOCK_SIZE; by < (tileY + OCCLUSION_TILE_SIZE) / OCCLUSION_BLOCK_SIZE; ++by)
+    {
+        for (u32 bx = tileX / OCCLUSION_BLOCK_SIZE; bx < (tileX + OCCLUSION_TILE_SIZE) / OCCLUSION_BLOCK_SIZE; ++bx)
+        {
+            __m128 farthest = zero;
+            for (u32 y = by * OCCLUSION_BLOCK_SIZE; y < (by + 1) * OCCLUSION_BLOCK_SIZE; ++y)
+            {
+                const f32* row = &culler.depth[y * OCCLUSION_WIDTH + bx * OCCLUSION_BLOCK_SIZE];
+                farthest = _mm_max_ps(farthest, _mm_max_ps(_mm_loadu_ps(row), _mm_loadu_ps(row + 4)));
+            }
+            farthest = _mm_max_ps(farthest, _mm_shuffle_ps(farthest, farthest, _MM_SHUFFLE(2, 3, 0, 1)));
+            farthest = _mm_max_ps(farthest, _mm_shuffle_ps(farthest, farthest, _MM_SHUFFLE(1, 0, 3, 2)));
+            culler.hiz[by * OCCLUSION_BLOCKS_X + bx] = _mm_cvtss_f32(farthest);
+        }
+    }
+}
 
-    // --- Geometry ---
+static void RasterizeOcclusionTiles(void* data)
+{
+    OcclusionCuller* culler = (OcclusionCuller*)data;
+    for (;;)
+    {
+        const u32 tileIdx = culler->nextTile.fetch_add(1);
+        if (tileIdx >= OCCLUSION_TILES_X * OCCLUSION_TILES_Y)
+            break;
+        RasterizeOcclusionTile(*culler, tileIdx);
+    }
+}
 
-    const VertexV3V2 vertices[] =
+void InitOcclusionCuller(OcclusionCuller& culler)
+{
+    culler.depth.assign(OCCLUSION_WIDTH * OCCLUSION_HEIGHT, 1.0f);
+    culler.hiz.assign(OCCLUSION_BLOCKS_X * OCCLUSION_BLOCKS_Y, 1.0f);
+    culler.bins.resize(OCCLUSION_TILES_X * OCCLUSION_TILES_Y);
+}
+
+// Triangles are in world space, 3 vertices each. Triangles crossing the near plane are
+// dropped, which only ever makes the occluders smaller.
+void RasterizeOccluders(OcclusionCuller& culler, const mat4& viewProjection, const vec3* vertices, u32 triangleCount, JobPool* pool)
+{
+    culler.triangles.clear();
+    for (std::vector<u32>& bin : culler.bins)
+        bin.clear();
+
+    const __m128 col0 = _mm_loadu_ps(&viewProjection[0][0]);
+    const __m128 col1 = _mm_loadu_ps(&viewProjection[1][0]);
+    const __m128 col2 = _mm_loadu_ps(&viewProjection[2][0]);
+    const __m128 col3 = _mm_loadu_ps(&viewProjection[3][0]);
+
+    for (u32 t = 0; t < triangleCount; ++t)
     {
-        { glm::vec3(-1.0f, -1.0f, 0.0f), glm::vec2(0.0f, 0.0f)}, // bottom-left vertex
-        { glm::vec3(1.0f, -1.0f, 0.0f), glm::vec2(1.0f, 0.0f)}, // bottom-right vertex
-        { glm::vec3(1.0f, 1.0f, 0.0f), glm::vec2(1.0f, 1.0f)}, // top-right vertex
-        { glm::vec3(-1.0f, 1.0f, 0.0f), glm::vec2(0.0f, 1.0f)}, // top-left vertex
-    };
+        vec3 screen[3];
+        bool clipped = false;
+        for (u32 k = 0; k < 3; ++k)
+        {
+            const vec3& v = vertices[t * 3 + k];
+            const __m128 clip = _mm_add_ps(_mm_add_ps(_mm_mul_ps(col0, _mm_set1_ps(v.x)), _mm_mul_ps(col1, _mm_set1_ps(v.y))),
+                                           _mm_add_ps(_mm_mul_ps(col2, _mm_set1_ps(v.z)), col3));
+            alignas(16) f32 c[4];
+            _mm_store_ps(c, clip);
+
+            if (c[3] < OCCLUSION_NEAR_W) { clipped = true; break; }
+
+            const f32 invW = 1.0f / c[3];
+            screen[k] = vec3((c[0] * invW * 0.5f + 0.5f) * OCCLUSION_WIDTH,
+                             (c[1] * invW * 0.5f + 0.5f) * OCCLUSION_HEIGHT,
+                              c[2] * invW * 0.5f + 0.5f);
+        }
+        if (clipped)
+            continue;
 
-    const u16 indices[] =
+        // Double sided: make every triangle counter-clockwise
+        f32 area = (screen[1].x - screen[0].x) * (screen[2].y - screen[0].y) - (screen[2].x - screen[0].x) * (screen[1].y - screen[0].y);
+        if (area < 0.0f)
+        {
+            std::swap(screen[1], screen[2]);
+            area = -area;
+        }
+        if (area < 1e-6f)
+            continue;
+
+        OcclusionTriangle tri;
+        tri.minX = max(0, (i32)floorf(min(min(screen[0].x, screen[1].x), screen[2].x)));
+        tri.maxX = min((i32)OCCLUSION_WIDTH - 1, (i32)ceilf(max(max(screen[0].x, screen[1].x), screen[2].x)));
+        tri.minY = max(0, (i32)floorf(min(min(screen[0].y, screen[1].y), screen[2].y)));
+        tri.maxY = min((i32)OCCLUSION_HEIGHT - 1, (i32)ceilf(max(max(screen[0].y, screen[1].y), screen[2].y)));
+        if (tri.minX > tri.maxX || tri.minY > tri.maxY)
+            continue;
+
+        // Edge i goes from vertex i+1 to vertex i+2 and is 0 at both, so divided by the
+        // area it is the barycentric weight of vertex i
+        f32 weightA[3], weightB[3], weightC[3];
+        for (u32 e = 0; e < 3; ++e)
+        {
+            const vec3& a = screen[(e + 1) % 3];
+            const vec3& b = screen[(e + 2) % 3];
+            tri.edgeA[e] = a.y - b.y;
+            tri.edgeB[e] = b.x - a.x;
+            tri.edgeC[e] = a.x * b.y - a.y * b.x;
+            weightA[e] = tri.edgeA[e] / area;
+            weightB[e] = tri.edgeB[e] / area;
+            weightC[e] = tri.edgeC[e] / area;
+        }
+        tri.depthA = weightA[0] * screen[0].z + weightA[1] * screen[1].z + weightA[2] * screen[2].z;
+        tri.depthB = weightB[0] * screen[0].z + weightB[1] * screen[1].z + weightB[2] * screen[2].z;
+        tri.depthC = weightC[0] * screen[0].z + weightC[1] * screen[1].z + weightC[2] * screen[2].z;
+
+        const u32 triangleIdx = (u32)culler.triangles.size();
+        culler.triangles.push_back(tri);
+
+        for (i32 ty = tri.minY / OCCLUSION_TILE_SIZE; ty <= tri.maxY / OCCLUSION_TILE_SIZE; ++ty)
+            for (i32 tx = tri.minX / OCCLUSION_TILE_SIZE; tx <= tri.maxX / OCCLUSION_TILE_SIZE; ++tx)
+                culler.bins[ty * OCCLUSION_TILES_X + tx].push_back(triangleIdx);
+    }
+
+    culler.nextTile = 0;
+    RunParallel(pool, RasterizeOcclusionTiles, &culler, "RasterizeOcclusionTiles");
+}
+
+bool IsOccluded(const OcclusionCuller& culler, const mat4& viewProjection, const AABB& bounds)
+{
+    f32 minX = FLT_MAX, maxX = -FLT_MAX, minY = FLT_MAX, maxY = -FLT_MAX, minZ = FLT_MAX;
+    for (u32 corner = 0; corner < 8; ++corner)
     {
-        0, 1, 2,
-        0, 2, 3
-    };
+        const vec3 position((corner & 1) ? bounds.max.x : bounds.min.x,
+                            (corner & 2) ? bounds.max.y : bounds.min.y,
+                            (corner & 4) ? bounds.max.z : bounds.min.z);
+        const vec4 clip = viewProjection * vec4(position, 1.0f);
+
+        // Crossing the near plane, the camera may be inside it
+        if (clip.w < OCCLUSION_NEAR_W)
+            return false;
+
+        const vec3 ndc = vec3(clip) / clip.w;
+        minX = min(minX, ndc.x); maxX = max(maxX, ndc.x);
+        minY = min(minY, ndc.y); maxY = max(maxY, ndc.y);
+        minZ = min(minZ, ndc.z);
+    }
 
-    glGenBuffers(1, &app->embeddedVertices);
-    glBindBuffer(GL_ARRAY_BUFFER, app->embeddedVertices);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    const f32 nearest = minZ * 0.5f + 0.5f;
+    const i32 bx0 = max(0, (i32)((minX * 0.5f + 0.5f) * OCCLUSION_BLOCKS_X));
+    const i32 bx1 = min((i32)OCCLUSION_BLOCKS_X - 1, (i32)((maxX * 0.5f + 0.5f) * OCCLUSION_BLOCKS_X));
+    const i32 by0 = max(0, (i32)((minY * 0.5f + 0.5f) * OCCLUSION_BLOCKS_Y));
+    const i32 by1 = min((i32)OCCLUSION_BLOCKS_Y - 1, (i32)((maxY * 0.5f + 0.5f) * OCCLUSION_BLOCKS_Y));
+    if (bx0 > bx1 || by0 > by1)
+        return false;
 
-    glGenBuffers(1, &app->embeddedElements);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, app->embeddedElements);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    for (i32 by = by0; by <= by1; ++by)
+        for (i32 bx = bx0; bx <= bx1; ++bx)
+            if (nearest <= culler.hiz[by * OCCLUSION_BLOCKS_X + bx])
+                return false;
 
-    // Attribute state
-    glGenVertexArrays(1, &app->vao);
-    glBindVertexArray(app->vao);
-    glBindBuffer(GL_ARRAY_BUFFER, app->embeddedVertices);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(VertexV3V2), (void*)0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(VertexV3V2), (void*)12);
-    glEnableVertexAttribArray(1);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, app->embeddedElements);
-    glBindVertexArray(0);
+    return true;
+}
 
-    //Creating uniform buffers
-    glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &app->maxUniformBufferSize);
-    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &app->uniformBlockAlignment);
+// Rasterizes the occluders among the frustum candidates and drops the items of
+// entities that end up completely hidden behind them
+void OcclusionCullRenderQueue(App* app, RenderQueue& queue)
+{
+    OcclusionCuller& culler = app->occlusionCuller;
+    culler.occludedCount = 0;
+    if (!culler.enabled || queue.items.empty())
+        return;
 
-    app->cbuffer = CreateConstantBuffer(app->maxUniformBufferSize);
+    auto rasterStart = std::chrono::high_resolution_clock::now();
 
-    //Load programs
-    app->ForwardProgramIdx = LoadProgram(app, "shaders.glsl", "FORWARD_RENDERING");
-    Program& ForwardProgram = app->programs[app->ForwardProgramIdx];
-    app->programUniformTexture = glGetUniformLocation(ForwardProgram.handle, "uTexture");
+    culler.worldTriangles.clear();
+    for (u32 entityIdx : queue.entities)
+    {
+        const Entity& entity = app->entities[entityIdx];
+        if (!entity.isOccluder)
+            continue;
 
-    app->texturedGeometryProgramIdx = LoadProgram(app, "shaders.glsl", "TEXTURED_GEOMETRY");
-    Program& texturedGeometryProgram = app->programs[app->texturedGeometryProgramIdx];
-    app->programUniformTexture = glGetUniformLocation(texturedGeometryProgram.handle, "uTexture");
+        const Mesh& mesh = app->meshes[app->models[entity.modelIndex].meshIdx];
+        for (const vec3& v : mesh.occluder)
+            culler.worldTriangles.push_back(vec3(entity.worldMatrix * vec4(v, 1.0f)));
+    }
 
-    app->GeometryPassProgramIdx = LoadProgram(app, "shaders.glsl", "GEOMETRY_PASS");
-    app->SSAOPassProgramIdx = LoadProgram(app, "shaders.glsl", "SSAO_PASS");
-    app->SSAOBlurPassProgramIdx = LoadProgram(app, "shaders.glsl", "SSAO_BLUR_PASS");
-    app->ShadingPassProgramIdx = LoadProgram(app, "shaders.glsl", "SHADING_PASS");
+    const mat4& viewProjection = app->camera.ViewProjectionMatrix;
+    RasterizeOccluders(culler, viewProjection, culler.worldTriangles.data(), (u32)culler.worldTriangles.size() / 3, &app->jobPool);
 
-    //Texture initialization
-    app->diceTexIdx = LoadTexture2D(app, "dice.png");
-    app->whiteTexIdx = LoadTexture2D(app, "color_white.png");
-    app->blackTexIdx = LoadTexture2D(app, "color_black.png");
-    app->normalTexIdx = LoadTexture2D(app, "color_normal.png");
-    app->magentaTexIdx = LoadTexture2D(app, "color_magenta.png");
+    auto testStart = std::chrono::high_resolution_clock::now();
 
-    Material Default = {};
-    Default.albedoTextureIdx = app->diceTexIdx;
-    app->materials.push_back(Default);
+    // Occluders are tested as well, one may hide behind another
+    culler.entityVisibility.assign(app->entities.size(), 0);
+    u32 visibleCount = 0;
+    for (u32 i = 0; i < queue.items.size(); ++i)
+    {
+        const u32 entityIdx = queue.items[i].entityIdx;
+        u8& visibility = culler.entityVisibility[entityIdx];
+        if (visibility == 0)
+        {
+            visibility = IsOccluded(culler, viewProjection, ComputeEntityBounds(app, app->entities[entityIdx])) ? 2 : 1;
+            culler.occludedCount += visibility == 2;
+        }
 
-    //Camera initialization
-    app->camera.CameraInit(vec3(0.f, 0.f, 5.f), vec3(0.f, 0.f, 1.f), vec3(0.f, 1.f, 0.f), (float)(app->displaySize.x / app->displaySize.y));
-    app->camera.position = vec3(0.f, 3.5f, 15.f);
+        if (visibility == 1)
+            queue.items[visibleCount++] = queue.items[i];
+    }
+    queue.culledCount += (u32)queue.items.size() - visibleCount;
+    queue.items.resize(visibleCount);
 
-    //  -------------- ENTITIES -------------------------
+    auto testEnd = std::chrono::high_resolution_clock::now();
+    culler.rasterTime = std::chrono::duration<f32, std::milli>(testStart - rasterStart).count();
+    culler.testTime = std::chrono::duration<f32, std::milli>(testEnd - testStart).count();
+}
 
-    //Lights
-    Light FirstLight = {};
-    FirstLight.position = vec3(5.f, 2.f, 5.f);
-    FirstLight.type = LightType::Point;
-    FirstLight.color = vec3(1.f, 1.f, 1.f);
-    FirstLight.range = 30.f;
-    app->lights.push_back(FirstLight);
+void BenchmarkOcclusion(App* app)
+{
+    OcclusionCuller& culler = app->occlusionCuller;
 
-    Light SecondLight = {};
-    SecondLight.position = vec3(-20.f, 2.f, 5.f);
-    SecondLight.type = LightType::Point;
-    SecondLight.color = vec3(1.f, 0.f, 0.f);
-    SecondLight.range = 30.f;
-    app->lights.push_back(SecondLight);
+    std::default_random_engine generator;
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
 
-    Light ThirdLight = {};
-    ThirdLight.position = vec3(0.0f, 20.f, -15.f);
-    ThirdLight.type = LightType::Point;
-    ThirdLight.color = vec3(1.f, 1.f, 1.f);
-    ThirdLight.range = 30.f;
-    app->lights.push_back(ThirdLight);
+    // Walls of random size and orientation in front of the camera
+    const u32 occluderCount = 2048;
+    std::vector<vec3> triangles;
+    for (u32 i = 0; i < occluderCount; ++i)
+    {
+        const vec3 center = vec3((unit(generator) - 0.5f) * 80.0f, (unit(generator) - 0.5f) * 40.0f, -10.0f - unit(generator) * 60.0f);
+        const vec3 right = normalize(vec3(unit(generator) - 0.5f, unit(generator) - 0.5f, 0.1f)) * (1.0f + unit(generator) * 4.0f);
+        const vec3 up = normalize(cross(right, vec3(0.0f, 0.0f, 1.0f))) * (1.0f + unit(generator) * 4.0f);
+        const vec3 quad[4] = { center - right - up, center + right - up, center + right + up, center - right + up };
+        triangles.insert(triangles.end(), { quad[0], quad[1], quad[2], quad[0], quad[2], quad[3] });
+    }
+
+    std::vector<AABB> boxes(100000);
+    for (AABB& box : boxes)
+    {
+        const vec3 center = vec3((unit(generator) - 0.5f) * 100.0f, (unit(generator) - 0.5f) * 50.0f, -5.0f - unit(generator) * 95.0f);
+        const vec3 extent = vec3(0.25f + unit(generator));
+        box = AABB{ center - extent, center + extent };
+    }
+
+    const mat4 viewProjection = perspective(radians(60.0f), 16.0f / 9.0f, 0.1f, 1000.0f) * lookAt(vec3(0.0f), vec3(0.0f, 0.0f, -1.0f), vec3(0.0f, 1.0f, 0.0f));
+    const u32 triangleCount = (u32)triangles.size() / 3;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    RasterizeOccluders(culler, viewProjection, triangles.data(), triangleCount, NULL);
+    auto end = std::chrono::high_resolution_clock::now();
+    culler.benchmarkRasterTime[0] = std::chrono::duration<f32, std::milli>(end - start).count();
+
+    start = std::chrono::high_resolution_clock::now();
+    RasterizeOccluders(culler, viewProjection, triangles.data(), triangleCount, &app->jobPool);
+    end = std::chrono::high_resolution_clock::now();
+    culler.benchmarkRasterTime[1] = std::chrono::duration<f32, std::milli>(end - start).count();
+
+    u32 occluded = 0;
+    start = std::chrono::high_resolution_clock::now();
+    for (const AABB& box : boxes)
+        occluded += IsOccluded(culler, viewProjection, box);
+    end = std::chrono::high_resolution_clock::now();
+    culler.benchmarkTestsPerSecond = boxes.size() / std::chrono::duration<f32>(end - start).count();
+
+    ILOG("Occlusion: %u triangles in %.3f ms single threaded, %.3f ms with %u workers, %.1f M box tests/s (%u of %u occluded)",
+        triangleCount, culler.benchmarkRasterTime[0], culler.benchmarkRasterTime[1], (u32)app->jobPool.workers.size(),
+        culler.benchmarkTestsPerSecond / 1e6f, occluded, (u32)boxes.size());
+}
+
+// ---------------------------------------------------
+// ---------- CPU PROFILER ---------------------------
+// ---------------------------------------------------
+
+CPUProfiler GlobalCPUProfiler;
+thread_local CPUProfilerThread* LocalCPUProfilerThread = nullptr;
+
+void InitCPUProfiler()
+{
+    CPUProfiler& profiler = GlobalCPUProfiler;
+    profiler.baseTicks = ReadCPUTicks();
+    profiler.baseTime = std::chrono::steady_clock::now();
+    profiler.captureStart = profiler.baseTicks;
+    RegisterCPUProfilerThread("Main thread");
+}
+
+// Called once per thread, the first time it records or when it starts if it wants a name
+CPUProfilerThread* RegisterCPUProfilerThread(const char* name)
+{
+    CPUProfiler& profiler = GlobalCPUProfiler;
+    CPUProfilerThread* thread = new CPUProfilerThread();
+
+    std::lock_guard<std::mutex> lock(profiler.mutex);
+    thread->tid = (u32)profiler.threads.size();
+    if (name)
+        snprintf(thread->name, sizeof(thread->name), "%s", name);
+    else
+        snprintf(thread->name, sizeof(thread->name), "Thread %u", thread->tid);
+    profiler.threads.push_back(thread);
+
+    LocalCPUProfilerThread = thread;
+    return thread;
+}
+
+// Counts down an ongoing capture, called at the start of every frame
+void CPUProfilerNewFrame()
+{
+    CPUProfiler& profiler = GlobalCPUProfiler;
+    if (profiler.captureFramesLeft > 0 && --profiler.captureFramesLeft == 0)
+        WriteCPUTrace("cpu_trace.json");
+}
+
+void StartCPUCapture(u32 frames)
+{
+    CPUProfiler& profiler = GlobalCPUProfiler;
+    profiler.captureStart = ReadCPUTicks();
+    profiler.captureFramesLeft = frames;
+    profiler.enabled = true;
+}
+
+// Chrome trace event JSON, opens in Perfetto or chrome://tracing
+bool WriteCPUTrace(const char* filepath)
+{
+    CPUProfiler& profiler = GlobalCPUProfiler;
+
+    // Calibrated over everything since init, long enough for the tick rate to be exact
+    const u64 nowTicks = ReadCPUTicks();
+    const f64 elapsedUs = std::chrono::duration<f64, std::micro>(std::chrono::steady_clock::now() - profiler.baseTime).count();
+    const f64 ticksPerUs = (nowTicks - profiler.baseTicks) / max(elapsedUs, 1.0);
+
+    FILE* file = fopen(filepath, "w");
+    if (!file)
+    {
+        ELOG("Could not write %s", filepath);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(profiler.mutex);
+
+    fprintf(file, "{\"traceEvents\":[\n");
+    u32 eventCount = 0;
+    std::vector<CPUProfileEvent> events;
+    for (CPUProfilerThread* thread : profiler.threads)
+    {
+        fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"%s\"}},\n", thread->tid, thread->name);
+
+        // Copy without stopping the owner, then drop whatever it may have overwritten meanwhile,
+        // including the slot it may be writing right now, one past the published head
+        const u64 head = thread->head.load(std::memory_order_acquire);
+        const u64 first = head > CPU_PROFILER_RING ? head - CPU_PROFILER_RING : 0;
+        events.clear();
+        for (u64 i = first; i < head; ++i)
+            events.push_back(thread->events[i & (CPU_PROFILER_RING - 1)]);
+        const u64 newHead = thread->head.load(std::memory_order_acquire);
+        const u64 overwritten = newHead + 1 > CPU_PROFILER_RING ? newHead + 1 - CPU_PROFILER_RING : 0;
+
+        for (u64 i = max(first, overwritten); i < head; ++i)
+        {
+            const CPUProfileEvent& event = events[i - first];
+            if (event.begin < profiler.captureStart)
+                continue;
+            fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f},\n", event.name, thread->tid,
+                (event.begin - profiler.baseTicks) / ticksPerUs, (event.end - event.begin) / ticksPerUs);
+            eventCount++;
+        }
+    }
+    fprintf(file, "{\"name\":\"trace_written\",\"ph\":\"i\",\"s\":\"g\",\"pid\":0,\"tid\":0,\"ts\":%.3f}\n",
+        (nowTicks - profiler.baseTicks) / ticksPerUs);
+    fprintf(file, "]}\n");
+    fclose(file);
+
+    ILOG("CPU trace: %u events from %u threads written to %s", eventCount, (u32)profiler.threads.size(), filepath);
+    return true;
+}
+
+void BenchmarkCPUProfiler()
+{
+    CPUProfiler& profiler = GlobalCPUProfiler;
+    const bool wasEnabled = profiler.enabled;
+    const u32 iterations = 1000000;
+
+    for (u32 recording = 0; recording < 2; ++recording)
+    {
+        profiler.enabled = recording == 1;
+        auto start = std::chrono::steady_clock::now();
+        for (u32 i = 0; i < iterations; ++i)
+        {
+            PROFILE_SCOPE("Benchmark scope");
+        }
+        auto end = std::chrono::steady_clock::now();
+        profiler.benchmarkOverhead[recording] = (f32)(std::chrono::duration<f64, std::nano>(end - start).count() / iterations);
+    }
+
+    // The benchmark filled the main thread ring, keep it out of the next trace
+    profiler.enabled = wasEnabled;
+    profiler.captureStart = ReadCPUTicks();
+
+    ILOG("CPU profiler: %.1f ns per scope recording, %.1f ns with recording off (budget 50 ns)",
+        profiler.benchmarkOverhead[1], profiler.benchmarkOverhead[0]);
+}
+
+// ---------------------------------------------------
+// ---------- GL TRACE -------------------------------
+// ---------------------------------------------------
+
+GLTrace GlobalGLTrace;
+
+template <u32 Id> struct GLTraceTag {};
+
+// Entry points without an observer below are only counted
+template <u32 Id, typename... Args>
+static void ObserveGLCall(GLTraceTag<Id>, Args...)
+{
+}
+
+// Counts a bind as redundant when the shadow already has it, then records it
+static void TraceBind(u32& shadow, u32 object)
+{
+    if (shadow == object)
+        GlobalGLTrace.frame.redundantBinds++;
+    shadow = object;
+}
+
+// Deleting a bound object reverts that binding to 0
+static void TraceDelete(u32* shadows, u32 count, GLsizei n, const GLuint* objects)
+{
+    for (GLsizei i = 0; i < n; ++i)
+        for (u32 j = 0; j < count; ++j)
+            if (objects[i] != 0 && shadows[j] == objects[i])
+                shadows[j] = 0;
+}
+
+static i32 GetGLTraceBufferTarget(GLenum target)
+{
+    switch (target)
+    {
+    case GL_ARRAY_BUFFER:          return GLTraceBuffer_Array;
+    case GL_ELEMENT_ARRAY_BUFFER:  return GLTraceBuffer_ElementArray;
+    case GL_UNIFORM_BUFFER:        return GLTraceBuffer_Uniform;
+    case GL_SHADER_STORAGE_BUFFER: return GLTraceBuffer_ShaderStorage;
+    case GL_DRAW_INDIRECT_BUFFER:  return GLTraceBuffer_DrawIndirect;
+    default:                       return -1;
+    }
+}
+
+// Bytes of one texel of client pixel data, 0 when the format isn't one the engine uploads
+static u32 GetTexelSize(GLenum format, GLenum type)
+{
+    if (type == GL_UNSIGNED_INT_24_8)
+        return 4;
+
+    u32 components = 0;
+    switch (format)
+    {
+    case GL_RED: case GL_DEPTH_COMPONENT: components = 1; break;
+    case GL_RG:   components = 2; break;
+    case GL_RGB:  components = 3; break;
+    case GL_RGBA: components = 4; break;
+    }
+
+    switch (type)
+    {
+    case GL_UNSIGNED_BYTE:  return components;
+    case GL_HALF_FLOAT:
+    case GL_UNSIGNED_SHORT: return components * 2;
+    case GL_FLOAT:
+    case GL_UNSIGNED_INT:   return components * 4;
+    default:                return 0;
+    }
+}
+
+static void ObserveGLCall(GLTraceTag<GLTrace_glActiveTexture>, GLenum texture)
+{
+    GLTraceBindings& bindings = GlobalGLTrace.bindings;
+    bindings.activeUnit = texture - GL_TEXTURE0;
+}
+
+static void ObserveGLCall(GLTraceTag<GLTrace_glBindTexture>, GLenum target, GLuint texture)
+{
+    GLTraceBindings& bindings = GlobalGLTrace.bindings;
+    if (bindings.activeUnit >= GL_TRACE_TEXTURE_UNITS)
+        return;
+
+    // Units hold one texture per target, only the last target bound is tracked
+    if (bindings.textureTargets[bindings.activeUnit] != target)
+        bindings.textures[bindings.activeUnit] = GL_TRACE_UNKNOWN;
+    bindings.textureTargets[bindings.activeUnit] = target;
+    TraceBind(bindings.textures[bindings.activeUnit], texture);
+}
+
+static void ObserveGLCall(GLTraceTag<GLTrace_glUseProgram>, GLuint program)
+{
+    TraceBind(GlobalGLTrace.bindings.program, program);
+}
+
+static void ObserveGLCall(GLTraceTag<GLTrace_glBindVertexArray>, GLuint array)
+{
+    GLTraceBindings& bindings = GlobalGLTrace.bindings;
+    if (bindings.vertexArray != array)
+        bindings.buffers[GLTraceBuffer_ElementArray] = GL_TRACE_UNKNOWN; //part of the VAO state
+    TraceBind(bindings.vertexArray, array);
+}
+
+static void ObserveGLCall(GLTraceTag<GLTrace_glBindFramebuffer>, GLenum target, GLuint framebuffer)
+{
+    GLTraceBindings& bindings = GlobalGLTrace.bindings;
+    if (target == GL_FRAMEBUFFER)
+    {
+        if (bindings.drawFramebuffer == framebuffer && bindings.readFramebuffer == framebuffer)
+            GlobalGLTrace.frame.redundantBinds++;
+        bindings.drawFramebuffer = framebuffer;
+        bindings.readFramebuffer = framebuffer;
+    }
+    else
+    {
+        TraceBind(target == GL_READ_FRAMEBUFFER ? bindings.readFramebuffer : bindings.drawFramebuffer, framebuffer);
+    }
+}
+
+static void ObserveGLCall(GLTraceTag<GLTrace_glBindBuffer>, GLenum target, GLuint buffer)
+{
+    const i32 slot = GetGLTraceBufferTarget(target);
+    if (slot >= 0)
+        TraceBind(GlobalGLTrace.bindings.buffers[slot], buffer);
+}
+
+// Indexed binds also bind the generic target, never redundant since the index differs
+static void ObserveGLCall(GLTraceTag<GLTrace_glBindBufferBase>, GLenum target, GLuint index, GLuint buffer)
+{
+    const i32 slot = GetGLTraceBufferTarget(target);
+    if (slot >= 0)
+        GlobalGLTrace.bindings.buffers[slot] = buffer;
+}
+
+static void ObserveGLCall(GLTraceTag<GLTrace_glBindBufferRange>, GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+    const i32 slot = GetGLTraceBufferTarget(target);
+    if (slot >= 0)
+        GlobalGLTrace.bindings.buffers[slot] = buffer;
+}
+
+static void ObserveGLCall(GLTraceTag<GLTrace_glDeleteTextures>, GLsizei n, const GLuint* textures)
+{
+    TraceDelete(GlobalGLTrace.bindings.textures, GL_TRACE_TEXTURE_UNITS, n, textures);
+}
+
+static void ObserveGLCall(GLTraceTag<GLTrace_glDeleteBuffers>, GLsizei n, const GLuint* buffers)
+{
+    TraceDelete(GlobalGLTrace.bindings.buffers, GLTraceBuffer_Count, n, buffers);
+}
+
+static void ObserveGLCall(GLTraceTag<GLTrace_glDeleteVertexArrays>, GLsizei n, const GLuint* arrays)
+{
+    TraceDelete(&GlobalGLTrace.bindings.vertexArray, 1, n, arrays);
+}
+
+static void ObserveGLCall(GLTraceTag<GLTrace_glDeleteFramebuffers>, GLsizei n, const GLuint* framebuffers)
+{
+    TraceDelete(&GlobalGLTrace.bindings.drawFramebuffer, 1, n, framebuffers);
+    TraceDelete(&GlobalGLTrace.bindings.readFramebuffer, 1, n, framebuffers);
+}
+
+static void ObserveGLCall(GLTraceTag<GLTrace_glBufferData>, GLenum target, GLsizeiptr size, const void* data, GLenum usage)
+{
+    if (data)
+        GlobalGLTrace.frame.uploadBytes += size;
+}
+
+static void ObserveGLCall(GLTraceTag<GLTrace_glBufferSubData>, GLenum target, GLintptr offset, GLsizeiptr size, const void* data)
+{
+    GlobalGLTrace.frame.uploadBytes += size;
+}
+
+// Rows are taken as tightly packed, GL_UNPACK_ALIGNMENT padding is not counted
+static void ObserveGLCall(GLTraceTag<GLTrace_glTexImage2D>, GLenum target, GLint level, GLint internalformat, GLsizei width,
+                          GLsizei height, GLint border, GLenum format, GLenum type, const void* pixels)
+{
+    if (pixels)
+        GlobalGLTrace.frame.uploadBytes += (u64)width * height * GetTexelSize(format, type);
+}
+
+static void ObserveGLCall(GLTraceTag<GLTrace_glCompressedTexImage2D>, GLenum target, GLint level, GLenum internalformat,
+                          GLsizei width, GLsizei height, GLint border, GLsizei imageSize, const void* data)
+{
+    GlobalGLTrace.frame.uploadBytes += imageSize;
+}
+
+static void ObserveGLCall(GLTraceTag<GLTrace_glMapBufferRange>, GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access)
+{
+    if (access & GL_MAP_WRITE_BIT)
+        GlobalGLTrace.frame.mappedBytes += length;
+}
 
-    //Entity plane = CreatePlane(app, 20.f);
+// One hook per entry point: count, observe, forward to the driver
+template <u32 Id, typename Function> struct GLTraceHook;
 
-    u32 JapanFloor = LoadModel(app, "Box/JapanFloor.fbx");
+template <u32 Id, typename Result, typename... Args>
+struct GLTraceHook<Id, Result (APIENTRY*)(Args...)>
+{
+    static Result (APIENTRY* real)(Args...);
 
-    Entity Floor = { mat4(1.0f), JapanFloor, 0, 0 };
-    Floor.TransformPosition(vec3(-10.f, 0.f, -10.f));
-    Floor.TransformScale(vec3(0.2f, 0.2f, 0.2f));
-    app->entities.push_back(Floor);
+    static Result APIENTRY Call(Args... args)
+    {
+        GlobalGLTrace.frame.calls[Id]++;
+        ObserveGLCall(GLTraceTag<Id>(), args...);
+        return real(args...);
+    }
+};
 
-    //------------------------------------------
+template <u32 Id, typename Result, typename... Args>
+Result (APIENTRY* GLTraceHook<Id, Result (APIENTRY*)(Args...)>::real)(Args...) = nullptr;
 
-    u32 cube_model = LoadModel(app, "Box/Cube.fbx");
+// Entry points the driver doesn't expose stay null, the engine checks some of them
+template <u32 Id, typename Function>
+static void SwapGLTraceHook(Function& pointer, bool enabled)
+{
+    typedef GLTraceHook<Id, Function> Hook;
+    if (enabled && pointer && pointer != &Hook::Call)
+    {
+        Hook::real = pointer;
+        pointer = &Hook::Call;
+    }
+    else if (!enabled && pointer == &Hook::Call)
+    {
+        pointer = Hook::real;
+    }
+}
 
-    Entity Cube = { mat4(1.0f), cube_model, 0, 0 };
-    Cube.TransformPosition(vec3(10.f, 11.f, -10.f));
-    Cube.TransformScale(vec3(0.05f, 0.05f, 0.05f));
+// Must be called from the thread that owns the GL context, between frames or from the GUI
+void SetGLTraceEnabled(bool enabled)
+{
+    GLTrace& trace = GlobalGLTrace;
+    if (trace.enabled == enabled)
+        return;
 
-    Model& model1 = app->models[Cube.modelIndex];
+#define GL_TRACE_SWAP(name) SwapGLTraceHook<GLTrace_##name>(name, enabled);
+    GL_TRACE_ENTRY_POINTS(GL_TRACE_SWAP)
+#undef GL_TRACE_SWAP
 
-    u32 submeshMaterialIdx1 = model1.materialIdx[0];
-    Material& submeshMaterial1 = app->materials[submeshMaterialIdx1]; 
-    submeshMaterial1.albedoTextureIdx = LoadTexture2D(app, "Box/tile1.jpg");
-    submeshMaterial1.normalsTextureIdx = LoadTexture2D(app, "Box/toy_box_normal.png");
-    submeshMaterial1.bumpTextureIdx = LoadTexture2D(app, "Box/toy_box_disp.png");
+    // Whatever was bound before is unknown, nothing counts as redundant until it's bound again
+    GLTraceBindings& bindings = trace.bindings;
+    bindings.activeUnit = 0;
+    for (u32 i = 0; i < GL_TRACE_TEXTURE_UNITS; ++i)
+    {
+        bindings.textures[i] = GL_TRACE_UNKNOWN;
+        bindings.textureTargets[i] = GL_TRACE_UNKNOWN;
+    }
+    bindings.program = GL_TRACE_UNKNOWN;
+    bindings.vertexArray = GL_TRACE_UNKNOWN;
+    bindings.drawFramebuffer = GL_TRACE_UNKNOWN;
+    bindings.readFramebuffer = GL_TRACE_UNKNOWN;
+    for (u32 i = 0; i < GLTraceBuffer_Count; ++i)
+        bindings.buffers[i] = GL_TRACE_UNKNOWN;
+
+    trace.frame = {};
+    trace.enabled = enabled;
+    if (!enabled)
+        trace.captureFramesLeft = 0;
+}
 
-    app->entities.push_back(Cube);
+// Closes the frame being recorded, called at the start of every frame
+void GLTraceNewFrame()
+{
+    GLTrace& trace = GlobalGLTrace;
+    trace.frameIndex++;
+    if (!trace.enabled)
+        return;
 
-    //---------------------------------
+    GLTraceFrame& frame = trace.frame;
+    for (u32 i = 0; i < GLTrace_Count; ++i)
+        frame.totalCalls += frame.calls[i];
+#define GL_TRACE_SUM_DRAWS(name) frame.drawCalls += frame.calls[GLTrace_##name];
+#define GL_TRACE_SUM_STATE(name) frame.stateChanges += frame.calls[GLTrace_##name];
+    GL_TRACE_DRAW_CALLS(GL_TRACE_SUM_DRAWS)
+    GL_TRACE_STATE_CHANGES(GL_TRACE_SUM_STATE)
+#undef GL_TRACE_SUM_DRAWS
+#undef GL_TRACE_SUM_STATE
+    frame.dispatches = frame.calls[GLTrace_glDispatchCompute];
+
+    trace.lastFrame = frame;
+    frame = {};
+
+    if (trace.captureFramesLeft > 0)
+    {
+        trace.capture.push_back(trace.lastFrame);
+        if (--trace.captureFramesLeft == 0)
+            WriteGLTraceCSV("gl_trace.csv");
+    }
+}
 
-    u32 cube_model2 = LoadModel(app, "Box/Cube.fbx");
+// Enables the trace if needed, the first frame captured is the next complete one
+void StartGLTraceCapture(u32 frames)
+{
+    GLTrace& trace = GlobalGLTrace;
+    SetGLTraceEnabled(true);
+    trace.capture.clear();
+    trace.capture.reserve(frames);
+    trace.captureStart = trace.frameIndex + 1;
+    trace.captureFramesLeft = frames;
+}
 
-    Entity Cube2 = { mat4(1.0f), cube_model2, 0, 0 };
-    Cube2.TransformPosition(vec3(-10.f, 11.f, -10.f));
-    Cube2.TransformScale(vec3(0.05f, 0.05f, 0.05f));
+// One row per captured frame: the totals, then the calls of every entry point
+bool WriteGLTraceCSV(const char* filepath)
+{
+    const GLTrace& trace = GlobalGLTrace;
 
-    Model& model2 = app->models[Cube2.modelIndex];
+    FILE* file = fopen(filepath, "w");
+    if (!file)
+    {
+        ELOG("Could not write %s", filepath);
+        return false;
+    }
 
-    u32 submeshMaterialIdx2 = model2.materialIdx[0];
-    Material& submeshMaterial2 = app->materials[submeshMaterialIdx2];
-    submeshMaterial2.albedoTextureIdx = LoadTexture2D(app, "Box/basecolor.jpg");
-    submeshMaterial2.normalsTextureIdx = LoadTexture2D(app, "Box/normal.jpg");
-    submeshMaterial2.bumpTextureIdx = LoadTexture2D(app, "Box/height.jpg");
+    fprintf(file, "frame,calls,draw_calls,dispatches,state_changes,redundant_binds,upload_bytes,mapped_bytes");
+#define GL_TRACE_HEADER(name) fprintf(file, "," #name);
+    GL_TRACE_ENTRY_POINTS(GL_TRACE_HEADER)
+#undef GL_TRACE_HEADER
+    fprintf(file, "\n");
 
-    app->entities.push_back(Cube2);
+    for (u32 i = 0; i < trace.capture.size(); ++i)
+    {
+        const GLTraceFrame& frame = trace.capture[i];
+        fprintf(file, "%llu,%u,%u,%u,%u,%u,%llu,%llu", (unsigned long long)(trace.captureStart + i), frame.totalCalls, frame.drawCalls,
+            frame.dispatches, frame.stateChanges, frame.redundantBinds, (unsigned long long)frame.uploadBytes, (unsigned long long)frame.mappedBytes);
+        for (u32 entry = 0; entry < GLTrace_Count; ++entry)
+            fprintf(file, ",%u", frame.calls[entry]);
+        fprintf(file, "\n");
+    }
 
-    //--------------------------------------
+    fclose(file);
+    ILOG("GL trace: %u frames written to %s", (u32)trace.capture.size(), filepath);
+    return true;
+}
 
-    u32 cube_model3 = LoadModel(app, "Box/Cube.fbx");
+// ---------------------------------------------------
+// ---------- GPU PROFILER ---------------------------
+// ---------------------------------------------------
 
-    Entity Cube3 = { mat4(1.0f), cube_model3, 0, 0 };
-    Cube3.TransformPosition(vec3(0.f, 11.f, -10.f));
-    Cube3.TransformScale(vec3(0.05f, 0.05f, 0.05f));
+void InitGPUProfiler(GPUProfiler& profiler)
+{
+    for (u32 i = 0; i < GPU_PROFILER_LATENCY; ++i)
+        glGenQueries(ARRAY_COUNT(profiler.frames[i].queries), profiler.frames[i].queries);
+}
 
-    Model& model3 = app->models[Cube3.modelIndex];
+// Reads back the frame GPU_PROFILER_LATENCY frames old and reuses its queries, never waiting on the GPU
+void GPUProfilerBeginFrame(GPUProfiler& profiler)
+{
+    ASSERT(profiler.openCount == 0, "GPU profiler scope left open at the end of the frame");
 
-    u32 submeshMaterialIdx3 = model3.materialIdx[0];
-    Material& submeshMaterial3 = app->materials[submeshMaterialIdx3];
-    submeshMaterial3.albedoTextureIdx = LoadTexture2D(app, "Box/basecolor1.jpg");
-    submeshMaterial3.normalsTextureIdx = LoadTexture2D(app, "Box/normal1.jpg");
-    submeshMaterial3.bumpTextureIdx = LoadTexture2D(app, "Box/height1.jpg");
+    profiler.frameIndex++;
+    GPUProfilerFrame& frame = profiler.frames[profiler.frameIndex % GPU_PROFILER_LATENCY];
 
-    app->entities.push_back(Cube3);
+    if (frame.recordCount > 0)
+    {
+        // Timestamps complete in order, so the last one issued being ready means all of them are
+        GLuint available = 0;
+        glGetQueryObjectuiv(frame.queries[frame.lastQuery], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available)
+        {
+            f32* times = profiler.history[profiler.historyHead];
+            std::fill_n(times, GPU_PROFILER_MAX_SCOPES, -1.0f);
 
-    //u32 modelIdx2 = LoadModel(app, "Sphere/sphere.fbx");
-    //app->models[modelIdx2].materialIdx[0] = 4;
+            for (u32 i = 0; i < frame.recordCount; ++i)
+            {
+                GLuint64 begin = 0, end = 0;
+                glGetQueryObjectui64v(frame.queries[i * 2], GL_QUERY_RESULT, &begin);
+                glGetQueryObjectui64v(frame.queries[i * 2 + 1], GL_QUERY_RESULT, &end);
 
-    //Entity entity3 = { mat4(1.0f), modelIdx2, 0, 0 };
-    //entity3.TransformPosition(vec3(5.f, 2.f, 5.f));
-    //entity3.TransformScale(vec3(0.01f, 0.01f, 0.01f));
-    //app->entities.push_back(entity3);
+                // A scope run several times in a frame adds up
+                f32& time = times[frame.scopes[i]];
+                time = max(time, 0.0f) + (f32)((end - begin) / 1.0e6);
+            }
 
-    //Entity entity4 = { mat4(1.0f), modelIdx2, 0, 0 };
-    //entity4.TransformPosition(vec3(-5.f, 2.f, 5.f));
-    //entity4.TransformScale(vec3(0.01f, 0.01f, 0.01f));
-    //app->entities.push_back(entity4);
+            profiler.historyFrames[profiler.historyHead] = frame.frameIndex;
+            profiler.historyHead = (profiler.historyHead + 1) % GPU_PROFILER_HISTORY;
+            profiler.historyCount = min(profiler.historyCount + 1, (u32)GPU_PROFILER_HISTORY);
+        }
+        else
+        {
+            profiler.droppedFrames++;
+        }
+    }
 
-    //Entity entity5 = { mat4(1.0f), modelIdx2, 0, 0 };
-    //entity5.TransformPosition(vec3(0.f, 2.f, -10.f));
-    //entity5.TransformScale(vec3(0.01f, 0.01f, 0.01f));
-    //app->entities.push_back(entity5);
+    frame.recordCount = 0;
+    frame.frameIndex = profiler.frameIndex;
+}
 
-    ///*Entity sphere = CreateSphere(app);
-    //sphere.worldMatrix = translate(sphere.worldMatrix, vec3(10.0f, 20.f, 0.0f));*/
+// Times everything submitted until the matching GPUProfilerEnd, and labels it for frame debuggers
+void GPUProfilerBegin(GPUProfiler& profiler, const char* name)
+{
+    glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 0, -1, name);
 
-    u32 modelIdx = LoadModel(app, "Patrick/Patrick.obj");
+    u32 scope = 0;
+    while (scope < profiler.scopeCount && strcmp(profiler.scopeNames[scope], name) != 0)
+        scope++;
+    if (scope == profiler.scopeCount && profiler.scopeCount < GPU_PROFILER_MAX_SCOPES)
+        profiler.scopeNames[profiler.scopeCount++] = name;
 
-    Entity entity = { mat4(1.0f), modelIdx, 0, 0 };
-    entity.TransformPosition(vec3(0.0f, 19.5f, -10.0f));
-    app->entities.push_back(entity);
+    GPUProfilerFrame& frame = profiler.frames[profiler.frameIndex % GPU_PROFILER_LATENCY];
+    ASSERT(profiler.openCount < GPU_PROFILER_MAX_RECORDS, "GPU profiler scopes nested too deep");
 
-    //Entity entity1 = { mat4(1.0f), modelIdx, 0, 0 };
-    //entity1.TransformPosition(vec3(5.0f, 3.5f, -4.0f));
-    //app->entities.push_back(entity1);
+    // Out of records or scope names, the debug group is still pushed but nothing is timed
+    if (scope == GPU_PROFILER_MAX_SCOPES || frame.recordCount == GPU_PROFILER_MAX_RECORDS)
+    {
+        profiler.openRecords[profiler.openCount++] = GPU_PROFILER_MAX_RECORDS;
+        return;
+    }
 
-    //Entity entity2 = { mat4(1.0f), modelIdx, 0, 0 };
-    //entity2.TransformPosition(vec3(-5.0f, 3.5f, -4.0f));
-    //app->entities.push_back(entity2);
+    const u32 record = frame.recordCount++;
+    frame.scopes[record] = scope;
+    glQueryCounter(frame.queries[record * 2], GL_TIMESTAMP);
+    frame.lastQuery = record * 2;
+    profiler.openRecords[profiler.openCount++] = record;
 }
 
-void Gui(App* app)
+void GPUProfilerEnd(GPUProfiler& profiler)
 {
-    ImGui::Begin("Info");
-    ImGui::Text("FPS: %f", 1.0f / app->deltaTime);
-    ImGui::Separator();
-    
-    //APP INFO
-    ImGui::Text("OpenGL version: %s", app->Info.OpenGLversion.c_str());
-    ImGui::Text("OpenGL renderer: %s", app->Info.GPU.c_str());
-    ImGui::Text("OpenGL vendor: %s", app->Info.Vendor.c_str());
-    ImGui::Text("OpenGL GLSL verison: %s", app->Info.GLSLverison.c_str());
-    ImGui::Separator();
+    ASSERT(profiler.openCount > 0, "GPUProfilerEnd without GPUProfilerBegin");
 
-    //Camera Movement UI
-    //ImGui::Text("Camera");
-    //ImGui::NewLine();
-    //ImGui::SameLine; ImGui::Text("Posiion X Y Z");
-    //
-    //ImGui::PushItemWidth(50); ImGui::DragFloat("##X1", &app->camera.position.x, 0.1f, -INFINITY, INFINITY);
-    //ImGui::SameLine(); ImGui::PushItemWidth(50); ImGui::DragFloat("##Y1", &app->camera.position.y, 0.1f, -INFINITY, INFINITY);
-    //ImGui::SameLine(); ImGui::PushItemWidth(50); ImGui::DragFloat("##Z1", &app->camera.position.z, 0.1f, -INFINITY, INFINITY);
-    //ImGui::SameLine; ImGui::Text("Pitch/Yaw/Roll");
-    //
-    //ImGui::PushItemWidth(50); ImGui::DragFloat("##X2", &app->camera.pitch, 0.1f, -INFINITY, INFINITY);
-    //ImGui::SameLine(); ImGui::PushItemWidth(50); ImGui::DragFloat("##Y2", &app->camera.yaw, 0.1f, -INFINITY, INFINITY);
-    //ImGui::SameLine(); ImGui::PushItemWidth(50); ImGui::DragFloat("##Z2", &app->camera.roll, 0.1f, -INFINITY, INFINITY);
-    //
-    //ImGui::Separator();
-    //ImGui::NewLine();
-    ImGui::Text("Select Render Mode");
+    const u32 record = profiler.openRecords[--profiler.openCount];
+    if (record < GPU_PROFILER_MAX_RECORDS)
+    {
+        GPUProfilerFrame& frame = profiler.frames[profiler.frameIndex % GPU_PROFILER_LATENCY];
+        glQueryCounter(frame.queries[record * 2 + 1], GL_TIMESTAMP);
+        frame.lastQuery = record * 2 + 1;
+    }
 
-    const char* render[] = { "Forward Rendering", "Deferred Rendering" };
-    static const char* curr = render[0];
+    glPopDebugGroup();
+}
 
-    ImGui::PushItemWidth(150);
-    if (ImGui::BeginCombo("##Render Mode", curr)) // The second parameter is the label previewed before opening the combo.
+GPUProfilerStats GetGPUProfilerStats(const GPUProfiler& profiler, u32 scope)
+{
+    GPUProfilerStats stats = {};
+
+    // Oldest to newest, so the last sample is the most recent frame the scope ran in
+    f32 samples[GPU_PROFILER_HISTORY];
+    const u32 oldest = (profiler.historyHead + GPU_PROFILER_HISTORY - profiler.historyCount) % GPU_PROFILER_HISTORY;
+    for (u32 i = 0; i < profiler.historyCount; ++i)
     {
-        for (int n = 0; n < IM_ARRAYSIZE(render); n++)
+        const f32 time = profiler.history[(oldest + i) % GPU_PROFILER_HISTORY][scope];
+        if (time >= 0.0f)
+            samples[stats.samples++] = time;
+    }
+    if (stats.samples == 0)
+        return stats;
+
+    stats.last = samples[stats.samples - 1];
+    f32 sum = 0.0f;
+    for (u32 i = 0; i < stats.samples; ++i)
+        sum += samples[i];
+    stats.average = sum / stats.samples;
+
+    // Nearest rank percentiles
+    std::sort(samples, samples + stats.samples);
+    stats.p50 = samples[(stats.samples - 1) * 50 / 100];
+    stats.p95 = samples[(stats.samples - 1) * 95 / 100];
+    stats.p99 = samples[(stats.samples - 1) * 99 / 100];
+    stats.max = samples[stats.samples - 1];
+    return stats;
+}
+
+// One row per resolved frame, one column per scope, empty where the scope didn't run
+bool ExportGPUProfilerCSV(const GPUProfiler& profiler, const char* filepath)
+{
+    FILE* file = fopen(filepath, "w");
+    if (!file)
+    {
+        ELOG("Could not write the GPU profile to %s", filepath);
+        return false;
+    }
+
+    fprintf(file, "frame");
+    for (u32 scope = 0; scope < profiler.scopeCount; ++scope)
+        fprintf(file, ",%s_ms", profiler.scopeNames[scope]);
+    fprintf(file, "\n");
+
+    const u32 oldest = (profiler.historyHead + GPU_PROFILER_HISTORY - profiler.historyCount) % GPU_PROFILER_HISTORY;
+    for (u32 i = 0; i < profiler.historyCount; ++i)
+    {
+        const u32 slot = (oldest + i) % GPU_PROFILER_HISTORY;
+        fprintf(file, "%llu", (unsigned long long)profiler.historyFrames[slot]);
+        for (u32 scope = 0; scope < profiler.scopeCount; ++scope)
         {
-            bool is_selected = (curr == render[n]); // You can store your selection however you want, outside or inside your objects
-            if (ImGui::Selectable(render[n], is_selected))
-                curr = render[n];
-            if (is_selected)
-                ImGui::SetItemDefaultFocus();   // You may set the initial focus when opening the combo (scrolling + for keyboard navigation support)
+            const f32 time = profiler.history[slot][scope];
+            if (time >= 0.0f)
+                fprintf(file, ",%.4f", time);
+            else
+                fprintf(file, ",");
         }
-        ImGui::EndCombo();
+        fprintf(file, "\n");
     }
 
-    if (curr == render[0])
-        app->renderMode = RenderMode::Mode_Forward;
-    else if (curr == render[1])
-        app->renderMode = RenderMode::Mode_Deferred;
+    fclose(file);
+    ILOG("GPU profile: %u frames written to %s", profiler.historyCount, filepath);
+    return true;
+}
 
-    ImGui::NewLine();
-    ImGui::Text("Select texture to visualize");
+// ---------------------------------------------------
+// ---------- BENCHMARK MODE -------------------------
+// ---------------------------------------------------
 
-    const char* items[] = { "Final Color", "Albedo", "Normals", "Position", "Depth", "SSAO" };
-    static const char* current_item = items[0];
+bool LoadCameraPath(const char* filepath, std::vector<CameraKey>& path)
+{
+    FILE* file = fopen(filepath, "r");
+    if (!file)
+    {
+        ELOG("Could not open camera path %s", filepath);
+        return false;
+    }
 
-    ImGui::PushItemWidth(150);
-    if (ImGui::BeginCombo("##Texture visualization", current_item)) // The second parameter is the label previewed before opening the combo.
+    path.clear();
+    char line[256];
+    while (fgets(line, sizeof(line), file))
     {
-        for (int n = 0; n < IM_ARRAYSIZE(items); n++)
+        CameraKey key;
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%f %f %f %f %f %f", &key.time, &key.position.x, &key.position.y, &key.position.z, &key.yaw, &key.pitch) != 6)
+            continue;
+        if (!path.empty() && key.time <= path.back().time)
         {
-            bool is_selected = (current_item == items[n]); // You can store your selection however you want, outside or inside your objects
-            if (ImGui::Selectable(items[n], is_selected))
-                current_item = items[n];
-                if (is_selected)
-                    ImGui::SetItemDefaultFocus();   // You may set the initial focus when opening the combo (scrolling + for keyboard navigation support)
+            ELOG("Camera path %s: keys must be sorted by time, %.3f s ignored", filepath, key.time);
+            continue;
         }
-        ImGui::EndCombo();
+        path.push_back(key);
     }
+    fclose(file);
 
-    if (current_item == items[0])
-        app->mode = Mode::Mode_FinalColor;
-    else if (current_item == items[1])
-        app->mode = Mode::Mode_TexturedAlbedo;
-    else if (current_item == items[2])
-        app->mode = Mode::Mode_TexturedNormals;
-    else if (current_item == items[3])
-        app->mode = Mode::Mode_TexturedPositions;
-    else if (current_item == items[4])
-        app->mode = Mode::Mode_TexturedDepth;
-    else if (current_item == items[5])
-        app->mode = Mode::Mode_SSAOValue;
+    if (path.empty())
+        ELOG("Camera path %s has no keys", filepath);
+    return !path.empty();
+}
 
-    ImGui::NewLine();
+// Linear between keys, loops once the last key is reached
+void ApplyCameraPath(Camera& camera, const std::vector<CameraKey>& path, f32 time)
+{
+    if (path.empty())
+        return;
 
-   
-    ImGui::Checkbox("Relief Mapping", &app->ReliefMapping);
-    ImGui::SameLine; ImGui::Text("Bumpiness"); ImGui::SameLine();  ImGui::PushItemWidth(50); ImGui::DragFloat("##BUMP", &app->bumpiness, 0.001f, 0.0, 0.5);
-    ImGui::NewLine();
-    ImGui::Checkbox("SSAO", &app->SSAO);
-    ImGui::SameLine; ImGui::Text("Radius"); ImGui::SameLine();  ImGui::PushItemWidth(50); ImGui::DragFloat("##RAD", &app->radius, 0.001f, 0.0, 0.5); 
-    ImGui::SameLine(); if(ImGui::Button("Reset Radius")) app->radius = 0.5f;
-    ImGui::SameLine; ImGui::Text("Bias"); ImGui::SameLine();  ImGui::PushItemWidth(75); ImGui::DragFloat("##BIAS", &app->bias, 0.00001f, 0.0, 0.01, "%.5f"); 
-    ImGui::SameLine(); if(ImGui::Button("Reset Bias")) app->bias = 0.0025f;
+    const f32 duration = path.back().time;
+    if (duration > 0.0f)
+        time = fmodf(time, duration);
 
-    ImGui::End();
+    u32 next = 0;
+    while (next < path.size() && path[next].time < time)
+        next++;
+
+    const CameraKey& b = path[min(next, (u32)path.size() - 1)];
+    const CameraKey& a = path[next > 0 ? next - 1 : 0];
+    const f32 t = b.time > a.time ? (time - a.time) / (b.time - a.time) : 0.0f;
+
+    camera.position = mix(a.position, b.position, t);
+    camera.yaw = mix(a.yaw, b.yaw, t);
+    camera.pitch = mix(a.pitch, b.pitch, t);
 }
 
-void Update(App* app)
+void BenchmarkUpdateCamera(App* app)
 {
-    // You can handle app->input keyboard/mouse here
+    const BenchmarkRun& run = app->benchmark;
+    ApplyCameraPath(app->camera, run.path, (f32)run.cpuFrameTimes.size() / BENCHMARK_FRAME_RATE);
+}
 
-    app->camera.UpdateCameraVectors();
+// Called after every frame of the run, returns true once all measured frames reached the GPU profiler
+bool BenchmarkFrame(App* app, f32 cpuFrameMs)
+{
+    BenchmarkRun& run = app->benchmark;
+    const GPUProfiler& profiler = app->gpuProfiler;
 
-    // Shader hot reload
-    for (u64 i = 0; i < app->programs.size(); i++)
+    // Measuring starts once the startup assets are in and caches are warm
+    if (run.measureStart == 0)
     {
-        Program& program = app->programs[i];
-        u64 currentTimestamp = GetFileLastWriteTimestamp(program.filepath.c_str());
-        if (currentTimestamp > program.lastWriteTimestamp)
+        bool loading;
         {
-            glDeleteProgram(program.handle);
-            String programSource = ReadTextFile(program.filepath.c_str());
-            const char* programName = program.programName.c_str();
-            program.handle = CreateProgramFromSource(programSource, programName);
-            program.lastWriteTimestamp = currentTimestamp;
+            std::lock_guard<std::mutex> lock(app->loader.mutex);
+            loading = app->loader.pendingJobs > 0;
         }
-    }
+        if (loading || ++run.warmupFrames < BENCHMARK_WARMUP_FRAMES)
+            return false;
 
-    //-------------------------------------- WASD position movement and QE yaw rotation -------------------------------------
-    static float speed = 20.0f * app->deltaTime;
+        run.measureStart = profiler.frameIndex + 1;
+        return false;
+    }
 
-    if (app->input.keys[K_W] == BUTTON_PRESSED) app->camera.position += app->camera.front * speed;
-    if (app->input.keys[K_S] == BUTTON_PRESSED) app->camera.position -= app->camera.front * speed;
-    if (app->input.keys[K_D] == BUTTON_PRESSED) app->camera.position += app->camera.right * speed;
-    if (app->input.keys[K_A] == BUTTON_PRESSED) app->camera.position -= app->camera.right * speed;
+    if (run.cpuFrameTimes.size() < run.frameCount)
+        run.cpuFrameTimes.push_back(cpuFrameMs);
 
-    if (app->input.keys[K_E] == BUTTON_PRESSED) app->camera.position += app->camera.up * speed;
-    if (app->input.keys[K_Q] == BUTTON_PRESSED) app->camera.position -= app->camera.up * speed;
+    // At most one frame is resolved per frame, GPU_PROFILER_LATENCY frames late
+    if (profiler.historyCount > 0)
+    {
+        const u32 latest = (profiler.historyHead + GPU_PROFILER_HISTORY - 1) % GPU_PROFILER_HISTORY;
+        const u64 frame = profiler.historyFrames[latest];
+        if (frame != run.lastGpuFrame && frame >= run.measureStart && frame < run.measureStart + run.frameCount)
+        {
+            run.gpuTimes.insert(run.gpuTimes.end(), profiler.history[latest], profiler.history[latest] + GPU_PROFILER_MAX_SCOPES);
+            run.lastGpuFrame = frame;
+        }
+    }
 
+    return run.cpuFrameTimes.size() == run.frameCount &&
+           profiler.frameIndex >= run.measureStart + run.frameCount + GPU_PROFILER_LATENCY;
+}
 
-    if (app->input.mouseButtons[LEFT] == BUTTON_PRESSED) app->camera.yaw += app->input.mouseDelta.x / 10;
-    if (app->input.mouseButtons[LEFT] == BUTTON_PRESSED) app->camera.pitch -= app->input.mouseDelta.y / 10;
+static void WriteTimingStats(FILE* file, const char* name, std::vector<f32> samples, bool last)
+{
+    f32 average = 0.0f, p50 = 0.0f, p95 = 0.0f, p99 = 0.0f, maximum = 0.0f;
+    if (!samples.empty())
+    {
+        std::sort(samples.begin(), samples.end());
+        for (f32 sample : samples)
+            average += sample;
+        average /= samples.size();
+
+        const size_t n = samples.size() - 1;
+        p50 = samples[n * 50 / 100];
+        p95 = samples[n * 95 / 100];
+        p99 = samples[n * 99 / 100];
+        maximum = samples[n];
+    }
 
-    //--------------------------------------------------------------------------------------------------------------------------
-   
-    MapBuffer(app->cbuffer, GL_WRITE_ONLY);
+    fprintf(file, "    \"%s\": {\"samples\": %u, \"avg\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f}%s\n",
+        name, (u32)samples.size(), average, p50, p95, p99, maximum, last ? "" : ",");
+}
 
-    //Global params
-    app->globalParamOffset = app->cbuffer.head;
-    PushVec3(app->cbuffer, app->camera.position);
-    PushUInt(app->cbuffer, app->lights.size());
+bool WriteBenchmarkReport(App* app, const char* filepath)
+{
+    const BenchmarkRun& run = app->benchmark;
+    const GPUProfiler& profiler = app->gpuProfiler;
 
-    for (auto& light : app->lights)
+    FILE* file = fopen(filepath, "w");
+    if (!file)
     {
-        AlignHead(app->cbuffer, sizeof(vec4));
-
-        PushUInt(app->cbuffer, light.type);
-        PushUInt(app->cbuffer, (u32)light.range);
-        PushVec3(app->cbuffer, light.color);
-        PushVec3(app->cbuffer, light.direction);
-        PushVec3(app->cbuffer, light.position);
+        ELOG("Could not write the benchmark report to %s", filepath);
+        return false;
     }
-    app->globalParamSize = app->cbuffer.head - app->globalParamOffset;
 
-    //Local params
-    for (auto& entity : app->entities)
+    // Per scope GPU samples, a scope missing from a frame (negative) didn't run in it
+    std::vector<f32> scopeTimes[GPU_PROFILER_MAX_SCOPES];
+    for (size_t row = 0; row < run.gpuTimes.size(); row += GPU_PROFILER_MAX_SCOPES)
+        for (u32 scope = 0; scope < profiler.scopeCount; ++scope)
+            if (run.gpuTimes[row + scope] >= 0.0f)
+                scopeTimes[scope].push_back(run.gpuTimes[row + scope]);
+
+    u32 frameScope = 0;
+    while (frameScope < profiler.scopeCount && strcmp(profiler.scopeNames[frameScope], "Frame") != 0)
+        frameScope++;
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"renderer\": \"%s\",\n", app->Info.GPU.c_str());
+    fprintf(file, "  \"render_mode\": \"%s\",\n", app->renderMode == RenderMode::Mode_Deferred ? "deferred" : "forward");
+    fprintf(file, "  \"resolution\": [%d, %d],\n", app->displaySize.x, app->displaySize.y);
+    fprintf(file, "  \"entities\": %u,\n", (u32)app->entities.size());
+    fprintf(file, "  \"lights\": %u,\n", (u32)app->lights.size());
+    fprintf(file, "  \"frames\": %u,\n", (u32)run.cpuFrameTimes.size());
+    fprintf(file, "  \"gpu_frames_resolved\": %u,\n", (u32)(run.gpuTimes.size() / GPU_PROFILER_MAX_SCOPES));
+    fprintf(file, "  \"frame_ms\": {\n");
+    WriteTimingStats(file, "cpu", run.cpuFrameTimes, false);
+    WriteTimingStats(file, "gpu", frameScope < profiler.scopeCount ? scopeTimes[frameScope] : std::vector<f32>(), true);
+    fprintf(file, "  },\n");
+    fprintf(file, "  \"gpu_pass_ms\": {\n");
+    for (u32 scope = 0; scope < profiler.scopeCount; ++scope)
+        WriteTimingStats(file, profiler.scopeNames[scope], scopeTimes[scope], scope + 1 == profiler.scopeCount);
+    fprintf(file, "  }\n");
+    fprintf(file, "}\n");
+    fclose(file);
+
+    ILOG("Benchmark: %u frames, report written to %s", (u32)run.cpuFrameTimes.size(), filepath);
+    return true;
+}
+
+// ---------------------------------------------------
+// ---------- SCENE GENERATOR ------------------------
+// ---------------------------------------------------
+
+struct GeneratorTextureSet
+{
+    const char* albedo;
+    const char* normals; //NULL for no normal map
+    const char* bump;    //NULL for no relief mapping
+};
+
+// Generated materials cycle through these, the first one keeps the default dice texture
+static const GeneratorTextureSet GeneratorTextureSets[] = {
+    { NULL, NULL, NULL },
+    { "Box/tile1.jpg", NULL, NULL },
+    { "Box/basecolor.jpg", "Box/normal.jpg", "Box/height.jpg" },
+    { "Box/basecolor1.jpg", "Box/normal1.jpg", "Box/height1.jpg" },
+    { "Box/wood.png", NULL, NULL },
+};
+
+// Creates the meshes every generated scene instances. The primitives add an entity of their
+// own, it's dropped since GenerateScene replaces the entities anyway
+static void InitSceneGenerator(App* app, SceneGenerator& generator)
+{
+    const u32 meshModels[SCENE_GENERATOR_MESHES] = {
+        CreatePlane(app, 0.5f).modelIndex,
+        CreateSphere(app).modelIndex,
+        LoadModel(app, "Box/Cube.fbx"),
+    };
+
+    generator.availableMeshes = 0;
+    for (u32 i = 0; i < SCENE_GENERATOR_MESHES; ++i)
     {
-        AlignHead(app->cbuffer, app->uniformBlockAlignment);
+        if (meshModels[i] == UINT32_MAX)
+            continue;
+
+        const Mesh& mesh = app->meshes[app->models[meshModels[i]].meshIdx];
+        AABB local = { vec3(FLT_MAX), vec3(-FLT_MAX) };
+        for (const Submesh& submesh : mesh.submeshes)
+            local = AABB{ min(local.min, submesh.bounds.min), max(local.max, submesh.bounds.max) };
 
-        mat4 WorldViewProjectionMatrix = app->camera.GetProjectionMatrix() * app->camera.GetViewMatrix() * entity.worldMatrix;
+        const vec3 size = local.max - local.min;
+        const f32 largest = max(size.x, max(size.y, size.z));
 
-        entity.localParamsOffset = app->cbuffer.head;
-        PushMat4(app->cbuffer, entity.worldMatrix);
-        PushMat4(app->cbuffer, WorldViewProjectionMatrix);
-        entity.localParamsSize = app->cbuffer.head - entity.localParamsOffset;
+        generator.meshModels[generator.availableMeshes] = meshModels[i];
+        generator.meshScales[generator.availableMeshes] = largest > 0.0f ? 1.0f / largest : 1.0f;
+        generator.availableMeshes++;
     }
 
-    UnmapBuffer(app->cbuffer);
-        
+    generator.baseModelCount = (u32)app->models.size();
+    generator.baseMaterialCount = (u32)app->materials.size();
+    generator.initialized = true;
 }
 
-void Render(App* app)
+// Fills entities, lights and materials from the params. The same params always give the same scene
+void GenerateScene(App* app, const SceneGeneratorParams& params)
 {
-    if (app->renderMode == RenderMode::Mode_Forward)
-    {
-        // - clear the framebuffer
-        glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        // - set the viewport
-        glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+    PROFILE_FUNCTION();
 
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    auto generateStart = std::chrono::high_resolution_clock::now();
 
-        // - bind the program 
-        Program& texturedMeshProgram = app->programs[app->ForwardProgramIdx];
-        glUseProgram(texturedMeshProgram.handle);
+    SceneGenerator& generator = app->sceneGenerator;
+    if (!generator.initialized)
+        InitSceneGenerator(app, generator);
+    generator.params = params;
 
-        //Binding buffer ranges to uniform blocks (GLOBAL PARAMETERS)
-        u32 blockOffset = app->globalParamOffset;
-        u32 blockSize = app->globalParamSize;
-        glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), app->cbuffer.handle, blockOffset, blockSize);
+    std::default_random_engine generatorEngine(params.seed);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
 
-        for (auto& entity : app->entities)
+    // Materials: a texture set each plus some random parameters
+    const u32 materialCount = glm::clamp(params.materialCount, 1u, (u32)SCENE_GENERATOR_MAX_MATERIALS);
+    app->materials.resize(generator.baseMaterialCount);
+    for (u32 i = 0; i < materialCount; ++i)
+    {
+        const GeneratorTextureSet& set = GeneratorTextureSets[i % ARRAY_COUNT(GeneratorTextureSets)];
+
+        Material material = {};
+        material.name = "Generated " + std::to_string(i);
+        material.albedo = vec3(unit(generatorEngine), unit(generatorEngine), unit(generatorEngine));
+        material.smoothness = unit(generatorEngine);
+        material.albedoTextureIdx = set.albedo ? LoadTexture2DAsync(app, set.albedo, app->magentaTexIdx) : app->diceTexIdx;
+        if (set.normals)
+            material.normalsTextureIdx = LoadTexture2DAsync(app, set.normals, app->normalTexIdx, TextureUsage_Normal);
+        if (set.bump)
+            material.bumpTextureIdx = LoadTexture2DAsync(app, set.bump, app->whiteTexIdx, TextureUsage_Height);
+        app->materials.push_back(material);
+    }
+
+    // Models: one per mesh and material, so entities pick both with a single index
+    const u32 meshCount = glm::clamp(params.meshCount, 1u, max(generator.availableMeshes, 1u));
+    app->models.resize(generator.baseModelCount);
+    for (u32 mesh = 0; mesh < meshCount; ++mesh)
+    {
+        for (u32 material = 0; material < materialCount; ++material)
         {
-            Model& model = app->models[entity.modelIndex];
-            Mesh& mesh = app->meshes[model.meshIdx];
+            const Model& source = app->models[generator.meshModels[mesh]];
 
-            //Binding buffer ranges to uniform blocks (LOCAL PARAMETERS)
-            u32 blockOffset = entity.localParamsOffset;
-            u32 blockSize = sizeof(mat4) * 2;
-            glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), app->cbuffer.handle, blockOffset, blockSize);
+            Model model = {};
+            model.meshIdx = source.meshIdx;
+            model.materialIdx.assign(source.materialIdx.size(), generator.baseMaterialCount + material);
+            app->models.push_back(model);
+        }
+    }
 
-            for (u32 i = 0; i < mesh.submeshes.size(); ++i)
-            {
-                GLuint vao = FindVAO(mesh, i, texturedMeshProgram);
-                glBindVertexArray(vao);
+    // Entities fill a cube sized so neighbours are about params.spacing apart
+    const u32 count = params.entityCount;
+    const u32 side = max((u32)ceilf(cbrtf((f32)count)), 1u);
+    const f32 extent = side * params.spacing;
+    const vec3 boxMin = vec3(-0.5f * extent, 0.0f, -0.5f * extent);
 
-                u32 submeshMaterialIdx = model.materialIdx[i];
-                Material& submeshMaterial = app->materials[submeshMaterialIdx];
+    std::vector<vec3> clusterCenters((count + SCENE_GENERATOR_CLUSTER_SIZE - 1) / SCENE_GENERATOR_CLUSTER_SIZE);
+    for (vec3& center : clusterCenters)
+        center = boxMin + vec3(unit(generatorEngine), unit(generatorEngine), unit(generatorEngine)) * extent;
+    std::normal_distribution<float> clusterOffset(0.0f, 0.5f * params.spacing * cbrtf((f32)SCENE_GENERATOR_CLUSTER_SIZE));
 
-                glUniform1f(glGetUniformLocation(texturedMeshProgram.handle, "hasNormalMap"), (float)submeshMaterial.normalsTextureIdx);
-                glUniform1f(glGetUniformLocation(texturedMeshProgram.handle, "hasReliefMap"), (float)submeshMaterial.bumpTextureIdx);
+    app->entities.clear();
+    app->entities.reserve(count);
+    for (u32 i = 0; i < count; ++i)
+    {
+        vec3 position;
+        switch (params.distribution)
+        {
+        case SceneDistribution::Grid:
+            position = boxMin + (vec3((f32)(i % side), (f32)(i / (side * side)), (f32)((i / side) % side)) + 0.5f) * params.spacing;
+            break;
+        case SceneDistribution::Clusters:
+            position = clusterCenters[i / SCENE_GENERATOR_CLUSTER_SIZE] +
+                       vec3(clusterOffset(generatorEngine), clusterOffset(generatorEngine), clusterOffset(generatorEngine));
+            break;
+        default:
+            position = boxMin + vec3(unit(generatorEngine), unit(generatorEngine), unit(generatorEngine)) * extent;
+            break;
+        }
 
-                //GLuint ssao = app->SSAO == true ? 1 : 0;
-                GLuint Relief = app->ReliefMapping == true ? 1 : 0;
-                glUniform1f(glGetUniformLocation(texturedMeshProgram.handle, "Relief"), (float)Relief);
+        const u32 mesh = min((u32)(unit(generatorEngine) * meshCount), meshCount - 1);
+        const u32 material = min((u32)(unit(generatorEngine) * materialCount), materialCount - 1);
+        const f32 angle = unit(generatorEngine) * 2.0f * PI;
+        const f32 size = lerp(0.5f, 1.5f, unit(generatorEngine)) * generator.meshScales[mesh];
 
-                glUniform1f(glGetUniformLocation(texturedMeshProgram.handle, "Bumpiness"), app->bumpiness);
+        Entity entity = {};
+        entity.worldMatrix = translate(position) * rotate(angle, vec3(0.0f, 1.0f, 0.0f)) * scale(vec3(size));
+        entity.modelIndex = generator.baseModelCount + mesh * materialCount + material;
+        app->entities.push_back(entity);
+    }
 
-                glActiveTexture(GL_TEXTURE0);
-                glBindTexture(GL_TEXTURE_2D, app->textures[submeshMaterial.albedoTextureIdx].handle);
-                glUniform1i(app->programUniformTexture, 0);
+    // Lights replace the scene ones, spread over the same cube
+    app->lights.clear();
+    for (u32 i = 0; i < params.lightCount; ++i)
+    {
+        Light light = {};
+        light.type = LightType::Point;
+        light.position = boxMin + vec3(unit(generatorEngine), unit(generatorEngine), unit(generatorEngine)) * extent;
+        light.color = vec3(unit(generatorEngine), unit(generatorEngine), unit(generatorEngine));
+        light.range = lerp(2.0f, 4.0f, unit(generatorEngine)) * params.spacing;
+        app->lights.push_back(light);
+    }
+    app->sceneLightCount = params.lightCount;
+    app->extraLightCount = 0;
+
+    // The entity indices changed under the BVH, an in flight rebuild is stale
+    if (app->bvhRebuild.valid())
+        app->bvhRebuild.get();
+    app->bvhMovedDuringRebuild.clear();
+    BuildEntityBVH(app);
+
+    auto generateEnd = std::chrono::high_resolution_clock::now();
+    generator.generateTime = std::chrono::duration<f32, std::milli>(generateEnd - generateStart).count();
+    ILOG("Scene generator: %u entities, %u lights, %u materials, seed %u in %.1f ms", count, params.lightCount,
+        materialCount, params.seed, generator.generateTime);
+}
 
-                glActiveTexture(GL_TEXTURE1);
-                glBindTexture(GL_TEXTURE_2D, app->textures[submeshMaterial.normalsTextureIdx].handle);
-                glUniform1i(glGetUniformLocation(texturedMeshProgram.handle, "uNormalMap"), 1);
+// ---------------------------------------------------
+// ---------- TILED SHADING --------------------------
+// ---------------------------------------------------
 
-                glActiveTexture(GL_TEXTURE2);
-                glBindTexture(GL_TEXTURE_2D, app->textures[submeshMaterial.bumpTextureIdx].handle);
-                glUniform1i(glGetUniformLocation(texturedMeshProgram.handle, "uBumpTex"), 2);
+// Keeps the scene lights and replaces the rest with count random point lights
+void SetExtraLightCount(App* app, u32 count)
+{
+    app->lights.resize(app->sceneLightCount);
 
-                Submesh& submesh = mesh.submeshes[i];
-                glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
-            }
-        }
-        //Clear vertex array and program
-        glBindVertexArray(0);
-        glUseProgram(0);
+    std::default_random_engine generator(count);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
 
+    for (u32 i = 0; i < count; ++i)
+    {
+        Light light = {};
+        light.type = LightType::Point;
+        light.position = vec3(lerp(-40.f, 20.f, unit(generator)), lerp(0.5f, 10.f, unit(generator)), lerp(-40.f, 20.f, unit(generator)));
+        light.color = vec3(unit(generator), unit(generator), unit(generator));
+        light.range = lerp(2.f, 6.f, unit(generator));
+        app->lights.push_back(light);
     }
 
-    else if (app->renderMode == RenderMode::Mode_Deferred)
+    app->extraLightCount = count;
+}
+
+// Copies every light into this frame's region of the light buffer
+void UploadLights(App* app)
+{
+    const u32 lightCount = (u32)app->lights.size();
+    ReserveRingBuffer(app->lightBuffer, max(lightCount, 1u) * sizeof(GPULight));
+
+    MapBufferRegion(app->lightBuffer);
+    GPULight* gpuLights = (GPULight*)app->lightBuffer.data;
+    for (u32 i = 0; i < lightCount; ++i)
     {
-        // --- Screen ---
-        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        const Light& light = app->lights[i];
+        gpuLights[i].positionRange = vec4(light.type == LightType::Directional ? light.direction : light.position, light.range);
+        gpuLights[i].colorType = vec4(light.color, (f32)light.type);
+    }
+    app->lightBuffer.head += max(lightCount, 1u) * sizeof(GPULight);
+    UnmapBufferRegion(app->lightBuffer);
+}
 
-        // Render on this framebuffer render targets
-        glBindFramebuffer(GL_FRAMEBUFFER, app->framebufferHandle);
+// One 16x16 work group per tile: it bounds the tile depth, culls the lights into shared memory and shades its pixels
+void TiledShadingPass(App* app)
+{
+    Program& tiledShading = app->programs[app->TiledShadingProgramIdx];
+    glUseProgram(tiledShading.handle);
+
+    const mat4 view = app->camera.GetViewMatrix();
+    const mat4 projection = app->camera.GetProjectionMatrix();
+
+    SetUniformMat4(tiledShading, UNIFORM("uView"), view);
+    SetUniformMat4(tiledShading, UNIFORM("uInverseProjection"), inverse(projection));
+    SetUniformMat4(tiledShading, UNIFORM("uInverseViewProjection"), inverse(projection * view));
+    SetUniform3fv(tiledShading, UNIFORM("uCameraPosition"), 1, value_ptr(app->camera.position));
+    SetUniform1i(tiledShading, UNIFORM("uLightCount"), (i32)app->lights.size());
+
+    SetUniform1i(tiledShading, UNIFORM("oAlbedo"), 0);
+    SetUniform1i(tiledShading, UNIFORM("oNormal"), 1);
+    SetUniform1i(tiledShading, UNIFORM("oDepth"), 2);
+    SetUniform1i(tiledShading, UNIFORM("oOcclusion"), 3);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, app->albedoAttachmentHandle);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, app->normalAttachmentHandle);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_2D, app->ssaoColorBuffer);
 
-        // Select on which render targets to draw
-        GLuint drawBuffers[] = {
-            GL_COLOR_ATTACHMENT0,
-            GL_COLOR_ATTACHMENT1,
-            GL_COLOR_ATTACHMENT2,
-            GL_COLOR_ATTACHMENT3,
-            GL_COLOR_ATTACHMENT4,
-            GL_COLOR_ATTACHMENT5,
-            GL_COLOR_ATTACHMENT6
-        };
+    glBindImageTexture(0, app->colorAttachmentHandle, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, app->lightBuffer.handle, app->lightBuffer.regionOffset,
+                      app->lightBuffer.head - app->lightBuffer.regionOffset);
 
-        glDrawBuffers(ARRAY_COUNT(drawBuffers), drawBuffers);
+    // Read the counter of TILE_OVERFLOW_LATENCY frames ago if the GPU is done with it, then reuse it
+    const u32 slot = app->tileOverflowFrame++ % TILE_OVERFLOW_LATENCY;
+    GLsync& fence = app->tileOverflowFences[slot];
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, app->tileOverflowBuffer);
+    if (fence)
+    {
+        if (glClientWaitSync(fence, 0, 0) != GL_TIMEOUT_EXPIRED)
+            glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, slot * sizeof(u32), sizeof(u32), &app->overflowTiles);
+        glDeleteSync(fence);
+        fence = 0;
+    }
+    const u32 zero = 0;
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, slot * sizeof(u32), sizeof(u32), &zero);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 2, app->tileOverflowBuffer, slot * sizeof(u32), sizeof(u32));
 
-        // - clear the framebuffer
-        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    const u32 tilesX = (app->displaySize.x + TILE_SIZE - 1) / TILE_SIZE;
+    const u32 tilesY = (app->displaySize.y + TILE_SIZE - 1) / TILE_SIZE;
+    glDispatchCompute(tilesX, tilesY, 1);
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 
+    // The color attachment is sampled right after to display it, or drawn over by the G-buffer views
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
 
-        // - set the viewport
-        glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+    glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+}
 
-        // ------- GEOMETRY PASS -------------
+// Point lights as spheres over the G-buffer. Per light, a stencil pass marks the pixels whose
+// surface is inside the sphere (back face behind it, front face not) and the lighting pass
+// shades only those, resetting the stencil to 0 as it goes. When measuring, only the lighting
+// draws are queried: the stencil draws pass depth too and would count as shaded pixels.
+void LightVolumePass(App* app, bool measure)
+{
+    Program& stencilProgram = app->programs[app->LightVolumeStencilProgramIdx];
+    Program& lightProgram = app->programs[app->LightVolumeProgramIdx];
+
+    const mat4 viewProjection = app->camera.GetProjectionMatrix() * app->camera.GetViewMatrix();
+
+    glUseProgram(stencilProgram.handle);
+    SetUniformMat4(stencilProgram, UNIFORM("uViewProjection"), viewProjection);
+
+    glUseProgram(lightProgram.handle);
+    SetUniformMat4(lightProgram, UNIFORM("uViewProjection"), viewProjection);
+    SetUniformMat4(lightProgram, UNIFORM("uInverseViewProjection"), inverse(viewProjection));
+    SetUniform2f(lightProgram, UNIFORM("uViewportSize"), vec2(app->displaySize));
+    SetUniform3fv(lightProgram, UNIFORM("uCameraPosition"), 1, value_ptr(app->camera.position));
+    SetUniform1i(lightProgram, UNIFORM("oAlbedo"), 0);
+    SetUniform1i(lightProgram, UNIFORM("oNormal"), 1);
+    SetUniform1i(lightProgram, UNIFORM("oDepth"), 2);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, app->albedoAttachmentHandle);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, app->normalAttachmentHandle);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
 
-        Program& ProgramGeometryPass = app->programs[app->GeometryPassProgramIdx];
-        glUseProgram(ProgramGeometryPass.handle);
+    const GLboolean blend = glIsEnabled(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    glEnable(GL_STENCIL_TEST);
+    glDepthMask(GL_FALSE);
+    glBindVertexArray(app->lightVolumeVao);
 
-        //Binding buffer ranges to uniform blocks (GLOBAL PARAMETERS)
-        u32 blockOffset = app->globalParamOffset;
-        u32 blockSize = app->globalParamSize;
-        glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), app->cbuffer.handle, blockOffset, blockSize);
+    if (measure)
+        app->lightingQueryCount = 0;
 
-        for (auto& entity : app->entities)
+    for (const Light& light : app->lights)
+    {
+        if (light.type != LightType::Point)
+            continue;
+
+        const vec4 positionRange(light.position, light.range);
+
+        // Stencil: +1 for back faces behind the surface, -1 for front faces behind it
+        glUseProgram(stencilProgram.handle);
+        SetUniform4f(stencilProgram, UNIFORM("uLightPositionRange"), positionRange);
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        glEnable(GL_DEPTH_TEST);
+        glDisable(GL_CULL_FACE);
+        glDisable(GL_BLEND);
+        glStencilFunc(GL_ALWAYS, 0, 0xFF);
+        glStencilOpSeparate(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP);
+        glStencilOpSeparate(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
+        glDrawElements(GL_TRIANGLES, app->lightVolumeIndexCount, GL_UNSIGNED_INT, 0);
+
+        // Lighting: back faces only, so it still works with the camera inside the volume
+        glUseProgram(lightProgram.handle);
+        SetUniform4f(lightProgram, UNIFORM("uLightPositionRange"), positionRange);
+        SetUniform3fv(lightProgram, UNIFORM("uLightColor"), 1, value_ptr(light.color));
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        glDisable(GL_DEPTH_TEST);
+        glEnable(GL_CULL_FACE);
+        glCullFace(GL_FRONT);
+        glEnable(GL_BLEND);
+        glStencilFunc(GL_NOTEQUAL, 0, 0xFF);
+        glStencilOp(GL_KEEP, GL_KEEP, GL_ZERO);
+        if (measure)
         {
-            Model& model = app->models[entity.modelIndex];
-            Mesh& mesh = app->meshes[model.meshIdx];
+            if (app->lightingQueryCount == app->lightingQueries.size())
+            {
+                app->lightingQueries.push_back(0);
+                glGenQueries(1, &app->lightingQueries.back());
+            }
+            glBeginQuery(GL_SAMPLES_PASSED, app->lightingQueries[app->lightingQueryCount++]);
+        }
+        glDrawElements(GL_TRIANGLES, app->lightVolumeIndexCount, GL_UNSIGNED_INT, 0);
+        if (measure)
+            glEndQuery(GL_SAMPLES_PASSED);
+    }
 
-            //Binding buffer ranges to uniform blocks (LOCAL PARAMETERS)
-            u32 blockOffset = entity.localParamsOffset;
-            u32 blockSize = sizeof(mat4) * 2;
-            glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), app->cbuffer.handle, blockOffset, blockSize);
+    glBindVertexArray(0);
+    glDepthMask(GL_TRUE);
+    glEnable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+    glCullFace(GL_BACK);
+    glDisable(GL_STENCIL_TEST);
+    glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    if (blend)
+        glEnable(GL_BLEND);
+    else
+        glDisable(GL_BLEND);
+}
 
-            for (u32 i = 0; i < mesh.submeshes.size(); ++i)
-            {
-                GLuint vao = FindVAO(mesh, i, ProgramGeometryPass);
-                glBindVertexArray(vao);
+// ---------------------------------------------------
+// ---------- SSAO -----------------------------------
+// ---------------------------------------------------
 
-                u32 submeshMaterialIdx = model.materialIdx[i];
-                Material& submeshMaterial = app->materials[submeshMaterialIdx];
+static void CreateSSAOTexture(GLuint& handle, ivec2 size, GLenum internalFormat, GLenum format, GLenum type)
+{
+    glGenTextures(1, &handle);
+    glBindTexture(GL_TEXTURE_2D, handle);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, size.x, size.y, 0, format, type, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
 
-                glUniform1f(glGetUniformLocation(ProgramGeometryPass.handle, "hasNormalMap"), (float)submeshMaterial.normalsTextureIdx);
-                glUniform1f(glGetUniformLocation(ProgramGeometryPass.handle, "hasReliefMap"), (float)submeshMaterial.bumpTextureIdx);
+void CreateSSAOTargets(App* app)
+{
+    if (app->ssaoFramebuffer)
+    {
+        const GLuint textures[] = { app->ssaoDepthBuffer, app->ssaoNormalBuffer, app->ssaoOcclusionBuffer };
+        glDeleteTextures(ARRAY_COUNT(textures), textures);
+        glDeleteFramebuffers(1, &app->ssaoFramebuffer);
+        app->ssaoFramebuffer = 0;
+    }
+    if (app->ssaoHistoryFramebuffer)
+    {
+        glDeleteTextures(1, &app->ssaoBlurBuffer);
+        glDeleteTextures(2, app->ssaoHistoryBuffers);
+        glDeleteFramebuffers(1, &app->ssaoHistoryFramebuffer);
+        app->ssaoHistoryFramebuffer = 0;
+    }
 
-                GLuint Relief = app->ReliefMapping == true ? 1 : 0;
-                glUniform1f(glGetUniformLocation(ProgramGeometryPass.handle, "Relief"), (float)Relief);
-                glUniform1f(glGetUniformLocation(ProgramGeometryPass.handle, "Bumpiness"), app->bumpiness);
+    app->ssaoTargetScale = app->ssaoScale;
+    app->ssaoTargetSize = (app->displaySize + app->ssaoScale - 1) / app->ssaoScale;
 
-                glActiveTexture(GL_TEXTURE0);
-                glBindTexture(GL_TEXTURE_2D, app->textures[submeshMaterial.albedoTextureIdx].handle);
-                glUniform1i(app->programUniformTexture, 0);
+    // History matches the resolution occlusion is computed at, the old one can't be reprojected
+    for (u32 i = 0; i < 2; ++i)
+        CreateSSAOTexture(app->ssaoHistoryBuffers[i], app->ssaoTargetSize, GL_RGBA16F, GL_RGBA, GL_HALF_FLOAT);
+    app->ssaoHistoryValid = false;
 
-                glActiveTexture(GL_TEXTURE1);
-                glBindTexture(GL_TEXTURE_2D, app->textures[submeshMaterial.normalsTextureIdx].handle);
-                glUniform1i(glGetUniformLocation(ProgramGeometryPass.handle, "uNormalMap"), 1);
+    glGenFramebuffers(1, &app->ssaoHistoryFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, app->ssaoHistoryFramebuffer);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, app->ssaoHistoryBuffers[0], 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        ELOG("SSAO history framebuffer incomplete at 1/%d resolution", app->ssaoScale);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-                glActiveTexture(GL_TEXTURE2);
-                glBindTexture(GL_TEXTURE_2D, app->textures[submeshMaterial.bumpTextureIdx].handle);
-                glUniform1i(glGetUniformLocation(ProgramGeometryPass.handle, "uBumpTex"), 2);
+    CreateSSAOTexture(app->ssaoBlurBuffer, app->ssaoTargetSize, GL_R8, GL_RED, GL_UNSIGNED_BYTE);
 
-                Submesh& submesh = mesh.submeshes[i];
-                glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
-            }
-        }
+    // At full resolution the G-buffer is read directly and the occlusion goes straight to its attachment
+    if (app->ssaoScale == 1)
+        return;
 
-        ////// -------- SSAO PASS ---------------
-        Program& SSAOPass = app->programs[app->SSAOPassProgramIdx];
-        glUseProgram(SSAOPass.handle);
+    // Raw depth in a float target so it reconstructs positions exactly like the full resolution one
+    CreateSSAOTexture(app->ssaoDepthBuffer, app->ssaoTargetSize, GL_R32F, GL_RED, GL_FLOAT);
+    CreateSSAOTexture(app->ssaoNormalBuffer, app->ssaoTargetSize, GL_RG16, GL_RG, GL_UNSIGNED_SHORT);
+    CreateSSAOTexture(app->ssaoOcclusionBuffer, app->ssaoTargetSize, GL_R8, GL_RED, GL_UNSIGNED_BYTE);
+
+    glGenFramebuffers(1, &app->ssaoFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, app->ssaoFramebuffer);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, app->ssaoDepthBuffer, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, app->ssaoNormalBuffer, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, app->ssaoOcclusionBuffer, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        ELOG("SSAO framebuffer incomplete at 1/%d resolution", app->ssaoScale);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
 
-        GLuint SSAO = app->SSAO == true ? 1 : 0;
-        glUniform1f(glGetUniformLocation(SSAOPass.handle, "SSAO"), (float)SSAO);
-        glUniform1f(glGetUniformLocation(SSAOPass.handle, "Radius"), (float)app->radius);
-        glUniform1f(glGetUniformLocation(SSAOPass.handle, "Bias"), (float)app->bias);
+// Runs after the geometry pass with the G-buffer bound and leaves it bound, occlusion ends up in ssaoColorBuffer
+void SSAOPass(App* app)
+{
+    if (app->ssaoTargetScale != app->ssaoScale)
+        CreateSSAOTargets(app);
 
-        for (unsigned int i = 0; i < 64; ++i)
+    // Timings come back a few frames late, only one set of timestamps is in flight at a time
+    if (app->ssaoTimerPending)
+    {
+        GLuint available = 0;
+        glGetQueryObjectuiv(app->ssaoTimestamps[SSAOStage_Count], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available)
         {
-            std::string name = "samples[" + std::to_string(i) + "]";
-            glUniform3fv(glGetUniformLocation(SSAOPass.handle, name.c_str()), 64, value_ptr(app->ssaoKernel[i]));
+            GLuint64 timestamps[SSAOStage_Count + 1];
+            for (u32 i = 0; i <= SSAOStage_Count; ++i)
+                glGetQueryObjectui64v(app->ssaoTimestamps[i], GL_QUERY_RESULT, &timestamps[i]);
+            for (u32 i = 0; i < SSAOStage_Count; ++i)
+                app->ssaoStageTimes[app->ssaoTimerPath][i] = (f32)((timestamps[i + 1] - timestamps[i]) / 1.0e6);
+            app->ssaoGpuTime[app->ssaoTimerPath][app->ssaoTimerScale] = (f32)((timestamps[SSAOStage_Count] - timestamps[0]) / 1.0e6);
+            app->ssaoTimerPending = false;
         }
+    }
+    const bool measure = !app->ssaoTimerPending;
+    auto Timestamp = [app, measure](u32 index) {
+        if (measure)
+            glQueryCounter(app->ssaoTimestamps[index], GL_TIMESTAMP);
+    };
+    Timestamp(0);
+
+    const bool reduced = app->ssaoScale > 1;
+    const bool compute = app->ssaoCompute;
+    const bool temporal = app->ssaoTemporal && !compute;
+    const mat4 projection = app->camera.GetProjectionMatrix();
+    const mat4 inverseProjection = inverse(projection);
+    const mat4 view = app->camera.GetViewMatrix();
+
+    if (!temporal)
+        app->ssaoHistoryValid = false;
 
-        glUniformMatrix4fv(glGetUniformLocation(SSAOPass.handle, "projection"), 1, GL_FALSE, value_ptr(app->camera.GetProjectionMatrix()));
+    glBindBufferBase(GL_UNIFORM_BUFFER, BINDING(1), app->ssaoKernelBuffer);
 
-        glUniform1i(glGetUniformLocation(SSAOPass.handle, "gPosition"), 0);
-        glUniform1i(glGetUniformLocation(SSAOPass.handle, "gNormal"), 1);
-        glUniform1i(glGetUniformLocation(SSAOPass.handle, "texNoise"), 2);
+    glDepthMask(false);
+    glDisable(GL_DEPTH_TEST);
+
+    GLuint depthTexture = app->depthAttachmentHandle;
+    GLuint normalTexture = app->normalAttachmentHandle;
+
+    if (reduced)
+    {
+        // Point sampled so the depth and normal of a low resolution pixel belong to the same surface
+        Program& downsample = app->programs[app->SSAODownsampleProgramIdx];
+        glUseProgram(downsample.handle);
+        SetUniform1i(downsample, UNIFORM("uScale"), app->ssaoScale);
+        SetUniform1i(downsample, UNIFORM("gDepth"), 0);
+        SetUniform1i(downsample, UNIFORM("gNormal"), 1);
 
         glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, app->positionAttachmentHandle);
+        glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
         glActiveTexture(GL_TEXTURE1);
         glBindTexture(GL_TEXTURE_2D, app->normalAttachmentHandle);
-        glActiveTexture(GL_TEXTURE2);
-        glBindTexture(GL_TEXTURE_2D, app->noiseTexture);
 
-        glDepthMask(false);
+        const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+        glBindFramebuffer(GL_FRAMEBUFFER, app->ssaoFramebuffer);
+        glDrawBuffers(ARRAY_COUNT(drawBuffers), drawBuffers);
+        glViewport(0, 0, app->ssaoTargetSize.x, app->ssaoTargetSize.y);
         renderQuad();
-        glDepthMask(true);
-
-        //// -------- SSAO BLUR PASS ---------------
-        Program& SSAOBlurPass = app->programs[app->SSAOBlurPassProgramIdx];
-        glUseProgram(SSAOBlurPass.handle);
-        
-        glUniform1i(glGetUniformLocation(SSAOBlurPass.handle, "ssaoInput"), 0);
-        
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, app->ssaoColorBuffer);
 
-        // -------- SHADING PASS ---------------
+        depthTexture = app->ssaoDepthBuffer;
+        normalTexture = app->ssaoNormalBuffer;
+        glDrawBuffer(GL_COLOR_ATTACHMENT2);
+    }
+    else
+    {
+        glDrawBuffer(GL_COLOR_ATTACHMENT3);
+    }
+    Timestamp(SSAOStage_Downsample + 1);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, depthTexture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, normalTexture);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, app->noiseTexture);
+
+    if (compute)
+    {
+        // Occlusion, then a depth aware blur along rows and back along columns into the same target
+        const GLuint occlusionTexture = reduced ? app->ssaoOcclusionBuffer : app->ssaoColorBuffer;
+        const ivec2 size = app->ssaoTargetSize;
+
+        Program& ssao = app->programs[app->SSAOComputeProgramIdx];
+        glUseProgram(ssao.handle);
+        SetUniform1f(ssao, UNIFORM("SSAO"), app->SSAO ? 1.0f : 0.0f);
+        SetUniform1f(ssao, UNIFORM("Radius"), (float)app->radius);
+        SetUniform1f(ssao, UNIFORM("Bias"), (float)app->bias);
+        SetUniformMat4(ssao, UNIFORM("projection"), projection);
+        SetUniformMat4(ssao, UNIFORM("uInverseProjection"), inverseProjection);
+        SetUniformMat4(ssao, UNIFORM("uView"), view);
+        SetUniform1i(ssao, UNIFORM("gDepth"), 0);
+        SetUniform1i(ssao, UNIFORM("gNormal"), 1);
+        SetUniform1i(ssao, UNIFORM("texNoise"), 2);
+
+        glBindImageTexture(0, occlusionTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R8);
+        glDispatchCompute((size.x + SSAO_GROUP_SIZE - 1) / SSAO_GROUP_SIZE, (size.y + SSAO_GROUP_SIZE - 1) / SSAO_GROUP_SIZE, 1);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+        Timestamp(SSAOStage_Occlusion + 1);
+
+        GPUProfilerBegin(app->gpuProfiler, "SSAO blur");
+        Program& blur = app->programs[app->SSAOBlurProgramIdx];
+        glUseProgram(blur.handle);
+        SetUniformMat4(blur, UNIFORM("uInverseProjection"), inverseProjection);
+        SetUniform1i(blur, UNIFORM("gDepth"), 0);
+        SetUniform1i(blur, UNIFORM("uOcclusion"), 3);
+
+        // Each group blurs SSAO_BLUR_GROUP pixels of one row (or column)
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_2D, occlusionTexture);
+        glBindImageTexture(0, app->ssaoBlurBuffer, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R8);
+        SetUniform2i(blur, UNIFORM("uDirection"), ivec2(1, 0));
+        glDispatchCompute((size.x + SSAO_BLUR_GROUP - 1) / SSAO_BLUR_GROUP, size.y, 1);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+        Timestamp(SSAOStage_BlurX + 1);
+
+        glBindTexture(GL_TEXTURE_2D, app->ssaoBlurBuffer);
+        glBindImageTexture(0, occlusionTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R8);
+        SetUniform2i(blur, UNIFORM("uDirection"), ivec2(0, 1));
+        glDispatchCompute((size.y + SSAO_BLUR_GROUP - 1) / SSAO_BLUR_GROUP, size.x, 1);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+        Timestamp(SSAOStage_BlurY + 1);
+        GPUProfilerEnd(app->gpuProfiler);
+
+        glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R8);
+    }
+    else
+    {
+        if (temporal)
+        {
+            // Only the written history is attached, the other one is sampled
+            glBindFramebuffer(GL_FRAMEBUFFER, app->ssaoHistoryFramebuffer);
+            glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, app->ssaoHistoryBuffers[app->ssaoHistoryIndex], 0);
+            glDrawBuffer(GL_COLOR_ATTACHMENT0);
+            glViewport(0, 0, app->ssaoTargetSize.x, app->ssaoTargetSize.y);
+        }
 
-        Program& shadingPass = app->programs[app->ShadingPassProgramIdx];
-        glUseProgram(shadingPass.handle);
+        Program& ssao = app->programs[app->SSAOPassProgramIdx];
+        glUseProgram(ssao.handle);
 
-        glUniform1i(glGetUniformLocation(shadingPass.handle, "oAlbedo"), 0);
-        glUniform1i(glGetUniformLocation(shadingPass.handle, "oNormal"), 1);
-        glUniform1i(glGetUniformLocation(shadingPass.handle, "oPosition"), 2);
-        glUniform1i(glGetUniformLocation(shadingPass.handle, "oDepth"), 3);
-        glUniform1i(glGetUniformLocation(shadingPass.handle, "oOcclusion"), 4);
+        SetUniform1f(ssao, UNIFORM("SSAO"), app->SSAO ? 1.0f : 0.0f);
+        SetUniform1f(ssao, UNIFORM("Radius"), (float)app->radius);
+        SetUniform1f(ssao, UNIFORM("Bias"), (float)app->bias);
+
+        SetUniformMat4(ssao, UNIFORM("projection"), projection);
+        SetUniformMat4(ssao, UNIFORM("uInverseProjection"), inverseProjection);
+        SetUniformMat4(ssao, UNIFORM("uView"), view);
+
+        // Temporal: a different interleaved subset of the kernel and a different noise rotation every
+        // frame, so a few frames of history add up to the whole kernel
+        const u32 sampleCount = temporal ? (u32)app->ssaoTemporalSamples : SSAO_KERNEL_SIZE;
+        const u32 sampleStride = SSAO_KERNEL_SIZE / sampleCount;
+        SetUniform1i(ssao, UNIFORM("uSampleCount"), (i32)sampleCount);
+        SetUniform1i(ssao, UNIFORM("uSampleStride"), (i32)sampleStride);
+        SetUniform1i(ssao, UNIFORM("uSampleOffset"), (i32)(temporal ? app->ssaoFrameIndex % sampleStride : 0));
+        SetUniform1f(ssao, UNIFORM("uNoiseRotation"), temporal ? (f32)app->ssaoFrameIndex * 2.39996323f : 0.0f);
+
+        SetUniform1i(ssao, UNIFORM("uTemporal"), temporal ? 1 : 0);
+        SetUniform1i(ssao, UNIFORM("uHistoryValid"), app->ssaoHistoryValid ? 1 : 0);
+        SetUniform1f(ssao, UNIFORM("uHistoryBlend"), max((f32)sampleCount / SSAO_KERNEL_SIZE, 0.1f));
+        SetUniformMat4(ssao, UNIFORM("uInverseView"), inverse(view));
+        SetUniformMat4(ssao, UNIFORM("uPrevViewProjection"), app->ssaoPrevViewProjection);
+        SetUniform1i(ssao, UNIFORM("uHistory"), 3);
+
+        // One noise texel per target pixel, whatever the resolution the pass runs at
+        SetUniform2f(ssao, UNIFORM("uNoiseScale"), vec2(app->ssaoTargetSize) / 4.0f);
+
+        SetUniform1i(ssao, UNIFORM("gDepth"), 0);
+        SetUniform1i(ssao, UNIFORM("gNormal"), 1);
+        SetUniform1i(ssao, UNIFORM("texNoise"), 2);
+
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_2D, app->ssaoHistoryBuffers[app->ssaoHistoryIndex ^ 1]);
+
+        renderQuad();
+        Timestamp(SSAOStage_Occlusion + 1);
+        Timestamp(SSAOStage_BlurX + 1);
+        Timestamp(SSAOStage_BlurY + 1);
+    }
+
+    if (reduced || temporal)
+    {
+        // Joint bilateral upsample, guided by the full resolution depth and normals. At full
+        // resolution it only moves the accumulated occlusion out of the history target
+        glBindFramebuffer(GL_FRAMEBUFFER, app->framebufferHandle);
+        glDrawBuffer(GL_COLOR_ATTACHMENT3);
+        glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+
+        Program& upsample = app->programs[app->SSAOUpsampleProgramIdx];
+        glUseProgram(upsample.handle);
+        SetUniform1i(upsample, UNIFORM("uScale"), app->ssaoScale);
+        SetUniformMat4(upsample, UNIFORM("uInverseProjection"), inverseProjection);
+        SetUniform1i(upsample, UNIFORM("lowDepth"), 0);
+        SetUniform1i(upsample, UNIFORM("lowNormal"), 1);
+        SetUniform1i(upsample, UNIFORM("lowOcclusion"), 2);
+        SetUniform1i(upsample, UNIFORM("gDepth"), 3);
+        SetUniform1i(upsample, UNIFORM("gNormal"), 4);
 
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, app->albedoAttachmentHandle);
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, app->normalAttachmentHandle);
         glActiveTexture(GL_TEXTURE2);
-        glBindTexture(GL_TEXTURE_2D, app->positionAttachmentHandle);
+        glBindTexture(GL_TEXTURE_2D, temporal ? app->ssaoHistoryBuffers[app->ssaoHistoryIndex] : app->ssaoOcclusionBuffer);
         glActiveTexture(GL_TEXTURE3);
-        glBindTexture(GL_TEXTURE_2D, app->depthTextureHandle);
+        glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
         glActiveTexture(GL_TEXTURE4);
-        glBindTexture(GL_TEXTURE_2D, app->ssaoColorBuffer);
+        glBindTexture(GL_TEXTURE_2D, app->normalAttachmentHandle);
 
-        // We only need to draw 1 buffer so it would be unnecessary to use an array of buffers
-        glDrawBuffer(GL_COLOR_ATTACHMENT0);
+        renderQuad();
+    }
+    Timestamp(SSAOStage_Upsample + 1);
 
-        glDepthMask(false);
+    glEnable(GL_DEPTH_TEST);
+    glDepthMask(true);
 
-        //Binding buffer ranges to uniform blocks (GLOBAL PARAMETERS)
-        glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), app->cbuffer.handle, blockOffset, blockSize);
-        renderQuad();
-        glDepthMask(true);
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (temporal)
+    {
+        app->ssaoPrevViewProjection = projection * view;
+        app->ssaoHistoryIndex ^= 1;
+        app->ssaoHistoryValid = true;
+        app->ssaoFrameIndex++;
+    }
 
+    if (measure)
+    {
+        app->ssaoTimerPending = true;
+        app->ssaoTimerPath = compute ? 1 : 0;
+        app->ssaoTimerScale = app->ssaoScale == 1 ? 0 : app->ssaoScale == 2 ? 1 : 2;
+    }
+}
 
-        switch (app->mode)
-        {
-        case Mode::Mode_FinalColor:
-        {
-            app->DisplayedTexture = app->colorAttachmentHandle;
-            break;
-        }
-        case Mode::Mode_TexturedAlbedo:
-        {
-            app->DisplayedTexture = app->albedoAttachmentHandle;
-            break;
-        }
-        case Mode::Mode_TexturedNormals:
-        {
-            app->DisplayedTexture = app->normalAttachmentHandle;
-            break;
-        }
-        case Mode::Mode_TexturedPositions:
-        {
-            app->DisplayedTexture = app->positionAttachmentHandle;
-            break;
-        }
-        case Mode::Mode_TexturedDepth:
+// ---------------------------------------------------
+// ---------- CLUSTERED LIGHTING ---------------------
+// ---------------------------------------------------
+
+// Slices are exponential in depth so clusters keep a similar shape along the view
+static f32 ClusterSliceDepth(const LightClusters& clusters, u32 slice)
+{
+    return clusters.near * powf(clusters.far / clusters.near, (f32)slice / clusters.countZ);
+}
+
+static u32 ClusterSlice(const LightClusters& clusters, f32 depth)
+{
+    const f32 slice = logf(depth / clusters.near) * clusters.countZ / logf(clusters.far / clusters.near);
+    return (u32)glm::clamp(slice, 0.0f, (f32)(clusters.countZ - 1));
+}
+
+static void BuildClusterBounds(LightClusters& clusters, const mat4& projection, f32 near, f32 far)
+{
+    clusters.projection = projection;
+    clusters.near = near;
+    clusters.far = far;
+
+    const u32 countX = clusters.countX;
+    const u32 countY = clusters.countY;
+    const u32 countZ = clusters.countZ;
+
+    // The padding lanes of the last column are always masked out
+    clusters.columnMinX.assign(countX * countZ + 3, FLT_MAX);
+    clusters.columnMaxX.assign(countX * countZ + 3, -FLT_MAX);
+    clusters.rowMinY.resize(countY * countZ);
+    clusters.rowMaxY.resize(countY * countZ);
+    clusters.sliceMinZ.resize(countZ);
+    clusters.sliceMaxZ.resize(countZ);
+
+    for (u32 z = 0; z < countZ; ++z)
+    {
+        const f32 depthNear = ClusterSliceDepth(clusters, z);
+        const f32 depthFar = ClusterSliceDepth(clusters, z + 1);
+        clusters.sliceMinZ[z] = -depthFar;
+        clusters.sliceMaxZ[z] = -depthNear;
+
+        // A cluster is a frustum piece, its box spans the tile at both slice depths
+        for (u32 x = 0; x < countX; ++x)
         {
-            app->DisplayedTexture = app->depthTextureHandle;
-            break;
+            const f32 ndc0 = (f32)x / countX * 2.0f - 1.0f;
+            const f32 ndc1 = (f32)(x + 1) / countX * 2.0f - 1.0f;
+            clusters.columnMinX[z * countX + x] = min(ndc0 * depthNear, ndc0 * depthFar) / projection[0][0];
+            clusters.columnMaxX[z * countX + x] = max(ndc1 * depthNear, ndc1 * depthFar) / projection[0][0];
         }
-        case Mode::Mode_SSAOValue:
+        for (u32 y = 0; y < countY; ++y)
         {
-            app->DisplayedTexture = app->ssaoColorBuffer;
-            break;
-        }
+            const f32 ndc0 = (f32)y / countY * 2.0f - 1.0f;
+            const f32 ndc1 = (f32)(y + 1) / countY * 2.0f - 1.0f;
+            clusters.rowMinY[z * countY + y] = min(ndc0 * depthNear, ndc0 * depthFar) / projection[1][1];
+            clusters.rowMaxY[z * countY + y] = max(ndc1 * depthNear, ndc1 * depthFar) / projection[1][1];
         }
+    }
 
+    clusters.grid.resize(countX * countY * countZ);
+    clusters.slicePairs.resize(countZ);
+    clusters.sliceIndices.resize(countZ);
+}
 
+// Finds the clusters of one slice each light touches and groups the light indices by cluster
+static void AssignClusterSlice(LightClusters& clusters, u32 z)
+{
+    const u32 countX = clusters.countX;
+    const u32 countY = clusters.countY;
+    const f32 sliceMinZ = clusters.sliceMinZ[z];
+    const f32 sliceMaxZ = clusters.sliceMaxZ[z];
+    const __m128 zero = _mm_setzero_ps();
 
-        // --- Draw framebuffer texture -------------------------------------------------
-        Program& programTexturedGeometry = app->programs[app->texturedGeometryProgramIdx];
-        glUseProgram(programTexturedGeometry.handle);
-        glBindVertexArray(app->vao);
+    std::vector<uvec2>& pairs = clusters.slicePairs[z];
+    pairs.clear();
 
-        //glEnable(GL_BLEND);
-        //glBlendFunc(GL_ONE, GL_ONE);
+    for (u32 l = 0; l < (u32)clusters.lights.size(); ++l)
+    {
+        const ClusterLight& light = clusters.lights[l];
+        if (z < light.minZ || z > light.maxZ)
+            continue;
 
-        glUniform1i(app->programUniformTexture, 0);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, app->DisplayedTexture);
+        const f32 radius2 = light.radius * light.radius;
+        const f32 dz = max(sliceMinZ - light.center.z, 0.0f) + max(light.center.z - sliceMaxZ, 0.0f);
+        if (dz * dz > radius2)
+            continue;
 
-        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+        const __m128 centerX = _mm_set1_ps(light.center.x);
+        const __m128 radius2x4 = _mm_set1_ps(radius2);
 
-        //Clear vertex array and program
-        glBindVertexArray(0);
-        glUseProgram(0);
+        for (u32 y = light.minY; y <= light.maxY; ++y)
+        {
+            const u32 row = z * countY + y;
+            const f32 dy = max(clusters.rowMinY[row] - light.center.y, 0.0f) + max(light.center.y - clusters.rowMaxY[row], 0.0f);
+            const f32 distanceYZ = dy * dy + dz * dz;
+            if (distanceYZ > radius2)
+                continue;
+
+            // Sphere against 4 cluster boxes of the row at once
+            const __m128 distanceYZx4 = _mm_set1_ps(distanceYZ);
+            for (u32 x = light.minX; x <= light.maxX; x += 4)
+            {
+                const u32 column = z * countX + x;
+                const __m128 dx = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&clusters.columnMinX[column]), centerX), zero),
+                                             _mm_max_ps(_mm_sub_ps(centerX, _mm_loadu_ps(&clusters.columnMaxX[column])), zero));
+                const __m128 distance = _mm_add_ps(_mm_mul_ps(dx, dx), distanceYZx4);
+
+                u32 mask = (u32)_mm_movemask_ps(_mm_cmple_ps(distance, radius2x4));
+                if (light.maxX - x < 3)
+                    mask &= (1u << (light.maxX - x + 1)) - 1;
+
+                for (u32 lane = 0; lane < 4; ++lane)
+                    if (mask & (1u << lane))
+                        pairs.push_back(uvec2(row * countX + x + lane, l));
+            }
+        }
+    }
+
+    // Counting sort by cluster, the lights of a cluster stay in index order
+    const u32 firstCluster = z * countX * countY;
+    uvec2* grid = clusters.grid.data() + firstCluster;
+    for (u32 c = 0; c < countX * countY; ++c)
+        grid[c] = uvec2(0, 0);
+    for (const uvec2& pair : pairs)
+        grid[pair.x - firstCluster].y++;
+
+    u32 offset = 0;
+    for (u32 c = 0; c < countX * countY; ++c)
+    {
+        grid[c].x = offset;
+        offset += grid[c].y;
+        grid[c].y = 0;
     }
-    
 
+    std::vector<u32>& indices = clusters.sliceIndices[z];
+    indices.resize(pairs.size());
+    for (const uvec2& pair : pairs)
+    {
+        uvec2& cell = grid[pair.x - firstCluster];
+        indices[cell.x + cell.y++] = pair.y;
+    }
 }
 
-unsigned int quadVAO = 0;
-unsigned int quadVBO;
-void renderQuad()
+static void AssignClusterSlices(void* data)
 {
-    if (quadVAO == 0)
+    LightClusters* clusters = (LightClusters*)data;
+    for (;;)
     {
-        float quadVertices[] = {
-            // positions        // texture Coords
-            -1.0f,  1.0f, 0.0f, 0.0f, 1.0f,
-            -1.0f, -1.0f, 0.0f, 0.0f, 0.0f,
-             1.0f,  1.0f, 0.0f, 1.0f, 1.0f,
-             1.0f, -1.0f, 0.0f, 1.0f, 0.0f,
-        };
-        // setup plane VAO
-        glGenVertexArrays(1, &quadVAO);
-        glGenBuffers(1, &quadVBO);
-        glBindVertexArray(quadVAO);
-        glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(quadVertices), &quadVertices, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
+        const u32 slice = clusters->nextSlice.fetch_add(1);
+        if (slice >= clusters->countZ)
+            break;
+        AssignClusterSlice(*clusters, slice);
+    }
+}
+
+// Light indices refer to the lights array, which is also what the light buffer holds
+void AssignLightsToClusters(LightClusters& clusters, const mat4& view, const mat4& projection, f32 near, f32 far,
+                            const Light* lights, u32 lightCount, JobPool* pool)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+
+    if (clusters.grid.size() != clusters.countX * clusters.countY * clusters.countZ ||
+        clusters.projection != projection || clusters.near != near || clusters.far != far)
+        BuildClusterBounds(clusters, projection, near, far);
+
+    // View space bounds of 4 lights at a time
+    const __m128 viewX[4] = { _mm_set1_ps(view[0][0]), _mm_set1_ps(view[1][0]), _mm_set1_ps(view[2][0]), _mm_set1_ps(view[3][0]) };
+    const __m128 viewY[4] = { _mm_set1_ps(view[0][1]), _mm_set1_ps(view[1][1]), _mm_set1_ps(view[2][1]), _mm_set1_ps(view[3][1]) };
+    const __m128 viewZ[4] = { _mm_set1_ps(view[0][2]), _mm_set1_ps(view[1][2]), _mm_set1_ps(view[2][2]), _mm_set1_ps(view[3][2]) };
+    const __m128 scaleX = _mm_set1_ps(projection[0][0]);
+    const __m128 scaleY = _mm_set1_ps(projection[1][1]);
+    const __m128 nearx4 = _mm_set1_ps(near);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 countX = _mm_set1_ps((f32)clusters.countX);
+    const __m128 countY = _mm_set1_ps((f32)clusters.countY);
+    const __m128 lastX = _mm_set1_ps((f32)(clusters.countX - 1));
+    const __m128 lastY = _mm_set1_ps((f32)(clusters.countY - 1));
+
+    clusters.lights.resize(lightCount);
+    for (u32 i = 0; i < lightCount; i += 4)
+    {
+        const u32 count = min(4u, lightCount - i);
+
+        alignas(16) f32 px[4], py[4], pz[4], pr[4];
+        for (u32 k = 0; k < 4; ++k)
+        {
+            const Light& light = lights[i + min(k, count - 1)];
+            px[k] = light.position.x;
+            py[k] = light.position.y;
+            pz[k] = light.position.z;
+            pr[k] = light.range;
+        }
+        const __m128 x = _mm_load_ps(px);
+        const __m128 y = _mm_load_ps(py);
+        const __m128 z = _mm_load_ps(pz);
+        const __m128 r = _mm_load_ps(pr);
+
+        const __m128 cx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(viewX[0], x), _mm_mul_ps(viewX[1], y)), _mm_add_ps(_mm_mul_ps(viewX[2], z), viewX[3]));
+        const __m128 cy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(viewY[0], x), _mm_mul_ps(viewY[1], y)), _mm_add_ps(_mm_mul_ps(viewY[2], z), viewY[3]));
+        const __m128 cz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(viewZ[0], x), _mm_mul_ps(viewZ[1], y)), _mm_add_ps(_mm_mul_ps(viewZ[2], z), viewZ[3]));
+
+        // Screen bounds of the light box: its extremes are at either its nearest or its farthest depth
+        const __m128 depth = _mm_sub_ps(zero, cz);
+        const __m128 invNear = _mm_div_ps(_mm_set1_ps(1.0f), _mm_max_ps(_mm_sub_ps(depth, r), nearx4));
+        const __m128 invFar = _mm_div_ps(_mm_set1_ps(1.0f), _mm_max_ps(_mm_add_ps(depth, r), nearx4));
+
+        const __m128 left = _mm_mul_ps(scaleX, _mm_sub_ps(cx, r));
+        const __m128 right = _mm_mul_ps(scaleX, _mm_add_ps(cx, r));
+        const __m128 bottom = _mm_mul_ps(scaleY, _mm_sub_ps(cy, r));
+        const __m128 top = _mm_mul_ps(scaleY, _mm_add_ps(cy, r));
+        const __m128 ndcMinX = _mm_min_ps(_mm_mul_ps(left, invNear), _mm_mul_ps(left, invFar));
+        const __m128 ndcMaxX = _mm_max_ps(_mm_mul_ps(right, invNear), _mm_mul_ps(right, invFar));
+        const __m128 ndcMinY = _mm_min_ps(_mm_mul_ps(bottom, invNear), _mm_mul_ps(bottom, invFar));
+        const __m128 ndcMaxY = _mm_max_ps(_mm_mul_ps(top, invNear), _mm_mul_ps(top, invFar));
+
+        // NDC to cluster coordinates, clamped before the conversion so it can truncate
+        auto toCluster = [half, zero](__m128 ndc, __m128 count, __m128 last) {
+            const __m128 cluster = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(ndc, half), half), count);
+            return _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(cluster, zero), last));
+        };
+
+        alignas(16) i32 minX[4], maxX[4], minY[4], maxY[4];
+        alignas(16) f32 lx[4], ly[4], lz[4];
+        _mm_store_si128((__m128i*)minX, toCluster(ndcMinX, countX, lastX));
+        _mm_store_si128((__m128i*)maxX, toCluster(ndcMaxX, countX, lastX));
+        _mm_store_si128((__m128i*)minY, toCluster(ndcMinY, countY, lastY));
+        _mm_store_si128((__m128i*)maxY, toCluster(ndcMaxY, countY, lastY));
+        _mm_store_ps(lx, cx);
+        _mm_store_ps(ly, cy);
+        _mm_store_ps(lz, cz);
+
+        for (u32 k = 0; k < count; ++k)
+        {
+            ClusterLight& light = clusters.lights[i + k];
+
+            if (lights[i + k].type == LightType::Directional)
+            {
+                light.center = vec3(0.0f);
+                light.radius = FLT_MAX;
+                light.minX = 0; light.maxX = clusters.countX - 1;
+                light.minY = 0; light.maxY = clusters.countY - 1;
+                light.minZ = 0; light.maxZ = clusters.countZ - 1;
+                continue;
+            }
+
+            light.center = vec3(lx[k], ly[k], lz[k]);
+            light.radius = pr[k];
+            light.minX = minX[k]; light.maxX = maxX[k];
+            light.minY = minY[k]; light.maxY = maxY[k];
+
+            const f32 nearest = -lz[k] - pr[k];
+            const f32 farthest = -lz[k] + pr[k];
+            if (farthest < near || nearest > far)
+            {
+                light.minZ = 1; light.maxZ = 0; //no slice
+                continue;
+            }
+            light.minZ = ClusterSlice(clusters, max(nearest, near));
+            light.maxZ = ClusterSlice(clusters, min(farthest, far));
+        }
     }
-    glBindVertexArray(quadVAO);
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-    glBindVertexArray(0);
+
+    // Slices are independent, the workers take them one at a time
+    clusters.nextSlice = 0;
+    RunParallel(pool, AssignClusterSlices, &clusters, "AssignClusterSlices");
+
+    // Compact the slice lists into a single index list
+    const u32 clustersPerSlice = clusters.countX * clusters.countY;
+    clusters.indices.clear();
+    for (u32 z = 0; z < clusters.countZ; ++z)
+    {
+        const u32 base = (u32)clusters.indices.size();
+        for (u32 c = 0; c < clustersPerSlice; ++c)
+            clusters.grid[z * clustersPerSlice + c].x += base;
+        clusters.indices.insert(clusters.indices.end(), clusters.sliceIndices[z].begin(), clusters.sliceIndices[z].end());
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    clusters.assignTime = std::chrono::duration<f32, std::milli>(end - start).count();
 }
 
-GLuint FindVAO(Mesh& mesh, u32 submeshIndex, const Program& program)
+// The shader finds the grid first and the light indices right after it
+void UploadLightClusters(App* app)
 {
-    Submesh& submesh = mesh.submeshes[submeshIndex];
+    const LightClusters& clusters = app->lightClusters;
+    const u32 gridSize = (u32)clusters.grid.size() * sizeof(uvec2);
+    const u32 indicesSize = (u32)clusters.indices.size() * sizeof(u32);
 
-    // Try finding a vao for this submesh/program
-    for (u32 i = 0; i < (u32)submesh.vaos.size(); ++i)
-        if (submesh.vaos[i].programHandle == program.handle)
-            return submesh.vaos[i].handle;
+    ReserveRingBuffer(app->clusterBuffer, gridSize + indicesSize);
 
-    //Create a new vao for this submesh/program
-    GLuint vaoHandle = 0;
-    glGenVertexArrays(1, &vaoHandle);
-    glBindVertexArray(vaoHandle);
+    MapBufferRegion(app->clusterBuffer);
+    memcpy(app->clusterBuffer.data, clusters.grid.data(), gridSize);
+    memcpy((u8*)app->clusterBuffer.data + gridSize, clusters.indices.data(), indicesSize);
+    app->clusterBuffer.head += gridSize + indicesSize;
+    UnmapBufferRegion(app->clusterBuffer);
+}
+
+// Times the CPU assignment alone for several light counts and cluster resolutions
+void BenchmarkLightClusters(App* app)
+{
+    const u32 lightCounts[] = { 256, 1024, 4096, 16384 };
+    const uvec3 resolutions[] = { uvec3(16, 9, 24), uvec3(32, 18, 48) };
+    const u32 runs = 10;
 
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
+    LightClusters& clusters = app->lightClusters;
+    const uvec3 resolution = uvec3(clusters.countX, clusters.countY, clusters.countZ);
 
-    for (u32 i = 0; i < program.vertexShaderLayout.attributes.size(); ++i)
+    Camera& camera = app->camera;
+    const mat4 view = camera.GetViewMatrix();
+    const mat4 projection = camera.GetProjectionMatrix();
+
+    std::default_random_engine generator;
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    for (u32 i = 0; i < ARRAY_COUNT(lightCounts); ++i)
     {
-        bool attributeWasLinked = false;
+        // Lights spread over the first 100 units in front of the camera
+        std::vector<Light> lights(lightCounts[i]);
+        for (Light& light : lights)
+        {
+            light.type = LightType::Point;
+            light.position = camera.position + camera.front * lerp(1.0f, 100.0f, unit(generator)) +
+                             camera.right * lerp(-50.0f, 50.0f, unit(generator)) + camera.up * lerp(-30.0f, 30.0f, unit(generator));
+            light.range = lerp(1.0f, 8.0f, unit(generator));
+        }
 
-        for (u32 j = 0; j < submesh.vertexBufferLayout.attributes.size(); ++j)
+        for (u32 j = 0; j < ARRAY_COUNT(resolutions); ++j)
         {
-            if (program.vertexShaderLayout.attributes[i].location == submesh.vertexBufferLayout.attributes[j].location)
-            {
-                const u32 index = submesh.vertexBufferLayout.attributes[j].location;
-                const u32 ncomp = submesh.vertexBufferLayout.attributes[j].componentCount;
-                const u32 offset = submesh.vertexBufferLayout.attributes[j].offset+submesh.vertexOffset;
-                const u32 stride = submesh.vertexBufferLayout.stride;
-                glVertexAttribPointer(index, ncomp, GL_FLOAT, GL_FALSE, stride, (void*)(u64)offset);
-                glEnableVertexAttribArray(index);
+            clusters.countX = resolutions[j].x;
+            clusters.countY = resolutions[j].y;
+            clusters.countZ = resolutions[j].z;
 
-                attributeWasLinked = true;
-                break;
+            f32 total = 0.0f;
+            for (u32 run = 0; run < runs; ++run)
+            {
+                AssignLightsToClusters(clusters, view, projection, camera.near_plane, camera.far_plane, lights.data(), (u32)lights.size(), &app->jobPool);
+                total += clusters.assignTime;
             }
+            clusters.benchmarkTimes[i][j] = total / runs;
+
+            ILOG("Light clusters: %u lights in %ux%ux%u clusters, %.3f ms (%u indices)", lightCounts[i],
+                resolutions[j].x, resolutions[j].y, resolutions[j].z, clusters.benchmarkTimes[i][j], (u32)clusters.indices.size());
         }
-        assert(attributeWasLinked); //The submesh should provide an attribute for each vertex inputs
     }
 
-    glBindVertexArray(0);
-
-    //Store it in the list of vaos of this submesh
-    Vao vao = { vaoHandle, program.handle };
-    submesh.vaos.push_back(vao);
-    return vaoHandle;
-
+    clusters.countX = resolution.x;
+    clusters.countY = resolution.y;
+    clusters.countZ = resolution.z;
 }
 
 // ---------------------------------------------------
@@ -1202,6 +6108,8 @@ void ProcessAssimpMesh(const aiScene* scene, aiMesh* mesh, Mesh* myMesh, u32 bas
     submesh.vertexBufferLayout = vertexBufferLayout;
     submesh.vertices.swap(vertices);
     submesh.indices.swap(indices);
+    submesh.indexCount = submesh.indices.size();
+    submesh.bounds = ComputeBounds(submesh.vertices, submesh.vertexBufferLayout.stride);
     myMesh->submeshes.push_back(submesh);
 }
 
@@ -1229,35 +6137,35 @@ void ProcessAssimpMaterial(App* app, aiMaterial* material, Material& myMaterial,
         material->GetTexture(aiTextureType_DIFFUSE, 0, &aiFilename);
         String filename = MakeString(aiFilename.C_Str());
         String filepath = MakePath(directory, filename);
-        myMaterial.albedoTextureIdx = LoadTexture2D(app, filepath.str);
+        myMaterial.albedoTextureIdx = LoadTexture2DAsync(app, filepath.str, app->magentaTexIdx);
     }
     if (material->GetTextureCount(aiTextureType_EMISSIVE) > 0)
     {
         material->GetTexture(aiTextureType_EMISSIVE, 0, &aiFilename);
         String filename = MakeString(aiFilename.C_Str());
         String filepath = MakePath(directory, filename);
-        myMaterial.emissiveTextureIdx = LoadTexture2D(app, filepath.str);
+        myMaterial.emissiveTextureIdx = LoadTexture2DAsync(app, filepath.str, app->blackTexIdx);
     }
     if (material->GetTextureCount(aiTextureType_SPECULAR) > 0)
     {
         material->GetTexture(aiTextureType_SPECULAR, 0, &aiFilename);
         String filename = MakeString(aiFilename.C_Str());
         String filepath = MakePath(directory, filename);
-        myMaterial.specularTextureIdx = LoadTexture2D(app, filepath.str);
+        myMaterial.specularTextureIdx = LoadTexture2DAsync(app, filepath.str, app->whiteTexIdx);
     }
     if (material->GetTextureCount(aiTextureType_NORMALS) > 0)
     {
         material->GetTexture(aiTextureType_NORMALS, 0, &aiFilename);
         String filename = MakeString(aiFilename.C_Str());
         String filepath = MakePath(directory, filename);
-        myMaterial.normalsTextureIdx = LoadTexture2D(app, filepath.str);
+        myMaterial.normalsTextureIdx = LoadTexture2DAsync(app, filepath.str, app->normalTexIdx, TextureUsage_Normal);
     }
     if (material->GetTextureCount(aiTextureType_HEIGHT) > 0)
     {
         material->GetTexture(aiTextureType_HEIGHT, 0, &aiFilename);
         String filename = MakeString(aiFilename.C_Str());
         String filepath = MakePath(directory, filename);
-        myMaterial.bumpTextureIdx = LoadTexture2D(app, filepath.str);
+        myMaterial.bumpTextureIdx = LoadTexture2DAsync(app, filepath.str, app->whiteTexIdx, TextureUsage_Height);
         int i = 0;
     }
 
@@ -1280,93 +6188,438 @@ void ProcessAssimpNode(const aiScene* scene, aiNode* node, Mesh* myMesh, u32 bas
     }
 }
 
-u32 LoadModel(App* app, const char* filename)
+static void CloneModelMaterials(App* app, const std::vector<u32>& srcMaterialIdx, std::vector<u32>& dstMaterialIdx)
+{
+    dstMaterialIdx.clear();
+    for (u32 i = 0; i < srcMaterialIdx.size(); ++i)
+    {
+        // Submeshes sharing a material keep sharing its copy
+        u32 cloneIdx = UINT32_MAX;
+        for (u32 j = 0; j < i; ++j)
+            if (srcMaterialIdx[j] == srcMaterialIdx[i])
+                cloneIdx = dstMaterialIdx[j];
+
+        if (cloneIdx == UINT32_MAX)
+        {
+            Material material = app->materials[srcMaterialIdx[i]];
+            cloneIdx = (u32)app->materials.size();
+            app->materials.push_back(material);
+        }
+        dstMaterialIdx.push_back(cloneIdx);
+    }
+}
+
+// Uploads all the submeshes of the mesh into the geometry pools. The mesh local offsets,
+// as if the submeshes were laid out one after the other, are what gets cooked
+static u32 UploadMeshGeometry(App* app, Mesh& mesh)
 {
-    const aiScene* scene = aiImportFile(filename,
-        aiProcess_Triangulate |
-        aiProcess_GenSmoothNormals |
-        aiProcess_CalcTangentSpace |
-        aiProcess_JoinIdenticalVertices |
-        aiProcess_PreTransformVertices |
-        aiProcess_ImproveCacheLocality |
-        aiProcess_OptimizeMeshes |
-        aiProcess_SortByPType);
+    u32 indicesOffset = 0;
+    u32 verticesOffset = 0;
 
-    if (!scene)
+    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
     {
-        ELOG("Error loading mesh %s: %s", filename, aiGetErrorString());
-        return UINT32_MAX;
+        Submesh& submesh = mesh.submeshes.at(i);
+        const u32 verticesSize = submesh.vertices.size() * sizeof(float);
+        const u32 indicesSize = submesh.indices.size() * sizeof(u32);
+
+        UploadSubmeshGeometry(app, submesh, submesh.vertices.data(), verticesSize, submesh.indices.data());
+        submesh.vertexOffset = verticesOffset;
+        submesh.indexOffset = indicesOffset;
+        verticesOffset += verticesSize;
+        indicesOffset += indicesSize;
     }
 
-    app->meshes.push_back(Mesh{});
-    Mesh& mesh = app->meshes.back();
-    u32 meshIdx = (u32)app->meshes.size() - 1u;
+    BuildOccluder(mesh);
 
-    app->models.push_back(Model{});
-    Model& model = app->models.back();
-    model.meshIdx = meshIdx;
-    u32 modelIdx = (u32)app->models.size() - 1u;
+    return verticesOffset + indicesOffset;
+}
+
+// ---------------------------------------------------
+// ---------- COOKED MESHES --------------------------
+// ---------------------------------------------------
+
+// A cooked mesh is the result of an Assimp import stored next to the source file
+// (e.g. Box/Cube.fbx.mesh) so later runs can skip the import altogether:
+//
+//   CookedMeshHeader | CookedSubmesh[submeshCount] | CookedMaterial[materialCount] | vertices | indices
+//
+// Vertices and indices are stored exactly as they are laid out in the GPU buffers,
+// so loading is a couple of glBufferData straight from the mapped file.
+
+#define COOKED_MESH_MAGIC    0x4853454D // "MESH"
+#define COOKED_MESH_VERSION  2
+#define COOKED_MESH_ALIGNMENT 16
+#define COOKED_MAX_ATTRIBUTES 8
+#define COOKED_MAX_PATH 128
+
+struct CookedMeshHeader
+{
+    u32 magic;
+    u32 version;
+    u32 importFlags;
+    u32 submeshCount;
+    u32 materialCount;
+    u32 vertexDataOffset;
+    u32 vertexDataSize;
+    u32 indexDataOffset;
+    u32 indexDataSize;
+};
+
+struct CookedSubmesh
+{
+    u32                   vertexOffset;
+    u32                   indexOffset;
+    u32                   indexCount;
+    u32                   materialIdx; //relative to the materials of the file
+    u8                    stride;
+    u8                    attributeCount;
+    VertexBufferAttribute attributes[COOKED_MAX_ATTRIBUTES];
+    AABB                  bounds;
+};
+
+struct CookedMaterial
+{
+    char name[64];
+    vec3 albedo;
+    vec3 emissive;
+    f32  smoothness;
+    char albedoTexture[COOKED_MAX_PATH];
+    char emissiveTexture[COOKED_MAX_PATH];
+    char specularTexture[COOKED_MAX_PATH];
+    char normalsTexture[COOKED_MAX_PATH];
+    char bumpTexture[COOKED_MAX_PATH];
+};
+
+static void CookTexturePath(App* app, u32 textureIdx, char* dst)
+{
+    // Index 0 is what unset material textures point to, so it does not need a path
+    if (textureIdx != 0 && textureIdx < app->textures.size())
+        strncpy(dst, app->textures[textureIdx].filepath.c_str(), COOKED_MAX_PATH - 1);
+}
+
+static u32 LoadCookedTexture(App* app, const char* path, u32 placeholderIdx, TextureUsage usage = TextureUsage_Color)
+{
+    return path[0] ? LoadTexture2DAsync(app, path, placeholderIdx, usage) : 0;
+}
 
-    String directory = GetDirectoryPart(MakeString(filename));
+static void WritePadding(FILE* file, u32& offset)
+{
+    static const u8 zeros[COOKED_MESH_ALIGNMENT] = {};
+    u32 aligned = Align(offset, COOKED_MESH_ALIGNMENT);
+    fwrite(zeros, 1, aligned - offset, file);
+    offset = aligned;
+}
 
-    // Create a list of materials
-    u32 baseMeshMaterialIndex = (u32)app->materials.size();
-    for (unsigned int i = 0; i < scene->mNumMaterials; ++i)
+void CookMesh(App* app, const char* cookedPath, u32 importFlags, const Mesh& mesh, const std::vector<u32>& materialIdx, u32 baseMaterialIdx, u32 materialCount)
+{
+    FILE* file = fopen(cookedPath, "wb");
+    if (!file)
     {
-        app->materials.push_back(Material{});
-        Material& material = app->materials.back();
-        ProcessAssimpMaterial(app, scene->mMaterials[i], material, directory);
+        ELOG("Could not write cooked mesh %s", cookedPath);
+        return;
     }
 
-    ProcessAssimpNode(scene, scene->mRootNode, &mesh, baseMeshMaterialIndex, model.materialIdx);
+    CookedMeshHeader header = {};
+    header.magic = COOKED_MESH_MAGIC;
+    header.version = COOKED_MESH_VERSION;
+    header.importFlags = importFlags;
+    header.submeshCount = mesh.submeshes.size();
+    header.materialCount = materialCount;
 
-    aiReleaseImport(scene);
+    for (const Submesh& submesh : mesh.submeshes)
+    {
+        header.vertexDataSize += submesh.vertices.size() * sizeof(float);
+        header.indexDataSize += submesh.indices.size() * sizeof(u32);
+    }
 
-    u32 vertexBufferSize = 0;
-    u32 indexBufferSize = 0;
+    u32 offset = sizeof(CookedMeshHeader) + header.submeshCount * sizeof(CookedSubmesh) + header.materialCount * sizeof(CookedMaterial);
+    header.vertexDataOffset = Align(offset, COOKED_MESH_ALIGNMENT);
+    header.indexDataOffset = Align(header.vertexDataOffset + header.vertexDataSize, COOKED_MESH_ALIGNMENT);
+
+    offset = 0;
+    fwrite(&header, sizeof(header), 1, file); offset += sizeof(header);
 
     for (u32 i = 0; i < mesh.submeshes.size(); ++i)
     {
-        vertexBufferSize += mesh.submeshes.at(i).vertices.size() * sizeof(float);
-        indexBufferSize += mesh.submeshes.at(i).indices.size() * sizeof(u32);
+        const Submesh& submesh = mesh.submeshes[i];
+        ASSERT(submesh.vertexBufferLayout.attributes.size() <= COOKED_MAX_ATTRIBUTES, "Too many vertex attributes to cook");
+
+        CookedSubmesh cooked = {};
+        cooked.vertexOffset = submesh.vertexOffset;
+        cooked.indexOffset = submesh.indexOffset;
+        cooked.indexCount = submesh.indexCount;
+        cooked.materialIdx = materialIdx[i] - baseMaterialIdx;
+        cooked.stride = submesh.vertexBufferLayout.stride;
+        cooked.bounds = submesh.bounds;
+        cooked.attributeCount = submesh.vertexBufferLayout.attributes.size();
+        for (u32 a = 0; a < cooked.attributeCount; ++a)
+            cooked.attributes[a] = submesh.vertexBufferLayout.attributes[a];
+
+        fwrite(&cooked, sizeof(cooked), 1, file); offset += sizeof(cooked);
     }
 
-    glGenBuffers(1, &mesh.vertexBufferHandle);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-    glBufferData(GL_ARRAY_BUFFER, vertexBufferSize, NULL, GL_STATIC_DRAW);
+    for (u32 i = 0; i < materialCount; ++i)
+    {
+        const Material& material = app->materials[baseMaterialIdx + i];
+
+        CookedMaterial cooked = {};
+        strncpy(cooked.name, material.name.c_str(), sizeof(cooked.name) - 1);
+        cooked.albedo = material.albedo;
+        cooked.emissive = material.emissive;
+        cooked.smoothness = material.smoothness;
+        CookTexturePath(app, material.albedoTextureIdx, cooked.albedoTexture);
+        CookTexturePath(app, material.emissiveTextureIdx, cooked.emissiveTexture);
+        CookTexturePath(app, material.specularTextureIdx, cooked.specularTexture);
+        CookTexturePath(app, material.normalsTextureIdx, cooked.normalsTexture);
+        CookTexturePath(app, material.bumpTextureIdx, cooked.bumpTexture);
+
+        fwrite(&cooked, sizeof(cooked), 1, file); offset += sizeof(cooked);
+    }
 
-    glGenBuffers(1, &mesh.indexBufferHandle);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBufferSize, NULL, GL_STATIC_DRAW);
+    WritePadding(file, offset);
+    for (const Submesh& submesh : mesh.submeshes)
+    {
+        fwrite(submesh.vertices.data(), sizeof(float), submesh.vertices.size(), file);
+        offset += submesh.vertices.size() * sizeof(float);
+    }
 
-    u32 indicesOffset = 0;
-    u32 verticesOffset = 0;
+    WritePadding(file, offset);
+    for (const Submesh& submesh : mesh.submeshes)
+    {
+        fwrite(submesh.indices.data(), sizeof(u32), submesh.indices.size(), file);
+        offset += submesh.indices.size() * sizeof(u32);
+    }
+
+    fclose(file);
+}
+
+// Everything the loader reads has to lie inside the file: a truncated or corrupt file
+// must fall back to the import instead of reading past the mapping
+static bool ValidCookedMesh(const MappedFile& file)
+{
+    const CookedMeshHeader* header = (const CookedMeshHeader*)file.data;
+
+    const u64 tablesEnd = sizeof(CookedMeshHeader) + (u64)header->submeshCount * sizeof(CookedSubmesh) +
+                          (u64)header->materialCount * sizeof(CookedMaterial);
+    if (tablesEnd > header->vertexDataOffset ||
+        (u64)header->vertexDataOffset + header->vertexDataSize > header->indexDataOffset ||
+        (u64)header->indexDataOffset + header->indexDataSize > file.size)
+        return false;
+
+    const CookedSubmesh* cookedSubmeshes = (const CookedSubmesh*)(file.data + sizeof(CookedMeshHeader));
+    for (u32 i = 0; i < header->submeshCount; ++i)
+    {
+        const CookedSubmesh& cooked = cookedSubmeshes[i];
+        const u32 vertexEnd = i + 1 < header->submeshCount ? cookedSubmeshes[i + 1].vertexOffset : header->vertexDataSize;
+
+        if (cooked.attributeCount > COOKED_MAX_ATTRIBUTES ||
+            cooked.stride < 3 * sizeof(float) ||
+            cooked.materialIdx >= header->materialCount ||
+            cooked.vertexOffset > vertexEnd ||
+            vertexEnd > header->vertexDataSize ||
+            (u64)cooked.indexOffset + (u64)cooked.indexCount * sizeof(u32) > header->indexDataSize)
+            return false;
+    }
+
+    return true;
+}
+
+// Fills the mesh and materials from a cooked file. Returns false if the file is missing,
+// older than the source asset, was cooked with a different version or import flags, or
+// does not hold together.
+bool LoadCookedMesh(App* app, const char* cookedPath, const char* sourcePath, u32 importFlags, Mesh& mesh, std::vector<u32>& materialIdx, u32& geometrySize)
+{
+    const u64 cookedTimestamp = GetFileLastWriteTimestamp(cookedPath);
+    if (cookedTimestamp == 0 || cookedTimestamp < GetFileLastWriteTimestamp(sourcePath))
+        return false;
+
+    MappedFile file = MapFile(cookedPath);
+    if (!file.data)
+        return false;
+
+    const CookedMeshHeader* header = (const CookedMeshHeader*)file.data;
+    if (file.size < sizeof(CookedMeshHeader) ||
+        header->magic != COOKED_MESH_MAGIC ||
+        header->version != COOKED_MESH_VERSION ||
+        header->importFlags != importFlags ||
+        !ValidCookedMesh(file))
+    {
+        UnmapFile(file);
+        return false;
+    }
+
+    const CookedSubmesh* cookedSubmeshes = (const CookedSubmesh*)(file.data + sizeof(CookedMeshHeader));
+    const CookedMaterial* cookedMaterials = (const CookedMaterial*)(cookedSubmeshes + header->submeshCount);
+
+    const u32 baseMaterialIdx = (u32)app->materials.size();
+    for (u32 i = 0; i < header->materialCount; ++i)
+    {
+        const CookedMaterial& cooked = cookedMaterials[i];
+
+        Material material = {};
+        material.name = cooked.name;
+        material.albedo = cooked.albedo;
+        material.emissive = cooked.emissive;
+        material.smoothness = cooked.smoothness;
+        material.albedoTextureIdx = LoadCookedTexture(app, cooked.albedoTexture, app->magentaTexIdx);
+        material.emissiveTextureIdx = LoadCookedTexture(app, cooked.emissiveTexture, app->blackTexIdx);
+        material.specularTextureIdx = LoadCookedTexture(app, cooked.specularTexture, app->whiteTexIdx);
+        material.normalsTextureIdx = LoadCookedTexture(app, cooked.normalsTexture, app->normalTexIdx, TextureUsage_Normal);
+        material.bumpTextureIdx = LoadCookedTexture(app, cooked.bumpTexture, app->whiteTexIdx, TextureUsage_Height);
+        app->materials.push_back(material);
+    }
+
+    for (u32 i = 0; i < header->submeshCount; ++i)
+    {
+        const CookedSubmesh& cooked = cookedSubmeshes[i];
+
+        Submesh submesh = {};
+        submesh.vertexBufferLayout.stride = cooked.stride;
+        submesh.vertexBufferLayout.attributes.assign(cooked.attributes, cooked.attributes + cooked.attributeCount);
+        submesh.vertexOffset = cooked.vertexOffset;
+        submesh.indexOffset = cooked.indexOffset;
+        submesh.indexCount = cooked.indexCount;
+        submesh.bounds = cooked.bounds;
+        mesh.submeshes.push_back(submesh);
+
+        materialIdx.push_back(baseMaterialIdx + cooked.materialIdx);
+    }
 
+    // Straight from the mapped file to the pools. Submeshes are stored in order, so each
+    // one's vertices end where the next one's begin
+    const u8* vertexData = file.data + header->vertexDataOffset;
+    const u8* indexData = file.data + header->indexDataOffset;
     for (u32 i = 0; i < mesh.submeshes.size(); ++i)
     {
-        const void* verticesData = mesh.submeshes.at(i).vertices.data();
-        u32   verticesSize = mesh.submeshes.at(i).vertices.size() * sizeof(float);
-        glBufferSubData(GL_ARRAY_BUFFER, verticesOffset, verticesSize, verticesData);
-        mesh.submeshes.at(i).vertexOffset = verticesOffset;
-        verticesOffset += verticesSize;
+        Submesh& submesh = mesh.submeshes[i];
+        const u32 vertexEnd = i + 1 < mesh.submeshes.size() ? mesh.submeshes[i + 1].vertexOffset : header->vertexDataSize;
+        UploadSubmeshGeometry(app, submesh, vertexData + submesh.vertexOffset, vertexEnd - submesh.vertexOffset, indexData + submesh.indexOffset);
+    }
 
-        const void* indicesData = mesh.submeshes.at(i).indices.data();
-        const u32   indicesSize = mesh.submeshes.at(i).indices.size() * sizeof(u32);
-        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, indicesOffset, indicesSize, indicesData);
-        mesh.submeshes.at(i).indexOffset = indicesOffset;
-        indicesOffset += indicesSize;
+    geometrySize = header->vertexDataSize + header->indexDataSize;
+
+    BuildOccluder(mesh, file.data + header->vertexDataOffset, file.data + header->indexDataOffset);
+
+    UnmapFile(file);
+    return true;
+}
+
+u32 LoadModel(App* app, const char* filename)
+{
+    PROFILE_FUNCTION();
+
+    const u32 importFlags = ModelImportFlags;
+
+    // Reuse the geometry of a previous import, only the materials are per model
+    for (const ModelCacheEntry& entry : app->modelCache)
+    {
+        if (entry.importFlags == importFlags && entry.filepath == filename)
+        {
+            Model model = {};
+            model.meshIdx = entry.meshIdx;
+            CloneModelMaterials(app, entry.materialIdx, model.materialIdx);
+
+            app->modelCacheHits++;
+            app->modelCacheBytesSaved += entry.geometrySize;
+
+            app->models.push_back(model);
+            return (u32)app->models.size() - 1u;
+        }
     }
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    auto loadStart = std::chrono::high_resolution_clock::now();
+    const f64 traceBegin = GetLoaderTime();
+
+    // Blocks until a prefetched import is done, there is nothing to wait for otherwise
+    const aiScene* prefetchedScene = TakePrefetchedModel(app, filename);
+
+    char cookedPath[256];
+    snprintf(cookedPath, sizeof(cookedPath), "%s.mesh", filename);
+
+    Mesh mesh = {};
+    std::vector<u32> materialIdx;
+    u32 geometrySize = 0;
+
+    const bool cooked = LoadCookedMesh(app, cookedPath, filename, importFlags, mesh, materialIdx, geometrySize);
+    if (cooked && prefetchedScene)
+        aiReleaseImport(prefetchedScene);
+
+    if (!cooked)
+    {
+        const aiScene* scene = prefetchedScene ? prefetchedScene : aiImportFile(filename, importFlags);
+
+        if (!scene)
+        {
+            ELOG("Error loading mesh %s: %s", filename, aiGetErrorString());
+            return UINT32_MAX;
+        }
+
+        String directory = GetDirectoryPart(MakeString(filename));
+
+        // Create a list of materials
+        u32 baseMeshMaterialIndex = (u32)app->materials.size();
+        for (unsigned int i = 0; i < scene->mNumMaterials; ++i)
+        {
+            app->materials.push_back(Material{});
+            Material& material = app->materials.back();
+            ProcessAssimpMaterial(app, scene->mMaterials[i], material, directory);
+        }
+
+        ProcessAssimpNode(scene, scene->mRootNode, &mesh, baseMeshMaterialIndex, materialIdx);
+
+        const u32 materialCount = scene->mNumMaterials;
+        aiReleaseImport(scene);
+
+        geometrySize = UploadMeshGeometry(app, mesh);
+
+        CookMesh(app, cookedPath, importFlags, mesh, materialIdx, baseMeshMaterialIndex, materialCount);
+    }
+
+    const u32 meshIdx = (u32)app->meshes.size();
+    app->meshes.push_back(mesh);
+
+    // The cache keeps the loaded materials untouched, the model gets its own copies
+    ModelCacheEntry entry = {};
+    entry.filepath = filename;
+    entry.importFlags = importFlags;
+    entry.meshIdx = meshIdx;
+    entry.materialIdx = materialIdx;
+    entry.geometrySize = geometrySize;
+    app->modelCache.push_back(entry);
+
+    Model model = {};
+    model.meshIdx = meshIdx;
+    CloneModelMaterials(app, entry.materialIdx, model.materialIdx);
+    app->models.push_back(model);
 
-    return modelIdx;
+    auto loadEnd = std::chrono::high_resolution_clock::now();
+    TraceAssetEvent(app->loader, std::string("LoadModel ") + filename, 0, traceBegin, GetLoaderTime());
+    ILOG("LoadModel %s: %f ms (%s)", filename, std::chrono::duration<f32, std::milli>(loadEnd - loadStart).count(), cooked ? "cooked" : "imported");
+
+    return (u32)app->models.size() - 1u;
 }
 
 // ---------------------------------------------
 // ---------- CREATE PRIMITIVES ----------------
 // ---------------------------------------------
 
+// Local bounds of an interleaved vertex array, position is always the first attribute
+AABB ComputeBounds(const std::vector<float>& vertices, u32 stride)
+{
+    const u32 floatStride = stride / sizeof(float);
+    if (vertices.size() < 3 || floatStride == 0)
+        return AABB{ vec3(0.0f), vec3(0.0f) };
+
+    AABB bounds = { vec3(FLT_MAX), vec3(-FLT_MAX) };
+    for (u32 i = 0; i + 2 < vertices.size(); i += floatStride)
+    {
+        const vec3 position(vertices[i], vertices[i + 1], vertices[i + 2]);
+        bounds.min = min(bounds.min, position);
+        bounds.max = max(bounds.max, position);
+    }
+    return bounds;
+}
+
 Entity CreatePlane(App* app, float size)
 {
 
@@ -1403,7 +6656,7 @@ Entity CreatePlane(App* app, float size)
     u32 modelIdx = (u32)app->models.size() - 1u;
     model.materialIdx.push_back(0); //default material created at initialization
 
-    Entity entity = { mat4(1.0f), modelIdx, 0, 0 };
+    Entity entity = { mat4(1.0f), modelIdx };
     app->entities.push_back(entity);
 
     // add the submesh into the mesh
@@ -1411,43 +6664,18 @@ Entity CreatePlane(App* app, float size)
     submesh.vertexBufferLayout = vertexBufferLayout;
     submesh.vertices.swap(Vertices);
     submesh.indices.swap(Indices);
+    submesh.indexCount = submesh.indices.size();
+    submesh.bounds = ComputeBounds(submesh.vertices, submesh.vertexBufferLayout.stride);
     mesh.submeshes.push_back(submesh);
 
-    glGenBuffers(1, &mesh.vertexBufferHandle);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-    glBufferData(GL_ARRAY_BUFFER, submesh.vertices.size() * sizeof(float), NULL, GL_STATIC_DRAW);
-
-    glGenBuffers(1, &mesh.indexBufferHandle);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, submesh.indices.size() * sizeof(u32), NULL, GL_STATIC_DRAW);
-
-    u32 indicesOffset = 0;
-    u32 verticesOffset = 0;
-
-    const void* verticesData = submesh.vertices.data();
-    u32   verticesSize = submesh.vertices.size() * sizeof(float);
-    glBufferSubData(GL_ARRAY_BUFFER, verticesOffset, verticesSize, verticesData);
-    submesh.vertexOffset = verticesOffset;
-    verticesOffset += verticesSize;
-
-    const void* indicesData = submesh.indices.data();
-    const u32   indicesSize = submesh.indices.size() * sizeof(u32);
-    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, indicesOffset, indicesSize, indicesData);
-    submesh.indexOffset = indicesOffset;
-    indicesOffset += indicesSize;
-
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    UploadMeshGeometry(app, mesh);
 
     return entity;
 }
 
-Entity CreateSphere(App* app)
+// UV sphere with position, normal and tex coords per vertex
+void GenerateSphere(float radius, u32 sectorCount, u32 stackCount, std::vector<float>& vertices, std::vector<u32>& indices)
 {
-    const float radius = 10.f;
-    const unsigned int sectorCount = 50;
-    const unsigned int stackCount = 50;
-    
     float x, y, z, xy;                              // vertex position
     float nx, ny, nz, lengthInv = 1.0f / radius;    // vertex normal
     float s, t;                                     // vertex texCoord
@@ -1456,8 +6684,6 @@ Entity CreateSphere(App* app)
     float stackStep = PI / stackCount;
     float sectorAngle, stackAngle;
 
-    std::vector<float> vertices;
-
     for (int i = 0; i <= stackCount; ++i)
     {
         stackAngle = PI / 2 - i * stackStep;        // starting from pi/2 to -pi/2
@@ -1493,7 +6719,6 @@ Entity CreateSphere(App* app)
         }
     }
 
-    std::vector<u32> indices;
     int k1, k2;
     for (int i = 0; i < stackCount; ++i)
     {
@@ -1520,6 +6745,13 @@ Entity CreateSphere(App* app)
             }
         }
     }
+}
+
+Entity CreateSphere(App* app)
+{
+    std::vector<float> vertices;
+    std::vector<u32> indices;
+    GenerateSphere(10.f, 50, 50, vertices, indices);
 
     //create vertex format
     VertexBufferLayout vertexBufferLayout = {};
@@ -1538,7 +6770,7 @@ Entity CreateSphere(App* app)
     u32 modelIdx = (u32)app->models.size() - 1u;
     model.materialIdx.push_back(0); //default material created at initialization
 
-    Entity entity = { mat4(1.0f), modelIdx, 0, 0 };
+    Entity entity = { mat4(1.0f), modelIdx };
     app->entities.push_back(entity);
 
     // add the submesh into the mesh
@@ -1546,35 +6778,107 @@ Entity CreateSphere(App* app)
     submesh.vertexBufferLayout = vertexBufferLayout;
     submesh.vertices.swap(vertices);
     submesh.indices.swap(indices);
+    submesh.indexCount = submesh.indices.size();
+    submesh.bounds = ComputeBounds(submesh.vertices, submesh.vertexBufferLayout.stride);
     mesh.submeshes.push_back(submesh);
 
-    glGenBuffers(1, &mesh.vertexBufferHandle);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-    glBufferData(GL_ARRAY_BUFFER, submesh.vertices.size() * sizeof(float), NULL, GL_STATIC_DRAW);
+    UploadMeshGeometry(app, mesh);
 
-    glGenBuffers(1, &mesh.indexBufferHandle);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, submesh.indices.size() * sizeof(u32), NULL, GL_STATIC_DRAW);
+    return entity;
+}
 
-    u32 indicesOffset = 0;
-    u32 verticesOffset = 0;
+// Streams spheres of varying detail through the pools: load them all, unload every other one,
+// load those again and unload everything. The reloads fit in the ranges just freed, so past
+// the first round the pools should not grow, and nothing should be left in use at the end.
+void BenchmarkGeometryPools(App* app)
+{
+    const u32 meshCount = 256;
+    const u32 baseMeshIdx = (u32)app->meshes.size();
 
-    const void* verticesData = submesh.vertices.data();
-    u32   verticesSize = submesh.vertices.size() * sizeof(float);
-    glBufferSubData(GL_ARRAY_BUFFER, verticesOffset, verticesSize, verticesData);
-    submesh.vertexOffset = verticesOffset;
-    verticesOffset += verticesSize;
+    VertexBufferLayout vertexBufferLayout = {};
+    vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 0, 3, 0 }); //vertex
+    vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 1, 3, 3 * sizeof(float) }); //normals
+    vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 2, 2, 6 * sizeof(float) }); //tex coords
+    vertexBufferLayout.stride = 8 * sizeof(float);
+
+    const u32 poolIdx = FindVertexPool(app, vertexBufferLayout);
+    const u32 usedVertices = app->geometry.vertexPools[poolIdx].vertices.used;
+    const u32 usedIndices = app->geometry.indices.used;
+
+    GeometryPoolBenchmark& result = app->geometryBenchmark;
+    result = {};
+
+    auto loadSphere = [&](u32 i)
+    {
+        Submesh submesh = {};
+        submesh.vertexBufferLayout = vertexBufferLayout;
+        GenerateSphere(1.0f, 8 + (i * 7) % 40, 6 + (i * 5) % 30, submesh.vertices, submesh.indices);
+        submesh.indexCount = submesh.indices.size();
+        submesh.bounds = ComputeBounds(submesh.vertices, submesh.vertexBufferLayout.stride);
+
+        Mesh& mesh = app->meshes[baseMeshIdx + i];
+        mesh.submeshes.push_back(submesh);
+        UploadMeshGeometry(app, mesh);
+        result.uploads++;
+    };
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    app->meshes.resize(baseMeshIdx + meshCount);
+    for (u32 i = 0; i < meshCount; ++i)
+        loadSphere(i);
+    const u32 firstRoundCapacity = app->geometry.vertexPools[poolIdx].vertices.capacity;
+
+    for (u32 i = 0; i < meshCount; i += 2)
+        UnloadMesh(app, baseMeshIdx + i);
+    for (u32 i = 0; i < meshCount; i += 2)
+        loadSphere(i);
+
+    for (u32 i = 0; i < meshCount; ++i)
+        UnloadMesh(app, baseMeshIdx + i);
+    app->meshes.resize(baseMeshIdx);
+
+    auto end = std::chrono::high_resolution_clock::now();
+
+    const GeometryBuffer& vertices = app->geometry.vertexPools[poolIdx].vertices;
+    result.time = std::chrono::duration<f32, std::milli>(end - start).count();
+    result.grownVertices = vertices.capacity - firstRoundCapacity;
+    result.leakedVertices = vertices.used - usedVertices;
+    result.leakedIndices = app->geometry.indices.used - usedIndices;
 
-    const void* indicesData = submesh.indices.data();
-    const u32   indicesSize = submesh.indices.size() * sizeof(u32);
-    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, indicesOffset, indicesSize, indicesData);
-    submesh.indexOffset = indicesOffset;
-    indicesOffset += indicesSize;
+    ILOG("Geometry pools: %u uploads in %.3f ms, grown %u vertices after the first round, %u vertices and %u indices leaked, %u free vertex ranges",
+        result.uploads, result.time, result.grownVertices, result.leakedVertices, result.leakedIndices, (u32)vertices.freeRanges.size());
+}
+
+// Low poly sphere for the light volumes. The faces of a tessellated sphere lie inside the real
+// one, so the radius is pushed out until they all enclose the unit sphere.
+void CreateLightVolume(App* app)
+{
+    const u32 sectorCount = 16;
+    const u32 stackCount = 12;
+    const float radius = 1.0f / (cosf(PI / sectorCount) * cosf(PI / (2 * stackCount)));
+
+    std::vector<float> vertices;
+    std::vector<u32> indices;
+    GenerateSphere(radius, sectorCount, stackCount, vertices, indices);
+    app->lightVolumeIndexCount = (u32)indices.size();
+
+    glGenBuffers(1, &app->lightVolumeVertices);
+    glBindBuffer(GL_ARRAY_BUFFER, app->lightVolumeVertices);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
+
+    glGenBuffers(1, &app->lightVolumeElements);
+
+    glGenVertexArrays(1, &app->lightVolumeVao);
+    glBindVertexArray(app->lightVolumeVao);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, app->lightVolumeElements);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(u32), indices.data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0); //only the position is used
+    glEnableVertexAttribArray(0);
+    glBindVertexArray(0);
 
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-    return entity;
 }
 
 // ----------------------------------------------
@@ -1605,6 +6909,18 @@ Buffer CreateBuffer(u32 size, GLenum type, GLenum usage)
     return buffer;
 }
 
+Buffer CreateRingBuffer(u32 regionSize, GLenum type, u32 regionCount)
+{
+    ASSERT(regionCount > 0 && regionCount <= MAX_BUFFER_REGIONS, "Invalid number of buffer regions");
+
+    Buffer buffer = CreateBuffer(regionSize * regionCount, type, GL_DYNAMIC_DRAW);
+    buffer.regionCount = regionCount;
+    buffer.regionSize = regionSize;
+    buffer.regionIdx = regionCount - 1; // the first MapBufferRegion() moves to region 0
+
+    return buffer;
+}
+
 void BindBuffer(const Buffer& buffer)
 {
     glBindBuffer(buffer.type, buffer.handle);
@@ -1623,6 +6939,75 @@ void UnmapBuffer(Buffer& buffer)
     glBindBuffer(buffer.type, 0);
 }
 
+// Returns true if the fence was not signaled yet and the CPU had to wait for it
+static bool WaitAndDeleteFence(GLsync& fence)
+{
+    if (!fence)
+        return false;
+
+    GLenum result = glClientWaitSync(fence, 0, 0);
+    const bool waited = result == GL_TIMEOUT_EXPIRED;
+    while (result == GL_TIMEOUT_EXPIRED)
+        result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000); // 1ms
+
+    glDeleteSync(fence);
+    fence = 0;
+    return waited;
+}
+
+void MapBufferRegion(Buffer& buffer)
+{
+    ASSERT(buffer.regionCount > 0, "The buffer was not created as a ring buffer");
+
+    buffer.regionIdx = (buffer.regionIdx + 1) % buffer.regionCount;
+    buffer.regionOffset = buffer.regionIdx * buffer.regionSize;
+
+    // Wait until the GPU is done with the frame that last used this region
+    if (WaitAndDeleteFence(buffer.fences[buffer.regionIdx]))
+        buffer.fenceWaitCount++;
+
+    // The fence already guarantees the region is free, so the driver must not sync again
+    const GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_FLUSH_EXPLICIT_BIT;
+
+    glBindBuffer(buffer.type, buffer.handle);
+    buffer.data = glMapBufferRange(buffer.type, buffer.regionOffset, buffer.regionSize, access);
+    buffer.head = buffer.regionOffset;
+}
+
+void UnmapBufferRegion(Buffer& buffer)
+{
+    glFlushMappedBufferRange(buffer.type, 0, buffer.head - buffer.regionOffset);
+    glUnmapBuffer(buffer.type);
+    glBindBuffer(buffer.type, 0);
+    buffer.data = NULL;
+}
+
+void FenceBufferRegion(Buffer& buffer)
+{
+    // Call it once all the draw calls reading from the current region have been issued
+    buffer.fences[buffer.regionIdx] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// Grows the regions of an unmapped ring buffer so each one holds at least regionSize bytes
+void ReserveRingBuffer(Buffer& buffer, u32 regionSize)
+{
+    if (regionSize <= buffer.regionSize)
+        return;
+
+    u32 newRegionSize = buffer.regionSize;
+    while (newRegionSize < regionSize)
+        newRegionSize *= 2;
+
+    for (u32 i = 0; i < buffer.regionCount; ++i)
+        WaitAndDeleteFence(buffer.fences[i]);
+
+    glDeleteBuffers(1, &buffer.handle);
+
+    const u32 fenceWaitCount = buffer.fenceWaitCount;
+    buffer = CreateRingBuffer(newRegionSize, buffer.type, buffer.regionCount);
+    buffer.fenceWaitCount = fenceWaitCount;
+}
+
 void AlignHead(Buffer& buffer, u32 alignment)
 {
     ASSERT(IsPowerOf2(alignment), "The alignment must be a power of 2");
@@ -1633,7 +7018,8 @@ void PushAlignedData(Buffer& buffer, const void* data, u32 size, u32 alignment)
 {
     ASSERT(buffer.data != NULL, "The buffer must be mapped first");
     AlignHead(buffer, alignment);
-    memcpy((u8*)buffer.data + buffer.head, data, size);
+    ASSERT(buffer.regionCount == 0 || buffer.head + size <= buffer.regionOffset + buffer.regionSize, "Trying to push more data than the region can hold");
+    memcpy((u8*)buffer.data + (buffer.head - buffer.regionOffset), data, size);
     buffer.head += size;
 }
 
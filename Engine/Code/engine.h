@@ -8,6 +8,20 @@
 #include <glad/glad.h>
 
 #include <random>
+#include <type_traits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <atomic>
+#include <chrono>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 typedef glm::vec2  vec2;
 typedef glm::vec3  vec3;
@@ -62,22 +76,218 @@ struct Vao
 
 // MODELS AND MATERIALS
 
+struct AABB
+{
+    vec3 min;
+    vec3 max;
+};
+
+// 32 bytes so two nodes share a cache line
+struct BVHNode
+{
+    vec3 min;
+    i32  left;  //child node, or -1 - entityIdx for leaves
+    vec3 max;
+    i32  right; //child node, or the next free node while in the free list
+};
+
+struct BVH
+{
+    std::vector<BVHNode> nodes;
+    std::vector<i32>     parents;      //kept apart from the nodes, queries never need them
+    std::vector<i32>     leafOfEntity;
+    i32                  root = -1;
+    i32                  freeNode = -1;
+    u32                  refitCount;   //since the last full build
+};
+
+// Parallel for shared by the frame's CPU stages. Every worker and the calling thread run
+// the same job, which pulls its own work items (tiles, slices) from an atomic counter.
+typedef void (*ParallelJob)(void* data);
+
+struct JobPool
+{
+    std::vector<std::thread> workers;
+    std::mutex               mutex;
+    std::condition_variable  workAvailable;
+    std::condition_variable  workDone;
+    ParallelJob              job;
+    void*                    data;
+    const char*              jobName; //profiler scope on the workers
+    u32                      generation;
+    u32                      busyWorkers;
+    bool                     quit;
+};
+
+// Software occlusion depth buffer, in tiles so each thread rasterizes its own part
+#define OCCLUSION_WIDTH      256
+#define OCCLUSION_HEIGHT     128
+#define OCCLUSION_TILE_SIZE  32
+#define OCCLUSION_TILES_X    (OCCLUSION_WIDTH / OCCLUSION_TILE_SIZE)
+#define OCCLUSION_TILES_Y    (OCCLUSION_HEIGHT / OCCLUSION_TILE_SIZE)
+#define OCCLUSION_BLOCK_SIZE 8
+#define OCCLUSION_BLOCKS_X   (OCCLUSION_WIDTH / OCCLUSION_BLOCK_SIZE)
+#define OCCLUSION_BLOCKS_Y   (OCCLUSION_HEIGHT / OCCLUSION_BLOCK_SIZE)
+
+// Screen space triangle set up for rasterization: three edge functions and the
+// depth plane, all as A * x + B * y + C
+struct OcclusionTriangle
+{
+    f32 edgeA[3], edgeB[3], edgeC[3];
+    f32 depthA, depthB, depthC;
+    i32 minX, maxX, minY, maxY;
+};
+
+struct OcclusionCuller
+{
+    bool enabled = true;
+
+    std::vector<f32>               depth; //nearest depth per pixel, [0, 1]
+    std::vector<f32>               hiz;   //farthest depth per 8x8 block
+    std::vector<OcclusionTriangle> triangles;
+    std::vector<std::vector<u32>>  bins;  //triangles overlapping each tile
+    std::vector<vec3>              worldTriangles;
+    std::vector<u8>                entityVisibility; //0 not tested yet, 1 visible, 2 occluded
+
+    std::atomic<u32>               nextTile;
+
+    // Stats
+    u32 occludedCount; //entities
+    f32 rasterTime;    //ms
+    f32 testTime;      //ms
+    f32 benchmarkRasterTime[2]; //single threaded, all workers
+    f32 benchmarkTestsPerSecond;
+};
+
+// View space froxels: countX x countY screen tiles, countZ exponential depth slices
+struct ClusterLight
+{
+    vec3 center; //view space
+    f32  radius;
+    u32  minX, maxX, minY, maxY, minZ, maxZ; //cluster range touched by the light bounds
+};
+
+struct LightClusters
+{
+    u32 countX = 16;
+    u32 countY = 9;
+    u32 countZ = 24;
+
+    // View space bounds the clusters were last built for
+    mat4 projection;
+    f32  near, far;
+    std::vector<f32> columnMinX, columnMaxX; //per (x, z), padded for 4 wide loads
+    std::vector<f32> rowMinY, rowMaxY;       //per (y, z)
+    std::vector<f32> sliceMinZ, sliceMaxZ;   //per z
+
+    std::vector<ClusterLight>       lights;
+    std::vector<std::vector<uvec2>> slicePairs;   //(cluster, light) found in each slice
+    std::vector<std::vector<u32>>   sliceIndices; //light indices of each slice, grouped by cluster
+
+    // Output: offset and count of every cluster into the compact light index list
+    std::vector<uvec2> grid;
+    std::vector<u32>   indices;
+
+    std::atomic<u32>                nextSlice;
+
+    // Stats
+    f32 assignTime; //ms
+    f32 benchmarkTimes[4][2]; //256 to 16k lights, 16x9x24 and 32x18x48 clusters
+};
+
+struct BVHBenchmark
+{
+    f32 buildTime;      //ms
+    f32 refitsPerSecond;
+    f32 frustumTime;    //ms
+    f32 bruteForceTime; //ms, same frustum testing every box
+    f32 spheresPerSecond;
+    f32 raysPerSecond;
+};
+
 struct Submesh
 {
     VertexBufferLayout vertexBufferLayout;
     std::vector<float> vertices;
-    std::vector<u32>   indices;
+    std::vector<u32>   indices; //empty for meshes loaded from a cooked file
     u32                vertexOffset;
     u32                indexOffset;
-
-    std::vector<Vao> vaos;
+    u32                indexCount;
+    AABB               bounds; //local space
+
+    // Where the geometry lives in the shared buffers, see GeometryPools
+    u32                vertexPool;  //GeometryPools::vertexPools entry, picked by the vertex layout
+    u32                baseVertex;  //first vertex in that pool
+    u32                vertexCount;
+    u32                firstIndex;  //first index in GeometryPools::indices
 };
 
+#define MAX_OCCLUDER_TRIANGLES 256
+
 struct Mesh
 {
     std::vector<Submesh> submeshes;
-    GLuint               vertexBufferHandle;
-    GLuint               indexBufferHandle;
+    std::vector<vec3>    occluder; //largest triangles of the mesh, 3 vertices each, local space
+};
+
+// GEOMETRY POOLS
+
+// All the mesh geometry is sub-allocated from a few big buffers: one vertex buffer per
+// vertex layout and a single index buffer. Draws pick their range with a base vertex and
+// a first index, so meshes sharing a layout share the VAO too.
+
+#define GEOMETRY_POOL_VERTICES (64 * 1024)   //initial capacity of a vertex pool
+#define GEOMETRY_POOL_INDICES  (1024 * 1024) //initial capacity of the index buffer
+#define DRAW_INSTANCE_LOCATION 5             //instanced uvec2 of the indirect geometry pass: queue index, material
+
+// Free space of a geometry buffer, in elements (vertices or indices)
+struct GeometryRange
+{
+    u32 offset;
+    u32 count;
+};
+
+// First fit over the free ranges, which are kept sorted by offset and merged on free.
+// Full buffers double in size, the contents are copied over on the GPU
+struct GeometryBuffer
+{
+    GLuint handle;
+    u32    elementSize; //bytes
+    u32    capacity;    //elements
+    u32    used;        //elements
+    std::vector<GeometryRange> freeRanges;
+};
+
+struct VertexPool
+{
+    VertexBufferLayout layout;
+    GeometryBuffer     vertices;
+    std::vector<Vao>   vaos; //one per program, rebuilt when a buffer they point to grows
+};
+
+struct GeometryPools
+{
+    std::vector<VertexPool> vertexPools;
+    GeometryBuffer          indices; //u32, relative to the base vertex of each draw
+};
+
+// Same layout glMultiDrawElementsIndirect reads from GL_DRAW_INDIRECT_BUFFER
+struct DrawElementsIndirectCommand
+{
+    u32 count;
+    u32 instanceCount;
+    u32 firstIndex;
+    i32 baseVertex;
+    u32 baseInstance;
+};
+
+// Load, unload and reload churn over the pools, see BenchmarkGeometryPools
+struct GeometryPoolBenchmark
+{
+    f32 time;          //ms
+    u32 uploads;
+    u32 grownVertices; //vertex pool growth after the first round, 0 when freed ranges are reused
+    u32 leakedVertices, leakedIndices; //still in use once everything is unloaded
 };
 
 struct Material
@@ -98,7 +308,17 @@ struct Material
 struct Model
 {
     u32              meshIdx;
-    std::vector<u32> materialIdx;
+    std::vector<u32> materialIdx; //one per submesh, owned by this model so it can be overridden
+};
+
+// Geometry already imported and uploaded, shared by every model loaded from the same file
+struct ModelCacheEntry
+{
+    std::string      filepath;
+    u32              importFlags;
+    u32              meshIdx;
+    std::vector<u32> materialIdx; //materials as imported, cloned for each new model
+    u32              geometrySize; //bytes uploaded to the vertex and index buffers
 };
 
 
@@ -106,8 +326,7 @@ struct Entity
 {
     mat4        worldMatrix;
     u32         modelIndex;
-    u32         localParamsOffset;
-    u32         localParamsSize;
+    bool        isOccluder = false; //rasterized by the software occlusion culler
 
     void TransformPosition(const vec3& pos)
     {
@@ -149,6 +368,21 @@ struct Light //efficient alignment
     float range;    
 };
 
+#define MAX_GLOBAL_LIGHTS 16 //size of uLight[] in the GlobalParams block
+#define TILE_SIZE 16         //tiled shading work group size, in pixels
+#define MAX_LIGHTS_PER_TILE 512 //same as TILED_SHADING in shaders.glsl, lights past it are dropped
+#define TILE_OVERFLOW_LATENCY 3 //frames before the overflowing tile count is read back
+#define SSAO_KERNEL_SIZE 64  //samples in the SSAOKernel block
+#define SSAO_GROUP_SIZE 8    //compute SSAO work group size, in pixels
+#define SSAO_BLUR_GROUP 64   //pixels of a row or column blurred by one work group
+
+// std430 layout of a light in the tiled shading light buffer
+struct GPULight
+{
+    vec4 positionRange; //xyz position, w range
+    vec4 colorType;     //xyz color, w LightType
+};
+
 struct Image
 {
     void* pixels;
@@ -157,10 +391,118 @@ struct Image
     i32   stride;
 };
 
+// Decides the block compression a texture is cooked with
+enum TextureUsage
+{
+    TextureUsage_Color,  //BC1, or BC3 when there is alpha
+    TextureUsage_Normal, //BC5, z is reconstructed in the shader
+    TextureUsage_Height  //BC4
+};
+
 struct Texture
 {
-    GLuint      handle;
-    std::string filepath;
+    GLuint       handle;
+    std::string  filepath;
+    TextureUsage usage; //same file loaded for another usage is another texture
+};
+
+#define MAX_TEXTURE_MIPS 16
+
+// Block compressed mip chain, either freshly cooked or mapped from a .tex file
+struct CompressedImage
+{
+    GLenum          format;
+    ivec2           size;
+    u32             sourceChannels; //of the source image, to compare against the uncompressed upload
+    u32             mipCount;
+    u32             mipOffsets[MAX_TEXTURE_MIPS];
+    u32             mipSizes[MAX_TEXTURE_MIPS];
+    std::vector<u8> blob;
+    MappedFile      file;
+};
+
+// ---------- Async asset loading ----------
+
+struct aiScene;
+
+enum AssetJobType
+{
+    AssetJob_Texture, //stbi decode, uploaded later on the GL thread
+    AssetJob_Model    //Assimp import, picked up by LoadModel
+};
+
+struct AssetJob
+{
+    AssetJobType   type;
+    u32            textureIdx;
+    TextureUsage   usage;
+    std::string    filepath;
+    CompressedImage compressed;
+    const aiScene* scene;
+};
+
+struct ModelPrefetch
+{
+    std::string    filepath;
+    const aiScene* scene;
+    bool           done;
+};
+
+struct AssetTraceEvent
+{
+    std::string name;
+    u32         threadIdx; //0 is the GL thread, workers start at 1
+    f64         begin;     //microseconds since the loader started
+    f64         end;
+};
+
+struct AssetLoader
+{
+    std::vector<std::thread>   workers;
+    std::mutex                 mutex;
+    std::condition_variable    jobAvailable;
+    std::condition_variable    prefetchDone;
+    std::deque<AssetJob>       jobs;
+    std::deque<AssetJob>       uploads;    //decoded textures waiting for the GL thread
+    std::vector<ModelPrefetch> prefetches;
+    u32                        pendingJobs; //queued, running or waiting for upload
+    bool                       quit;
+
+    std::vector<AssetTraceEvent> trace;
+    bool                         traceWritten;
+
+    // Texture cooking stats, summed over all workers
+    u64 cookedPixels;
+    f64 cookTime; //microseconds spent encoding blocks
+};
+
+// FNV-1a, usable at compile time so uniform names are hashed once by the compiler
+constexpr u32 HashString(const char* str, u32 hash = 2166136261u)
+{
+    return *str ? HashString(str + 1, (hash ^ (u8)*str) * 16777619u) : hash;
+}
+
+#define UNIFORM(name) (std::integral_constant<u32, HashString(name)>::value)
+
+struct UniformSlot
+{
+    bool   used;
+    u32    nameHash;
+    GLint  location;
+    GLenum type;
+    GLint  arraySize;
+
+    // Last uploaded value, to skip redundant glUniform calls (not used for arrays)
+    bool   cached;
+    u32    value[16];
+};
+
+struct UniformBlockSlot
+{
+    u32    nameHash;
+    GLuint index;
+    GLint  binding;
+    GLint  dataSize;
 };
 
 struct Program
@@ -169,17 +511,421 @@ struct Program
     std::string        filepath;
     std::string        programName;
     u64                lastWriteTimestamp; 
+    bool               isCompute;
 
     VertexShaderLayout vertexShaderLayout;
+
+    // Reflected from the linked program, open addressing table indexed by name hash
+    std::vector<UniformSlot>      uniforms;
+    std::vector<UniformBlockSlot> uniformBlocks;
 };
 
-struct Buffer 
+#define MAX_BUFFER_REGIONS 3
+
+struct Buffer
 {
     GLuint handle;
     GLenum type;
     u32 size;
     u32 head;
     void* data; //mapped data
+
+    // Ring mode: the buffer is split in regionCount regions of regionSize bytes,
+    // one per frame in flight. Each region is guarded by a fence so the CPU never
+    // writes into a range the GPU may still be reading.
+    u32 regionCount;
+    u32 regionSize;
+    u32 regionIdx;
+    u32 regionOffset; //start of the currently mapped region
+    GLsync fences[MAX_BUFFER_REGIONS];
+    u32 fenceWaitCount; //times a frame had to wait for the GPU to release a region
+};
+
+// RENDER QUEUE
+
+enum SSAOStage
+{
+    SSAOStage_Downsample,
+    SSAOStage_Occlusion,
+    SSAOStage_BlurX,
+    SSAOStage_BlurY,
+    SSAOStage_Upsample,
+    SSAOStage_Count
+};
+
+enum RenderPass
+{
+    RenderPass_Forward,
+    RenderPass_Geometry
+};
+
+// Sort key, from most to least significant bits:
+// pass (4) | program (6) | material (14) | mesh (12) | submesh (4) | depth (24, front to back)
+// Items that only differ in depth end up adjacent and are drawn as one instanced batch.
+#define DRAW_KEY_PASS_SHIFT     60
+#define DRAW_KEY_PROGRAM_SHIFT  54
+#define DRAW_KEY_MATERIAL_SHIFT 40
+#define DRAW_KEY_MESH_SHIFT     28
+#define DRAW_KEY_SUBMESH_SHIFT  24
+#define DRAW_KEY_DEPTH_BITS     24
+
+struct DrawItem
+{
+    u64 key;
+    u32 entityIdx;
+    u32 submeshIdx;
+    u32 meshIdx;
+    u32 materialIdx;
+};
+
+// Commands [firstCommand, firstCommand + commandCount) of the indirect buffer, drawn with the textures of materialIdx
+struct MultiDraw
+{
+    u32 firstCommand;
+    u32 commandCount;
+    u32 vertexPool;
+    u32 materialIdx;
+};
+
+struct RenderQueue
+{
+    RenderPass            pass;
+    u32                   programIdx;
+    std::vector<DrawItem> items;
+    std::vector<DrawItem> scratch; //radix sort ping-pong buffer
+    u32                   batchCount; //instanced draw calls issued in the last submission
+    u32                   multiDrawCount; //glMultiDrawElementsIndirect calls, batchCount commands among them
+    std::vector<MultiDraw> multiDraws;  //built by SubmitRenderQueueIndirect
+
+    // Frustum culling: world space bounds of the items as 6 SoA streams (center xyz,
+    // extent xyz), each padded to a multiple of 8 boxes
+    std::vector<u32>      entities;   //candidates returned by the BVH
+    std::vector<f32>      cullBounds;
+    bool                  frustumCulling = true;
+    u32                   culledCount;
+    f32                   cullTime; //ms
+};
+
+// Per-instance data read by the mesh programs through gl_InstanceID (std430)
+struct InstanceParams
+{
+    mat4 worldMatrix;
+    mat4 worldViewProjectionMatrix;
+};
+
+#define MAX_TEXTURE_UNITS 8
+
+// Shadow copy of the GL bindings touched by the draw submission, so redundant binds are dropped
+struct GLStateCache
+{
+    GLuint program;
+    GLuint vao;
+    GLuint activeTextureUnit;
+    GLuint textures[MAX_TEXTURE_UNITS];
+
+    u32    bindsIssued;
+    u32    bindsSkipped;
+};
+
+// CPU PROFILER
+
+#define CPU_PROFILER_RING 32768 //events kept per thread, a power of two
+
+struct CPUProfileEvent
+{
+    const char* name;  //string literal, only the pointer is kept
+    u64         begin; //CPU ticks
+    u64         end;
+};
+
+// Written only by the thread it belongs to, read when the trace is written
+struct CPUProfilerThread
+{
+    CPUProfileEvent  events[CPU_PROFILER_RING];
+    std::atomic<u64> head; //events ever recorded, the ring holds the last CPU_PROFILER_RING
+    u32              tid;
+    char             name[32];
+};
+
+struct CPUProfiler
+{
+    std::atomic<bool>               enabled{ true };
+    std::mutex                      mutex; //guards threads
+    std::vector<CPUProfilerThread*> threads;
+
+    // Tick and clock readings at init, ticks are converted to microseconds against them
+    u64                                   baseTicks;
+    std::chrono::steady_clock::time_point baseTime;
+
+    u64 captureStart;      //ticks, older events are left out of the trace
+    u32 captureFramesLeft;
+    f32 benchmarkOverhead[2]; //ns per scope, recording off and on
+};
+
+extern CPUProfiler GlobalCPUProfiler;
+extern thread_local CPUProfilerThread* LocalCPUProfilerThread;
+
+CPUProfilerThread* RegisterCPUProfilerThread(const char* name);
+
+inline u64 ReadCPUTicks()
+{
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (u64)std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Records the enclosing scope into the calling thread's ring, a relaxed load when recording is off
+struct CPUProfileScope
+{
+    const char* name;
+    u64         begin;
+
+    CPUProfileScope(const char* scopeName)
+    {
+        name = GlobalCPUProfiler.enabled.load(std::memory_order_relaxed) ? scopeName : nullptr;
+        if (name)
+            begin = ReadCPUTicks();
+    }
+
+    ~CPUProfileScope()
+    {
+        if (!name)
+            return;
+
+        const u64 end = ReadCPUTicks();
+        CPUProfilerThread* thread = LocalCPUProfilerThread;
+        if (!thread)
+            thread = RegisterCPUProfilerThread(nullptr);
+
+        // Single writer: fill the slot, then publish it
+        const u64 head = thread->head.load(std::memory_order_relaxed);
+        thread->events[head & (CPU_PROFILER_RING - 1)] = CPUProfileEvent{ name, begin, end };
+        thread->head.store(head + 1, std::memory_order_release);
+    }
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) CPUProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_FUNCTION() PROFILE_SCOPE(__FUNCTION__)
+
+// GL TRACE
+
+// Entry points the trace can intercept: everything the engine and the ImGui backend call
+#define GL_TRACE_ENTRY_POINTS(X) \
+    X(glActiveTexture) X(glAttachShader) X(glBeginQuery) X(glBindBuffer) \
+    X(glBindBufferBase) X(glBindBufferRange) X(glBindFramebuffer) X(glBindImageTexture) \
+    X(glBindSampler) X(glBindTexture) X(glBindVertexArray) X(glBindVertexBuffer) \
+    X(glBlendEquation) X(glBlendEquationSeparate) X(glBlendFunc) X(glBlendFuncSeparate) \
+    X(glBufferData) X(glBufferSubData) X(glCheckFramebufferStatus) X(glClear) \
+    X(glClearColor) X(glClientWaitSync) X(glColorMask) X(glCompileShader) \
+    X(glCompressedTexImage2D) X(glCopyBufferSubData) X(glCreateProgram) X(glCreateShader) \
+    X(glCullFace) X(glDebugMessageCallback) X(glDeleteBuffers) X(glDeleteFramebuffers) \
+    X(glDeleteProgram) X(glDeleteShader) X(glDeleteSync) X(glDeleteTextures) \
+    X(glDeleteVertexArrays) X(glDepthMask) X(glDetachShader) X(glDisable) \
+    X(glDispatchCompute) X(glDrawArrays) X(glDrawBuffer) X(glDrawBuffers) \
+    X(glDrawElements) X(glDrawElementsBaseVertex) X(glDrawElementsInstanced) X(glDrawElementsInstancedBaseVertex) \
+    X(glEnable) X(glEnableVertexAttribArray) X(glEndQuery) X(glFenceSync) \
+    X(glFlushMappedBufferRange) X(glFramebufferTexture) X(glFramebufferTexture2D) X(glGenBuffers) \
+    X(glGenFramebuffers) X(glGenQueries) X(glGenTextures) X(glGenVertexArrays) \
+    X(glGenerateMipmap) X(glGetActiveAttrib) X(glGetActiveUniform) X(glGetActiveUniformBlockName) \
+    X(glGetActiveUniformBlockiv) X(glGetAttribLocation) X(glGetError) X(glGetIntegerv) \
+    X(glGetProgramInfoLog) X(glGetProgramiv) X(glGetQueryObjectui64v) X(glGetQueryObjectuiv) \
+    X(glGetShaderInfoLog) X(glGetShaderiv) X(glGetString) X(glGetUniformLocation) \
+    X(glIsEnabled) X(glLinkProgram) X(glMapBuffer) X(glMapBufferRange) \
+    X(glMemoryBarrier) X(glMultiDrawElementsIndirect) X(glPixelStorei) X(glPolygonMode) \
+    X(glPopDebugGroup) X(glPushDebugGroup) X(glQueryCounter) X(glScissor) \
+    X(glShaderSource) X(glStencilFunc) X(glStencilOp) X(glStencilOpSeparate) \
+    X(glTexImage2D) X(glTexParameteri) X(glTexParameteriv) X(glUniform1f) \
+    X(glUniform1i) X(glUniform2f) X(glUniform2i) X(glUniform3fv) \
+    X(glUniform3i) X(glUniform4f) X(glUniformMatrix4fv) X(glUnmapBuffer) \
+    X(glUseProgram) X(glVertexAttribBinding) X(glVertexAttribIFormat) X(glVertexAttribPointer) \
+    X(glVertexBindingDivisor) X(glViewport)
+
+// Summed per frame from the call counts, so the hooks don't have to classify calls
+#define GL_TRACE_DRAW_CALLS(X) \
+    X(glDrawArrays) X(glDrawElements) X(glDrawElementsBaseVertex) X(glDrawElementsInstanced) \
+    X(glDrawElementsInstancedBaseVertex) X(glMultiDrawElementsIndirect)
+
+#define GL_TRACE_STATE_CHANGES(X) \
+    X(glActiveTexture) X(glBindBuffer) X(glBindBufferBase) X(glBindBufferRange) \
+    X(glBindFramebuffer) X(glBindImageTexture) X(glBindSampler) X(glBindTexture) \
+    X(glBindVertexArray) X(glBindVertexBuffer) X(glBlendEquation) X(glBlendEquationSeparate) \
+    X(glBlendFunc) X(glBlendFuncSeparate) X(glClearColor) X(glColorMask) \
+    X(glCullFace) X(glDepthMask) X(glDisable) X(glDrawBuffer) \
+    X(glDrawBuffers) X(glEnable) X(glPixelStorei) X(glPolygonMode) \
+    X(glScissor) X(glStencilFunc) X(glStencilOp) X(glStencilOpSeparate) \
+    X(glUseProgram) X(glViewport)
+
+#define GL_TRACE_ENUM(name) GLTrace_##name,
+enum GLTraceEntryPoint
+{
+    GL_TRACE_ENTRY_POINTS(GL_TRACE_ENUM)
+    GLTrace_Count
+};
+#undef GL_TRACE_ENUM
+
+#define GL_TRACE_TEXTURE_UNITS 32
+#define GL_TRACE_UNKNOWN       0xffffffffu //binding not seen since the trace was enabled
+
+enum GLTraceBufferTarget
+{
+    GLTraceBuffer_Array,
+    GLTraceBuffer_ElementArray,
+    GLTraceBuffer_Uniform,
+    GLTraceBuffer_ShaderStorage,
+    GLTraceBuffer_DrawIndirect,
+    GLTraceBuffer_Count
+};
+
+struct GLTraceFrame
+{
+    u32 calls[GLTrace_Count];
+    u32 totalCalls;
+    u32 drawCalls;
+    u32 dispatches;
+    u32 stateChanges;
+    u32 redundantBinds; //object already bound to that unit or target
+    u64 uploadBytes;    //copied in by glBufferData/glBufferSubData/glTexImage2D/glCompressedTexImage2D
+    u64 mappedBytes;    //buffer ranges mapped for writing
+};
+
+// Shadow of the bindings, to spot the redundant ones
+struct GLTraceBindings
+{
+    u32 activeUnit;
+    u32 textures[GL_TRACE_TEXTURE_UNITS];
+    u32 textureTargets[GL_TRACE_TEXTURE_UNITS];
+    u32 program;
+    u32 vertexArray;
+    u32 drawFramebuffer;
+    u32 readFramebuffer;
+    u32 buffers[GLTraceBuffer_Count];
+};
+
+// Swaps the glad function pointers for counting hooks while enabled. When disabled the
+// pointers are the driver's again, so the trace costs nothing
+struct GLTrace
+{
+    bool            enabled;
+    GLTraceFrame    frame;     //being recorded
+    GLTraceFrame    lastFrame; //last complete frame, what the panel shows
+    GLTraceBindings bindings;
+    u64             frameIndex;
+
+    std::vector<GLTraceFrame> capture;
+    u64                       captureStart; //frameIndex of capture[0]
+    u32                       captureFramesLeft;
+};
+
+extern GLTrace GlobalGLTrace;
+
+// GPU PROFILER
+
+#define GPU_PROFILER_MAX_SCOPES  16  //distinct scope names
+#define GPU_PROFILER_MAX_RECORDS 32  //scopes timed in a single frame
+#define GPU_PROFILER_LATENCY     4   //frames a set of queries is given before it is read back
+#define GPU_PROFILER_HISTORY     240 //resolved frames kept for the rolling statistics
+
+// Timestamp queries of one frame, reused GPU_PROFILER_LATENCY frames later
+struct GPUProfilerFrame
+{
+    GLuint queries[GPU_PROFILER_MAX_RECORDS * 2]; //begin and end of every record
+    u32    scopes[GPU_PROFILER_MAX_RECORDS];
+    u32    recordCount;
+    u32    lastQuery;   //issued last, scopes nest so it is not always the end of the last record
+    u64    frameIndex;
+};
+
+struct GPUProfilerStats
+{
+    u32 samples;
+    f32 last, average, p50, p95, p99, max; //ms
+};
+
+struct GPUProfiler
+{
+    const char*      scopeNames[GPU_PROFILER_MAX_SCOPES];
+    u32              scopeCount;
+
+    GPUProfilerFrame frames[GPU_PROFILER_LATENCY];
+    u64              frameIndex;
+    u32              openRecords[GPU_PROFILER_MAX_RECORDS]; //begun and not yet ended, innermost last
+    u32              openCount;
+
+    // Resolved frames, ms per scope, negative when the scope didn't run that frame
+    f32              history[GPU_PROFILER_HISTORY][GPU_PROFILER_MAX_SCOPES];
+    u64              historyFrames[GPU_PROFILER_HISTORY];
+    u32              historyHead; //next slot written
+    u32              historyCount;
+    u32              droppedFrames; //still not finished after GPU_PROFILER_LATENCY frames, skipped instead of waiting
+};
+
+// BENCHMARK MODE
+
+#define BENCHMARK_WARMUP_FRAMES 30 //played once the startup assets are loaded, before measuring
+#define BENCHMARK_FRAME_RATE    60 //camera path time advanced per frame, fixed so runs are reproducible
+
+// One line of a camera path file: time (s), position x y z, yaw and pitch (degrees)
+struct CameraKey
+{
+    f32  time;
+    vec3 position;
+    f32  yaw;
+    f32  pitch;
+};
+
+// Headless run over a scripted camera path, driven by the platform loop
+struct BenchmarkRun
+{
+    std::vector<CameraKey> path;
+    u32                    frameCount;    //measured frames
+    u32                    warmupFrames;  //played so far
+    u64                    measureStart;  //GPU profiler index of the first measured frame, 0 while warming up
+    u64                    lastGpuFrame;  //last GPU profiler frame copied into gpuTimes
+    std::vector<f32>       cpuFrameTimes; //ms, Update and Render of every measured frame
+    std::vector<f32>       gpuTimes;      //ms, GPU_PROFILER_MAX_SCOPES per measured frame resolved
+};
+
+// SCENE GENERATOR
+
+#define SCENE_GENERATOR_MESHES        3   //plane, sphere and the Box cube
+#define SCENE_GENERATOR_MAX_MATERIALS 64
+#define SCENE_GENERATOR_CLUSTER_SIZE  1000 //entities per cluster with SceneDistribution::Clusters
+
+enum class SceneDistribution
+{
+    Grid,     //lattice filling a cube
+    Random,   //uniform inside the same cube
+    Clusters, //gaussian blobs around random centers
+    Count
+};
+
+struct SceneGeneratorParams
+{
+    u32 seed = 1;
+    u32 entityCount = 1000;
+    u32 lightCount = 16;
+    u32 materialCount = 8;
+    u32 meshCount = SCENE_GENERATOR_MESHES; //how many of the generator meshes are used
+    SceneDistribution distribution = SceneDistribution::Grid;
+    f32 spacing = 3.0f; //average distance between neighbouring entities
+};
+
+// Replaces the hardcoded scene with a procedural one. The meshes are created once, the models
+// and materials after baseModelCount/baseMaterialCount belong to the generator and are rebuilt
+struct SceneGenerator
+{
+    SceneGeneratorParams params;
+    bool initialized;
+    u32  meshModels[SCENE_GENERATOR_MESHES]; //model of each mesh, for its meshIdx
+    f32  meshScales[SCENE_GENERATOR_MESHES]; //brings each mesh to unit size
+    u32  availableMeshes;                    //the cube is missing if Box/Cube.fbx failed to load
+    u32  baseModelCount;
+    u32  baseMaterialCount;
+    f32  generateTime; //ms
 };
 
 struct OpenGLInfo
@@ -208,6 +954,16 @@ enum class RenderMode
     Mode_Deferred
 };
 
+// How the deferred path applies the lights to the G-buffer
+enum class LightingMode
+{
+    Mode_Tiled,          //compute pass, lights culled per tile
+    Mode_FullScreenQuad, //every pixel loops over the GlobalParams lights
+    Mode_LightVolumes,   //a stencil masked sphere per point light
+
+    Mode_Count
+};
+
 class OpenGLErrorGuard
 {
 public:
@@ -228,6 +984,8 @@ struct Camera
 
     mat4 ViewMatrix;
     mat4 ProjectionMatrix;
+    mat4 ViewProjectionMatrix; //computed once per frame in Update()
+    vec4 FrustumPlanes[6];     //world space, xyz pointing inwards
 
     vec3 worldUp;
     vec3 position;
@@ -318,6 +1076,7 @@ struct App
     std::vector<Material>   materials;
     std::vector<Mesh>       meshes;
     std::vector<Model>      models;
+    std::vector<ModelCacheEntry> modelCache;
     std::vector<Light>      lights;
     std::vector<Program>    programs;
 
@@ -325,9 +1084,17 @@ struct App
     u32 texturedGeometryProgramIdx;
     u32 ForwardProgramIdx;
     u32 GeometryPassProgramIdx;
+    u32 GeometryPassIndirectProgramIdx;
     u32 SSAOPassProgramIdx;
-    u32 SSAOBlurPassProgramIdx;
+    u32 SSAOComputeProgramIdx;
+    u32 SSAOBlurProgramIdx;
+    u32 SSAODownsampleProgramIdx;
+    u32 SSAOUpsampleProgramIdx;
     u32 ShadingPassProgramIdx;
+    u32 TiledShadingProgramIdx;
+    u32 LightVolumeProgramIdx;
+    u32 LightVolumeStencilProgramIdx;
+    u32 GBufferViewProgramIdx;
 
     //Uniform buffers info
     GLint maxUniformBufferSize;
@@ -336,6 +1103,78 @@ struct App
     u32 globalParamOffset;
     u32 globalParamSize;
     Buffer cbuffer;
+    Buffer instanceBuffer; //InstanceParams of every draw item, in render queue order
+    Buffer lightBuffer;    //GPULight of every light, read by the tiled shading pass
+
+    // Tiles that had more than MAX_LIGHTS_PER_TILE lights, one counter per frame in flight
+    GLuint tileOverflowBuffer;
+    GLsync tileOverflowFences[TILE_OVERFLOW_LATENCY];
+    u32    tileOverflowFrame;
+    u32    overflowTiles; //as of the last counter read back
+    Buffer indirectBuffer;     //DrawElementsIndirectCommand of the indirect geometry pass
+    Buffer drawInstanceBuffer; //queue index and material of every draw item, an instanced attribute
+    Buffer materialBuffer;     //flags of every material, bit 0 normal mapped, bit 1 relief mapped
+
+    GeometryPools geometry;
+    GeometryPoolBenchmark geometryBenchmark;
+    bool multiDrawIndirect = true; //deferred geometry pass through glMultiDrawElementsIndirect
+
+    f32 startupTime; //ms spent in Init()
+
+    AssetLoader loader;
+    f32 uploadBudget = 2.0f; //ms per frame spent creating streamed in textures
+
+    // Texture memory, and what the same textures would take as RGB8/RGBA8 with mips
+    u64 textureMemory;
+    u64 textureMemoryUncompressed;
+
+    // Model cache stats
+    u32 modelCacheHits;
+    u64 modelCacheBytesSaved;
+
+    RenderQueue  renderQueue;
+    GLStateCache stateCache;
+    GPUProfiler  gpuProfiler;
+    BenchmarkRun benchmark;
+    SceneGenerator sceneGenerator;
+
+    // Entity BVH, rebuilt in the background once refits pile up
+    BVH              bvh;
+    std::vector<u32> bvhMoved;            //through SetEntityWorldMatrix since the last update
+    std::vector<u32> bvhMovedDuringRebuild;
+    std::future<BVH> bvhRebuild;
+    u32              bvhRebuildCount;
+    BVHBenchmark     bvhBenchmark[3]; //10k, 100k and 1M entities
+
+    JobPool jobPool; //occlusion rasterization and light clustering
+    OcclusionCuller occlusionCuller;
+
+    // Light volumes: a unit sphere circumscribing the real one
+    GLuint lightVolumeVao;
+    GLuint lightVolumeVertices;
+    GLuint lightVolumeElements;
+    u32    lightVolumeIndexCount;
+
+    // Shaded pixels, one per light per pixel, of the last frame each approach was measured
+    std::vector<GLuint> lightingQueries; //one per lighting draw, the light volumes need one per light
+    u32    lightingQueryCount;
+    bool   lightingQueryPending;
+    u32    lightingQueryLights; //lights every passed sample shaded
+    u64    lightingQueryExtra;  //pixels shaded outside the query
+    LightingMode lightingQueryMode;
+    u64    shadedPixels[(u32)LightingMode::Mode_Count];
+
+    // Clustered forward shading
+    LightClusters lightClusters;
+    Buffer        clusterBuffer; //grid followed by the light indices
+
+    // Transform stage timings (ms)
+    f32 transformStageTime;
+    f32 transformBenchmarkTimes[4]; //1k, 10k, 100k and 1M entities
+
+    // CPU side of the frame (ms), Render doesn't include the time the GPU takes
+    f32 updateTime;
+    f32 renderTime;
     
     // texture indices
     u32 diceTexIdx;
@@ -348,9 +1187,18 @@ struct App
     Mode mode;
     RenderMode renderMode;
 
+    // Deferred lighting
+    LightingMode lightingMode = LightingMode::Mode_Tiled;
+    i32  extraLightCount; //random point lights spawned on top of the scene ones
+    u32  sceneLightCount;
+
     bool SSAO = true;
     float radius = 0.5f;
     float bias = 0.0025f;
+    i32   ssaoScale = 2; //1, 2 or 4, occlusion is computed at displaySize / ssaoScale
+    bool  ssaoTemporal = true; //spread the kernel over frames and accumulate, fragment path only
+    bool  ssaoCompute; //compute dispatches with a depth aware blur instead of the fragment pass
+    i32   ssaoTemporalSamples = 16; //kernel samples per frame, 8 or 16
     bool ReliefMapping = true;
     float bumpiness = 0.1f;
 
@@ -359,9 +1207,6 @@ struct App
     GLuint embeddedVertices;
     GLuint embeddedElements;
 
-    // Location of the texture uniform in the textured quad shader
-    GLuint programUniformTexture;
-  
     // VAO object to link our screen filling quad with our textured quad shader
     GLuint vao;
 
@@ -369,10 +1214,9 @@ struct App
     GLuint colorAttachmentHandle;
     GLuint albedoAttachmentHandle;
     GLuint normalAttachmentHandle;
-    GLuint positionAttachmentHandle;
-    GLuint depthTextureHandle;
     GLuint depthAttachmentHandle;
     GLuint ssaoColorBuffer;
+    u32    gbufferBytesPerPixel; //written by the geometry pass
     GLuint noiseTexture;
 
     GLuint DisplayedTexture;
@@ -381,13 +1225,61 @@ struct App
     // SSAO utilities
     std::vector<glm::vec3> ssaoKernel;
     std::vector<glm::vec3> ssaoNoise;
+    GLuint ssaoKernelBuffer; //SSAOKernel uniform block, uploaded once
+
+    // Reduced resolution SSAO: point sampled depth and normal, and the occlusion computed from them
+    GLuint ssaoFramebuffer;
+    GLuint ssaoDepthBuffer;
+    GLuint ssaoNormalBuffer;
+    GLuint ssaoOcclusionBuffer;
+    GLuint ssaoBlurBuffer; //horizontal blur output of the compute path, at the SSAO resolution
+    i32    ssaoTargetScale; //scale the targets above were created for
+    ivec2  ssaoTargetSize;
+
+    // Temporal SSAO: occlusion, view depth and encoded normal of the last two frames, ping-ponged
+    GLuint ssaoHistoryFramebuffer;
+    GLuint ssaoHistoryBuffers[2];
+    u32    ssaoHistoryIndex; //the one written this frame
+    bool   ssaoHistoryValid;
+    u32    ssaoFrameIndex;
+    mat4   ssaoPrevViewProjection;
+
+    // GPU timestamps around every SSAO stage, skipped stages measure 0
+    GLuint ssaoTimestamps[SSAOStage_Count + 1];
+    bool   ssaoTimerPending;
+    u32    ssaoTimerScale;
+    u32    ssaoTimerPath;
+    f32    ssaoGpuTime[2][3];                  //whole stage (ms), fragment and compute path, per scale
+    f32    ssaoStageTimes[2][SSAOStage_Count]; //per stage (ms), fragment and compute path
 };
 
 
 u32 LoadTexture2D(App* app, const char* filepath);
 
+void InitAssetLoader(App* app, u32 workerCount);
+
+void ShutdownAssetLoader(App* app);
+
+bool CookTexture(const char* sourcePath, const char* cookedPath, TextureUsage usage, CompressedImage& image, u64& encodedPixels, f64& encodeTime);
+
+bool LoadCompressedTexture(const char* cookedPath, const char* sourcePath, TextureUsage usage, CompressedImage& image);
+
+GLuint CreateCompressedTexture2D(const CompressedImage& image);
+
+void FreeCompressedImage(CompressedImage& image);
+
+u32 LoadTexture2DAsync(App* app, const char* filepath, u32 placeholderIdx, TextureUsage usage = TextureUsage_Color);
+
+void PrefetchModel(App* app, const char* filepath);
+
+const aiScene* TakePrefetchedModel(App* app, const char* filepath);
+
+void ProcessAssetUploads(App* app, f32 budgetMs);
+
 void Init(App* app);
 
+void Shutdown(App* app);
+
 void Gui(App* app);
 
 void Update(App* app);
@@ -396,20 +1288,152 @@ void Render(App* app);
 
 void OnGlError(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* userParam);
 
-GLuint FindVAO(Mesh& mesh, u32 submeshIndex, const Program& program);
+GLuint FindVAO(App* app, VertexPool& pool, const Program& program);
 
-u32 LoadModel(App* app, const char* filename);
+void UploadSubmeshGeometry(App* app, Submesh& submesh, const void* vertices, u32 vertexSize, const void* indices);
+
+void UnloadMesh(App* app, u32 meshIdx);
+void BenchmarkGeometryPools(App* app);
+
+u32 LoadComputeProgram(App* app, const char* filepath, const char* programName);
+
+void SetExtraLightCount(App* app, u32 count);
+
+void UploadLights(App* app);
+
+void TiledShadingPass(App* app);
+
+void LightVolumePass(App* app, bool measure);
 
+void InitCPUProfiler();
+
+void CPUProfilerNewFrame();
+
+void StartCPUCapture(u32 frames);
+
+bool WriteCPUTrace(const char* filepath);
+
+void BenchmarkCPUProfiler();
+
+void SetGLTraceEnabled(bool enabled);
+
+void GLTraceNewFrame();
+
+void StartGLTraceCapture(u32 frames);
+
+bool WriteGLTraceCSV(const char* filepath);
+
+void InitGPUProfiler(GPUProfiler& profiler);
+
+void GPUProfilerBeginFrame(GPUProfiler& profiler);
+
+void GPUProfilerBegin(GPUProfiler& profiler, const char* name);
+
+void GPUProfilerEnd(GPUProfiler& profiler);
+
+GPUProfilerStats GetGPUProfilerStats(const GPUProfiler& profiler, u32 scope);
+
+bool ExportGPUProfilerCSV(const GPUProfiler& profiler, const char* filepath);
+
+bool LoadCameraPath(const char* filepath, std::vector<CameraKey>& path);
+
+void ApplyCameraPath(Camera& camera, const std::vector<CameraKey>& path, f32 time);
+
+void BenchmarkUpdateCamera(App* app);
+
+bool BenchmarkFrame(App* app, f32 cpuFrameMs);
+
+bool WriteBenchmarkReport(App* app, const char* filepath);
+
+void GenerateScene(App* app, const SceneGeneratorParams& params);
+
+void CreateSSAOTargets(App* app);
+
+void SSAOPass(App* app);
+
+
+
+void AssignLightsToClusters(LightClusters& clusters, const mat4& view, const mat4& projection, f32 near, f32 far,
+                            const Light* lights, u32 lightCount, JobPool* pool);
+
+void UploadLightClusters(App* app);
+
+void BenchmarkLightClusters(App* app);
+
+void ReflectProgramUniforms(Program& program);
+UniformSlot* FindUniform(Program& program, u32 nameHash);
+const UniformBlockSlot* FindUniformBlock(const Program& program, u32 nameHash);
+void SetUniform1i(Program& program, u32 nameHash, i32 value);
+void SetUniform1f(Program& program, u32 nameHash, f32 value);
+void SetUniform2f(Program& program, u32 nameHash, const vec2& value);
+void SetUniform2i(Program& program, u32 nameHash, const ivec2& value);
+void SetUniform3i(Program& program, u32 nameHash, const ivec3& value);
+void SetUniform4f(Program& program, u32 nameHash, const vec4& value);
+void SetUniformMat4(Program& program, u32 nameHash, const mat4& value);
+void SetUniform3fv(Program& program, u32 nameHash, u32 count, const f32* values);
+
+u32 LoadModel(App* app, const char* filename);
+void CookMesh(App* app, const char* cookedPath, u32 importFlags, const Mesh& mesh, const std::vector<u32>& materialIdx, u32 baseMaterialIdx, u32 materialCount);
+bool LoadCookedMesh(App* app, const char* cookedPath, const char* sourcePath, u32 importFlags, Mesh& mesh, std::vector<u32>& materialIdx, u32& geometrySize);
+
+void TransformEntities(const mat4& viewProjection, const Entity* entities, const DrawItem* items, u32 count, u8* dst, u32 stride);
+void BenchmarkTransformStage(App* app);
+
+void BuildRenderQueue(App* app, RenderQueue& queue, RenderPass pass, u32 programIdx);
+void CullRenderQueue(App* app, RenderQueue& queue);
+
+void BuildBVH(BVH& bvh, const AABB* bounds, u32 count);
+void InsertBVHLeaf(BVH& bvh, u32 entityIdx, const AABB& bounds);
+void RemoveBVHLeaf(BVH& bvh, u32 entityIdx);
+bool UpdateBVHLeaf(BVH& bvh, u32 entityIdx, const AABB& bounds);
+void QueryBVHFrustum(const BVH& bvh, const vec4* planes, std::vector<u32>& out);
+void QueryBVHSphere(const BVH& bvh, const vec3& center, f32 radius, std::vector<u32>& out);
+bool RaycastBVH(const BVH& bvh, const vec3& origin, const vec3& direction, f32 maxDistance, u32& entityIdx, f32& distance);
+AABB ComputeEntityBounds(App* app, const Entity& entity);
+void BuildEntityBVH(App* app);
+void SetEntityWorldMatrix(App* app, u32 entityIdx, const mat4& worldMatrix);
+void UpdateEntityBVH(App* app);
+void BenchmarkBVH(App* app);
+
+void BuildOccluder(Mesh& mesh, const u8* vertexData = NULL, const u8* indexData = NULL);
+void InitJobPool(JobPool& pool, u32 workerCount);
+void ShutdownJobPool(JobPool& pool);
+void RunParallel(JobPool* pool, ParallelJob job, void* data, const char* jobName);
+
+void InitOcclusionCuller(OcclusionCuller& culler);
+void RasterizeOccluders(OcclusionCuller& culler, const mat4& viewProjection, const vec3* vertices, u32 triangleCount, JobPool* pool);
+bool IsOccluded(const OcclusionCuller& culler, const mat4& viewProjection, const AABB& bounds);
+void OcclusionCullRenderQueue(App* app, RenderQueue& queue);
+void BenchmarkOcclusion(App* app);
+void SortRenderQueue(RenderQueue& queue);
+void SubmitRenderQueue(App* app, RenderQueue& queue, Program& program);
+void SubmitRenderQueueIndirect(App* app, RenderQueue& queue, Program& program);
+
+void InvalidateStateCache(GLStateCache& cache);
+void CacheUseProgram(GLStateCache& cache, GLuint program);
+void CacheBindVertexArray(GLStateCache& cache, GLuint vao);
+void CacheBindTexture(GLStateCache& cache, u32 unit, GLuint texture);
+
+AABB ComputeBounds(const std::vector<float>& vertices, u32 stride);
 Entity CreatePlane(App* app, float size);
+void GenerateSphere(float radius, u32 sectorCount, u32 stackCount, std::vector<float>& vertices, std::vector<u32>& indices);
+
 Entity CreateSphere(App* app);
 
+void CreateLightVolume(App* app);
+
 
 bool IsPowerOf2(u32 value);
 u32 Align(u32 value, u32 alignment);
 Buffer CreateBuffer(u32 size, GLenum type, GLenum usage);
+Buffer CreateRingBuffer(u32 regionSize, GLenum type, u32 regionCount);
 void BindBuffer(const Buffer& buffer);
 void MapBuffer(Buffer& buffer, GLenum access);
 void UnmapBuffer(Buffer& buffer);
+void MapBufferRegion(Buffer& buffer);
+void UnmapBufferRegion(Buffer& buffer);
+void FenceBufferRegion(Buffer& buffer);
+void ReserveRingBuffer(Buffer& buffer, u32 regionSize);
 void AlignHead(Buffer& buffer, u32 alignment);
 void PushAlignedData(Buffer& buffer, const void* data, u32 size, u32 alignment);
 void renderQuad();
\ No newline at end of file
@@ -12,6 +12,8 @@
 #else
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 #endif
 
@@ -19,6 +21,8 @@
 
 #include <GLFW/glfw3.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
 #include <imgui_impl_opengl3.h>
@@ -114,8 +118,141 @@ void OnGlfwCloseWindow(GLFWwindow* window)
     app->isRunning = false;
 }
 
-int main()
+// Command line:
+//   --headless               no window or GUI, plays the camera path and writes a report
+//   --camera-path <file>     keys for BenchmarkRun, see CameraKey
+//   --frames <count>         measured frames (600)
+//   --render-mode <mode>     forward or deferred
+//   --report <file>          benchmark report (benchmark_report.json)
+//   --scene-entities <count> replaces the default scene with a generated one, see GenerateScene
+//   --scene-lights <count>   point lights of the generated scene (16)
+//   --scene-seed <seed>      seed of the generated scene (1)
+struct LaunchOptions
 {
+    bool        headless;
+    const char* cameraPath;
+    u32         frames;
+    const char* renderMode;
+    const char* reportPath;
+    bool        generateScene;
+    SceneGeneratorParams scene;
+};
+
+bool ParseLaunchOptions(int argc, char** argv, LaunchOptions& options)
+{
+    options = {};
+    options.frames = 600;
+    options.reportPath = "benchmark_report.json";
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const bool hasValue = i + 1 < argc;
+        if      (strcmp(argv[i], "--headless") == 0)                options.headless = true;
+        else if (strcmp(argv[i], "--camera-path") == 0 && hasValue) options.cameraPath = argv[++i];
+        else if (strcmp(argv[i], "--frames") == 0 && hasValue)      options.frames = (u32)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--render-mode") == 0 && hasValue) options.renderMode = argv[++i];
+        else if (strcmp(argv[i], "--report") == 0 && hasValue)      options.reportPath = argv[++i];
+        else if (strcmp(argv[i], "--scene-entities") == 0 && hasValue)
+        {
+            options.generateScene = true;
+            options.scene.entityCount = (u32)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--scene-lights") == 0 && hasValue) options.scene.lightCount = (u32)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--scene-seed") == 0 && hasValue)   options.scene.seed = (u32)atoi(argv[++i]);
+        else
+        {
+            ELOG("Unknown or incomplete argument %s", argv[i]);
+            return false;
+        }
+    }
+
+    if (options.renderMode && strcmp(options.renderMode, "forward") != 0 && strcmp(options.renderMode, "deferred") != 0)
+    {
+        ELOG("--render-mode must be forward or deferred, not %s", options.renderMode);
+        return false;
+    }
+    if (options.frames == 0)
+    {
+        ELOG("--frames must be at least 1");
+        return false;
+    }
+    return true;
+}
+
+// Never shown. OSMesa renders in software with no GPU or display server, EGL covers Mesa
+// drivers (llvmpipe included) and a hidden native window is the last resort
+GLFWwindow* CreateOffscreenWindow()
+{
+    const int contextApis[] = { GLFW_OSMESA_CONTEXT_API, GLFW_EGL_CONTEXT_API, GLFW_NATIVE_CONTEXT_API };
+    const char* contextApiNames[] = { "OSMesa", "EGL", "native" };
+
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    for (u32 i = 0; i < ARRAY_COUNT(contextApis); ++i)
+    {
+        glfwWindowHint(GLFW_CONTEXT_CREATION_API, contextApis[i]);
+        GLFWwindow* window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
+        if (window)
+        {
+            ILOG("Headless: %s context", contextApiNames[i]);
+            return window;
+        }
+    }
+    return NULL;
+}
+
+// Plays the camera path with a fixed time step and no GUI, then writes the benchmark report
+int RunHeadless(App& app, GLFWwindow* window, const LaunchOptions& options)
+{
+    if (options.cameraPath && !LoadCameraPath(options.cameraPath, app.benchmark.path))
+        return -1;
+    app.benchmark.frameCount = options.frames;
+
+    GlobalFrameArenaMemory = (u8*)malloc(GLOBAL_FRAME_ARENA_SIZE);
+
+    Init(&app);
+    if (options.renderMode)
+        app.renderMode = strcmp(options.renderMode, "deferred") == 0 ? RenderMode::Mode_Deferred : RenderMode::Mode_Forward;
+    if (options.generateScene)
+        GenerateScene(&app, options.scene);
+
+    while (app.isRunning)
+    {
+        CPUProfilerNewFrame();
+        GLTraceNewFrame();
+        glfwPollEvents();
+
+        BenchmarkUpdateCamera(&app);
+
+        const f64 frameBegin = glfwGetTime();
+        Update(&app);
+        Render(&app);
+        const f32 cpuFrameMs = (f32)((glfwGetTime() - frameBegin) * 1000.0);
+
+        glfwSwapBuffers(window);
+
+        if (BenchmarkFrame(&app, cpuFrameMs))
+            app.isRunning = false;
+
+        // Reset frame allocator
+        GlobalFrameArenaHead = 0;
+    }
+
+    const bool written = WriteBenchmarkReport(&app, options.reportPath);
+
+    Shutdown(&app);
+    free(GlobalFrameArenaMemory);
+    glfwDestroyWindow(window);
+    glfwTerminate();
+
+    return written ? 0 : -1;
+}
+
+int main(int argc, char** argv)
+{
+    LaunchOptions options;
+    if (!ParseLaunchOptions(argc, argv, options))
+        return -1;
+
     App app         = {};
     app.deltaTime   = 1.0f/60.0f;
     app.displaySize = ivec2(WINDOW_WIDTH, WINDOW_HEIGHT);
@@ -134,7 +271,8 @@ int main()
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
-    GLFWwindow* window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
+    GLFWwindow* window = options.headless ? CreateOffscreenWindow()
+                                          : glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
     if (!window)
     {
         ELOG("glfwCreateWindow() failed\n");
@@ -160,6 +298,13 @@ int main()
         return -1;
     }
 
+    if (options.headless)
+    {
+        // Frames as fast as they come, they are what is being measured
+        glfwSwapInterval(0);
+        return RunHeadless(app, window, options);
+    }
+
     IMGUI_CHECKVERSION();
     ImGui::CreateContext();
 
@@ -200,9 +345,16 @@ int main()
     GlobalFrameArenaMemory = (u8*)malloc(GLOBAL_FRAME_ARENA_SIZE);
 
     Init(&app);
+    if (options.renderMode)
+        app.renderMode = strcmp(options.renderMode, "deferred") == 0 ? RenderMode::Mode_Deferred : RenderMode::Mode_Forward;
+    if (options.generateScene)
+        GenerateScene(&app, options.scene);
 
     while (app.isRunning)
     {
+        CPUProfilerNewFrame();
+        GLTraceNewFrame();
+
         // Tell GLFW to call platform callbacks
         glfwPollEvents();
 
@@ -262,6 +414,8 @@ int main()
         GlobalFrameArenaHead = 0;
     }
 
+    Shutdown(&app);
+
     free(GlobalFrameArenaMemory);
 
     ImGui_ImplOpenGL3_Shutdown();
@@ -375,6 +529,71 @@ String ReadTextFile(const char* filepath)
     return fileText;
 }
 
+MappedFile MapFile(const char* filepath)
+{
+    MappedFile file = {};
+
+#ifdef _WIN32
+    HANDLE fileHandle = CreateFileA(filepath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (fileHandle == INVALID_HANDLE_VALUE)
+        return file;
+
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(fileHandle, &fileSize);
+
+    HANDLE mappingHandle = fileSize.QuadPart > 0 ? CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    if (!mappingHandle)
+    {
+        CloseHandle(fileHandle);
+        return file;
+    }
+
+    file.data = (const u8*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+    file.size = (u64)fileSize.QuadPart;
+    file.fileHandle = fileHandle;
+    file.mappingHandle = mappingHandle;
+
+    if (!file.data)
+        UnmapFile(file);
+#else
+    // NOTE: This has not been tested in unix-like systems
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0)
+        return file;
+
+    struct stat attrib;
+    if (fstat(fd, &attrib) != 0 || attrib.st_size == 0)
+    {
+        close(fd);
+        return file;
+    }
+
+    void* data = mmap(NULL, attrib.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data != MAP_FAILED)
+    {
+        file.data = (const u8*)data;
+        file.size = (u64)attrib.st_size;
+    }
+#endif
+
+    return file;
+}
+
+void UnmapFile(MappedFile& file)
+{
+#ifdef _WIN32
+    if (file.data) UnmapViewOfFile(file.data);
+    if (file.mappingHandle) CloseHandle((HANDLE)file.mappingHandle);
+    if (file.fileHandle) CloseHandle((HANDLE)file.fileHandle);
+#else
+    if (file.data) munmap((void*)file.data, file.size);
+#endif
+
+    file = {};
+}
+
 u64 GetFileLastWriteTimestamp(const char* filepath)
 {
 #ifdef _WIN32
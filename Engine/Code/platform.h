@@ -75,6 +75,22 @@ String GetDirectoryPart(String path);
  */
 String ReadTextFile(const char *filepath);
 
+struct MappedFile
+{
+    const u8* data;
+    u64       size;
+    void*     fileHandle;
+    void*     mappingHandle;
+};
+
+/**
+ * Maps a whole file read-only into memory. The returned data stays valid until
+ * UnmapFile() is called. On failure, data is NULL.
+ */
+MappedFile MapFile(const char *filepath);
+
+void UnmapFile(MappedFile& file);
+
 /**
  * It retrieves a timestamp indicating the last time the file was modified.
  * Can be useful in order to check for file modifications to implement hot reloads.
@@ -1,6 +1,35 @@
 ///////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////
+//------------------------------------------------------------------------
+//-------------------- G-BUFFER ENCODING ---------------------------------
+//------------------------------------------------------------------------
+
+// Octahedral normal encoding, the G-buffer keeps it in an RG16 target
+vec2 EncodeNormal(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 signs = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    vec2 e = n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * signs;
+    return e * 0.5 + 0.5;
+}
+
+vec3 DecodeNormal(vec2 e)
+{
+    e = e * 2.0 - 1.0;
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = clamp(-n.z, 0.0, 1.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
+
+// Position from the depth attachment, in the space the inverse matrix leads to
+vec3 ReconstructPosition(vec2 uv, float depth, mat4 inverseProjection)
+{
+    vec4 position = inverseProjection * vec4(uv * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    return position.xyz / position.w;
+}
+
 #ifdef TEXTURED_GEOMETRY
 
 #if defined(VERTEX) ///////////////////////////////////////////////////
@@ -54,12 +83,20 @@ layout(location=2) in vec2 aTexCoord;
 layout(location=3) in vec3 aTangent;
 layout(location=4) in vec3 aBitangent;
 
-layout(binding = 1, std140) uniform LocalParams
+struct InstanceParams
 {
-    mat4 uWorldMatrix;
-    mat4 uWorldViewProjectionMatrix;
+    mat4 worldMatrix;
+    mat4 worldViewProjectionMatrix;
 };
 
+// One entry per instance, all the instances of a draw call are contiguous
+layout(binding = 0, std430) readonly buffer Instances
+{
+    InstanceParams uInstances[];
+};
+
+uniform int uBaseInstance;
+
 layout(binding = 0, std140) uniform GlobalParams
 {
     vec3            uCameraPosition;
@@ -75,13 +112,16 @@ out mat3 vTBN;
 
 void main()
 {
+    mat4 worldMatrix = uInstances[uBaseInstance + gl_InstanceID].worldMatrix;
+    mat4 worldViewProjectionMatrix = uInstances[uBaseInstance + gl_InstanceID].worldViewProjectionMatrix;
+
     vTexCoord = aTexCoord;
-    vPosition = vec3(uWorldMatrix * vec4(aPosition, 1.0)); // 1.0 because its a point
-    vNormal = vec3(uWorldMatrix * vec4(aNormal, 0.0)); // 0.0 because its a vector
+    vPosition = vec3(worldMatrix * vec4(aPosition, 1.0)); // 1.0 because its a point
+    vNormal = vec3(worldMatrix * vec4(aNormal, 0.0)); // 0.0 because its a vector
     vViewDir = normalize(uCameraPosition - vPosition);
 
-    vec3 T = normalize(vec3(uWorldMatrix * vec4(aTangent, 0.0)));
-    vec3 N = normalize(vec3(uWorldMatrix * vec4(aNormal, 0.0)));
+    vec3 T = normalize(vec3(worldMatrix * vec4(aTangent, 0.0)));
+    vec3 N = normalize(vec3(worldMatrix * vec4(aNormal, 0.0)));
 
     //T = normalize(T - dot(T, N) * N); //re-orthogonalize
 
@@ -89,7 +129,7 @@ void main()
 
     vTBN = mat3(T, B, N);
 
-    gl_Position = uWorldViewProjectionMatrix * vec4(aPosition, 1.0);
+    gl_Position = worldViewProjectionMatrix * vec4(aPosition, 1.0);
 }
 
 #elif defined(FRAGMENT)
@@ -108,13 +148,28 @@ uniform sampler2D uTexture;
 uniform sampler2D uNormalMap;
 uniform sampler2D uBumpTex;
 
-layout(binding = 0, std140) uniform GlobalParams
+struct LightData
 {
-    vec3            uCameraPosition;
-    unsigned int    uLightCount;
-    Light           uLight[16];
+    vec4 positionRange; // direction instead of position for directional lights
+    vec4 colorType;     // 0 directional, 1 point
 };
 
+layout(binding = 1, std430) readonly buffer Lights
+{
+    LightData uLights[];
+};
+
+// (offset, count) of every cluster followed by the light indices they point to
+layout(binding = 2, std430) readonly buffer Clusters
+{
+    uint uClusters[];
+};
+
+uniform ivec3 uClusterCount;
+uniform vec2  uViewportSize;
+uniform float uClusterNear;
+uniform float uClusterFar;
+
 layout(location = 0) out vec4 oColor;
 
 vec2 parallaxMapping(vec2 T, vec3 V)
@@ -208,22 +263,54 @@ void main()
     else
     {
         //normal mapping 
-        vec3 normal = texture(uNormalMap, texCoords).xyz;
-        normal = normal * 2.0 - 1.0;
+        //normal maps are BC5, only x and y are stored
+        vec3 normal;
+        normal.xy = texture(uNormalMap, texCoords).xy * 2.0 - 1.0;
+        normal.z = sqrt(max(0.0, 1.0 - dot(normal.xy, normal.xy)));
         normal = normalize(vTBN * normal);
         N = normal;
     }
 
+    // Cluster of this fragment, slices are exponential in view depth
+    float ndcDepth = gl_FragCoord.z * 2.0 - 1.0;
+    float viewDepth = 2.0 * uClusterNear * uClusterFar / (uClusterFar + uClusterNear - ndcDepth * (uClusterFar - uClusterNear));
+
+    ivec3 cluster;
+    cluster.xy = ivec2(gl_FragCoord.xy / uViewportSize * vec2(uClusterCount.xy));
+    cluster.z = int(log(viewDepth / uClusterNear) * float(uClusterCount.z) / log(uClusterFar / uClusterNear));
+    cluster = clamp(cluster, ivec3(0), uClusterCount - 1);
+
+    uint clusterIdx = uint((cluster.z * uClusterCount.y + cluster.y) * uClusterCount.x + cluster.x);
+    uint gridSize = uint(uClusterCount.x * uClusterCount.y * uClusterCount.z) * 2u;
+    uint lightOffset = gridSize + uClusters[clusterIdx * 2u];
+    uint lightCount = uClusters[clusterIdx * 2u + 1u];
+
     float ambientFactor = 0.2;
+    oColor = ambientFactor * albedo;
 
-    for(unsigned int i=0; i < uLightCount; i++)
+    for(uint i = 0u; i < lightCount; ++i)
     {
-        vec3 L = normalize(uLight[i].position - vPosition);
-    
-        float diffuseFactor = max(0.0, dot(L,N));
-        oColor += ambientFactor * albedo + diffuseFactor*albedo*vec4(uLight[i].color, 1.0); 
+        LightData light = uLights[uClusters[lightOffset + i]];
+
+        vec3 L;
+        float attenuation = 1.0;
+        if(light.colorType.w > 0.5)
+        {
+            // Same falloff as the deferred path, windowed to the range the clusters were built with
+            vec3 toLight = light.positionRange.xyz - vPosition;
+            float dist = length(toLight);
+            float window = clamp(1.0 - pow(dist / light.positionRange.w, 4.0), 0.0, 1.0);
+            L = toLight / max(dist, 0.0001);
+            attenuation = window * window / (1.0 + 0.1 * dist + 0.02 * dist * dist);
+        }
+        else
+        {
+            L = normalize(-light.positionRange.xyz);
+        }
+
+        float diffuseFactor = max(0.0, dot(L, normalize(N)));
+        oColor += diffuseFactor * attenuation * albedo * vec4(light.colorType.rgb, 1.0);
     }
-    oColor /= uLightCount;      
     oColor.w = 1.0;
 }
 
@@ -235,7 +322,9 @@ void main()
 ///////////////////////////////////////////////////////////////////////
 //------------------------- DEFERRED LIGHTNING -----------------------------------
 
-#ifdef GEOMETRY_PASS
+// GEOMETRY_PASS_INDIRECT is the same pass drawn with glMultiDrawElementsIndirect: the
+// instance and material come from an instanced attribute instead of uniforms
+#if defined(GEOMETRY_PASS) || defined(GEOMETRY_PASS_INDIRECT)
 
 struct Light
 {
@@ -254,12 +343,33 @@ layout(location=2) in vec2 aTexCoord;
 layout(location=3) in vec3 aTangent;
 layout(location=4) in vec3 aBitangent;
 
-layout(binding = 1, std140) uniform LocalParams
+struct InstanceParams
+{
+    mat4 worldMatrix;
+    mat4 worldViewProjectionMatrix;
+};
+
+// One entry per instance, all the instances of a draw call are contiguous
+layout(binding = 0, std430) readonly buffer Instances
+{
+    InstanceParams uInstances[];
+};
+
+#ifdef GEOMETRY_PASS_INDIRECT
+// Read from the base instance of the command on: x the instance, y its material
+layout(location=5) in uvec2 aDrawInstance;
+
+// Bit 0 normal mapped, bit 1 relief mapped
+layout(binding = 3, std430) readonly buffer Materials
 {
-    mat4 uWorldMatrix;
-    mat4 uWorldViewProjectionMatrix;
+    uint uMaterialFlags[];
 };
 
+flat out uint vMaterialFlags;
+#else
+uniform int uBaseInstance;
+#endif
+
 layout(binding = 0, std140) uniform GlobalParams
 {
     vec3            uCameraPosition;
@@ -275,13 +385,22 @@ out mat3 vTBN;
 
 void main()
 {
+#ifdef GEOMETRY_PASS_INDIRECT
+    uint instance = aDrawInstance.x;
+    vMaterialFlags = uMaterialFlags[aDrawInstance.y];
+#else
+    uint instance = uint(uBaseInstance + gl_InstanceID);
+#endif
+    mat4 worldMatrix = uInstances[instance].worldMatrix;
+    mat4 worldViewProjectionMatrix = uInstances[instance].worldViewProjectionMatrix;
+
 	vTexCoord = aTexCoord;
-    vPosition = vec3(uWorldMatrix * vec4(aPosition, 1.0)); // 1.0 because its a point
-    vNormal = vec3(uWorldMatrix * vec4(aNormal, 0.0)); // 0.0 because its a vector
+    vPosition = vec3(worldMatrix * vec4(aPosition, 1.0)); // 1.0 because its a point
+    vNormal = vec3(worldMatrix * vec4(aNormal, 0.0)); // 0.0 because its a vector
     vViewDir = normalize(uCameraPosition - vPosition);
 
-    vec3 T = normalize(vec3(uWorldMatrix * vec4(aTangent, 0.0)));
-    vec3 N = normalize(vec3(uWorldMatrix * vec4(aNormal, 0.0)));
+    vec3 T = normalize(vec3(worldMatrix * vec4(aTangent, 0.0)));
+    vec3 N = normalize(vec3(worldMatrix * vec4(aNormal, 0.0)));
 
     //T = normalize(T - dot(T, N) * N); //re-orthogonalize
 
@@ -289,7 +408,7 @@ void main()
 
     vTBN = mat3(T, B, N);
 
-    gl_Position = uWorldViewProjectionMatrix * vec4(aPosition, 1.0);
+    gl_Position = worldViewProjectionMatrix * vec4(aPosition, 1.0);
 }
 
 #elif defined(FRAGMENT)
@@ -300,8 +419,12 @@ in vec3 vNormal;
 in vec3 vViewDir;
 in mat3 vTBN;
 
+#ifdef GEOMETRY_PASS_INDIRECT
+flat in uint vMaterialFlags;
+#else
 uniform float hasNormalMap;
 uniform float hasReliefMap;
+#endif
 uniform float Relief;
 uniform float Bumpiness;
 uniform sampler2D uTexture;
@@ -315,20 +438,9 @@ layout(binding = 0, std140) uniform GlobalParams
     Light           uLight[16];
 };
 
-layout(location = 0) out vec4 oColor;
-layout(location = 1) out vec4 oAlbedo;
-layout(location = 2) out vec4 oNormal;
-layout(location = 3) out vec4 oPosition;
-layout(location = 4) out vec4 oDepth;
-
-float near = 0.1; 
-float far  = 100.0; 
-  
-float LinearizeDepth(float depth) 
-{
-    float z = depth * 2.0 - 1.0; // back to NDC 
-    return (2.0 * near * far) / (far + near - z * (far - near));	
-}
+// Position and depth are rebuilt from the depth attachment
+layout(location = 1) out vec4 oAlbedo; // rgb albedo, a material bits
+layout(location = 2) out vec2 oNormal; // octahedral
 
 vec2 parallaxMapping(vec2 T, vec3 V)
 {
@@ -404,35 +516,39 @@ vec2 parallaxMapping(vec2 T, vec3 V)
 
 void main()
 {
+#ifdef GEOMETRY_PASS_INDIRECT
+    bool normalMapped = (vMaterialFlags & 1u) != 0u;
+    bool reliefMapped = (vMaterialFlags & 2u) != 0u;
+#else
+    bool normalMapped = hasNormalMap != 0.0;
+    bool reliefMapped = hasReliefMap != 0.0;
+#endif
+
     //relief mapping
     vec2 texCoords = vec2(0.0, 0.0);
     
     if(Relief == 1.0)
-        texCoords = hasReliefMap == 0.0 ? vTexCoord : parallaxMapping(vTexCoord, vViewDir);
+        texCoords = reliefMapped ? parallaxMapping(vTexCoord, vViewDir) : vTexCoord;
     else
         texCoords = vTexCoord;
 
     //oAlbedo = texture(uTexture, vTexCoord);
-    oAlbedo = texture(uTexture, texCoords);
+    vec3 albedo = texture(uTexture, texCoords).rgb;
 
-    if(hasNormalMap == 0.0)
-    {
-        oNormal = vec4(vec3(vNormal), 1.0);
-    }
-    else
+    vec3 normal = vNormal;
+    if(normalMapped)
     {
         //normal mapping 
-        vec3 normal = texture(uNormalMap, texCoords).xyz;
-        normal = normal * 2.0 - 1.0;
-        normal = normalize(vTBN * normal);
-        oNormal = vec4(normal, 1.0);
+        //normal maps are BC5, only x and y are stored
+        normal.xy = texture(uNormalMap, texCoords).xy * 2.0 - 1.0;
+        normal.z = sqrt(max(0.0, 1.0 - dot(normal.xy, normal.xy)));
+        normal = vTBN * normal;
     }
-    
-    oPosition = vec4(vec3(vPosition), 1.0);
+    oNormal = EncodeNormal(normalize(normal));
 
-	float depth = LinearizeDepth(gl_FragCoord.z) / far; // divide by far for demonstration
-	oDepth = vec4(vec3(depth), 1.0);
-	
+    // bit 0: normal mapped, bit 1: relief mapped
+    uint materialBits = (normalMapped ? 1u : 0u) | (reliefMapped && Relief == 1.0 ? 2u : 0u);
+    oAlbedo = vec4(albedo, float(materialBits) / 255.0);
 }
 
 #endif
@@ -458,7 +574,7 @@ void main()
 
 #elif defined(FRAGMENT) 
 
-uniform sampler2D gPosition;
+uniform sampler2D gDepth;
 uniform sampler2D gNormal;
 uniform sampler2D texNoise;
 
@@ -466,27 +582,52 @@ uniform float SSAO;
 uniform float Radius;
 uniform float Bias;
 
-uniform vec3 samples[64];
+// Uploaded once at init, shared with the compute path
+layout(binding = 1, std140) uniform SSAOKernel
+{
+    vec4 samples[64];
+};
+
 uniform mat4 projection;
+uniform mat4 uInverseProjection;
+uniform mat4 uView;
+uniform vec2 uNoiseScale; // tile noise texture over the target, its size divided by noise size
+
+// Kernel subset evaluated this frame: samples[uSampleOffset + i * uSampleStride], i < uSampleCount
+uniform int   uSampleCount;
+uniform int   uSampleStride;
+uniform int   uSampleOffset;
+uniform float uNoiseRotation;
+
+// Temporal accumulation, history holds occlusion, view depth and the encoded world normal
+uniform int       uTemporal;
+uniform int       uHistoryValid;
+uniform float     uHistoryBlend;
+uniform sampler2D uHistory;
+uniform mat4      uInverseView;
+uniform mat4      uPrevViewProjection;
 
 in vec2 vTexCoord;
 
-layout(location = 5) out vec4 oOcclusion;
+// Written to whichever attachment is the single draw buffer
+layout(location = 0) out vec4 oOcclusion;
 
 // parameters (you'd probably want to use them as uniforms to more easily tweak the effect)
-int kernelSize = 64;
 float radius = Radius;
 float bias = Bias;
 
-// tile noise texture over screen, based on screen dimensions divided by noise size
-const vec2 noiseScale = vec2(1600.0/4.0, 1200.0/4.0); // screen = 1600x1200
-
 void main()
 {
     
-    vec3 fragPos   = texture(gPosition, vTexCoord).rgb;
-    vec3 normal    = texture(gNormal, vTexCoord).rgb;
-    vec3 randomVec = texture(texNoise, vTexCoord * noiseScale).rgb; 
+    // View space position and normal, rebuilt from the compact G-buffer
+    vec2 encodedNormal = texture(gNormal, vTexCoord).rg;
+    vec3 fragPos   = ReconstructPosition(vTexCoord, texture(gDepth, vTexCoord).r, uInverseProjection);
+    vec3 normal    = mat3(uView) * DecodeNormal(encodedNormal);
+    vec3 randomVec = texture(texNoise, vTexCoord * uNoiseScale).rgb; 
+
+    // Noise vectors lie in the tangent plane (z = 0), spinning them changes the kernel orientation
+    float c = cos(uNoiseRotation), s = sin(uNoiseRotation);
+    randomVec.xy = mat2(c, s, -s, c) * randomVec.xy;
 
     vec3 tangent   = normalize(randomVec - normal * dot(randomVec, normal));
     vec3 bitangent = cross(normal, tangent);
@@ -494,9 +635,9 @@ void main()
 
     float occlusion = 0;
 
-    for(int i = 0; i < kernelSize; ++i)
+    for(int i = 0; i < uSampleCount; ++i)
     {
-        vec3 samplePos = TBN * samples[i];
+        vec3 samplePos = TBN * samples[uSampleOffset + i * uSampleStride].xyz;
         samplePos = fragPos + samplePos * radius; 
 
         // project sample position (to sample texture) (to get position on screen/texture)
@@ -506,20 +647,78 @@ void main()
         offset.xyz  = offset.xyz * 0.5 + 0.5; // transform to range 0.0 - 1.0  
 
         // get sample depth
-        float sampleDepth = texture(gPosition, offset.xy).z; // get depth value of kernel sample
+        float sampleDepth = ReconstructPosition(offset.xy, texture(gDepth, offset.xy).r, uInverseProjection).z; // get depth value of kernel sample
 
         // range check & accumulate
         float rangeCheck = smoothstep(0.0, 1.0, radius / abs(fragPos.z - sampleDepth));
         occlusion += (sampleDepth >= samplePos.z + bias ? 1.0 : 0.0) * rangeCheck;
     }
-    occlusion = 1.0 - (occlusion / kernelSize);  
-    oOcclusion = SSAO == 1.0 ? vec4(vec3(occlusion*occlusion), 1.0) : vec4(1.0);
+    occlusion = 1.0 - (occlusion / uSampleCount);  
+    occlusion = SSAO == 1.0 ? occlusion * occlusion : 1.0;
+
+    if (uTemporal == 0)
+    {
+        oOcclusion = vec4(vec3(occlusion), 1.0);
+        return;
+    }
+
+    // Where this surface was last frame. History is kept only if it saw the same surface there:
+    // the depth it stored matches the reprojected one and the normals agree
+    vec4 worldPos = uInverseView * vec4(fragPos, 1.0);
+    vec4 prevClip = uPrevViewProjection * worldPos;
+    vec2 prevUV   = prevClip.xy / prevClip.w * 0.5 + 0.5;
+
+    if (uHistoryValid == 1 && prevClip.w > 0.0 && all(greaterThanEqual(prevUV, vec2(0.0))) && all(lessThanEqual(prevUV, vec2(1.0))))
+    {
+        vec4 history = texture(uHistory, prevUV);
+        bool sameDepth  = abs(history.g - prevClip.w) < 0.02 * prevClip.w;
+        bool sameNormal = dot(DecodeNormal(history.ba), DecodeNormal(encodedNormal)) > 0.9;
+        if (sameDepth && sameNormal)
+            occlusion = mix(history.r, occlusion, uHistoryBlend);
+    }
+
+    oOcclusion = vec4(occlusion, -fragPos.z, encodedNormal);
+}
+
+#endif
+#endif
+
+//--------------------------------------------------------------------------
+//-------------- REDUCED RESOLUTION SSAO -----------------------------------
+//--------------------------------------------------------------------------
+#ifdef SSAO_DOWNSAMPLE
+
+#if defined(VERTEX)
+
+layout(location=0) in vec3 aPosition;
+layout(location=1) in vec2 aTexCoord;
+
+void main()
+{
+	gl_Position =  vec4(aPosition, 1.0);
+}
+
+#elif defined(FRAGMENT) 
+
+uniform sampler2D gDepth;
+uniform sampler2D gNormal;
+uniform int uScale;
+
+layout(location = 0) out float oDepth;
+layout(location = 1) out vec2 oNormal;
+
+void main()
+{
+    // One full resolution texel, averaging depths or normals would invent surfaces at the edges
+    ivec2 texel = min(ivec2(gl_FragCoord.xy) * uScale, textureSize(gDepth, 0) - 1);
+    oDepth  = texelFetch(gDepth, texel, 0).r;
+    oNormal = texelFetch(gNormal, texel, 0).rg;
 }
 
 #endif
 #endif
 
-#ifdef SSAO_BLUR_PASS
+#ifdef SSAO_UPSAMPLE
 
 #if defined(VERTEX)
 
@@ -536,27 +735,188 @@ void main()
 
 #elif defined(FRAGMENT) 
 
-uniform sampler2D ssaoInput;
+uniform sampler2D lowDepth;
+uniform sampler2D lowNormal;
+uniform sampler2D lowOcclusion;
+uniform sampler2D gDepth;
+uniform sampler2D gNormal;
+uniform int uScale;
+uniform mat4 uInverseProjection;
 
 in vec2 vTexCoord;
 
-layout(location = 5) out vec4 oOcclusion;
+layout(location = 0) out vec4 oOcclusion;
+
+float ViewDepth(vec2 uv, float depth)
+{
+    return -ReconstructPosition(uv, depth, uInverseProjection).z;
+}
 
 void main()
 {
-    float Occlusion = texture(oOcclusion, vTexCoord).r;
-    vec2 texelSize = 1.0 / vec2(textureSize(ssaoInput, 0));
-    float result = 0.0;
-    for (int x = -2; x < 2; ++x) 
+    ivec2 pixel  = ivec2(gl_FragCoord.xy);
+    float depth  = ViewDepth(vTexCoord, texelFetch(gDepth, pixel, 0).r);
+    vec3  normal = DecodeNormal(texelFetch(gNormal, pixel, 0).rg);
+
+    // Low resolution texel i covers full resolution pixels [i * uScale, (i + 1) * uScale)
+    // and was sampled at its first one
+    ivec2 lowSize = textureSize(lowOcclusion, 0);
+    vec2  lowPosition = (vec2(pixel) + 0.5) / float(uScale) - 0.5;
+    ivec2 base = ivec2(floor(lowPosition));
+    vec2  f = lowPosition - vec2(base);
+
+    // The 4 nearest low resolution samples, bilinear weights scaled down by how different
+    // their surface is, so occlusion does not bleed across depth or orientation changes
+    float occlusion = 0.0;
+    float weightSum = 0.0;
+    for (int i = 0; i < 4; ++i)
     {
-        for (int y = -2; y < 2; ++y) 
-        {
-            vec2 offset = vec2(float(x), float(y)) * texelSize;
-            result += texture(ssaoInput, TexCoords + offset).r;
-        }
+        ivec2 offset = ivec2(i & 1, i >> 1);
+        ivec2 texel  = clamp(base + offset, ivec2(0), lowSize - 1);
+        vec2  sampleUV = (vec2(texel * uScale) + 0.5) / vec2(textureSize(gDepth, 0));
+
+        float sampleDepth  = ViewDepth(sampleUV, texelFetch(lowDepth, texel, 0).r);
+        vec3  sampleNormal = DecodeNormal(texelFetch(lowNormal, texel, 0).rg);
+
+        float bilinear = (offset.x == 1 ? f.x : 1.0 - f.x) * (offset.y == 1 ? f.y : 1.0 - f.y);
+        float depthWeight  = exp(-abs(depth - sampleDepth) / (0.02 * depth));
+        float normalWeight = pow(max(dot(normal, sampleNormal), 0.0), 8.0);
+
+        // Never exactly 0, a pixel unlike all 4 falls back to plain bilinear
+        float weight = bilinear * (depthWeight * normalWeight + 1e-4);
+        occlusion += texelFetch(lowOcclusion, texel, 0).r * weight;
+        weightSum += weight;
+    }
+
+    oOcclusion = vec4(vec3(occlusion / max(weightSum, 1e-6)), 1.0);
+}
+
+#endif
+#endif
+
+#ifdef SSAO_COMPUTE
+
+#if defined(COMPUTE)
+
+#define SSAO_GROUP_SIZE 8
+
+layout(local_size_x = SSAO_GROUP_SIZE, local_size_y = SSAO_GROUP_SIZE) in;
+
+layout(binding = 1, std140) uniform SSAOKernel
+{
+    vec4 samples[64];
+};
+
+uniform sampler2D gDepth;
+uniform sampler2D gNormal;
+uniform sampler2D texNoise;
+
+uniform float SSAO;
+uniform float Radius;
+uniform float Bias;
+
+uniform mat4 projection;
+uniform mat4 uInverseProjection;
+uniform mat4 uView;
+
+layout(binding = 0, r8) uniform writeonly image2D oOcclusion;
+
+void main()
+{
+    ivec2 size  = imageSize(oOcclusion);
+    ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+    if (any(greaterThanEqual(pixel, size)))
+        return;
+
+    vec2 uv = (vec2(pixel) + 0.5) / vec2(size);
+    vec3 fragPos   = ReconstructPosition(uv, texelFetch(gDepth, pixel, 0).r, uInverseProjection);
+    vec3 normal    = mat3(uView) * DecodeNormal(texelFetch(gNormal, pixel, 0).rg);
+    vec3 randomVec = texelFetch(texNoise, pixel & 3, 0).rgb;
+
+    vec3 tangent   = normalize(randomVec - normal * dot(randomVec, normal));
+    vec3 bitangent = cross(normal, tangent);
+    mat3 TBN       = mat3(tangent, bitangent, normal);
+
+    float occlusion = 0.0;
+    for (int i = 0; i < 64; ++i)
+    {
+        vec3 samplePos = fragPos + TBN * samples[i].xyz * Radius;
+
+        vec4 offset = projection * vec4(samplePos, 1.0);
+        offset.xy   = offset.xy / offset.w * 0.5 + 0.5;
+
+        float sampleDepth = ReconstructPosition(offset.xy, texture(gDepth, offset.xy).r, uInverseProjection).z;
+
+        float rangeCheck = smoothstep(0.0, 1.0, Radius / abs(fragPos.z - sampleDepth));
+        occlusion += (sampleDepth >= samplePos.z + Bias ? 1.0 : 0.0) * rangeCheck;
+    }
+    occlusion = 1.0 - occlusion / 64.0;
+
+    imageStore(oOcclusion, pixel, vec4(SSAO == 1.0 ? occlusion * occlusion : 1.0));
+}
+
+#endif
+#endif
+
+#ifdef SSAO_BLUR
+
+#if defined(COMPUTE)
+
+#define SSAO_BLUR_GROUP 64
+#define BLUR_RADIUS 4
+#define BLUR_LINE (SSAO_BLUR_GROUP + 2 * BLUR_RADIUS)
+
+// One group blurs SSAO_BLUR_GROUP consecutive pixels along uDirection, of the row or
+// column given by gl_WorkGroupID.y
+layout(local_size_x = SSAO_BLUR_GROUP) in;
+
+uniform sampler2D uOcclusion;
+uniform sampler2D gDepth;
+uniform ivec2 uDirection;
+uniform mat4 uInverseProjection;
+
+layout(binding = 0, r8) uniform writeonly image2D oOcclusion;
+
+shared float sOcclusion[BLUR_LINE];
+shared float sDepth[BLUR_LINE];
+
+// Gaussian, sigma 2
+const float kWeights[BLUR_RADIUS + 1] = float[](1.0, 0.8825, 0.6065, 0.3247, 0.1353);
+
+void main()
+{
+    ivec2 size   = imageSize(oOcclusion);
+    ivec2 across = ivec2(1) - uDirection;
+    ivec2 start  = uDirection * int(gl_WorkGroupID.x * SSAO_BLUR_GROUP) + across * int(gl_WorkGroupID.y);
+
+    // Stage the line and an apron of BLUR_RADIUS texels on each side, every texel is read
+    // 2 * BLUR_RADIUS + 1 times below but fetched once
+    for (int i = int(gl_LocalInvocationID.x); i < BLUR_LINE; i += SSAO_BLUR_GROUP)
+    {
+        ivec2 texel = clamp(start + uDirection * (i - BLUR_RADIUS), ivec2(0), size - 1);
+        vec2 uv = (vec2(texel) + 0.5) / vec2(size);
+        sOcclusion[i] = texelFetch(uOcclusion, texel, 0).r;
+        sDepth[i]     = -ReconstructPosition(uv, texelFetch(gDepth, texel, 0).r, uInverseProjection).z;
+    }
+    barrier();
+
+    ivec2 pixel = start + uDirection * int(gl_LocalInvocationID.x);
+    if (any(greaterThanEqual(pixel, size)))
+        return;
+
+    // Neighbours on another surface (a depth jump relative to this one) barely contribute
+    int   center = int(gl_LocalInvocationID.x) + BLUR_RADIUS;
+    float depth  = sDepth[center];
+    float sum    = 0.0;
+    float weightSum = 0.0;
+    for (int k = -BLUR_RADIUS; k <= BLUR_RADIUS; ++k)
+    {
+        float weight = kWeights[abs(k)] * exp(-abs(sDepth[center + k] - depth) / (0.02 * depth));
+        sum       += sOcclusion[center + k] * weight;
+        weightSum += weight;
     }
-    result /= 16.0;
-    oOcclusion = vec4(vec3(result), 1.0);
+
+    imageStore(oOcclusion, pixel, vec4(sum / weightSum));
 }
 
 #endif
@@ -582,12 +942,6 @@ struct Light
 layout(location=0) in vec3 aPosition;
 layout(location=1) in vec2 aTexCoord;
 
-layout(binding = 1, std140) uniform LocalParams
-{
-    mat4 uWorldMatrix;
-    mat4 uWorldViewProjectionMatrix;
-};
-
 layout(binding = 0, std140) uniform GlobalParams
 {
     vec3            uCameraPosition;
@@ -601,7 +955,7 @@ out vec3 vViewDir;
 void main()
 {
 	vTexCoord = aTexCoord;
-	vViewDir = vec3(uWorldViewProjectionMatrix * vec4(uCameraPosition, 1.0));
+	vViewDir = uCameraPosition;
 	gl_Position =  vec4(aPosition, 1.0);
 }
 
@@ -619,9 +973,10 @@ layout(binding = 0, std140) uniform GlobalParams
 
 uniform sampler2D oAlbedo;
 uniform sampler2D oNormal;
-uniform sampler2D oPosition;
 uniform sampler2D oDepth;
 uniform sampler2D oOcclusion;
+uniform mat4 uInverseViewProjection;
+uniform int uDirectionalOnly; // the light volumes shade the point lights
 
 layout(location = 0) out vec4 oColor;
 
@@ -629,20 +984,22 @@ void main()
 {
     // Retrieve information from the G-buffer
     vec3 iAlbedo = texture(oAlbedo, vTexCoord).rgb;
-	vec3 iNormal = texture(oNormal, vTexCoord).rgb;
-	vec3 iPosition = texture(oPosition, vTexCoord).rgb;
+    vec3 iPosition = ReconstructPosition(vTexCoord, texture(oDepth, vTexCoord).r, uInverseViewProjection);
     float Occlusion = texture(oOcclusion, vTexCoord).r;
 	
-    vec3 Normal = normalize(iNormal);
+    vec3 Normal = DecodeNormal(texture(oNormal, vTexCoord).rg);
     float ambientColor = 0.5;
     vec3 lighting = iAlbedo * ambientColor * Occlusion;
     vec3 ViewDir = normalize(vViewDir - iPosition);
 
     for(int i = 0; i < uLightCount; ++i)
     {
+        bool directional = uLight[i].type == 0u;
+        if (uDirectionalOnly == 1 && !directional)
+            continue;
        
         // diffuse
-        vec3 lightDir = normalize(uLight[i].position - iPosition);
+        vec3 lightDir = directional ? normalize(-uLight[i].direction) : normalize(uLight[i].position - iPosition);
         vec3 diffuse = max(dot(Normal, lightDir), 0.0) * iAlbedo * uLight[i].color * 1.0;
     
         // specular
@@ -650,10 +1007,14 @@ void main()
         float spec = pow(max(dot(Normal, halfwayDir), 0.0), 10.0);
         vec3 specular = uLight[i].color * spec * vec3(0.5);
 
-        // attenuation
+        // attenuation, windowed to the range like the tiled and light volume paths
         float attenuation = 1.0;
-        float dist = length(uLight[i].position - iPosition);
-        attenuation = 1.0 / (1.0 + 0.1 * dist + 0.02 * pow(dist, 2.0));
+        if (!directional)
+        {
+            float dist = length(uLight[i].position - iPosition);
+            float window = clamp(1.0 - pow(dist / uLight[i].range, 4.0), 0.0, 1.0);
+            attenuation = window * window / (1.0 + 0.1 * dist + 0.02 * pow(dist, 2.0));
+        }
         
         diffuse *= attenuation;
         specular *= attenuation;
@@ -667,3 +1028,325 @@ void main()
 
 #endif
 #endif
+
+//------------------------------------------------------
+//------------------ TILED SHADING ---------------------
+//------------------------------------------------------
+
+#ifdef TILED_SHADING
+
+#if defined(COMPUTE)
+
+#define TILE_SIZE 16
+#define MAX_LIGHTS_PER_TILE 512 // same as engine.h
+
+layout(local_size_x = TILE_SIZE, local_size_y = TILE_SIZE) in;
+
+struct Light
+{
+    vec4 positionRange; // direction instead of position for directional lights
+    vec4 colorType;     // 0 directional, 1 point
+};
+
+layout(binding = 1, std430) readonly buffer Lights
+{
+    Light uLights[];
+};
+
+// Tiles that found more lights than fit in sLightIndices, shown in the Info panel
+layout(binding = 2, std430) buffer TileOverflow
+{
+    uint uOverflowTiles;
+};
+
+uniform int  uLightCount;
+uniform mat4 uView;
+uniform mat4 uInverseProjection;
+uniform mat4 uInverseViewProjection;
+uniform vec3 uCameraPosition;
+
+uniform sampler2D oAlbedo;
+uniform sampler2D oNormal;
+uniform sampler2D oDepth;
+uniform sampler2D oOcclusion;
+
+layout(binding = 0, rgba8) uniform writeonly image2D oColor;
+
+// Positive floats keep their order when compared as uints
+shared uint sMinDepth;
+shared uint sMaxDepth;
+shared uint sLightCount;
+shared uint sLightIndices[MAX_LIGHTS_PER_TILE];
+
+vec3 UnprojectToView(vec2 ndc, float ndcDepth)
+{
+    vec4 position = uInverseProjection * vec4(ndc, ndcDepth, 1.0);
+    return position.xyz / position.w;
+}
+
+// Side plane of the tile frustum through the camera, facing the tile center
+vec3 TilePlane(vec3 a, vec3 b, vec3 center)
+{
+    vec3 n = normalize(cross(a, b));
+    return dot(n, center) < 0.0 ? -n : n;
+}
+
+void main()
+{
+    ivec2 size = textureSize(oDepth, 0);
+    ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+    bool inside = pixel.x < size.x && pixel.y < size.y;
+
+    if (gl_LocalInvocationIndex == 0)
+    {
+        sMinDepth = 0x7f7fffffu;
+        sMaxDepth = 0;
+        sLightCount = 0;
+    }
+    barrier();
+
+    // Tile depth bounds, in positive view space distance
+    float depth = inside ? texelFetch(oDepth, pixel, 0).r : 1.0;
+    bool background = depth >= 1.0;
+    vec2 ndc = (vec2(pixel) + 0.5) / vec2(size) * 2.0 - 1.0;
+    float viewDepth = -UnprojectToView(ndc, depth * 2.0 - 1.0).z;
+
+    if (inside && !background)
+    {
+        atomicMin(sMinDepth, floatBitsToUint(viewDepth));
+        atomicMax(sMaxDepth, floatBitsToUint(viewDepth));
+    }
+    barrier();
+
+    float minDepth = uintBitsToFloat(sMinDepth);
+    float maxDepth = uintBitsToFloat(sMaxDepth);
+
+    // Tile corners on the far plane
+    vec2 tileMin = vec2(gl_WorkGroupID.xy * TILE_SIZE) / vec2(size) * 2.0 - 1.0;
+    vec2 tileMax = vec2((gl_WorkGroupID.xy + 1) * TILE_SIZE) / vec2(size) * 2.0 - 1.0;
+    vec3 c0 = UnprojectToView(vec2(tileMin.x, tileMin.y), 1.0);
+    vec3 c1 = UnprojectToView(vec2(tileMax.x, tileMin.y), 1.0);
+    vec3 c2 = UnprojectToView(vec2(tileMax.x, tileMax.y), 1.0);
+    vec3 c3 = UnprojectToView(vec2(tileMin.x, tileMax.y), 1.0);
+    vec3 center = c0 + c2;
+
+    vec3 planes[4];
+    planes[0] = TilePlane(c0, c1, center);
+    planes[1] = TilePlane(c1, c2, center);
+    planes[2] = TilePlane(c2, c3, center);
+    planes[3] = TilePlane(c3, c0, center);
+
+    // Every thread culls a strided slice of the lights into the shared list
+    for (uint i = gl_LocalInvocationIndex; i < uint(uLightCount); i += TILE_SIZE * TILE_SIZE)
+    {
+        Light light = uLights[i];
+        bool visible = minDepth <= maxDepth;
+
+        if (visible && light.colorType.w > 0.5)
+        {
+            vec3 c = (uView * vec4(light.positionRange.xyz, 1.0)).xyz;
+            float r = light.positionRange.w;
+
+            visible = -c.z + r >= minDepth && -c.z - r <= maxDepth;
+            for (int p = 0; p < 4 && visible; ++p)
+                visible = dot(planes[p], c) >= -r;
+        }
+
+        if (visible)
+        {
+            uint idx = atomicAdd(sLightCount, 1u);
+            if (idx < MAX_LIGHTS_PER_TILE)
+                sLightIndices[idx] = i;
+        }
+    }
+    barrier();
+
+    if (gl_LocalInvocationIndex == 0 && sLightCount > MAX_LIGHTS_PER_TILE)
+        atomicAdd(uOverflowTiles, 1u);
+
+    if (!inside)
+        return;
+
+    if (background)
+    {
+        imageStore(oColor, pixel, vec4(0.0, 0.0, 0.0, 1.0));
+        return;
+    }
+
+    // Same lighting as SHADING_PASS, with the attenuation windowed to the light range
+    vec4 worldPosition = uInverseViewProjection * vec4(ndc, depth * 2.0 - 1.0, 1.0);
+    vec3 iPosition = worldPosition.xyz / worldPosition.w;
+    vec3 iAlbedo = texelFetch(oAlbedo, pixel, 0).rgb;
+    float Occlusion = texelFetch(oOcclusion, pixel, 0).r;
+
+    vec3 Normal = DecodeNormal(texelFetch(oNormal, pixel, 0).rg);
+    float ambientColor = 0.5;
+    vec3 lighting = iAlbedo * ambientColor * Occlusion;
+    vec3 ViewDir = normalize(uCameraPosition - iPosition);
+
+    uint lightCount = min(sLightCount, uint(MAX_LIGHTS_PER_TILE));
+    for (uint i = 0; i < lightCount; ++i)
+    {
+        Light light = uLights[sLightIndices[i]];
+
+        vec3 lightDir;
+        float attenuation = 1.0;
+        if (light.colorType.w > 0.5)
+        {
+            vec3 toLight = light.positionRange.xyz - iPosition;
+            float dist = length(toLight);
+            float window = clamp(1.0 - pow(dist / light.positionRange.w, 4.0), 0.0, 1.0);
+            lightDir = toLight / max(dist, 0.0001);
+            attenuation = window * window / (1.0 + 0.1 * dist + 0.02 * dist * dist);
+        }
+        else
+        {
+            lightDir = normalize(-light.positionRange.xyz);
+        }
+
+        vec3 diffuse = max(dot(Normal, lightDir), 0.0) * iAlbedo * light.colorType.rgb;
+
+        vec3 halfwayDir = normalize(lightDir + ViewDir);
+        float spec = pow(max(dot(Normal, halfwayDir), 0.0), 10.0);
+        vec3 specular = light.colorType.rgb * spec * vec3(0.5);
+
+        lighting += (diffuse + specular) * attenuation;
+    }
+
+    imageStore(oColor, pixel, vec4(lighting, 1.0));
+}
+
+#endif
+#endif
+
+//------------------------------------------------------
+//------------------ LIGHT VOLUMES ---------------------
+//------------------------------------------------------
+
+#if defined(LIGHT_VOLUME) || defined(LIGHT_VOLUME_STENCIL)
+
+#if defined(VERTEX)
+
+layout(location=0) in vec3 aPosition;
+
+uniform mat4 uViewProjection;
+uniform vec4 uLightPositionRange;
+
+void main()
+{
+    gl_Position = uViewProjection * vec4(uLightPositionRange.xyz + aPosition * uLightPositionRange.w, 1.0);
+}
+
+#elif defined(FRAGMENT) && defined(LIGHT_VOLUME_STENCIL)
+
+// Only the stencil is written
+void main()
+{
+}
+
+#elif defined(FRAGMENT)
+
+uniform vec4 uLightPositionRange;
+uniform vec3 uLightColor;
+uniform vec2 uViewportSize;
+uniform mat4 uInverseViewProjection;
+uniform vec3 uCameraPosition;
+
+uniform sampler2D oAlbedo;
+uniform sampler2D oNormal;
+uniform sampler2D oDepth;
+
+layout(location = 0) out vec4 oColor;
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(oDepth, pixel, 0).r;
+    vec2 ndc = gl_FragCoord.xy / uViewportSize * 2.0 - 1.0;
+    vec4 worldPosition = uInverseViewProjection * vec4(ndc, depth * 2.0 - 1.0, 1.0);
+    vec3 iPosition = worldPosition.xyz / worldPosition.w;
+
+    vec3 iAlbedo = texelFetch(oAlbedo, pixel, 0).rgb;
+    vec3 Normal = DecodeNormal(texelFetch(oNormal, pixel, 0).rg);
+    vec3 ViewDir = normalize(uCameraPosition - iPosition);
+
+    // Same lighting as SHADING_PASS for a single point light, added on top of it
+    vec3 toLight = uLightPositionRange.xyz - iPosition;
+    float dist = length(toLight);
+    vec3 lightDir = toLight / max(dist, 0.0001);
+
+    vec3 diffuse = max(dot(Normal, lightDir), 0.0) * iAlbedo * uLightColor;
+
+    vec3 halfwayDir = normalize(lightDir + ViewDir);
+    float spec = pow(max(dot(Normal, halfwayDir), 0.0), 10.0);
+    vec3 specular = uLightColor * spec * vec3(0.5);
+
+    float window = clamp(1.0 - pow(dist / uLightPositionRange.w, 4.0), 0.0, 1.0);
+    float attenuation = window * window / (1.0 + 0.1 * dist + 0.02 * dist * dist);
+
+    oColor = vec4((diffuse + specular) * attenuation, 1.0);
+}
+
+#endif
+#endif
+
+//------------------------------------------------------
+//------------------ G-BUFFER VIEW ---------------------
+//------------------------------------------------------
+
+#ifdef GBUFFER_VIEW
+
+#if defined(VERTEX)
+
+layout(location=0) in vec3 aPosition;
+layout(location=1) in vec2 aTexCoord;
+
+out vec2 vTexCoord;
+
+void main()
+{
+    vTexCoord = aTexCoord;
+    gl_Position = vec4(aPosition, 1.0);
+}
+
+#elif defined(FRAGMENT)
+
+in vec2 vTexCoord;
+
+uniform int  uMode; // Mode: 1 albedo, 2 normals, 3 positions, 4 depth, 5 SSAO
+uniform mat4 uInverseViewProjection;
+uniform float uNear;
+uniform float uFar;
+
+uniform sampler2D oAlbedo;
+uniform sampler2D oNormal;
+uniform sampler2D oDepth;
+uniform sampler2D oOcclusion;
+
+layout(location = 0) out vec4 oColor;
+
+void main()
+{
+    float depth = texture(oDepth, vTexCoord).r;
+    vec3 color = vec3(0.0);
+
+    if (uMode == 1)
+        color = texture(oAlbedo, vTexCoord).rgb;
+    else if (uMode == 2)
+        color = DecodeNormal(texture(oNormal, vTexCoord).rg) * 0.5 + 0.5;
+    else if (uMode == 3)
+        color = depth < 1.0 ? fract(ReconstructPosition(vTexCoord, depth, uInverseViewProjection) / 10.0) : vec3(0.0);
+    else if (uMode == 4)
+    {
+        float z = depth * 2.0 - 1.0;
+        float linearDepth = 2.0 * uNear * uFar / (uFar + uNear - z * (uFar - uNear));
+        color = vec3(linearDepth / 100.0); // the first 100 units, like the old depth target
+    }
+    else if (uMode == 5)
+        color = texture(oOcclusion, vTexCoord).rrr;
+
+    oColor = vec4(color, 1.0);
+}
+
+#endif
+#endif